@@ -97,6 +97,10 @@ void gen_citations(paragraph *source, keywordlist *kl) {
 		wd->type = word_Normal;
 		wd->alt = NULL;
 		wd->next = NULL;
+		wd->breaks = FALSE;
+		wd->aux = 0;
+		wd->fpos = para->fpos;
+		wd->private_data = NULL;
 		kw->text = wd;
 	    }
 	    para->kwtext = kw->text;
@@ -24,6 +24,7 @@
 #include <assert.h>
 #include <limits.h>
 #include "halibut.h"
+#include "deflate.h"
 
 #define is_heading_type(type) ( (type) == para_Title || \
 				(type) == para_Chapter || \
@@ -50,11 +51,14 @@ typedef struct {
     int leaf_contains_contents, leaf_smallest_contents;
     int navlinks;
     int rellinks;
+    int skip_unchanged;
+    enum { GZIP_NONE, GZIP_ALSO, GZIP_ONLY } gzip;
     char *contents_filename;
     char *index_filename;
     char *template_filename;
     char *single_filename;
     char *chm_filename, *hhp_filename, *hhc_filename, *hhk_filename;
+    char *search_prefix;
     char **template_fragments;
     int ntfragments;
     char *head_end, *body_start, *body_end, *addr_start, *addr_end;
@@ -103,6 +107,7 @@ struct htmlsect {
     enum { NORMAL, TOP, INDEX } type;
     int contents_depth;
     char **fragments;
+    int searchid;		       /* target number in search index */
 };
 
 typedef struct {
@@ -138,7 +143,16 @@ typedef struct {
      * ending tags, and writing to the file. It's the lexical
      * level.
      */
-    FILE *fp;
+    outsink *out;
+    char *outbuf;		       /* output waiting to go to out */
+    int outlen;
+    /*
+     * For html-gzip, a compressed copy of the output goes to gzout
+     * as well as (or instead of) the plain one.
+     */
+    outsink *gzout;
+    deflate_compress_ctx *gz;
+    int written;		       /* set by cleanup() */
     int charset, restrict_charset;
     charset_state cstate;
     int ver;
@@ -170,6 +184,8 @@ typedef struct {
 #define HO_HACK_QUOTENOTHING 2
 #define HO_HACK_OMITQUOTES 4
 
+#define HTML_OUTBUF_SIZE 65536
+
 static int html_fragment_compare(void *av, void *bv)
 {
     htmlfragment *a = (htmlfragment *)av;
@@ -221,6 +237,10 @@ static void html_text_limit_internal(htmloutput *ho, wchar_t const *text,
 static void html_nl(htmloutput *ho);
 static void html_raw(htmloutput *ho, char *text);
 static void html_raw_as_attr(htmloutput *ho, char *text);
+static void html_out(htmloutput *ho, char const *p, int len);
+static void html_outs(htmloutput *ho, char const *s);
+static void html_open(htmloutput *ho, outdest *od, char *filename,
+		      int skip_unchanged, int gzip);
 static void cleanup(htmloutput *ho);
 
 static void html_href(htmloutput *ho, htmlfile *thisfile,
@@ -263,12 +283,15 @@ static htmlconfig html_configure(paragraph *source) {
     ret.leaf_smallest_contents = 4;
     ret.navlinks = TRUE;
     ret.rellinks = TRUE;
+    ret.skip_unchanged = FALSE;
+    ret.gzip = GZIP_NONE;
     ret.single_filename = dupstr("Manual.html");
     ret.contents_filename = dupstr("Contents.html");
     ret.index_filename = dupstr("IndexPage.html");
     ret.template_filename = dupstr("%n.html");
     ret.chm_filename = ret.hhp_filename = NULL;
     ret.hhc_filename = ret.hhk_filename = NULL;
+    ret.search_prefix = NULL;
     ret.ntfragments = 1;
     ret.template_fragments = snewn(ret.ntfragments, char *);
     ret.template_fragments[0] = dupstr("%b");
@@ -390,6 +413,14 @@ static htmlconfig html_configure(paragraph *source) {
 		ret.navlinks = !utob(uadv(k));
 	    } else if (!ustricmp(k, L"html-rellinks")) {
 		ret.rellinks = utob(uadv(k));
+	    } else if (!ustricmp(k, L"html-skip-unchanged")) {
+		ret.skip_unchanged = utob(uadv(k));
+	    } else if (!ustricmp(k, L"html-gzip")) {
+		wchar_t *u = uadv(k);
+		if (!ustricmp(u, L"only"))
+		    ret.gzip = GZIP_ONLY;
+		else
+		    ret.gzip = utob(u) ? GZIP_ALSO : GZIP_NONE;
 	    } else if (!ustricmp(k, L"html-chapter-suffix")) {
 		ret.achapter.number_suffix = uadv(k);
 	    } else if (!ustricmp(k, L"html-leaf-level")) {
@@ -538,6 +569,13 @@ static htmlconfig html_configure(paragraph *source) {
 	    } else if (!ustricmp(k, L"html-mshtmlhelp-index")) {
 		sfree(ret.hhk_filename);
 		ret.hhk_filename = dupstr(adv(p->origkeyword));
+	    } else if (!ustricmp(k, L"html-search-index")) {
+		sfree(ret.search_prefix);
+		ret.search_prefix = dupstr(adv(p->origkeyword));
+		if (!*ret.search_prefix) {
+		    sfree(ret.search_prefix);
+		    ret.search_prefix = NULL;
+		}
 	    }
 	}
     }
@@ -592,1054 +630,1103 @@ paragraph *html_config_filename(char *filename)
     return p;
 }
 
-void html_backend(paragraph *sourceform, keywordlist *keywords,
-		  indexdata *idx, void *unused)
+/*
+ * Everything the output code for a single HTML file needs to know.
+ * None of it is modified while the files are being written, so
+ * html_write_file() can be run on several files at once; the only
+ * per-file state it updates lives in that file's own htmlfile and
+ * htmlsect structures (and, for the index file, in the index
+ * entries' htmlindex records, which nothing else touches).
+ */
+typedef struct {
+    htmlconfig *conf;
+    htmlfilelist *files;
+    htmlsectlist *sects;
+    paragraph *sourceform;
+    keywordlist *keywords;
+    indexdata *idx;
+    int has_index;
+    htmlfile **filearray;
+    outdest *od;
+    int *written;		       /* per file, filled in as we go */
+} htmlfilewriter;
+
+static void html_write_file(void *vw, int fileno)
 {
+    htmlfilewriter *w = (htmlfilewriter *)vw;
+    htmlconfig *conf = w->conf;
+    htmlfilelist *files = w->files;
+    htmlsectlist *sects = w->sects;
+    paragraph *sourceform = w->sourceform;
+    keywordlist *keywords = w->keywords;
+    indexdata *idx = w->idx;
+    int has_index = w->has_index;
+    htmlfile *f = w->filearray[fileno];
+    htmlfile *prevf = (fileno > 0 ? w->filearray[fileno-1] : NULL);
+    htmlsect *s;
     paragraph *p;
-    htmlsect *topsect;
-    htmlconfig conf;
-    htmlfilelist files = { NULL, NULL, NULL, NULL, NULL, NULL };
-    htmlsectlist sects = { NULL, NULL }, nonsects = { NULL, NULL };
-    char *hhk_filename;
-    int has_index;
+    htmloutput ho;
+    int displaying;
+    enum LISTTYPE { NOLIST, UL, OL, DL };
+    enum ITEMTYPE { NOITEM, LI, DT, DD };
+    struct stackelement {
+	struct stackelement *next;
+	enum LISTTYPE listtype;
+	enum ITEMTYPE itemtype;
+    } *stackhead;
 
-    IGNORE(unused);
+#define listname(lt) ( (lt)==UL ? "ul" : (lt)==OL ? "ol" : "dl" )
+#define itemname(lt) ( (lt)==LI ? "li" : (lt)==DT ? "dt" : "dd" )
 
-    conf = html_configure(sourceform);
+    html_open(&ho, w->od, f->filename, conf->skip_unchanged, conf->gzip);
+
+    ho.charset = conf->output_charset;
+    ho.restrict_charset = conf->restrict_charset;
+    ho.cstate = charset_init_state;
+    ho.ver = conf->htmlver;
+    ho.state = HO_NEUTRAL;
+    ho.contents_level = 0;
+    ho.hackflags = 0;	       /* none of these thankyouverymuch */
+    ho.hacklimit = -1;
+
+    /* <!DOCTYPE>. */
+    switch (conf->htmlver) {
+      case HTML_3_2:
+	html_outs(&ho, "<!DOCTYPE HTML PUBLIC \"-//W3C//DTD "
+		  "HTML 3.2 Final//EN\">\n");
+	break;
+      case HTML_4:
+	html_outs(&ho, "<!DOCTYPE HTML PUBLIC \"-//W3C//DTD HTML"
+		  " 4.01//EN\"\n\"http://www.w3.org/TR/html4/"
+		  "strict.dtd\">\n");
+	break;
+      case ISO_HTML:
+	html_outs(&ho, "<!DOCTYPE HTML PUBLIC \"ISO/IEC "
+		  "15445:2000//DTD HTML//EN\">\n");
+	break;
+      case XHTML_1_0_TRANSITIONAL:
+	html_outs(&ho, "<?xml version=\"1.0\" encoding=\"");
+	html_outs(&ho, charset_to_mimeenc(conf->output_charset));
+	html_outs(&ho, "\"?>\n");
+	html_outs(&ho, "<!DOCTYPE html PUBLIC \"-//W3C//DTD XHTML"
+		  " 1.0 Transitional//EN\"\n\"http://www.w3.org/TR/"
+		  "xhtml1/DTD/xhtml1-transitional.dtd\">\n");
+	break;
+      case XHTML_1_0_STRICT:
+	html_outs(&ho, "<?xml version=\"1.0\" encoding=\"");
+	html_outs(&ho, charset_to_mimeenc(conf->output_charset));
+	html_outs(&ho, "\"?>\n");
+	html_outs(&ho, "<!DOCTYPE html PUBLIC \"-//W3C//DTD XHTML"
+		  " 1.0 Strict//EN\"\n\"http://www.w3.org/TR/xhtml1/"
+		  "DTD/xhtml1-strict.dtd\">\n");
+	break;
+    }
 
-    /*
-     * We're going to make heavy use of paragraphs' private data
-     * fields in the forthcoming code. Clear them first, so we can
-     * reliably tell whether we have auxiliary data for a
-     * particular paragraph.
-     */
-    for (p = sourceform; p; p = p->next)
-	p->private_data = NULL;
+    element_open(&ho, "html");
+    if (is_xhtml(conf->htmlver)) {
+	element_attr(&ho, "xmlns", "http://www.w3.org/1999/xhtml");
+    }
+    html_nl(&ho);
 
-    files.frags = newtree234(html_fragment_compare);
-    files.files = newtree234(html_filename_compare);
+    element_open(&ho, "head");
+    html_nl(&ho);
 
-    /*
-     * Start by figuring out into which file each piece of the
-     * document should be put. We'll do this by inventing an
-     * `htmlsect' structure and stashing it in the private_data
-     * field of each section paragraph; we also need one additional
-     * htmlsect for the document index, which won't show up in the
-     * source form but needs to be consistently mentioned in
-     * contents links.
-     * 
-     * While we're here, we'll also invent the HTML fragment name(s)
-     * for each section.
-     */
+    element_empty(&ho, "meta");
+    element_attr(&ho, "http-equiv", "content-type");
     {
-	htmlsect *sect;
-	int d;
+	char buf[200];
+	sprintf(buf, "text/html; charset=%.150s",
+		charset_to_mimeenc(conf->output_charset));
+	element_attr(&ho, "content", buf);
+    }
+    html_nl(&ho);
 
-	topsect = html_new_sect(&sects, NULL, &conf);
-	topsect->type = TOP;
-	topsect->title = NULL;
-	topsect->text = sourceform;
-	topsect->contents_depth = contents_depth(conf, 0);
-	html_file_section(&conf, &files, topsect, -1);
+    if (conf->author) {
+	element_empty(&ho, "meta");
+	element_attr(&ho, "name", "author");
+	element_attr_w(&ho, "content", conf->author);
+	html_nl(&ho);
+    }
 
-	for (p = sourceform; p; p = p->next)
-	    if (is_heading_type(p->type)) {
-		d = heading_depth(p);
+    if (conf->description) {
+	element_empty(&ho, "meta");
+	element_attr(&ho, "name", "description");
+	element_attr_w(&ho, "content", conf->description);
+	html_nl(&ho);
+    }
 
-		if (p->type == para_Title) {
-		    topsect->title = p;
-		    continue;
-		}
+    element_open(&ho, "title");
+    if (f->first && f->first->title) {
+	html_words(&ho, f->first->title->words, NOTHING,
+		   f, keywords, conf);
 
-		sect = html_new_sect(&sects, p, &conf);
-		sect->text = p->next;
+	assert(f->last);
+	if (f->last != f->first && f->last->title) {
+	    html_text(&ho, conf->title_separator);
+	    html_words(&ho, f->last->title->words, NOTHING,
+		       f, keywords, conf);
+	}
+    }
+    element_close(&ho, "title");
+    html_nl(&ho);
 
-		sect->contents_depth = contents_depth(conf, d+1) - (d+1);
+    if (conf->rellinks) {
 
-		if (p->parent) {
-		    sect->parent = (htmlsect *)p->parent->private_data;
-		    assert(sect->parent != NULL);
-		} else
-		    sect->parent = topsect;
-		p->private_data = sect;
+	if (prevf) {
+	    element_empty(&ho, "link");
+	    element_attr(&ho, "rel", "previous");
+	    element_attr(&ho, "href", prevf->filename);
+	    html_nl(&ho);
+	}
 
-		html_file_section(&conf, &files, sect, d);
+	if (f != files->head) {
+	    element_empty(&ho, "link");
+	    element_attr(&ho, "rel", "ToC");
+	    element_attr(&ho, "href", files->head->filename);
+	    html_nl(&ho);
+	}
 
-		{
-		    int i;
-		    for (i=0; i < conf.ntfragments; i++) {
-			sect->fragments[i] =
-			    html_format(p, conf.template_fragments[i]);
-			sect->fragments[i] =
-			    html_sanitise_fragment(&files, sect->file,
-						   sect->fragments[i]);
-		    }
-		}
+	if (conf->leaf_level > 0) {
+	    htmlsect *p = f->first->parent;
+	    assert(p == f->last->parent);
+	    if (p) {
+		element_empty(&ho, "link");
+		element_attr(&ho, "rel", "up");
+		element_attr(&ho, "href", p->file->filename);
+		html_nl(&ho);
 	    }
+	}
 
-	/*
-	 * And the index, if we have one. Note that we don't output
-	 * an index as an HTML file if we're outputting one as a
-	 * .HHK.
-	 */
-	has_index = (count234(idx->entries) > 0);
-	if (has_index && !conf.hhk_filename) {
-	    sect = html_new_sect(&sects, NULL, &conf);
-	    sect->text = NULL;
-	    sect->type = INDEX;
-	    sect->parent = topsect;
-            sect->contents_depth = 0;
-	    html_file_section(&conf, &files, sect, 0);   /* peer of chapters */
-	    sect->fragments[0] = utoa_dup(conf.index_text, CS_ASCII);
-	    sect->fragments[0] = html_sanitise_fragment(&files, sect->file,
-							sect->fragments[0]);
-	    files.index = sect->file;
+	if (has_index && files->index && f != files->index) {
+	    element_empty(&ho, "link");
+	    element_attr(&ho, "rel", "index");
+	    element_attr(&ho, "href", files->index->filename);
+	    html_nl(&ho);
+	}
+
+	if (f->next) {
+	    element_empty(&ho, "link");
+	    element_attr(&ho, "rel", "next");
+	    element_attr(&ho, "href", f->next->filename);
+	    html_nl(&ho);
 	}
+
     }
 
+    if (conf->head_end)
+	html_raw(&ho, conf->head_end);
+
     /*
-     * Go through the keyword list and sort out fragment IDs for
-     * all the potentially referenced paragraphs which _aren't_
-     * headings.
+     * Add any <head> data defined in specific sections
+     * that go in this file. (This is mostly to allow <meta
+     * name="AppleTitle"> tags for Mac online help.)
      */
-    {
-	int i;
-	keyword *kw;
-	htmlsect *sect;
+    for (s = sects->head; s; s = s->next) {
+	if (s->file == f && s->text) {
+	    for (p = s->text;
+		 p && (p == s->text || p->type == para_Title ||
+		       !is_heading_type(p->type));
+		 p = p->next) {
+		if (p->type == para_Config) {
+		    if (!ustricmp(p->keyword, L"html-local-head")) {
+			html_raw(&ho, adv(p->origkeyword));
+		    }
+		}
+	    }
+	}
+    }
 
-	for (i = 0; (kw = index234(keywords->keys, i)) != NULL; i++) {
-	    paragraph *q, *p = kw->para;
+    element_close(&ho, "head");
+    html_nl(&ho);
 
-	    if (!is_heading_type(p->type)) {
-		htmlsect *parent;
+    if (conf->body_tag)
+	html_raw(&ho, conf->body_tag);
+    else
+	element_open(&ho, "body");
+    html_nl(&ho);
 
-		/*
-		 * Find the paragraph's parent htmlsect, to
-		 * determine which file it will end up in.
-		 */
-		q = p->parent;
-		if (!q) {
-		    /*
-		     * Preamble paragraphs have no parent. So if we
-		     * have a non-heading with no parent, it must
-		     * be preamble, and therefore its parent
-		     * htmlsect must be the preamble one.
-		     */
-		    assert(sects.head &&
-			   sects.head->type == TOP);
-		    parent = sects.head;
-		} else
-		    parent = (htmlsect *)q->private_data;
+    if (conf->body_start)
+	html_raw(&ho, conf->body_start);
 
-		/*
-		 * Now we can construct an htmlsect for this
-		 * paragraph itself, taking care to put it in the
-		 * list of non-sections rather than the list of
-		 * sections (so that traverses of the `sects' list
-		 * won't attempt to add it to the contents or
-		 * anything weird like that).
-		 */
-		sect = html_new_sect(&nonsects, p, &conf);
-		sect->file = parent->file;
-		sect->parent = parent;
-		p->private_data = sect;
+    /*
+     * Write out a nav bar. Special case: we don't do this
+     * if there is only one file.
+     */
+    if (conf->navlinks && files->head != files->tail) {
+	element_open(&ho, "p");
+	if (conf->nav_attr)
+	    html_raw_as_attr(&ho, conf->nav_attr);
+
+	if (prevf) {
+	    element_open(&ho, "a");
+	    element_attr(&ho, "href", prevf->filename);
+	}
+	html_text(&ho, conf->nav_prev_text);
+	if (prevf)
+	    element_close(&ho, "a");
 
-		/*
-		 * Fragment IDs for these paragraphs will simply be
-		 * `p' followed by an integer.
-		 */
-		sect->fragments[0] = snewn(40, char);
-		sprintf(sect->fragments[0], "p%d",
-			sect->file->last_fragment_number++);
-		sect->fragments[0] = html_sanitise_fragment(&files, sect->file,
-							    sect->fragments[0]);
+	html_text(&ho, conf->nav_separator);
+
+	if (f != files->head) {
+	    element_open(&ho, "a");
+	    element_attr(&ho, "href", files->head->filename);
+	}
+	html_text(&ho, conf->contents_text);
+	if (f != files->head)
+	    element_close(&ho, "a");
+
+	/* We don't bother with "Up" links for leaf-level 1,
+	 * as they would be identical to the "Contents" links. */
+	if (conf->leaf_level >= 2) {
+	    htmlsect *p = f->first->parent;
+	    assert(p == f->last->parent);
+	    html_text(&ho, conf->nav_separator);
+	    if (p) {
+		element_open(&ho, "a");
+		element_attr(&ho, "href", p->file->filename);
+	    }
+	    html_text(&ho, conf->nav_up_text);
+	    if (p) {
+		element_close(&ho, "a");
 	    }
 	}
-    }
 
-    /*
-     * Reset the fragment numbers in each file. I've just used them
-     * to generate `p' fragment IDs for non-section paragraphs
-     * (numbered list elements, bibliocited), and now I want to use
-     * them for `i' fragment IDs for index entries.
-     */
-    {
-	htmlfile *file;
-	for (file = files.head; file; file = file->next)
-	    file->last_fragment_number = 0;
+	if (has_index && files->index) {
+	    html_text(&ho, conf->nav_separator);
+	    if (f != files->index) {
+		element_open(&ho, "a");
+		element_attr(&ho, "href", files->index->filename);
+	    }
+	    html_text(&ho, conf->index_text);
+	    if (f != files->index)
+		element_close(&ho, "a");
+	}
+
+	html_text(&ho, conf->nav_separator);
+
+	if (f->next) {
+	    element_open(&ho, "a");
+	    element_attr(&ho, "href", f->next->filename);
+	}
+	html_text(&ho, conf->nav_next_text);
+	if (f->next)
+	    element_close(&ho, "a");
+
+	element_close(&ho, "p");
+	html_nl(&ho);
     }
 
     /*
-     * Now sort out the index. This involves:
+     * Write out a prefix TOC for the file (if a leaf file).
      * 
-     * 	- For each index term, we set up an htmlindex structure to
-     * 	  store all the references to that term.
+     * We start by going through the section list and
+     * collecting the sections which need to be added to
+     * the contents. On the way, we also test to see if
+     * this file is a leaf file (defined as one which
+     * contains all descendants of any section it
+     * contains), because this will play a part in our
+     * decision on whether or not to _output_ the TOC.
      * 
-     * 	- Then we make a pass over the actual document, finding
-     * 	  every word_IndexRef; for each one, we actually figure out
-     * 	  the HTML filename/fragment pair we will use to reference
-     * 	  it, store that information in the private data field of
-     * 	  the word_IndexRef itself (so we can recreate it when the
-     * 	  time comes to output our HTML), and add a reference to it
-     * 	  to the index term in question.
+     * Special case: we absolutely do not do this if we're
+     * in single-file mode.
      */
-    {
-	int i;
-	indexentry *entry;
-	htmlsect *lastsect;
-	word *w;
+    if (files->head != files->tail) {
+	int ntoc = 0, tocsize = 0;
+	htmlsect **toc = NULL;
+	int leaf = TRUE;
 
-	/*
-	 * Set up the htmlindex structures.
-	 */
+	for (s = sects->head; s; s = s->next) {
+	    htmlsect *a, *ac;
+	    int depth, adepth;
 
-	for (i = 0; (entry = index234(idx->entries, i)) != NULL; i++) {
-	    htmlindex *hi = snew(htmlindex);
+	    /*
+	     * Search up from this section until we find
+	     * the highest-level one which belongs in this
+	     * file.
+	     */
+	    depth = adepth = 0;
+	    a = NULL;
+	    for (ac = s; ac; ac = ac->parent) {
+		if (ac->file == f) {
+		    a = ac;
+		    adepth = depth;
+		}
+		depth++;
+	    }
 
-	    hi->nrefs = hi->refsize = 0;
-	    hi->refs = NULL;
+	    if (s->file != f && a != NULL)
+		leaf = FALSE;
 
-	    entry->backend_data = hi;
+	    if (a) {
+		if (adepth <= a->contents_depth) {
+		    if (ntoc >= tocsize) {
+			tocsize += 64;
+			toc = sresize(toc, tocsize, htmlsect *);
+		    }
+		    toc[ntoc++] = s;
+		}
+	    }
 	}
 
-	/*
-	 * Run over the document inventing fragments. Each fragment
-	 * is of the form `i' followed by an integer.
-	 */
-	lastsect = sects.head;	       /* this is always the top section */
-	for (p = sourceform; p; p = p->next) {
-	    if (is_heading_type(p->type) && p->type != para_Title)
-		lastsect = (htmlsect *)p->private_data;
+	if (leaf && conf->leaf_contains_contents &&
+	    ntoc >= conf->leaf_smallest_contents) {
+	    int i;
 
-	    for (w = p->words; w; w = w->next)
-		if (w->type == word_IndexRef) {
-		    htmlindexref *hr = snew(htmlindexref);
-		    indextag *tag;
-		    int i;
+	    for (i = 0; i < ntoc; i++) {
+		htmlsect *s = toc[i];
+		int hlevel = (s->type == TOP ? -1 :
+			      s->type == INDEX ? 0 :
+			      heading_depth(s->title))
+		    - f->min_heading_depth + 1;
 
-		    hr->referenced = hr->generated = FALSE;
-		    hr->section = lastsect;
-		    {
-			char buf[40];
-			sprintf(buf, "i%d",
-				lastsect->file->last_fragment_number++);
-			hr->fragment = dupstr(buf);
-			hr->fragment =
-			    html_sanitise_fragment(&files, hr->section->file,
-						   hr->fragment);
-		    }
-		    w->private_data = hr;
-
-		    tag = index_findtag(idx, w->text);
-		    if (!tag)
-			break;
-
-		    for (i = 0; i < tag->nrefs; i++) {
-			indexentry *entry = tag->refs[i];
-			htmlindex *hi = (htmlindex *)entry->backend_data;
-
-			if (hi->nrefs >= hi->refsize) {
-			    hi->refsize += 32;
-			    hi->refs = sresize(hi->refs, hi->refsize, word *);
-			}
-
-			hi->refs[hi->nrefs++] = w;
-		    }
-		}
+		assert(hlevel >= 1);
+		html_contents_entry(&ho, hlevel, s,
+				    f, keywords, conf);
+	    }
+	    html_contents_entry(&ho, 0, NULL, f, keywords, conf);
 	}
     }
 
     /*
-     * Now we're ready to write out the actual HTML files.
-     * 
-     * For each file:
-     * 
-     *  - we open that file and write its header
-     *  - we run down the list of sections
-     * 	- for each section directly contained within that file, we
-     * 	  output the section text
-     * 	- for each section which is not in the file but which has a
-     * 	  parent that is, we output a contents entry for the
-     * 	  section if appropriate
-     *  - finally, we output the file trailer and close the file.
+     * Now go through the document and output some real
+     * text.
      */
-    {
-	htmlfile *f, *prevf;
-	htmlsect *s;
-	paragraph *p;
-
-	prevf = NULL;
-
-	for (f = files.head; f; f = f->next) {
-	    htmloutput ho;
-	    int displaying;
-	    enum LISTTYPE { NOLIST, UL, OL, DL };
-	    enum ITEMTYPE { NOITEM, LI, DT, DD };
-	    struct stackelement {
-		struct stackelement *next;
-		enum LISTTYPE listtype;
-		enum ITEMTYPE itemtype;
-	    } *stackhead;
+    displaying = FALSE;
+    for (s = sects->head; s; s = s->next) {
+	if (s->file == f) {
+	    /*
+	     * This section belongs in this file.
+	     * Display it.
+	     */
+	    displaying = TRUE;
+	} else {
+	    /*
+	     * Doesn't belong in this file, but it may be
+	     * a descendant of a section which does, in
+	     * which case we should consider it for the
+	     * main TOC of this file (for non-leaf files).
+	     */
+	    htmlsect *a, *ac;
+	    int depth, adepth;
 
-#define listname(lt) ( (lt)==UL ? "ul" : (lt)==OL ? "ol" : "dl" )
-#define itemname(lt) ( (lt)==LI ? "li" : (lt)==DT ? "dt" : "dd" )
+	    displaying = FALSE;
 
-	    if (!strcmp(f->filename, "-"))
-		ho.fp = stdout;
-	    else
-		ho.fp = fopen(f->filename, "w");
-	    if (!ho.fp)
-		err_cantopenw(f->filename);
-
-	    ho.charset = conf.output_charset;
-	    ho.restrict_charset = conf.restrict_charset;
-	    ho.cstate = charset_init_state;
-	    ho.ver = conf.htmlver;
-	    ho.state = HO_NEUTRAL;
-	    ho.contents_level = 0;
-	    ho.hackflags = 0;	       /* none of these thankyouverymuch */
-	    ho.hacklimit = -1;
-
-	    /* <!DOCTYPE>. */
-	    switch (conf.htmlver) {
-	      case HTML_3_2:
-		if (ho.fp)
-		    fprintf(ho.fp, "<!DOCTYPE HTML PUBLIC \"-//W3C//DTD "
-			    "HTML 3.2 Final//EN\">\n");
-		break;
-	      case HTML_4:
-		if (ho.fp)
-		    fprintf(ho.fp, "<!DOCTYPE HTML PUBLIC \"-//W3C//DTD HTML"
-			    " 4.01//EN\"\n\"http://www.w3.org/TR/html4/"
-			    "strict.dtd\">\n");
-		break;
-	      case ISO_HTML:
-		if (ho.fp)
-		    fprintf(ho.fp, "<!DOCTYPE HTML PUBLIC \"ISO/IEC "
-			    "15445:2000//DTD HTML//EN\">\n");
-		break;
-	      case XHTML_1_0_TRANSITIONAL:
-		if (ho.fp) {
-		    fprintf(ho.fp, "<?xml version=\"1.0\" encoding=\"%s\"?>\n",
-			    charset_to_mimeenc(conf.output_charset));
-		    fprintf(ho.fp, "<!DOCTYPE html PUBLIC \"-//W3C//DTD XHTML"
-			    " 1.0 Transitional//EN\"\n\"http://www.w3.org/TR/"
-			    "xhtml1/DTD/xhtml1-transitional.dtd\">\n");
-		}
-		break;
-	      case XHTML_1_0_STRICT:
-		if (ho.fp) {
-		    fprintf(ho.fp, "<?xml version=\"1.0\" encoding=\"%s\"?>\n",
-			    charset_to_mimeenc(conf.output_charset));
-		    fprintf(ho.fp, "<!DOCTYPE html PUBLIC \"-//W3C//DTD XHTML"
-			    " 1.0 Strict//EN\"\n\"http://www.w3.org/TR/xhtml1/"
-			    "DTD/xhtml1-strict.dtd\">\n");
+	    /*
+	     * Search up from this section until we find
+	     * the highest-level one which belongs in this
+	     * file.
+	     */
+	    depth = adepth = 0;
+	    a = NULL;
+	    for (ac = s; ac; ac = ac->parent) {
+		if (ac->file == f) {
+		    a = ac;
+		    adepth = depth;
 		}
-		break;
+		depth++;
 	    }
 
-	    element_open(&ho, "html");
-	    if (is_xhtml(conf.htmlver)) {
-		element_attr(&ho, "xmlns", "http://www.w3.org/1999/xhtml");
+	    if (a != NULL) {
+		/*
+		 * This section does not belong in this
+		 * file, but an ancestor of it does. Write
+		 * out a contents table entry, if the depth
+		 * doesn't exceed the maximum contents
+		 * depth for the ancestor section.
+		 */
+		if (adepth <= a->contents_depth) {
+		    html_contents_entry(&ho, adepth, s,
+					f, keywords, conf);
+		}
 	    }
-	    html_nl(&ho);
+	}
 
-	    element_open(&ho, "head");
-	    html_nl(&ho);
+	if (displaying) {
+	    int hlevel;
+	    char htag[3];
 
-	    element_empty(&ho, "meta");
-	    element_attr(&ho, "http-equiv", "content-type");
+	    html_contents_entry(&ho, 0, NULL, f, keywords, conf);
+
+	    /*
+	     * Display the section heading.
+	     */
+
+	    hlevel = (s->type == TOP ? -1 :
+		      s->type == INDEX ? 0 :
+		      heading_depth(s->title))
+		- f->min_heading_depth + 1;
+	    assert(hlevel >= 1);
+	    /* HTML headings only go up to <h6> */
+	    if (hlevel > 6)
+		hlevel = 6;
+	    htag[0] = 'h';
+	    htag[1] = '0' + hlevel;
+	    htag[2] = '\0';
+	    element_open(&ho, htag);
+
+	    /*
+	     * Provide anchor(s) for cross-links to target.
+	     * 
+	     * (Also we'll have to do this separately in
+	     * other paragraph types - NumberedList and
+	     * BiblioCited.)
+	     */
 	    {
-		char buf[200];
-		sprintf(buf, "text/html; charset=%.150s",
-			charset_to_mimeenc(conf.output_charset));
-		element_attr(&ho, "content", buf);
+		int i;
+		for (i=0; i < conf->ntfragments; i++)
+		    if (s->fragments[i])
+			html_fragment(&ho, s->fragments[i]);
 	    }
-	    html_nl(&ho);
 
-	    if (conf.author) {
-		element_empty(&ho, "meta");
-		element_attr(&ho, "name", "author");
-		element_attr_w(&ho, "content", conf.author);
-		html_nl(&ho);
-	    }
+	    html_section_title(&ho, s, f, keywords, conf, TRUE);
 
-	    if (conf.description) {
-		element_empty(&ho, "meta");
-		element_attr(&ho, "name", "description");
-		element_attr_w(&ho, "content", conf.description);
-		html_nl(&ho);
-	    }
+	    element_close(&ho, htag);
 
-	    element_open(&ho, "title");
-	    if (f->first && f->first->title) {
-		html_words(&ho, f->first->title->words, NOTHING,
-			   f, keywords, &conf);
+	    /*
+	     * Now display the section text.
+	     */
+	    if (s->text) {
+		stackhead = snew(struct stackelement);
+		stackhead->next = NULL;
+		stackhead->listtype = NOLIST;
+		stackhead->itemtype = NOITEM;
 
-		assert(f->last);
-		if (f->last != f->first && f->last->title) {
-		    html_text(&ho, conf.title_separator);
-		    html_words(&ho, f->last->title->words, NOTHING,
-			       f, keywords, &conf);
-		}
-	    }
-	    element_close(&ho, "title");
-	    html_nl(&ho);
+		for (p = s->text;; p = p->next) {
+		    enum LISTTYPE listtype;
+		    struct stackelement *se;
 
-	    if (conf.rellinks) {
+		    /*
+		     * Preliminary switch to figure out what
+		     * sort of list we expect to be inside at
+		     * this stage.
+		     *
+		     * Since p may still be NULL at this point,
+		     * I invent a harmless paragraph type for
+		     * it if it is.
+		     */
+		    switch (p ? p->type : para_Normal) {
+		      case para_Rule:
+		      case para_Normal:
+		      case para_Copyright:
+		      case para_BiblioCited:
+		      case para_Code:
+		      case para_QuotePush:
+		      case para_QuotePop:
+		      case para_Chapter:
+		      case para_Appendix:
+		      case para_UnnumberedChapter:
+		      case para_Heading:
+		      case para_Subsect:
+		      case para_LcontPop:
+			listtype = NOLIST;
+			break;
 
-		if (prevf) {
-		    element_empty(&ho, "link");
-		    element_attr(&ho, "rel", "previous");
-		    element_attr(&ho, "href", prevf->filename);
-		    html_nl(&ho);
-		}
+		      case para_Bullet:
+			listtype = UL;
+			break;
+
+		      case para_NumberedList:
+			listtype = OL;
+			break;
+
+		      case para_DescribedThing:
+		      case para_Description:
+			listtype = DL;
+			break;
+
+		      case para_LcontPush:
+			se = snew(struct stackelement);
+			se->next = stackhead;
+			se->listtype = NOLIST;
+			se->itemtype = NOITEM;
+			stackhead = se;
+			continue;
+
+		      default:     /* some totally non-printing para */
+			continue;
+		    }
 
-		if (f != files.head) {
-		    element_empty(&ho, "link");
-		    element_attr(&ho, "rel", "ToC");
-		    element_attr(&ho, "href", files.head->filename);
 		    html_nl(&ho);
-		}
 
-		if (conf.leaf_level > 0) {
-		    htmlsect *p = f->first->parent;
-		    assert(p == f->last->parent);
-		    if (p) {
-			element_empty(&ho, "link");
-			element_attr(&ho, "rel", "up");
-			element_attr(&ho, "href", p->file->filename);
+		    /*
+		     * Terminate the most recent list item, if
+		     * any. (We left this until after
+		     * processing LcontPush, since in that case
+		     * the list item won't want to be
+		     * terminated until after the corresponding
+		     * LcontPop.)
+		     */
+		    if (stackhead->itemtype != NOITEM) {
+			element_close(&ho, itemname(stackhead->itemtype));
 			html_nl(&ho);
 		    }
-		}
+		    stackhead->itemtype = NOITEM;
 
-		if (has_index && files.index && f != files.index) {
-		    element_empty(&ho, "link");
-		    element_attr(&ho, "rel", "index");
-		    element_attr(&ho, "href", files.index->filename);
-		    html_nl(&ho);
-		}
+		    /*
+		     * Terminate the current list, if it's not
+		     * the one we want to be in.
+		     */
+		    if (listtype != stackhead->listtype &&
+			stackhead->listtype != NOLIST) {
+			element_close(&ho, listname(stackhead->listtype));
+			html_nl(&ho);
+		    }
 
-		if (f->next) {
-		    element_empty(&ho, "link");
-		    element_attr(&ho, "rel", "next");
-		    element_attr(&ho, "href", f->next->filename);
-		    html_nl(&ho);
-		}
+		    /*
+		     * Leave the loop if our time has come.
+		     */
+		    if (!p || (is_heading_type(p->type) &&
+			       p->type != para_Title))
+			break;     /* end of section text */
 
-	    }
+		    /*
+		     * Start a fresh list if necessary.
+		     */
+		    if (listtype != stackhead->listtype &&
+			listtype != NOLIST)
+			element_open(&ho, listname(listtype));
 
-	    if (conf.head_end)
-		html_raw(&ho, conf.head_end);
+		    stackhead->listtype = listtype;
 
-	    /*
-	     * Add any <head> data defined in specific sections
-	     * that go in this file. (This is mostly to allow <meta
-	     * name="AppleTitle"> tags for Mac online help.)
-	     */
-	    for (s = sects.head; s; s = s->next) {
-		if (s->file == f && s->text) {
-		    for (p = s->text;
-			 p && (p == s->text || p->type == para_Title ||
-			       !is_heading_type(p->type));
-			 p = p->next) {
-			if (p->type == para_Config) {
-			    if (!ustricmp(p->keyword, L"html-local-head")) {
-				html_raw(&ho, adv(p->origkeyword));
-			    }
+		    switch (p->type) {
+		      case para_Rule:
+			element_empty(&ho, "hr");
+			break;
+		      case para_Code:
+			html_codepara(&ho, p->words);
+			break;
+		      case para_Normal:
+		      case para_Copyright:
+			element_open(&ho, "p");
+			html_nl(&ho);
+			html_words(&ho, p->words, ALL,
+				   f, keywords, conf);
+			html_nl(&ho);
+			element_close(&ho, "p");
+			break;
+		      case para_BiblioCited:
+			element_open(&ho, "p");
+			if (p->private_data) {
+			    htmlsect *s = (htmlsect *)p->private_data;
+			    int i;
+			    for (i=0; i < conf->ntfragments; i++)
+				if (s->fragments[i])
+				    html_fragment(&ho, s->fragments[i]);
+			}
+			html_nl(&ho);
+			html_words(&ho, p->kwtext, ALL,
+				   f, keywords, conf);
+			html_text(&ho, L" ");
+			html_words(&ho, p->words, ALL,
+				   f, keywords, conf);
+			html_nl(&ho);
+			element_close(&ho, "p");
+			break;
+		      case para_Bullet:
+		      case para_NumberedList:
+			element_open(&ho, "li");
+			if (p->private_data) {
+			    htmlsect *s = (htmlsect *)p->private_data;
+			    int i;
+			    for (i=0; i < conf->ntfragments; i++)
+				if (s->fragments[i])
+				    html_fragment(&ho, s->fragments[i]);
 			}
+			html_nl(&ho);
+			stackhead->itemtype = LI;
+			html_words(&ho, p->words, ALL,
+				   f, keywords, conf);
+			break;
+		      case para_DescribedThing:
+			element_open(&ho, "dt");
+			html_nl(&ho);
+			stackhead->itemtype = DT;
+			html_words(&ho, p->words, ALL,
+				   f, keywords, conf);
+			break;
+		      case para_Description:
+			element_open(&ho, "dd");
+			html_nl(&ho);
+			stackhead->itemtype = DD;
+			html_words(&ho, p->words, ALL,
+				   f, keywords, conf);
+			break;
+
+		      case para_QuotePush:
+			element_open(&ho, "blockquote");
+			break;
+		      case para_QuotePop:
+			element_close(&ho, "blockquote");
+			break;
+
+		      case para_LcontPop:
+			se = stackhead;
+			stackhead = stackhead->next;
+			assert(stackhead);
+			sfree(se);
+			break;
 		    }
 		}
-	    }
-
-	    element_close(&ho, "head");
-	    html_nl(&ho);
 
-	    if (conf.body_tag)
-		html_raw(&ho, conf.body_tag);
-	    else
-		element_open(&ho, "body");
-	    html_nl(&ho);
+		assert(stackhead && !stackhead->next);
+		sfree(stackhead);
+	    }
 
-	    if (conf.body_start)
-		html_raw(&ho, conf.body_start);
+	    if (s->type == INDEX) {
+		indexentry *entry;
+		int i;
 
-	    /*
-	     * Write out a nav bar. Special case: we don't do this
-	     * if there is only one file.
-	     */
-	    if (conf.navlinks && files.head != files.tail) {
+		/*
+		 * This section is the index. I'll just
+		 * render it as a single paragraph, with a
+		 * colon between the index term and the
+		 * references, and <br> in between each
+		 * entry.
+		 */
 		element_open(&ho, "p");
-		if (conf.nav_attr)
-		    html_raw_as_attr(&ho, conf.nav_attr);
 
-		if (prevf) {
-		    element_open(&ho, "a");
-		    element_attr(&ho, "href", prevf->filename);
-		}
-		html_text(&ho, conf.nav_prev_text);
-		if (prevf)
-		    element_close(&ho, "a");
+		for (i = 0; (entry =
+			     index234(idx->entries, i)) != NULL; i++) {
+		    htmlindex *hi = (htmlindex *)entry->backend_data;
+		    int j;
 
-		html_text(&ho, conf.nav_separator);
+		    if (i > 0)
+			element_empty(&ho, "br");
+		    html_nl(&ho);
 
-		if (f != files.head) {
-		    element_open(&ho, "a");
-		    element_attr(&ho, "href", files.head->filename);
-		}
-		html_text(&ho, conf.contents_text);
-		if (f != files.head)
-		    element_close(&ho, "a");
-
-		/* We don't bother with "Up" links for leaf-level 1,
-		 * as they would be identical to the "Contents" links. */
-		if (conf.leaf_level >= 2) {
-		    htmlsect *p = f->first->parent;
-		    assert(p == f->last->parent);
-		    html_text(&ho, conf.nav_separator);
-		    if (p) {
-			element_open(&ho, "a");
-			element_attr(&ho, "href", p->file->filename);
-		    }
-		    html_text(&ho, conf.nav_up_text);
-		    if (p) {
+		    html_words(&ho, entry->text, MARKUP|LINKS,
+			       f, keywords, conf);
+
+		    html_text(&ho, conf->index_main_sep);
+
+		    for (j = 0; j < hi->nrefs; j++) {
+			htmlindexref *hr =
+			    (htmlindexref *)hi->refs[j]->private_data;
+			paragraph *p = hr->section->title;
+
+			if (j > 0)
+			    html_text(&ho, conf->index_multi_sep);
+
+			html_href(&ho, f, hr->section->file,
+				  hr->fragment);
+			hr->referenced = TRUE;
+			if (p && p->kwtext)
+			    html_words(&ho, p->kwtext, MARKUP|LINKS,
+				       f, keywords, conf);
+			else if (p && p->words)
+			    html_words(&ho, p->words, MARKUP|LINKS,
+				       f, keywords, conf);
+			else {
+			    /*
+			     * If there is no title at all,
+			     * this must be because our
+			     * target section is the
+			     * preamble section and there
+			     * is no title. So we use the
+			     * preamble_text.
+			     */
+			    html_text(&ho, conf->preamble_text);
+			}
 			element_close(&ho, "a");
 		    }
 		}
+		element_close(&ho, "p");
+	    }
+	}
+    }
 
-		if (has_index && files.index) {
-		    html_text(&ho, conf.nav_separator);
-		    if (f != files.index) {
-			element_open(&ho, "a");
-			element_attr(&ho, "href", files.index->filename);
-		    }
-		    html_text(&ho, conf.index_text);
-		    if (f != files.index)
-			element_close(&ho, "a");
-		}
+    html_contents_entry(&ho, 0, NULL, f, keywords, conf);
+    html_nl(&ho);
 
-		html_text(&ho, conf.nav_separator);
+    {
+	/*
+	 * Footer.
+	 */
+	int done_version_ids = FALSE;
 
-		if (f->next) {
-		    element_open(&ho, "a");
-		    element_attr(&ho, "href", f->next->filename);
-		}
-		html_text(&ho, conf.nav_next_text);
-		if (f->next)
-		    element_close(&ho, "a");
+	if (conf->address_section)
+	    element_empty(&ho, "hr");
 
-		element_close(&ho, "p");
+	if (conf->body_end)
+	    html_raw(&ho, conf->body_end);
+
+	if (conf->address_section) {
+	    int started = FALSE;
+	    if (conf->htmlver == ISO_HTML) {
+		/*
+		 * The ISO-HTML validator complains if
+		 * there isn't a <div> tag surrounding the
+		 * <address> tag. I'm uncertain of why this
+		 * should be - there appears to be no
+		 * mention of this in the ISO-HTML spec,
+		 * suggesting that it doesn't represent a
+		 * change from HTML 4, but nonetheless the
+		 * HTML 4 validator doesn't seem to mind.
+		 */
+		element_open(&ho, "div");
+	    }
+	    element_open(&ho, "address");
+	    if (conf->addr_start) {
+		html_raw(&ho, conf->addr_start);
 		html_nl(&ho);
+		started = TRUE;
+	    }
+	    if (conf->visible_version_id) {
+		for (p = sourceform; p; p = p->next)
+		    if (p->type == para_VersionID) {
+			if (started)
+			    element_empty(&ho, "br");
+			html_nl(&ho);
+			html_text(&ho, conf->pre_versionid);
+			html_words(&ho, p->words, NOTHING,
+				   f, keywords, conf);
+			html_text(&ho, conf->post_versionid);
+			started = TRUE;
+		    }
+		done_version_ids = TRUE;
 	    }
-	    prevf = f;
+	    if (conf->addr_end) {
+		if (started)
+		    element_empty(&ho, "br");
+		html_raw(&ho, conf->addr_end);
+	    }
+	    element_close(&ho, "address");
+	    if (conf->htmlver == ISO_HTML)
+		element_close(&ho, "div");
+	}
 
+	if (!done_version_ids) {
 	    /*
-	     * Write out a prefix TOC for the file (if a leaf file).
-	     * 
-	     * We start by going through the section list and
-	     * collecting the sections which need to be added to
-	     * the contents. On the way, we also test to see if
-	     * this file is a leaf file (defined as one which
-	     * contains all descendants of any section it
-	     * contains), because this will play a part in our
-	     * decision on whether or not to _output_ the TOC.
-	     * 
-	     * Special case: we absolutely do not do this if we're
-	     * in single-file mode.
+	     * If the user didn't want the version IDs
+	     * visible, I think we still have a duty to put
+	     * them in an HTML comment.
 	     */
-	    if (files.head != files.tail) {
-		int ntoc = 0, tocsize = 0;
-		htmlsect **toc = NULL;
-		int leaf = TRUE;
-
-		for (s = sects.head; s; s = s->next) {
-		    htmlsect *a, *ac;
-		    int depth, adepth;
-
-		    /*
-		     * Search up from this section until we find
-		     * the highest-level one which belongs in this
-		     * file.
-		     */
-		    depth = adepth = 0;
-		    a = NULL;
-		    for (ac = s; ac; ac = ac->parent) {
-			if (ac->file == f) {
-			    a = ac;
-			    adepth = depth;
-			}
-			depth++;
+	    int started = FALSE;
+	    for (p = sourceform; p; p = p->next)
+		if (p->type == para_VersionID) {
+		    if (!started) {
+			html_raw(&ho, "<!-- version IDs:\n");
+			started = TRUE;
 		    }
+		    html_words(&ho, p->words, NOTHING,
+			       f, keywords, conf);
+		    html_nl(&ho);
+		}
+	    if (started)
+		html_raw(&ho, "-->\n");
+	}
+    }
 
-		    if (s->file != f && a != NULL)
-			leaf = FALSE;
+    element_close(&ho, "body");
+    html_nl(&ho);
+    element_close(&ho, "html");
+    html_nl(&ho);
+    cleanup(&ho);
+    w->written[fileno] = ho.written;
+}
 
-		    if (a) {
-			if (adepth <= a->contents_depth) {
-			    if (ntoc >= tocsize) {
-				tocsize += 64;
-				toc = sresize(toc, tocsize, htmlsect *);
-			    }
-			    toc[ntoc++] = s;
-			}
-		    }
-		}
+void html_backend(paragraph *sourceform, keywordlist *keywords,
+		  indexdata *idx, void *unused, outdest *od)
+{
+    paragraph *p;
+    htmlsect *topsect;
+    htmlconfig conf;
+    htmlfilelist files = { NULL, NULL, NULL, NULL, NULL, NULL };
+    htmlsectlist sects = { NULL, NULL }, nonsects = { NULL, NULL };
+    char *hhk_filename;
+    int has_index;
+    int nwritten = 0, noutput = 0;
 
-		if (leaf && conf.leaf_contains_contents &&
-		    ntoc >= conf.leaf_smallest_contents) {
-		    int i;
+    IGNORE(unused);
 
-		    for (i = 0; i < ntoc; i++) {
-			htmlsect *s = toc[i];
-			int hlevel = (s->type == TOP ? -1 :
-				      s->type == INDEX ? 0 :
-				      heading_depth(s->title))
-			    - f->min_heading_depth + 1;
+    conf = html_configure(sourceform);
 
-			assert(hlevel >= 1);
-			html_contents_entry(&ho, hlevel, s,
-					    f, keywords, &conf);
-		    }
-		    html_contents_entry(&ho, 0, NULL, f, keywords, &conf);
-		}
-	    }
+    /*
+     * We're going to make heavy use of paragraphs' private data
+     * fields in the forthcoming code. Clear them first, so we can
+     * reliably tell whether we have auxiliary data for a
+     * particular paragraph.
+     */
+    for (p = sourceform; p; p = p->next)
+	p->private_data = NULL;
 
-	    /*
-	     * Now go through the document and output some real
-	     * text.
-	     */
-	    displaying = FALSE;
-	    for (s = sects.head; s; s = s->next) {
-		if (s->file == f) {
-		    /*
-		     * This section belongs in this file.
-		     * Display it.
-		     */
-		    displaying = TRUE;
-		} else {
-		    /*
-		     * Doesn't belong in this file, but it may be
-		     * a descendant of a section which does, in
-		     * which case we should consider it for the
-		     * main TOC of this file (for non-leaf files).
-		     */
-		    htmlsect *a, *ac;
-		    int depth, adepth;
+    files.frags = newtree234(html_fragment_compare);
+    files.files = newtree234(html_filename_compare);
+
+    /*
+     * Start by figuring out into which file each piece of the
+     * document should be put. We'll do this by inventing an
+     * `htmlsect' structure and stashing it in the private_data
+     * field of each section paragraph; we also need one additional
+     * htmlsect for the document index, which won't show up in the
+     * source form but needs to be consistently mentioned in
+     * contents links.
+     * 
+     * While we're here, we'll also invent the HTML fragment name(s)
+     * for each section.
+     */
+    {
+	htmlsect *sect;
+	int d;
 
-		    displaying = FALSE;
+	topsect = html_new_sect(&sects, NULL, &conf);
+	topsect->type = TOP;
+	topsect->title = NULL;
+	topsect->text = sourceform;
+	topsect->contents_depth = contents_depth(conf, 0);
+	html_file_section(&conf, &files, topsect, -1);
 
-		    /*
-		     * Search up from this section until we find
-		     * the highest-level one which belongs in this
-		     * file.
-		     */
-		    depth = adepth = 0;
-		    a = NULL;
-		    for (ac = s; ac; ac = ac->parent) {
-			if (ac->file == f) {
-			    a = ac;
-			    adepth = depth;
-			}
-			depth++;
-		    }
+	for (p = sourceform; p; p = p->next)
+	    if (is_heading_type(p->type)) {
+		d = heading_depth(p);
 
-		    if (a != NULL) {
-			/*
-			 * This section does not belong in this
-			 * file, but an ancestor of it does. Write
-			 * out a contents table entry, if the depth
-			 * doesn't exceed the maximum contents
-			 * depth for the ancestor section.
-			 */
-			if (adepth <= a->contents_depth) {
-			    html_contents_entry(&ho, adepth, s,
-						f, keywords, &conf);
-			}
-		    }
+		if (p->type == para_Title) {
+		    topsect->title = p;
+		    continue;
 		}
 
-		if (displaying) {
-		    int hlevel;
-		    char htag[3];
+		sect = html_new_sect(&sects, p, &conf);
+		sect->text = p->next;
 
-		    html_contents_entry(&ho, 0, NULL, f, keywords, &conf);
+		sect->contents_depth = contents_depth(conf, d+1) - (d+1);
 
-		    /*
-		     * Display the section heading.
-		     */
+		if (p->parent) {
+		    sect->parent = (htmlsect *)p->parent->private_data;
+		    assert(sect->parent != NULL);
+		} else
+		    sect->parent = topsect;
+		p->private_data = sect;
 
-		    hlevel = (s->type == TOP ? -1 :
-			      s->type == INDEX ? 0 :
-			      heading_depth(s->title))
-			- f->min_heading_depth + 1;
-		    assert(hlevel >= 1);
-		    /* HTML headings only go up to <h6> */
-		    if (hlevel > 6)
-			hlevel = 6;
-		    htag[0] = 'h';
-		    htag[1] = '0' + hlevel;
-		    htag[2] = '\0';
-		    element_open(&ho, htag);
+		html_file_section(&conf, &files, sect, d);
 
-		    /*
-		     * Provide anchor(s) for cross-links to target.
-		     * 
-		     * (Also we'll have to do this separately in
-		     * other paragraph types - NumberedList and
-		     * BiblioCited.)
-		     */
-		    {
-			int i;
-			for (i=0; i < conf.ntfragments; i++)
-			    if (s->fragments[i])
-				html_fragment(&ho, s->fragments[i]);
+		{
+		    int i;
+		    for (i=0; i < conf.ntfragments; i++) {
+			sect->fragments[i] =
+			    html_format(p, conf.template_fragments[i]);
+			sect->fragments[i] =
+			    html_sanitise_fragment(&files, sect->file,
+						   sect->fragments[i]);
 		    }
+		}
+	    }
 
-		    html_section_title(&ho, s, f, keywords, &conf, TRUE);
-
-		    element_close(&ho, htag);
-
-		    /*
-		     * Now display the section text.
-		     */
-		    if (s->text) {
-			stackhead = snew(struct stackelement);
-			stackhead->next = NULL;
-			stackhead->listtype = NOLIST;
-			stackhead->itemtype = NOITEM;
+	/*
+	 * And the index, if we have one. Note that we don't output
+	 * an index as an HTML file if we're outputting one as a
+	 * .HHK.
+	 */
+	has_index = (count234(idx->entries) > 0);
+	if (has_index && !conf.hhk_filename) {
+	    sect = html_new_sect(&sects, NULL, &conf);
+	    sect->text = NULL;
+	    sect->type = INDEX;
+	    sect->parent = topsect;
+            sect->contents_depth = 0;
+	    html_file_section(&conf, &files, sect, 0);   /* peer of chapters */
+	    sect->fragments[0] = utoa_dup(conf.index_text, CS_ASCII);
+	    sect->fragments[0] = html_sanitise_fragment(&files, sect->file,
+							sect->fragments[0]);
+	    files.index = sect->file;
+	}
+    }
 
-			for (p = s->text;; p = p->next) {
-			    enum LISTTYPE listtype;
-			    struct stackelement *se;
+    /*
+     * Go through the keyword list and sort out fragment IDs for
+     * all the potentially referenced paragraphs which _aren't_
+     * headings.
+     */
+    {
+	int i;
+	keyword *kw;
+	htmlsect *sect;
 
-			    /*
-			     * Preliminary switch to figure out what
-			     * sort of list we expect to be inside at
-			     * this stage.
-			     *
-			     * Since p may still be NULL at this point,
-			     * I invent a harmless paragraph type for
-			     * it if it is.
-			     */
-			    switch (p ? p->type : para_Normal) {
-			      case para_Rule:
-			      case para_Normal:
-			      case para_Copyright:
-			      case para_BiblioCited:
-			      case para_Code:
-			      case para_QuotePush:
-			      case para_QuotePop:
-			      case para_Chapter:
-			      case para_Appendix:
-			      case para_UnnumberedChapter:
-			      case para_Heading:
-			      case para_Subsect:
-			      case para_LcontPop:
-				listtype = NOLIST;
-				break;
+	for (i = 0; (kw = index234(keywords->keys, i)) != NULL; i++) {
+	    paragraph *q, *p = kw->para;
 
-			      case para_Bullet:
-				listtype = UL;
-				break;
+	    if (!is_heading_type(p->type)) {
+		htmlsect *parent;
 
-			      case para_NumberedList:
-				listtype = OL;
-				break;
+		/*
+		 * Find the paragraph's parent htmlsect, to
+		 * determine which file it will end up in.
+		 */
+		q = p->parent;
+		if (!q) {
+		    /*
+		     * Preamble paragraphs have no parent. So if we
+		     * have a non-heading with no parent, it must
+		     * be preamble, and therefore its parent
+		     * htmlsect must be the preamble one.
+		     */
+		    assert(sects.head &&
+			   sects.head->type == TOP);
+		    parent = sects.head;
+		} else
+		    parent = (htmlsect *)q->private_data;
 
-			      case para_DescribedThing:
-			      case para_Description:
-				listtype = DL;
-				break;
+		/*
+		 * Now we can construct an htmlsect for this
+		 * paragraph itself, taking care to put it in the
+		 * list of non-sections rather than the list of
+		 * sections (so that traverses of the `sects' list
+		 * won't attempt to add it to the contents or
+		 * anything weird like that).
+		 */
+		sect = html_new_sect(&nonsects, p, &conf);
+		sect->file = parent->file;
+		sect->parent = parent;
+		p->private_data = sect;
 
-			      case para_LcontPush:
-				se = snew(struct stackelement);
-				se->next = stackhead;
-				se->listtype = NOLIST;
-				se->itemtype = NOITEM;
-				stackhead = se;
-				continue;
+		/*
+		 * Fragment IDs for these paragraphs will simply be
+		 * `p' followed by an integer.
+		 */
+		sect->fragments[0] = snewn(40, char);
+		sprintf(sect->fragments[0], "p%d",
+			sect->file->last_fragment_number++);
+		sect->fragments[0] = html_sanitise_fragment(&files, sect->file,
+							    sect->fragments[0]);
+	    }
+	}
+    }
 
-			      default:     /* some totally non-printing para */
-				continue;
-			    }
+    /*
+     * Reset the fragment numbers in each file. I've just used them
+     * to generate `p' fragment IDs for non-section paragraphs
+     * (numbered list elements, bibliocited), and now I want to use
+     * them for `i' fragment IDs for index entries.
+     */
+    {
+	htmlfile *file;
+	for (file = files.head; file; file = file->next)
+	    file->last_fragment_number = 0;
+    }
 
-			    html_nl(&ho);
+    /*
+     * Now sort out the index. This involves:
+     * 
+     * 	- For each index term, we set up an htmlindex structure to
+     * 	  store all the references to that term.
+     * 
+     * 	- Then we make a pass over the actual document, finding
+     * 	  every word_IndexRef; for each one, we actually figure out
+     * 	  the HTML filename/fragment pair we will use to reference
+     * 	  it, store that information in the private data field of
+     * 	  the word_IndexRef itself (so we can recreate it when the
+     * 	  time comes to output our HTML), and add a reference to it
+     * 	  to the index term in question.
+     */
+    {
+	int i;
+	indexentry *entry;
+	htmlsect *lastsect;
+	word *w;
 
-			    /*
-			     * Terminate the most recent list item, if
-			     * any. (We left this until after
-			     * processing LcontPush, since in that case
-			     * the list item won't want to be
-			     * terminated until after the corresponding
-			     * LcontPop.)
-			     */
-			    if (stackhead->itemtype != NOITEM) {
-				element_close(&ho, itemname(stackhead->itemtype));
-				html_nl(&ho);
-			    }
-			    stackhead->itemtype = NOITEM;
+	/*
+	 * Set up the htmlindex structures.
+	 */
 
-			    /*
-			     * Terminate the current list, if it's not
-			     * the one we want to be in.
-			     */
-			    if (listtype != stackhead->listtype &&
-				stackhead->listtype != NOLIST) {
-				element_close(&ho, listname(stackhead->listtype));
-				html_nl(&ho);
-			    }
+	for (i = 0; (entry = index234(idx->entries, i)) != NULL; i++) {
+	    htmlindex *hi = snew(htmlindex);
 
-			    /*
-			     * Leave the loop if our time has come.
-			     */
-			    if (!p || (is_heading_type(p->type) &&
-				       p->type != para_Title))
-				break;     /* end of section text */
+	    hi->nrefs = hi->refsize = 0;
+	    hi->refs = NULL;
 
-			    /*
-			     * Start a fresh list if necessary.
-			     */
-			    if (listtype != stackhead->listtype &&
-				listtype != NOLIST)
-				element_open(&ho, listname(listtype));
+	    entry->backend_data = hi;
+	}
 
-			    stackhead->listtype = listtype;
+	/*
+	 * Run over the document inventing fragments. Each fragment
+	 * is of the form `i' followed by an integer.
+	 */
+	lastsect = sects.head;	       /* this is always the top section */
+	for (p = sourceform; p; p = p->next) {
+	    if (is_heading_type(p->type) && p->type != para_Title)
+		lastsect = (htmlsect *)p->private_data;
 
-			    switch (p->type) {
-			      case para_Rule:
-				element_empty(&ho, "hr");
-				break;
-			      case para_Code:
-				html_codepara(&ho, p->words);
-				break;
-			      case para_Normal:
-			      case para_Copyright:
-				element_open(&ho, "p");
-				html_nl(&ho);
-				html_words(&ho, p->words, ALL,
-					   f, keywords, &conf);
-				html_nl(&ho);
-				element_close(&ho, "p");
-				break;
-			      case para_BiblioCited:
-				element_open(&ho, "p");
-				if (p->private_data) {
-				    htmlsect *s = (htmlsect *)p->private_data;
-				    int i;
-				    for (i=0; i < conf.ntfragments; i++)
-					if (s->fragments[i])
-					    html_fragment(&ho, s->fragments[i]);
-				}
-				html_nl(&ho);
-				html_words(&ho, p->kwtext, ALL,
-					   f, keywords, &conf);
-				html_text(&ho, L" ");
-				html_words(&ho, p->words, ALL,
-					   f, keywords, &conf);
-				html_nl(&ho);
-				element_close(&ho, "p");
-				break;
-			      case para_Bullet:
-			      case para_NumberedList:
-				element_open(&ho, "li");
-				if (p->private_data) {
-				    htmlsect *s = (htmlsect *)p->private_data;
-				    int i;
-				    for (i=0; i < conf.ntfragments; i++)
-					if (s->fragments[i])
-					    html_fragment(&ho, s->fragments[i]);
-				}
-				html_nl(&ho);
-				stackhead->itemtype = LI;
-				html_words(&ho, p->words, ALL,
-					   f, keywords, &conf);
-				break;
-			      case para_DescribedThing:
-				element_open(&ho, "dt");
-				html_nl(&ho);
-				stackhead->itemtype = DT;
-				html_words(&ho, p->words, ALL,
-					   f, keywords, &conf);
-				break;
-			      case para_Description:
-				element_open(&ho, "dd");
-				html_nl(&ho);
-				stackhead->itemtype = DD;
-				html_words(&ho, p->words, ALL,
-					   f, keywords, &conf);
-				break;
+	    for (w = p->words; w; w = w->next)
+		if (w->type == word_IndexRef) {
+		    htmlindexref *hr = snew(htmlindexref);
+		    indextag *tag;
+		    int i;
 
-			      case para_QuotePush:
-				element_open(&ho, "blockquote");
-				break;
-			      case para_QuotePop:
-				element_close(&ho, "blockquote");
-				break;
+		    hr->referenced = hr->generated = FALSE;
+		    hr->section = lastsect;
+		    {
+			char buf[40];
+			sprintf(buf, "i%d",
+				lastsect->file->last_fragment_number++);
+			hr->fragment = dupstr(buf);
+			hr->fragment =
+			    html_sanitise_fragment(&files, hr->section->file,
+						   hr->fragment);
+		    }
+		    w->private_data = hr;
 
-			      case para_LcontPop:
-				se = stackhead;
-				stackhead = stackhead->next;
-				assert(stackhead);
-				sfree(se);
-				break;
-			    }
-			}
+		    tag = index_findtag(idx, w->text);
+		    if (!tag)
+			break;
 
-			assert(stackhead && !stackhead->next);
-			sfree(stackhead);
-		    }
-		    
-		    if (s->type == INDEX) {
-			indexentry *entry;
-			int i;
-
-			/*
-			 * This section is the index. I'll just
-			 * render it as a single paragraph, with a
-			 * colon between the index term and the
-			 * references, and <br> in between each
-			 * entry.
-			 */
-			element_open(&ho, "p");
+		    for (i = 0; i < tag->nrefs; i++) {
+			indexentry *entry = tag->refs[i];
+			htmlindex *hi = (htmlindex *)entry->backend_data;
 
-			for (i = 0; (entry =
-				     index234(idx->entries, i)) != NULL; i++) {
-			    htmlindex *hi = (htmlindex *)entry->backend_data;
-			    int j;
-
-			    if (i > 0)
-				element_empty(&ho, "br");
-			    html_nl(&ho);
-
-			    html_words(&ho, entry->text, MARKUP|LINKS,
-				       f, keywords, &conf);
-
-			    html_text(&ho, conf.index_main_sep);
-
-			    for (j = 0; j < hi->nrefs; j++) {
-				htmlindexref *hr =
-				    (htmlindexref *)hi->refs[j]->private_data;
-				paragraph *p = hr->section->title;
-
-				if (j > 0)
-				    html_text(&ho, conf.index_multi_sep);
-
-				html_href(&ho, f, hr->section->file,
-					  hr->fragment);
-				hr->referenced = TRUE;
-				if (p && p->kwtext)
-				    html_words(&ho, p->kwtext, MARKUP|LINKS,
-					       f, keywords, &conf);
-				else if (p && p->words)
-				    html_words(&ho, p->words, MARKUP|LINKS,
-					       f, keywords, &conf);
-				else {
-				    /*
-				     * If there is no title at all,
-				     * this must be because our
-				     * target section is the
-				     * preamble section and there
-				     * is no title. So we use the
-				     * preamble_text.
-				     */
-				    html_text(&ho, conf.preamble_text);
-				}
-				element_close(&ho, "a");
-			    }
+			if (hi->nrefs >= hi->refsize) {
+			    hi->refsize += 32;
+			    hi->refs = sresize(hi->refs, hi->refsize, word *);
 			}
-			element_close(&ho, "p");
-		    }
-		}
-	    }
-
-	    html_contents_entry(&ho, 0, NULL, f, keywords, &conf);
-	    html_nl(&ho);
 
-	    {
-		/*
-		 * Footer.
-		 */
-		int done_version_ids = FALSE;
-
-		if (conf.address_section)
-		    element_empty(&ho, "hr");
-
-		if (conf.body_end)
-		    html_raw(&ho, conf.body_end);
-
-		if (conf.address_section) {
-		    int started = FALSE;
-		    if (conf.htmlver == ISO_HTML) {
-			/*
-			 * The ISO-HTML validator complains if
-			 * there isn't a <div> tag surrounding the
-			 * <address> tag. I'm uncertain of why this
-			 * should be - there appears to be no
-			 * mention of this in the ISO-HTML spec,
-			 * suggesting that it doesn't represent a
-			 * change from HTML 4, but nonetheless the
-			 * HTML 4 validator doesn't seem to mind.
-			 */
-			element_open(&ho, "div");
-		    }
-		    element_open(&ho, "address");
-		    if (conf.addr_start) {
-			html_raw(&ho, conf.addr_start);
-			html_nl(&ho);
-			started = TRUE;
-		    }
-		    if (conf.visible_version_id) {
-			for (p = sourceform; p; p = p->next)
-			    if (p->type == para_VersionID) {
-				if (started)
-				    element_empty(&ho, "br");
-				html_nl(&ho);
-				html_text(&ho, conf.pre_versionid);
-				html_words(&ho, p->words, NOTHING,
-					   f, keywords, &conf);
-				html_text(&ho, conf.post_versionid);
-				started = TRUE;
-			    }
-			done_version_ids = TRUE;
-		    }
-		    if (conf.addr_end) {
-			if (started)
-			    element_empty(&ho, "br");
-			html_raw(&ho, conf.addr_end);
+			hi->refs[hi->nrefs++] = w;
 		    }
-		    element_close(&ho, "address");
-		    if (conf.htmlver == ISO_HTML)
-			element_close(&ho, "div");
 		}
+	}
+    }
 
-		if (!done_version_ids) {
-		    /*
-		     * If the user didn't want the version IDs
-		     * visible, I think we still have a duty to put
-		     * them in an HTML comment.
-		     */
-		    int started = FALSE;
-		    for (p = sourceform; p; p = p->next)
-			if (p->type == para_VersionID) {
-			    if (!started) {
-				html_raw(&ho, "<!-- version IDs:\n");
-				started = TRUE;
-			    }
-			    html_words(&ho, p->words, NOTHING,
-				       f, keywords, &conf);
-			    html_nl(&ho);
-			}
-		    if (started)
-			html_raw(&ho, "-->\n");
-		}
-	    }
+    /*
+     * Now we're ready to write out the actual HTML files.
+     * 
+     * For each file:
+     * 
+     *  - we open that file and write its header
+     *  - we run down the list of sections
+     * 	- for each section directly contained within that file, we
+     * 	  output the section text
+     * 	- for each section which is not in the file but which has a
+     * 	  parent that is, we output a contents entry for the
+     * 	  section if appropriate
+     *  - finally, we output the file trailer and close the file.
+     */
+    {
+	htmlfilewriter w;
+	htmlfile *f;
+	int i, nfiles;
 
-	    element_close(&ho, "body");
-	    html_nl(&ho);
-	    element_close(&ho, "html");
-	    html_nl(&ho);
-	    cleanup(&ho);
-	}
+	nfiles = 0;
+	for (f = files.head; f; f = f->next)
+	    nfiles++;
+	w.filearray = snewn(nfiles, htmlfile *);
+	w.written = snewn(nfiles, int);
+	for (i = 0, f = files.head; f; f = f->next)
+	    w.filearray[i++] = f;
+
+	w.conf = &conf;
+	w.files = &files;
+	w.sects = &sects;
+	w.sourceform = sourceform;
+	w.keywords = keywords;
+	w.idx = idx;
+	w.has_index = has_index;
+	w.od = od;
+
+	run_in_parallel(nfiles, html_write_file, &w);
+
+	for (i = 0; i < nfiles; i++)
+	    nwritten += w.written[i];
+	noutput += nfiles;
+
+	sfree(w.filearray);
+	sfree(w.written);
     }
 
     /*
@@ -1683,27 +1770,32 @@ void html_backend(paragraph *sourceform, keywordlist *keywords,
 	ho.contents_level = 0;
 	ho.hackflags = HO_HACK_QUOTENOTHING;
 
-	ho.fp = fopen(conf.hhp_filename, "w");
-	if (!ho.fp)
-	    err_cantopenw(conf.hhp_filename);
-
-	fprintf(ho.fp,
-		"[OPTIONS]\n"
-		/* Binary TOC required for Next/Previous nav to work */
-		"Binary TOC=Yes\n"
-		"Compatibility=1.1 or later\n"
-		"Compiled file=%s\n"
-		"Default Window=main\n"
-		"Default topic=%s\n"
-		"Display compile progress=Yes\n"
-		"Full-text search=Yes\n"
-		"Title=", conf.chm_filename, files.head->filename);
+	html_open(&ho, od, conf.hhp_filename, conf.skip_unchanged,
+		  GZIP_NONE);
+
+	html_outs(&ho,
+		  "[OPTIONS]\n"
+		  /* Binary TOC required for Next/Previous nav to work */
+		  "Binary TOC=Yes\n"
+		  "Compatibility=1.1 or later\n"
+		  "Compiled file=");
+	html_outs(&ho, conf.chm_filename);
+	html_outs(&ho,
+		  "\n"
+		  "Default Window=main\n"
+		  "Default topic=");
+	html_outs(&ho, files.head->filename);
+	html_outs(&ho,
+		  "\n"
+		  "Display compile progress=Yes\n"
+		  "Full-text search=Yes\n"
+		  "Title=");
 
 	ho.hacklimit = 255;
 	html_words(&ho, topsect->title->words, NOTHING,
 		   NULL, keywords, &conf);
 
-	fprintf(ho.fp, "\n");
+	html_outs(&ho, "\n");
 
 	/*
 	 * These two entries don't seem to be remotely necessary
@@ -1712,33 +1804,42 @@ void html_backend(paragraph *sourceform, keywordlist *keywords,
 	 * rather strangely if you try to load the help project
 	 * into that and edit it.
 	 */
-	if (conf.hhc_filename)
-	    fprintf(ho.fp, "Contents file=%s\n", conf.hhc_filename);
-	if (hhk_filename)
-	    fprintf(ho.fp, "Index file=%s\n", hhk_filename);
+	if (conf.hhc_filename) {
+	    html_outs(&ho, "Contents file=");
+	    html_outs(&ho, conf.hhc_filename);
+	    html_outs(&ho, "\n");
+	}
+	if (hhk_filename) {
+	    html_outs(&ho, "Index file=");
+	    html_outs(&ho, hhk_filename);
+	    html_outs(&ho, "\n");
+	}
 
-	fprintf(ho.fp, "\n[WINDOWS]\nmain=\"");
+	html_outs(&ho, "\n[WINDOWS]\nmain=\"");
 
 	ho.hackflags |= HO_HACK_OMITQUOTES;
 	ho.hacklimit = 255;
 	html_words(&ho, topsect->title->words, NOTHING,
 		   NULL, keywords, &conf);
 
-	fprintf(ho.fp, "\",\"%s\",\"%s\",\"%s\",,,,,,"
-		/* This first magic number is fsWinProperties, controlling
-		 * Navigation Pane options and the like.
-		 * Constants HHWIN_PROP_* in htmlhelp.h. */
-		"0x62520,,"
-		/* This second number is fsToolBarFlags, mainly controlling
-		 * toolbar buttons. Constants HHWIN_BUTTON_*.
-		 * NOTE: there are two pairs of bits for Next/Previous
-		 * buttons: 7/8 (which do nothing useful), and 21/22
-		 * (which work). (Neither of these are exposed in the HHW
-		 * UI, but they work fine in HH.) We use the latter. */
-		"0x60304e,,,,,,,,0\n",
-		conf.hhc_filename ? conf.hhc_filename : "",
-		hhk_filename ? hhk_filename : "",
-		files.head->filename);
+	html_outs(&ho, "\",\"");
+	html_outs(&ho, conf.hhc_filename ? conf.hhc_filename : "");
+	html_outs(&ho, "\",\"");
+	html_outs(&ho, hhk_filename ? hhk_filename : "");
+	html_outs(&ho, "\",\"");
+	html_outs(&ho, files.head->filename);
+	html_outs(&ho, "\",,,,,,"
+		  /* This first magic number is fsWinProperties, controlling
+		   * Navigation Pane options and the like.
+		   * Constants HHWIN_PROP_* in htmlhelp.h. */
+		  "0x62520,,"
+		  /* This second number is fsToolBarFlags, mainly controlling
+		   * toolbar buttons. Constants HHWIN_BUTTON_*.
+		   * NOTE: there are two pairs of bits for Next/Previous
+		   * buttons: 7/8 (which do nothing useful), and 21/22
+		   * (which work). (Neither of these are exposed in the HHW
+		   * UI, but they work fine in HH.) We use the latter. */
+		  "0x60304e,,,,,,,,0\n");
 
 	/*
 	 * The [FILES] section is also not necessary for
@@ -1746,11 +1847,15 @@ void html_backend(paragraph *sourceform, keywordlist *keywords,
 	 * files just by following links from the given starting
 	 * points), but useful for loading the project into HHW.
 	 */
-	fprintf(ho.fp, "\n[FILES]\n");
-	for (f = files.head; f; f = f->next)
-	    fprintf(ho.fp, "%s\n", f->filename);
+	html_outs(&ho, "\n[FILES]\n");
+	for (f = files.head; f; f = f->next) {
+	    html_outs(&ho, f->filename);
+	    html_outs(&ho, "\n");
+	}
 
-	fclose(ho.fp);
+	cleanup(&ho);
+	nwritten += ho.written;
+	noutput++;
     }
     if (conf.hhc_filename) {
 	htmlfile *f;
@@ -1758,9 +1863,8 @@ void html_backend(paragraph *sourceform, keywordlist *keywords,
 	htmloutput ho;
 	int currdepth = 0;
 
-	ho.fp = fopen(conf.hhc_filename, "w");
-	if (!ho.fp)
-	    err_cantopenw(conf.hhc_filename);
+	html_open(&ho, od, conf.hhc_filename, conf.skip_unchanged,
+		  GZIP_NONE);
 
 	ho.charset = CS_CP1252;	       /* as far as I know, HHC files are */
 	ho.restrict_charset = CS_CP1252;   /* hardwired to this charset */
@@ -1774,12 +1878,13 @@ void html_backend(paragraph *sourceform, keywordlist *keywords,
 	 * Magic DOCTYPE which seems to work for .HHC files. I'm
 	 * wary of trying to change it!
 	 */
-	fprintf(ho.fp, "<!DOCTYPE HTML PUBLIC \"-//IETF//DTD HTML//EN\">\n"
-		"<HTML><HEAD>\n"
-		"<META HTTP-EQUIV=\"Content-Type\" "
-		"CONTENT=\"text/html; charset=%s\">\n"
-		"</HEAD><BODY><UL>\n",
-		charset_to_mimeenc(conf.output_charset));
+	html_outs(&ho, "<!DOCTYPE HTML PUBLIC \"-//IETF//DTD HTML//EN\">\n"
+		  "<HTML><HEAD>\n"
+		  "<META HTTP-EQUIV=\"Content-Type\" "
+		  "CONTENT=\"text/html; charset=");
+	html_outs(&ho, charset_to_mimeenc(conf.output_charset));
+	html_outs(&ho, "\">\n"
+		  "</HEAD><BODY><UL>\n");
 
 	for (f = files.head; f; f = f->next) {
 	    /*
@@ -1829,35 +1934,39 @@ void html_backend(paragraph *sourceform, keywordlist *keywords,
 	     * Now write out our contents entry.
 	     */
 	    while (currdepth < depth) {
-		fprintf(ho.fp, "<UL>\n");
+		html_outs(&ho, "<UL>\n");
 		currdepth++;
 	    }
 	    while (currdepth > depth) {
-		fprintf(ho.fp, "</UL>\n");
+		html_outs(&ho, "</UL>\n");
 		currdepth--;
 	    }
 	    /* fprintf(ho.fp, "<!-- depth=%d -->", depth); */
-	    fprintf(ho.fp, "<LI><OBJECT TYPE=\"text/sitemap\">"
-		    "<PARAM NAME=\"Name\" VALUE=\"");
+	    html_outs(&ho, "<LI><OBJECT TYPE=\"text/sitemap\">"
+		      "<PARAM NAME=\"Name\" VALUE=\"");
 	    ho.hacklimit = 255;
 	    if (f->first->title)
 		html_words(&ho, f->first->title->words, NOTHING,
 			   NULL, keywords, &conf);
 	    else if (f->first->type == INDEX)
 		html_text(&ho, conf.index_text);
-	    fprintf(ho.fp, "\"><PARAM NAME=\"Local\" VALUE=\"%s\">"
-		    "<PARAM NAME=\"ImageNumber\" VALUE=\"%d\"></OBJECT>\n",
-		    f->filename, leaf ? 11 : 1);
+	    html_outs(&ho, "\"><PARAM NAME=\"Local\" VALUE=\"");
+	    html_outs(&ho, f->filename);
+	    html_outs(&ho, "\"><PARAM NAME=\"ImageNumber\" VALUE=\"");
+	    html_outs(&ho, leaf ? "11" : "1");
+	    html_outs(&ho, "\"></OBJECT>\n");
 	}
 
 	while (currdepth > 0) {
-	    fprintf(ho.fp, "</UL>\n");
+	    html_outs(&ho, "</UL>\n");
 	    currdepth--;
 	}
 
-	fprintf(ho.fp, "</UL></BODY></HTML>\n");
+	html_outs(&ho, "</UL></BODY></HTML>\n");
 
 	cleanup(&ho);
+	nwritten += ho.written;
+	noutput++;
     }
     if (hhk_filename) {
 	htmlfile *f;
@@ -1872,9 +1981,8 @@ void html_backend(paragraph *sourceform, keywordlist *keywords,
 	for (f = files.head; f; f = f->next)
 	    f->temp = 0;
 
-	ho.fp = fopen(hhk_filename, "w");
-	if (!ho.fp)
-	    err_cantopenw(hhk_filename);
+	html_open(&ho, od, hhk_filename, conf.skip_unchanged,
+		  GZIP_NONE);
 
 	ho.charset = CS_CP1252;	       /* as far as I know, HHK files are */
 	ho.restrict_charset = CS_CP1252;   /* hardwired to this charset */
@@ -1888,12 +1996,13 @@ void html_backend(paragraph *sourceform, keywordlist *keywords,
 	 * Magic DOCTYPE which seems to work for .HHK files. I'm
 	 * wary of trying to change it!
 	 */
-	fprintf(ho.fp, "<!DOCTYPE HTML PUBLIC \"-//IETF//DTD HTML//EN\">\n"
-		"<HTML><HEAD>\n"
-		"<META HTTP-EQUIV=\"Content-Type\" "
-		"CONTENT=\"text/html; charset=%s\">\n"
-		"</HEAD><BODY><UL>\n",
-		charset_to_mimeenc(conf.output_charset));
+	html_outs(&ho, "<!DOCTYPE HTML PUBLIC \"-//IETF//DTD HTML//EN\">\n"
+		  "<HTML><HEAD>\n"
+		  "<META HTTP-EQUIV=\"Content-Type\" "
+		  "CONTENT=\"text/html; charset=");
+	html_outs(&ho, charset_to_mimeenc(conf.output_charset));
+	html_outs(&ho, "\">\n"
+		  "</HEAD><BODY><UL>\n");
 
 	/*
 	 * Go through the index terms and output each one.
@@ -1903,12 +2012,12 @@ void html_backend(paragraph *sourceform, keywordlist *keywords,
 	    int j;
 
 	    if (hi->nrefs > 0) {
-		fprintf(ho.fp, "<LI><OBJECT TYPE=\"text/sitemap\">\n"
-			"<PARAM NAME=\"Name\" VALUE=\"");
+		html_outs(&ho, "<LI><OBJECT TYPE=\"text/sitemap\">\n"
+			  "<PARAM NAME=\"Name\" VALUE=\"");
 		ho.hacklimit = 255;
 		html_words(&ho, entry->text, NOTHING,
 			   NULL, keywords, &conf);
-		fprintf(ho.fp, "\">\n");
+		html_outs(&ho, "\">\n");
 
 		for (j = 0; j < hi->nrefs; j++) {
 		    htmlindexref *hr =
@@ -1919,15 +2028,16 @@ void html_backend(paragraph *sourceform, keywordlist *keywords,
 		     * reference the same file more than once.
 		     */
 		    if (!hr->section->file->temp) {
-			fprintf(ho.fp, "<PARAM NAME=\"Local\" VALUE=\"%s\">\n",
-				hr->section->file->filename);
+			html_outs(&ho, "<PARAM NAME=\"Local\" VALUE=\"");
+			html_outs(&ho, hr->section->file->filename);
+			html_outs(&ho, "\">\n");
 			hr->section->file->temp = 1;
 		    }
 
 		    hr->referenced = TRUE;
 		}
 
-		fprintf(ho.fp, "</OBJECT>\n");
+		html_outs(&ho, "</OBJECT>\n");
 
 		/*
 		 * Now go through those files and re-clear the temp
@@ -1941,10 +2051,54 @@ void html_backend(paragraph *sourceform, keywordlist *keywords,
 	    }
 	}
 
-	fprintf(ho.fp, "</UL></BODY></HTML>\n");
+	html_outs(&ho, "</UL></BODY></HTML>\n");
 	cleanup(&ho);
+	nwritten += ho.written;
+	noutput++;
+    }
+
+    /*
+     * Build the search index, if requested. Each section is a
+     * target; its text is everything from its heading up to the
+     * next one, plus any index terms which refer into it.
+     */
+    if (conf.search_prefix) {
+	searchindex *si = search_new();
+	htmlsect *sect, *lastsect;
+	indexentry *entry;
+	int i, j;
+
+	for (sect = sects.head; sect; sect = sect->next)
+	    sect->searchid = search_add_target(
+		si, sect->file->filename, sect->fragments[0],
+		sect->title ? sect->title->kwtext2 : NULL,
+		sect->title ? sect->title->words : NULL);
+
+	lastsect = sects.head;	       /* this is always the top section */
+	for (p = sourceform; p; p = p->next) {
+	    if (is_heading_type(p->type) && p->type != para_Title)
+		lastsect = (htmlsect *)p->private_data;
+	    search_add_para(si, lastsect->searchid, p);
+	}
+
+	for (i = 0; (entry = index234(idx->entries, i)) != NULL; i++) {
+	    htmlindex *hi = (htmlindex *)entry->backend_data;
+
+	    for (j = 0; j < hi->nrefs; j++) {
+		htmlindexref *hr =
+		    (htmlindexref *)hi->refs[j]->private_data;
+		search_add_words(si, hr->section->searchid, entry->text);
+	    }
+	}
+
+	search_write(si, od, conf.search_prefix,
+		     conf.skip_unchanged ? OUT_IF_CHANGED : 0);
+	search_free(si);
     }
 
+    if (conf.skip_unchanged)
+	info_htmlupdated(nwritten, noutput);
+
     /*
      * Go through and check that no index fragments were referenced
      * without being generated, or indeed vice versa.
@@ -2040,6 +2194,7 @@ void html_backend(paragraph *sourceform, keywordlist *keywords,
     sfree(conf.contents_filename);
     sfree(conf.index_filename);
     sfree(conf.template_filename);
+    sfree(conf.search_prefix);
     while (conf.ntfragments--)
 	sfree(conf.template_fragments[conf.ntfragments]);
     sfree(conf.template_fragments);
@@ -2340,6 +2495,65 @@ static void html_codepara(htmloutput *ho, word *words)
     element_close(ho, "pre");
 }
 
+/*
+ * All output to an HTML file goes through a buffer in the
+ * htmloutput, which is passed to the outsinks in large chunks. If
+ * we have no outsink (we failed to open the files), output is
+ * discarded.
+ */
+#define html_discarding(ho) (!(ho)->out && !(ho)->gzout)
+
+static void html_write(htmloutput *ho, char const *p, int len, int flush)
+{
+    if (ho->out && len > 0)
+	out_write(ho->out, p, len);
+    if (ho->gzout) {
+	void *zbuf;
+	int zlen;
+
+	deflate_compress_data(ho->gz, p, len, flush, &zbuf, &zlen);
+	if (zlen > 0)
+	    out_write(ho->gzout, zbuf, zlen);
+	sfree(zbuf);
+    }
+}
+
+static void html_flush(htmloutput *ho)
+{
+    if (ho->outlen > 0)
+	html_write(ho, ho->outbuf, ho->outlen, DEFLATE_NO_FLUSH);
+    ho->outlen = 0;
+}
+
+static void html_out(htmloutput *ho, char const *p, int len)
+{
+    if (html_discarding(ho))
+	return;
+    if (ho->outlen + len > HTML_OUTBUF_SIZE) {
+	html_flush(ho);
+	if (len > HTML_OUTBUF_SIZE) {
+	    html_write(ho, p, len, DEFLATE_NO_FLUSH);
+	    return;
+	}
+    }
+    memcpy(ho->outbuf + ho->outlen, p, len);
+    ho->outlen += len;
+}
+
+static void html_outs(htmloutput *ho, char const *s)
+{
+    html_out(ho, s, strlen(s));
+}
+
+static void html_outc(htmloutput *ho, char c)
+{
+    if (html_discarding(ho))
+	return;
+    if (ho->outlen == HTML_OUTBUF_SIZE)
+	html_flush(ho);
+    ho->outbuf[ho->outlen++] = c;
+}
+
 static void html_charset_cleanup(htmloutput *ho)
 {
     char outbuf[256];
@@ -2347,18 +2561,16 @@ static void html_charset_cleanup(htmloutput *ho)
 
     bytes = charset_from_unicode(NULL, NULL, outbuf, lenof(outbuf),
 				 ho->charset, &ho->cstate, NULL);
-    if (ho->fp && bytes > 0)
-	fwrite(outbuf, 1, bytes, ho->fp);
+    if (bytes > 0)
+	html_out(ho, outbuf, bytes);
 }
 
 static void return_mostly_to_neutral(htmloutput *ho)
 {
-    if (ho->fp) {
-	if (ho->state == HO_IN_EMPTY_TAG && is_xhtml(ho->ver)) {
-	    fprintf(ho->fp, " />");
-	} else if (ho->state == HO_IN_EMPTY_TAG || ho->state == HO_IN_TAG) {
-	    fprintf(ho->fp, ">");
-	}
+    if (ho->state == HO_IN_EMPTY_TAG && is_xhtml(ho->ver)) {
+	html_outs(ho, " />");
+    } else if (ho->state == HO_IN_EMPTY_TAG || ho->state == HO_IN_TAG) {
+	html_outc(ho, '>');
     }
 
     ho->state = HO_NEUTRAL;
@@ -2376,68 +2588,68 @@ static void return_to_neutral(htmloutput *ho)
 static void element_open(htmloutput *ho, char const *name)
 {
     return_to_neutral(ho);
-    if (ho->fp)
-	fprintf(ho->fp, "<%s", name);
+    html_outc(ho, '<');
+    html_outs(ho, name);
     ho->state = HO_IN_TAG;
 }
 
 static void element_close(htmloutput *ho, char const *name)
 {
     return_to_neutral(ho);
-    if (ho->fp)
-	fprintf(ho->fp, "</%s>", name);
+    html_outs(ho, "</");
+    html_outs(ho, name);
+    html_outc(ho, '>');
     ho->state = HO_NEUTRAL;
 }
 
 static void element_empty(htmloutput *ho, char const *name)
 {
     return_to_neutral(ho);
-    if (ho->fp)
-	fprintf(ho->fp, "<%s", name);
+    html_outc(ho, '<');
+    html_outs(ho, name);
     ho->state = HO_IN_EMPTY_TAG;
 }
 
 static void html_nl(htmloutput *ho)
 {
     return_to_neutral(ho);
-    if (ho->fp)
-	fputc('\n', ho->fp);
+    html_outc(ho, '\n');
 }
 
 static void html_raw(htmloutput *ho, char *text)
 {
     return_to_neutral(ho);
-    if (ho->fp)
-	fputs(text, ho->fp);
+    html_outs(ho, text);
 }
 
 static void html_raw_as_attr(htmloutput *ho, char *text)
 {
     assert(ho->state == HO_IN_TAG || ho->state == HO_IN_EMPTY_TAG);
-    if (ho->fp) {
-	fputc(' ', ho->fp);
-	fputs(text, ho->fp);
-    }
+    html_outc(ho, ' ');
+    html_outs(ho, text);
 }
 
 static void element_attr(htmloutput *ho, char const *name, char const *value)
 {
     html_charset_cleanup(ho);
     assert(ho->state == HO_IN_TAG || ho->state == HO_IN_EMPTY_TAG);
-    if (ho->fp)
-	fprintf(ho->fp, " %s=\"%s\"", name, value);
+    html_outc(ho, ' ');
+    html_outs(ho, name);
+    html_outs(ho, "=\"");
+    html_outs(ho, value);
+    html_outc(ho, '"');
 }
 
 static void element_attr_w(htmloutput *ho, char const *name,
 			   wchar_t const *value)
 {
     html_charset_cleanup(ho);
-    if (ho->fp)
-	fprintf(ho->fp, " %s=\"", name);
+    html_outc(ho, ' ');
+    html_outs(ho, name);
+    html_outs(ho, "=\"");
     html_text_limit_internal(ho, value, 0, TRUE, FALSE);
     html_charset_cleanup(ho);
-    if (ho->fp)
-	fputc('"', ho->fp);
+    html_outc(ho, '"');
 }
 
 static void html_text(htmloutput *ho, wchar_t const *text)
@@ -2458,12 +2670,101 @@ static void html_text_limit(htmloutput *ho, wchar_t const *text, int maxlen)
     html_text_limit_internal(ho, text, maxlen, FALSE, FALSE);
 }
 
+/*
+ * The characters which html_text_limit_internal may have to
+ * escape all lie in the range 0x20 to 0x3F, so we can test for
+ * them with a single range check and a shift of a 32-bit mask
+ * with one bit per character in that range.
+ */
+#define HTML_SPECIAL_BIT(c) (1UL << ((c) - 0x20))
+#define HTML_SPECIAL_MARKUP \
+    (HTML_SPECIAL_BIT('<') | HTML_SPECIAL_BIT('>') | HTML_SPECIAL_BIT('&'))
+#define html_is_special(c, mask) \
+    ((unsigned long)(c) - 0x20UL < 0x20UL && \
+     ((mask) >> ((unsigned long)(c) - 0x20UL)) & 1)
+
+/*
+ * Write a run of text containing nothing special to HTML,
+ * converting it to the output charset. UTF-8, and printable ASCII
+ * in any charset which encodes it as itself, are written straight
+ * into the output buffer; everything else goes through libcharset,
+ * and characters the output charset can't represent become
+ * numeric entity references.
+ */
+static void html_text_run(htmloutput *ho, wchar_t const *text, int len)
+{
+    char outbuf[256];
+    int asciiok = ascii_ok(ho->charset);
+    int bytes, err, n;
+
+    while (len > 0) {
+	if (ho->charset == CS_UTF8) {
+	    while (len > 0) {
+		if (ho->outlen > HTML_OUTBUF_SIZE - 4)
+		    html_flush(ho);
+		n = utf8_encode(ho->outbuf + ho->outlen, *text);
+		if (!n)
+		    break;
+		if (!html_discarding(ho))
+		    ho->outlen += n;
+		text++, len--;
+	    }
+	    n = (len > 0 ? 1 : 0);
+	} else if (asciiok &&
+		   !memcmp(&ho->cstate, &charset_init_state,
+			   sizeof(ho->cstate))) {
+	    for (n = 0; n < len && text[n] >= 0x20 && text[n] < 0x7F; n++);
+	    if (n > 0) {
+		if (ho->outlen + n > HTML_OUTBUF_SIZE)
+		    html_flush(ho);
+		if (n > HTML_OUTBUF_SIZE) {
+		    n = HTML_OUTBUF_SIZE;
+		}
+		if (!html_discarding(ho)) {
+		    int i;
+		    for (i = 0; i < n; i++)
+			ho->outbuf[ho->outlen + i] = (char)text[i];
+		    ho->outlen += n;
+		}
+		text += n, len -= n;
+		continue;
+	    }
+	    /* Hand libcharset everything up to the next ASCII. */
+	    for (n = 0; n < len && !(text[n] >= 0x20 && text[n] < 0x7F); n++);
+	} else {
+	    n = len;
+	}
+
+	len -= n;
+	while (n > 0) {
+	    int lenafter = n;
+	    bytes = charset_from_unicode(&text, &lenafter, outbuf,
+					 lenof(outbuf), ho->charset,
+					 &ho->cstate, &err);
+	    n = lenafter;
+	    if (bytes > 0)
+		html_out(ho, outbuf, bytes);
+	    if (err) {
+		/*
+		 * We have encountered a character that cannot be
+		 * displayed in the selected output charset.
+		 * Therefore, we use an HTML numeric entity
+		 * reference.
+		 */
+		assert(n > 0);
+		sprintf(outbuf, "&#%ld;", (long int)*text);
+		html_outs(ho, outbuf);
+		text++, n--;
+	    }
+	}
+    }
+}
+
 static void html_text_limit_internal(htmloutput *ho, wchar_t const *text,
 				     int maxlen, int quote_quotes, int nbsp)
 {
     int textlen = ustrlen(text);
-    char outbuf[256];
-    int bytes, err;
+    unsigned long special;
 
     if (ho->hackflags & (HO_HACK_QUOTEQUOTES | HO_HACK_OMITQUOTES))
 	quote_quotes = TRUE;	       /* override the input value */
@@ -2476,68 +2777,96 @@ static void html_text_limit_internal(htmloutput *ho, wchar_t const *text,
 	ho->hacklimit -= textlen;
     }
 
+    special = HTML_SPECIAL_MARKUP;
+    if (quote_quotes)
+	special |= HTML_SPECIAL_BIT('"');
+    if (nbsp)
+	special |= HTML_SPECIAL_BIT(' ');
+
     while (textlen > 0) {
 	/* Scan ahead for characters we really can't display in HTML. */
-	int lenbefore, lenafter;
+	int lenbefore;
 	for (lenbefore = 0; lenbefore < textlen; lenbefore++)
-	    if (text[lenbefore] == L'<' ||
-		text[lenbefore] == L'>' ||
-		text[lenbefore] == L'&' ||
-		(text[lenbefore] == L'"' && quote_quotes) ||
-		(text[lenbefore] == L' ' && nbsp))
+	    if (html_is_special(text[lenbefore], special))
 		break;
-	lenafter = lenbefore;
-	bytes = charset_from_unicode(&text, &lenafter, outbuf, lenof(outbuf),
-				     ho->charset, &ho->cstate, &err);
-	textlen -= (lenbefore - lenafter);
-	if (bytes > 0 && ho->fp)
-	    fwrite(outbuf, 1, bytes, ho->fp);
-	if (err) {
-	    /*
-	     * We have encountered a character that cannot be
-	     * displayed in the selected output charset. Therefore,
-	     * we use an HTML numeric entity reference.
-	     */
-	    assert(textlen > 0);
-	    if (ho->fp)
-		fprintf(ho->fp, "&#%ld;", (long int)*text);
-	    text++, textlen--;
-	} else if (lenafter == 0 && textlen > 0) {
+	html_text_run(ho, text, lenbefore);
+	text += lenbefore;
+	textlen -= lenbefore;
+
+	if (textlen > 0) {
 	    /*
 	     * We have encountered a character which is special to
 	     * HTML.
 	     */
-	    if (ho->fp) {
-		if (*text == L'"' && (ho->hackflags & HO_HACK_OMITQUOTES)) {
-		    fputc('\'', ho->fp);
-		} else if (ho->hackflags & HO_HACK_QUOTENOTHING) {
-		    fputc(*text, ho->fp);
-		} else {
-		    if (*text == L'<')
-			fprintf(ho->fp, "&lt;");
-		    else if (*text == L'>')
-			fprintf(ho->fp, "&gt;");
-		    else if (*text == L'&')
-			fprintf(ho->fp, "&amp;");
-		    else if (*text == L'"')
-			fprintf(ho->fp, "&quot;");
-		    else if (*text == L' ') {
-			assert(nbsp);
-			fprintf(ho->fp, "&nbsp;");
-		    } else
-			assert(!"Can't happen");
-		}
+	    if (*text == L'"' && (ho->hackflags & HO_HACK_OMITQUOTES)) {
+		html_outc(ho, '\'');
+	    } else if (ho->hackflags & HO_HACK_QUOTENOTHING) {
+		html_outc(ho, (char)*text);
+	    } else {
+		if (*text == L'<')
+		    html_outs(ho, "&lt;");
+		else if (*text == L'>')
+		    html_outs(ho, "&gt;");
+		else if (*text == L'&')
+		    html_outs(ho, "&amp;");
+		else if (*text == L'"')
+		    html_outs(ho, "&quot;");
+		else if (*text == L' ') {
+		    assert(nbsp);
+		    html_outs(ho, "&nbsp;");
+		} else
+		    assert(!"Can't happen");
 	    }
 	    text++, textlen--;
 	}
     }
 }
 
+/*
+ * Set up an htmloutput to write to the named file, and/or to a
+ * gzipped copy with `.gz' on the end of the name. If skip_unchanged
+ * is set, cleanup() only replaces files whose contents have changed.
+ */
+static void html_open(htmloutput *ho, outdest *od, char *filename,
+		      int skip_unchanged, int gzip)
+{
+    int flags = skip_unchanged ? OUT_IF_CHANGED : 0;
+
+    if (!strcmp(filename, "-"))
+	gzip = GZIP_NONE;	       /* no name to put .gz on */
+
+    ho->out = ho->gzout = NULL;
+    ho->gz = NULL;
+    if (gzip != GZIP_ONLY)
+	ho->out = out_open(od, filename, flags);
+    if (gzip != GZIP_NONE) {
+	char *gzname = snewn(strlen(filename) + 4, char);
+	sprintf(gzname, "%s.gz", filename);
+	ho->gzout = out_open(od, gzname, flags | OUT_BINARY);
+	if (ho->gzout)
+	    ho->gz = deflate_compress_new(DEFLATE_TYPE_GZIP);
+	sfree(gzname);
+    }
+    ho->written = FALSE;
+    ho->outbuf = snewn(HTML_OUTBUF_SIZE, char);
+    ho->outlen = 0;
+}
+
 static void cleanup(htmloutput *ho)
 {
     return_to_neutral(ho);
-    if (ho->fp && ho->fp != stdout)
-	fclose(ho->fp);
+    if (!html_discarding(ho)) {
+	html_flush(ho);
+	if (ho->gzout)
+	    html_write(ho, NULL, 0, DEFLATE_END_OF_DATA);
+    }
+    if (ho->out)
+	ho->written |= out_close(ho->out);
+    if (ho->gzout) {
+	ho->written |= out_close(ho->gzout);
+	deflate_compress_free(ho->gz);
+    }
+    sfree(ho->outbuf);
 }
 
 static void html_href(htmloutput *ho, htmlfile *thisfile,
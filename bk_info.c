@@ -71,6 +71,9 @@ typedef struct {
     wchar_t *startemph, *endemph;
     wchar_t *startstrong, *endstrong;
     wchar_t *lquote, *rquote;
+    /* display widths of the above, cached for info_width_internal() */
+    int lquote_wid, rquote_wid, startemph_wid, endemph_wid;
+    int startstrong_wid, endstrong_wid;
     wchar_t *sectsuffix;
     wchar_t *rule;
     wchar_t *index_text;
@@ -297,6 +300,13 @@ static infoconfig info_configure(paragraph *source) {
 	   !cvt_ok(ret.charset, ret.rule))
 	ret.rule = uadv(ret.rule);
 
+    ret.lquote_wid = ustrwid(ret.lquote, ret.charset);
+    ret.rquote_wid = ustrwid(ret.rquote, ret.charset);
+    ret.startemph_wid = ustrwid(ret.startemph, ret.charset);
+    ret.endemph_wid = ustrwid(ret.endemph, ret.charset);
+    ret.startstrong_wid = ustrwid(ret.startstrong, ret.charset);
+    ret.endstrong_wid = ustrwid(ret.endstrong, ret.charset);
+
     return ret;
 }
 
@@ -306,7 +316,7 @@ paragraph *info_config_filename(char *filename)
 }
 
 void info_backend(paragraph *sourceform, keywordlist *keywords,
-		  indexdata *idx, void *unused) {
+		  indexdata *idx, void *unused, outdest *od) {
     paragraph *p;
     infoconfig conf;
     word *prefix, *body, *wp;
@@ -319,7 +329,7 @@ void info_backend(paragraph *sourceform, keywordlist *keywords,
     info_data intro_text = EMPTY_INFO_DATA;
     node *topnode, *currnode;
     word bullet;
-    FILE *fp;
+    outsink *out;
 
     IGNORE(unused);
 
@@ -704,39 +714,37 @@ void info_backend(paragraph *sourceform, keywordlist *keywords,
     /*
      * Write the primary output file.
      */
-    fp = fopen(conf.filename, "w");
-    if (!fp) {
-	err_cantopenw(conf.filename);
+    out = out_open(od, conf.filename, 0);
+    if (!out)
 	return;
-    }
-    fputs(intro_text.output.text, fp);
+    out_puts(out, intro_text.output.text);
     if (conf.maxfilesize == 0) {
 	for (currnode = topnode; currnode; currnode = currnode->listnext)
-	    fputs(currnode->text.output.text, fp);
+	    out_puts(out, currnode->text.output.text);
     } else {
 	int filenum = 0;
-	fprintf(fp, "\037\nIndirect:\n");
+	out_printf(out, "\037\nIndirect:\n");
 	for (currnode = topnode; currnode; currnode = currnode->listnext)
 	    if (filenum != currnode->filenum) {
 		filenum = currnode->filenum;
-		fprintf(fp, "%s-%d: %d\n", conf.filename, filenum,
-			currnode->pos);
+		out_printf(out, "%s-%d: %d\n", conf.filename, filenum,
+			   currnode->pos);
 	    }
     }
-    fprintf(fp, "\037\nTag Table:\n");
+    out_printf(out, "\037\nTag Table:\n");
     if (conf.maxfilesize > 0)
-	fprintf(fp, "(Indirect)\n");
+	out_printf(out, "(Indirect)\n");
     for (currnode = topnode; currnode; currnode = currnode->listnext)
-	fprintf(fp, "Node: %s\177%d\n", currnode->name, currnode->pos);
-    fprintf(fp, "\037\nEnd Tag Table\n");
-    fclose(fp);
+	out_printf(out, "Node: %s\177%d\n", currnode->name, currnode->pos);
+    out_printf(out, "\037\nEnd Tag Table\n");
+    out_close(out);
 
     /*
      * Write the subfiles.
      */
     if (conf.maxfilesize > 0) {
 	int filenum = 0;
-	fp = NULL;
+	out = NULL;
 
 	for (currnode = topnode; currnode; currnode = currnode->listnext) {
 	    if (filenum != currnode->filenum) {
@@ -744,23 +752,21 @@ void info_backend(paragraph *sourceform, keywordlist *keywords,
 
 		filenum = currnode->filenum;
 
-		if (fp)
-		    fclose(fp);
+		if (out)
+		    out_close(out);
 		fname = snewn(strlen(conf.filename) + 40, char);
 		sprintf(fname, "%s-%d", conf.filename, filenum);
-		fp = fopen(fname, "w");
-		if (!fp) {
-		    err_cantopenw(fname);
-		    return;
-		}
+		out = out_open(od, fname, 0);
 		sfree(fname);
-		fputs(intro_text.output.text, fp);
+		if (!out)
+		    return;
+		out_puts(out, intro_text.output.text);
 	    }
-	    fputs(currnode->text.output.text, fp);
+	    out_puts(out, currnode->text.output.text);
 	}
 
-	if (fp)
-	    fclose(fp);
+	if (out)
+	    out_close(out);
     }
 }
 
@@ -985,16 +991,16 @@ static int info_width_internal(word *words, int xrefs, infoconfig *cfg) {
     if (attr == word_Emph || attr == word_Strong || attr == word_Code) {
 	if (attraux(words->aux) == attr_Only ||
 	    attraux(words->aux) == attr_First)
-	    wid += ustrwid(attr == word_Emph ? cfg->startemph :
-                           attr == word_Strong ? cfg->startstrong :
-                           cfg->lquote, cfg->charset);
+	    wid += (attr == word_Emph ? cfg->startemph_wid :
+		    attr == word_Strong ? cfg->startstrong_wid :
+		    cfg->lquote_wid);
     }
     if (attr == word_Emph || attr == word_Strong || attr == word_Code) {
 	if (attraux(words->aux) == attr_Only ||
 	    attraux(words->aux) == attr_Last)
-	    wid += ustrwid(attr == word_Emph ? cfg->startemph :
-                           attr == word_Strong ? cfg->startstrong :
-                           cfg->lquote, cfg->charset);
+	    wid += (attr == word_Emph ? cfg->endemph_wid :
+		    attr == word_Strong ? cfg->endstrong_wid :
+		    cfg->rquote_wid);
     }
 
     switch (words->type) {
@@ -1023,9 +1029,9 @@ static int info_width_internal(word *words, int xrefs, infoconfig *cfg) {
 	       words->type != word_WkCodeQuote);
 	if (removeattr(words->type) == word_Quote) {
 	    if (quoteaux(words->aux) == quote_Open)
-		wid += ustrwid(cfg->lquote, cfg->charset);
+		wid += cfg->lquote_wid;
 	    else
-		wid += ustrwid(cfg->rquote, cfg->charset);
+		wid += cfg->rquote_wid;
 	} else
 	    wid++;		       /* space */
     }
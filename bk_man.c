@@ -16,9 +16,9 @@ typedef struct {
     wchar_t *bullet, *rule, *lquote, *rquote;
 } manconfig;
 
-static void man_text(FILE *, word *,
+static void man_text(outsink *, word *,
 		     int newline, int quote_props, manconfig *conf);
-static void man_codepara(FILE *, word *, int charset);
+static void man_codepara(outsink *, word *, int charset);
 static int man_convert(wchar_t const *s, int maxlen,
 		       char **result, int quote_props,
 		       int charset, charset_state *state);
@@ -220,9 +220,9 @@ paragraph *man_config_filename(char *filename)
 #define QUOTE_LITERAL     4 /* defeat special meaning of `, ', - in troff */
 
 void man_backend(paragraph *sourceform, keywordlist *keywords,
-		 indexdata *idx, void *unused) {
+		 indexdata *idx, void *unused, outdest *od) {
     paragraph *p;
-    FILE *fp;
+    outsink *out;
     manconfig conf;
     int had_described_thing;
 
@@ -235,48 +235,43 @@ void man_backend(paragraph *sourceform, keywordlist *keywords,
     /*
      * Open the output file.
      */
-    if (!strcmp(conf.filename, "-"))
-	fp = stdout;
-    else
-	fp = fopen(conf.filename, "w");
-    if (!fp) {
-	err_cantopenw(conf.filename);
+    out = out_open(od, conf.filename, 0);
+    if (!out)
 	return;
-    }
 
     /* Do the version ID */
     for (p = sourceform; p; p = p->next)
 	if (p->type == para_VersionID) {
-	    fprintf(fp, ".\\\" ");
-	    man_text(fp, p->words, TRUE, 0, &conf);
+	    out_printf(out, ".\\\" ");
+	    man_text(out, p->words, TRUE, 0, &conf);
 	}
 
     /* Standard preamble */
     /* Dodge to try to get literal U+0027 in output when required,
      * bypassing groff's Unicode transform; pinched from pod2man */
-    fprintf(fp, ".ie \\n(.g .ds Aq \\(aq\n"
-	        ".el       .ds Aq '\n");
+    out_printf(out, ".ie \\n(.g .ds Aq \\(aq\n"
+		   ".el       .ds Aq '\n");
 
     /* .TH name-of-program manual-section */
-    fprintf(fp, ".TH");
+    out_printf(out, ".TH");
     if (conf.th && *conf.th) {
 	char *c;
 	wchar_t *wp;
 
 	for (wp = conf.th; *wp; wp = uadv(wp)) {
-	    fputs(" \"", fp);
+	    out_puts(out, " \"");
 	    man_convert(wp, 0, &c, QUOTE_QUOTES, conf.charset, NULL);
-	    fputs(c, fp);
+	    out_puts(out, c);
 	    sfree(c);
-	    fputc('"', fp);
+	    out_putc(out, '"');
 	}
     }
-    fputc('\n', fp);
+    out_putc(out, '\n');
 
     had_described_thing = FALSE;
 #define cleanup_described_thing do { \
     if (had_described_thing) \
-	fprintf(fp, "\n"); \
+	out_printf(out, "\n"); \
     had_described_thing = FALSE; \
 } while (0)
 
@@ -313,15 +308,15 @@ void man_backend(paragraph *sourceform, keywordlist *keywords,
 		depth = 0;
 	    if (depth >= conf.mindepth) {
 		if (depth > conf.mindepth)
-		    fprintf(fp, ".SS \"");
+		    out_printf(out, ".SS \"");
 		else
-		    fprintf(fp, ".SH \"");
+		    out_printf(out, ".SH \"");
 		if (conf.headnumbers && p->kwtext) {
-		    man_text(fp, p->kwtext, FALSE, QUOTE_QUOTES, &conf);
-		    fprintf(fp, " ");
+		    man_text(out, p->kwtext, FALSE, QUOTE_QUOTES, &conf);
+		    out_printf(out, " ");
 		}
-		man_text(fp, p->words, FALSE, QUOTE_QUOTES, &conf);
-		fprintf(fp, "\"\n");
+		man_text(out, p->words, FALSE, QUOTE_QUOTES, &conf);
+		out_printf(out, "\"\n");
 	    }
 	    break;
 	}
@@ -331,8 +326,8 @@ void man_backend(paragraph *sourceform, keywordlist *keywords,
 	 */
       case para_Code:
 	cleanup_described_thing;
-	fprintf(fp, ".PP\n");
-	man_codepara(fp, p->words, conf.charset);
+	out_printf(out, ".PP\n");
+	man_codepara(out, p->words, conf.charset);
 	break;
 
 	/*
@@ -341,8 +336,8 @@ void man_backend(paragraph *sourceform, keywordlist *keywords,
       case para_Normal:
       case para_Copyright:
 	cleanup_described_thing;
-	fprintf(fp, ".PP\n");
-	man_text(fp, p->words, TRUE, 0, &conf);
+	out_printf(out, ".PP\n");
+	man_text(out, p->words, TRUE, 0, &conf);
 	break;
 
 	/*
@@ -359,12 +354,12 @@ void man_backend(paragraph *sourceform, keywordlist *keywords,
 	    char *bullettext;
 	    man_convert(conf.bullet, -1, &bullettext, QUOTE_QUOTES,
 			conf.charset, NULL);
-	    fprintf(fp, ".IP \"\\fB%s\\fP\"\n", bullettext);
+	    out_printf(out, ".IP \"\\fB%s\\fP\"\n", bullettext);
 	    sfree(bullettext);
 	} else if (p->type == para_NumberedList) {
-	    fprintf(fp, ".IP \"");
-	    man_text(fp, p->kwtext, FALSE, QUOTE_QUOTES, &conf);
-	    fprintf(fp, "\"\n");
+	    out_printf(out, ".IP \"");
+	    man_text(out, p->kwtext, FALSE, QUOTE_QUOTES, &conf);
+	    out_printf(out, "\"\n");
 	} else if (p->type == para_Description) {
 	    if (had_described_thing) {
 		/*
@@ -377,22 +372,22 @@ void man_backend(paragraph *sourceform, keywordlist *keywords,
 		 * A \dd without a preceding \dt is given a blank
 		 * one.
 		 */
-		fprintf(fp, ".IP \"\"\n");
+		out_printf(out, ".IP \"\"\n");
 	    }
 	} else if (p->type == para_BiblioCited) {
-	    fprintf(fp, ".IP \"");
-	    man_text(fp, p->kwtext, FALSE, QUOTE_QUOTES, &conf);
-	    fprintf(fp, "\"\n");
+	    out_printf(out, ".IP \"");
+	    man_text(out, p->kwtext, FALSE, QUOTE_QUOTES, &conf);
+	    out_printf(out, "\"\n");
 	}
-	man_text(fp, p->words, TRUE, 0, &conf);
+	man_text(out, p->words, TRUE, 0, &conf);
 	had_described_thing = FALSE;
 	break;
 
       case para_DescribedThing:
 	cleanup_described_thing;
-	fprintf(fp, ".IP \"");
-	man_text(fp, p->words, FALSE, QUOTE_QUOTES, &conf);
-	fprintf(fp, "\"\n");
+	out_printf(out, ".IP \"");
+	man_text(out, p->words, FALSE, QUOTE_QUOTES, &conf);
+	out_printf(out, "\"\n");
 	had_described_thing = TRUE;
 	break;
 
@@ -406,8 +401,8 @@ void man_backend(paragraph *sourceform, keywordlist *keywords,
 	     */
 	    cleanup_described_thing;
 	    man_convert(conf.rule, -1, &ruletext, 0, conf.charset, NULL);
-	    fprintf(fp, ".PP\n.ie t \\u\\l'\\n(.lu-\\n(.iu'\\d\n"
-		    ".el \\l'\\n(.lu-\\n(.iu\\&%s'\n", ruletext);
+	    out_printf(out, ".PP\n.ie t \\u\\l'\\n(.lu-\\n(.iu'\\d\n"
+		       ".el \\l'\\n(.lu-\\n(.iu\\&%s'\n", ruletext);
 	    sfree(ruletext);
 	}
 	break;
@@ -415,12 +410,12 @@ void man_backend(paragraph *sourceform, keywordlist *keywords,
       case para_LcontPush:
       case para_QuotePush:
 	cleanup_described_thing;
-	fprintf(fp, ".RS\n");
+	out_printf(out, ".RS\n");
       	break;
       case para_LcontPop:
       case para_QuotePop:
 	cleanup_described_thing;
-	fprintf(fp, ".RE\n");
+	out_printf(out, ".RE\n");
 	break;
     }
     cleanup_described_thing;
@@ -428,8 +423,7 @@ void man_backend(paragraph *sourceform, keywordlist *keywords,
     /*
      * Tidy up.
      */
-    if (fp != stdout)
-	fclose(fp);
+    out_close(out);
     man_conf_cleanup(conf);
 }
 
@@ -678,20 +672,20 @@ static int man_rdaddwc(rdstringc *rs, word *text, word *end,
     return quote_props;
 }
 
-static void man_text(FILE *fp, word *text, int newline,
+static void man_text(outsink *out, word *text, int newline,
 		     int quote_props, manconfig *conf) {
     rdstringc t = { 0, 0, NULL };
     charset_state state = CHARSET_INIT_STATE;
 
     man_rdaddwc(&t, text, NULL, quote_props | QUOTE_INITCTRL, conf, &state);
-    fprintf(fp, "%s", t.text);
+    out_printf(out, "%s", t.text);
     sfree(t.text);
     if (newline)
-	fputc('\n', fp);
+	out_putc(out, '\n');
 }
 
-static void man_codepara(FILE *fp, word *text, int charset) {
-    fprintf(fp, ".nf\n");
+static void man_codepara(outsink *out, word *text, int charset) {
+    out_printf(out, ".nf\n");
     for (; text; text = text->next) if (text->type == word_WeakCode) {
 	char *c;
 	wchar_t *t, *e;
@@ -710,21 +704,21 @@ static void man_codepara(FILE *fp, word *text, int charset) {
 
 	    for (n = 0; t[n] && e[n] && e[n] == ec; n++);
 	    if (ec == 'i')
-		fprintf(fp, "\\fI");
+		out_printf(out, "\\fI");
 	    else if (ec == 'b')
-		fprintf(fp, "\\fB");
+		out_printf(out, "\\fB");
 	    man_convert(t, n, &c, quote_props, charset, NULL);
 	    quote_props &= ~QUOTE_INITCTRL;
-	    fprintf(fp, "%s", c);
+	    out_printf(out, "%s", c);
 	    sfree(c);
 	    if (ec == 'i' || ec == 'b')
-		fprintf(fp, "\\fP");
+		out_printf(out, "\\fP");
 	    t += n;
 	    e += n;
 	}
 	man_convert(t, 0, &c, quote_props, charset, NULL);
-	fprintf(fp, "%s\n", c);
+	out_printf(out, "%s\n", c);
 	sfree(c);
     }
-    fprintf(fp, ".fi\n");
+    out_printf(out, ".fi\n");
 }
@@ -12,8 +12,6 @@
 /*
  * TODO in future work:
  * 
- *  - linearised PDF, perhaps?
- * 
  *  - I'm uncertain of whether I need to include a ToUnicode CMap
  *    in each of my font definitions in PDF. Currently things (by
  *    which I mean cut and paste out of acroread) seem to be
@@ -134,6 +132,16 @@ struct paper_idx_Tag {
     page_data *lastpage;
 };
 
+/*
+ * The paragraphs to be formatted by paper_format_para(), and the
+ * indentation each one is to be wrapped with.
+ */
+typedef struct {
+    paragraph **paras;
+    int *indents;
+    paper_conf *conf;
+} paper_paras;
+
 enum {
     word_PageXref = word_NotWordType + 1
 };
@@ -157,9 +165,12 @@ static void render_para(para_data *pdata, paper_conf *conf,
 static int string_width(font_data *font, wchar_t const *string, int *errs,
 			unsigned flags);
 static int paper_width_simple(para_data *pdata, word *text, paper_conf *conf);
+static void paper_format_para(void *vparas, int i);
+static void free_para_data(para_data *pdata);
 static para_data *code_paragraph(int indent, word *words, paper_conf *conf);
 static para_data *rule_paragraph(int indent, paper_conf *conf);
 static void add_rect_to_page(page_data *page, int x, int y, int w, int h);
+static void page_free_chunks(page_data *page);
 static para_data *make_para_data(int ptype, int paux, int indent, int rmargin,
 				 word *pkwtext, word *pkwtext2, word *pwords,
 				 paper_conf *conf);
@@ -203,6 +214,7 @@ static void paper_cfg_fonts(font_data **fonts, font_list *fontlist,
     for (i = 0; i < NFONTS && *wp; i++, wp = uadv(wp)) {
 	fn = utoa_dup(wp, CS_ASCII);
 	f = make_std_font(fontlist, fn);
+	sfree(fn);
 	if (f)
 	    fonts[i] = f;
 	else
@@ -521,7 +533,7 @@ static paper_conf paper_configure(paragraph *source, font_list *fontlist) {
 }
 
 void *paper_pre_backend(paragraph *sourceform, keywordlist *keywords,
-			indexdata *idx) {
+			indexdata *idx, halibut *h) {
     paragraph *p;
     document *doc;
     int indent, used_contents;
@@ -535,10 +547,12 @@ void *paper_pre_backend(paragraph *sourceform, keywordlist *keywords,
     int pagenum;
     paragraph index_placeholder_para;
     page_data *first_index_page;
+    paper_paras paras;
+    int nparas;
 
-    init_std_fonts();
     fontlist = snew(font_list);
     fontlist->head = fontlist->tail = NULL;
+    fontlist->loaded = h->fonts;
 
     ourconf = paper_configure(sourceform, fontlist);
     conf = &ourconf;
@@ -574,6 +588,7 @@ void *paper_pre_backend(paragraph *sourceform, keywordlist *keywords,
 
 	firstcont = make_para_data(para_UnnumberedChapter, 0, 0, 0,
 				   NULL, NULL, contents_title, conf);
+	firstcont->own_words = contents_title;
 	lastcont = firstcont;
 	lastcont->next = NULL;
 	firstcontline = firstcont->first;
@@ -609,6 +624,7 @@ void *paper_pre_backend(paragraph *sourceform, keywordlist *keywords,
 				       NULL, NULL, words, conf);
 		pdata->next = NULL;
 		pdata->contents_entry = p;
+		pdata->own_words = words;
 		lastcont->next = pdata;
 		lastcont = pdata;
 
@@ -636,10 +652,12 @@ void *paper_pre_backend(paragraph *sourceform, keywordlist *keywords,
 	 * And one extra one, for the index.
 	 */
 	if (has_index) {
+	    word *words = fake_word(conf->index_text);
+
 	    pdata = make_para_data(para_Normal, 0, 0,
 				   conf->contents_margin,
-				   NULL, NULL,
-				   fake_word(conf->index_text), conf);
+				   NULL, NULL, words, conf);
+	    pdata->own_words = words;
 	    pdata->next = NULL;
 	    pdata->contents_entry = &index_placeholder_para;
 	    lastcont->next = pdata;
@@ -660,11 +678,19 @@ void *paper_pre_backend(paragraph *sourceform, keywordlist *keywords,
     }
 
     /*
-     * Do the main paragraph formatting.
+     * Do the main paragraph formatting. Finding out how far each
+     * paragraph is indented has to be done in order, but after
+     * that each one can be wrapped without reference to any
+     * other, so we collect them up and do that part in parallel.
      */
     indent = 0;
-    used_contents = FALSE;
-    firstline = lastline = NULL;
+    nparas = 0;
+    for (p = sourceform; p; p = p->next)
+	nparas++;
+    paras.paras = snewn(nparas, paragraph *);
+    paras.indents = snewn(nparas, int);
+    paras.conf = conf;
+    nparas = 0;
     for (p = sourceform; p; p = p->next) {
 	p->private_data = NULL;
 
@@ -698,32 +724,10 @@ void *paper_pre_backend(paragraph *sourceform, keywordlist *keywords,
 	    indent -= conf->indent_quote; assert(indent >= 0); break;
 
 	    /*
-	     * This paragraph type is special. Process it
-	     * specially.
+	     * Everything else is formatted by paper_format_para().
 	     */
 	  case para_Code:
-	    pdata = code_paragraph(indent, p->words, conf);
-	    p->private_data = pdata;
-	    if (pdata->first != pdata->last) {
-		pdata->first->penalty_after += 100000;
-		pdata->last->penalty_before += 100000;
-	    }
-	    break;
-
-	    /*
-	     * This paragraph is also special.
-	     */
 	  case para_Rule:
-	    pdata = rule_paragraph(indent, conf);
-	    p->private_data = pdata;
-	    break;
-
-	    /*
-	     * All of these paragraph types require wrapping in the
-	     * ordinary way. So we must supply a set of fonts, a
-	     * line width and auxiliary information (e.g. bullet
-	     * text) for each one.
-	     */
 	  case para_Chapter:
 	  case para_Appendix:
 	  case para_UnnumberedChapter:
@@ -737,14 +741,22 @@ void *paper_pre_backend(paragraph *sourceform, keywordlist *keywords,
 	  case para_Description:
 	  case para_Copyright:
 	  case para_Title:
-	    pdata = make_para_data(p->type, p->aux, indent, 0,
-				   p->kwtext, p->kwtext2, p->words, conf);
-
-	    p->private_data = pdata;
-
+	    paras.paras[nparas] = p;
+	    paras.indents[nparas] = indent;
+	    nparas++;
 	    break;
 	}
+    }
+    run_in_parallel(nparas, paper_format_para, &paras);
+    sfree(paras.paras);
+    sfree(paras.indents);
 
+    /*
+     * Now link the results together in document order.
+     */
+    used_contents = FALSE;
+    firstline = lastline = NULL;
+    for (p = sourceform; p; p = p->next) {
 	if (p->private_data) {
 	    pdata = (para_data *)p->private_data;
 
@@ -800,6 +812,18 @@ void *paper_pre_backend(paragraph *sourceform, keywordlist *keywords,
 	}
     }
 
+    /*
+     * If there were no headings, the contents section never got
+     * used.
+     */
+    if (!used_contents) {
+	while (firstcont) {
+	    pdata = firstcont;
+	    firstcont = firstcont->next;
+	    free_para_data(pdata);
+	}
+    }
+
     /*
      * Now we have an enormous linked list of every line of text in
      * the document. Break it up into pages.
@@ -828,6 +852,7 @@ void *paper_pre_backend(paragraph *sourceform, keywordlist *keywords,
 	    first_index_page->first_text = first_index_page->last_text = NULL;
 	    first_index_page->first_xref = first_index_page->last_xref = NULL;
 	    first_index_page->first_rect = first_index_page->last_rect = NULL;
+	    first_index_page->frag_chunks = NULL;
 
 	    /* And don't forget the as-yet-uncreated index. */
 	    sprintf(buf, "%d", ++pagenum);
@@ -863,6 +888,7 @@ void *paper_pre_backend(paragraph *sourceform, keywordlist *keywords,
 
 	firstidx = make_para_data(para_UnnumberedChapter, 0, 0, 0,
 				  NULL, NULL, index_title, conf);
+	firstidx->own_words = index_title;
 	lastidx = firstidx;
 	lastidx->next = NULL;
 	firstidxline = firstidx->first;
@@ -881,6 +907,7 @@ void *paper_pre_backend(paragraph *sourceform, keywordlist *keywords,
 	    pages  = make_para_data(para_Normal, 0, 0,
 				    conf->base_width - conf->index_colwidth,
 				    NULL, NULL, pi->words, conf);
+	    pages->own_words = pi->words;
 
 	    text->justification = LEFT;
 	    pages->justification = RIGHT;
@@ -1022,6 +1049,20 @@ void *paper_pre_backend(paragraph *sourceform, keywordlist *keywords,
 	lastpara = lastidx;
     }
 
+    /*
+     * The index paragraphs have taken over the page number lists,
+     * so we're finished with the rest of the index data.
+     */
+    {
+	int i;
+	indexentry *entry;
+
+	for (i = 0; (entry = index234(idx->entries, i)) != NULL; i++) {
+	    sfree(entry->backend_data);
+	    entry->backend_data = NULL;
+	}
+    }
+
     /*
      * Draw the headers and footers.
      * 
@@ -1056,6 +1097,7 @@ void *paper_pre_backend(paragraph *sourceform, keywordlist *keywords,
     doc->pages = pages;
     doc->paper_width = conf->paper_width;
     doc->paper_height = conf->paper_height;
+    doc->paras = firstpara;
 
     /*
      * Collect the section heading paragraphs into a document
@@ -1096,9 +1138,91 @@ void *paper_pre_backend(paragraph *sourceform, keywordlist *keywords,
 	}
     }
 
+    sfree(conf->fsect);
+
     return doc;
 }
 
+/*
+ * Free a paragraph, its lines, and any words it owns.
+ */
+static void free_para_data(para_data *pdata)
+{
+    line_data *ldata, *next;
+
+    for (ldata = pdata->first; ldata; ldata = next) {
+	next = (ldata == pdata->last ? NULL : ldata->next);
+	if (pdata->own_line_words)
+	    free_word_list(ldata->first);
+	sfree(ldata);
+    }
+    free_word_list(pdata->own_words);
+    free_word_list(pdata->own_aux);
+    free_word_list(pdata->own_aux2);
+    sfree(pdata->outline_title);
+    sfree(pdata);
+}
+
+/*
+ * Free everything paper_pre_backend() built, once the back ends
+ * have finished with it. Anything a back end hung on the document
+ * (page_data's `spare', font_encoding's `name') is that back end's
+ * own business to free.
+ */
+void paper_free_document(void *vdoc)
+{
+    document *doc = (document *)vdoc;
+    page_data *page, *npage;
+    para_data *pdata, *npdata;
+    font_encoding *fe, *nfe;
+
+    for (page = doc->pages; page; page = npage) {
+	xref *xr, *nxr;
+	rect *r, *nr;
+
+	npage = page->next;
+	for (xr = page->first_xref; xr; xr = nxr) {
+	    nxr = xr->next;
+	    if (xr->dest.type == URL)
+		sfree(xr->dest.url);
+	    sfree(xr);
+	}
+	for (r = page->first_rect; r; r = nr) {
+	    nr = r->next;
+	    sfree(r);
+	}
+	page_free_chunks(page);
+	sfree(page->number);
+	sfree(page);
+    }
+
+    for (pdata = doc->paras; pdata; pdata = npdata) {
+	npdata = pdata->next;
+	free_para_data(pdata);
+    }
+
+    /*
+     * A font's last subfont is also the last in the whole list to
+     * refer to it, so that's when the font itself can go.
+     */
+    for (fe = doc->fonts->head; fe; fe = nfe) {
+	nfe = fe->next;
+	if (fe->font->latest_subfont == fe) {
+	    font_data *f = fe->font;
+	    int i;
+
+	    for (i = 0; i < (int)lenof(f->subfont_map); i++)
+		sfree(f->subfont_map[i]);
+	    sfree(f);
+	}
+	sfree(fe);
+    }
+    sfree(doc->fonts);
+
+    sfree(doc->outline_elements);
+    sfree(doc);
+}
+
 static void setfont(para_data *p, font_cfg *f) {
     int i;
 
@@ -1108,6 +1232,54 @@ static void setfont(para_data *p, font_cfg *f) {
     }
 }
 
+/*
+ * Format one paragraph of the main text. This only reads the
+ * document's fonts and configuration, and only writes to the
+ * paragraph's own data, so several can be done at once.
+ */
+static void paper_format_para(void *vparas, int i)
+{
+    paper_paras *paras = (paper_paras *)vparas;
+    paragraph *p = paras->paras[i];
+    int indent = paras->indents[i];
+    paper_conf *conf = paras->conf;
+    para_data *pdata;
+
+    switch (p->type) {
+	/*
+	 * This paragraph type is special. Process it
+	 * specially.
+	 */
+      case para_Code:
+	pdata = code_paragraph(indent, p->words, conf);
+	if (pdata->first != pdata->last) {
+	    pdata->first->penalty_after += 100000;
+	    pdata->last->penalty_before += 100000;
+	}
+	break;
+
+	/*
+	 * This paragraph is also special.
+	 */
+      case para_Rule:
+	pdata = rule_paragraph(indent, conf);
+	break;
+
+	/*
+	 * All other paragraph types require wrapping in the
+	 * ordinary way. So we must supply a set of fonts, a line
+	 * width and auxiliary information (e.g. bullet text) for
+	 * each one.
+	 */
+      default:
+	pdata = make_para_data(p->type, p->aux, indent, 0,
+			       p->kwtext, p->kwtext2, p->words, conf);
+	break;
+    }
+
+    p->private_data = pdata;
+}
+
 static para_data *make_para_data(int ptype, int paux, int indent, int rmargin,
 				 word *pkwtext, word *pkwtext2, word *pwords,
 				 paper_conf *conf)
@@ -1124,6 +1296,8 @@ static para_data *make_para_data(int ptype, int paux, int indent, int rmargin,
     pdata->contents_entry = NULL;
     pdata->justification = JUST;
     pdata->extraflags = 0;
+    pdata->own_words = pdata->own_aux = pdata->own_aux2 = NULL;
+    pdata->own_line_words = FALSE;
 
     /*
      * Choose fonts for this paragraph.
@@ -1224,7 +1398,7 @@ static para_data *make_para_data(int ptype, int paux, int indent, int rmargin,
 	/*
 	 * Auxiliary text consisting of a bullet.
 	 */
-	aux = fake_word(conf->bullet);
+	aux = pdata->own_aux = fake_word(conf->bullet);
 	aux_indent = indent + conf->indent_list_bullet;
 	break;
 
@@ -1261,7 +1435,7 @@ static para_data *make_para_data(int ptype, int paux, int indent, int rmargin,
 		   indent + extra_indent, conf);
 
     pdata->first->aux_text = aux;
-    pdata->first->aux_text_2 = aux2;
+    pdata->first->aux_text_2 = pdata->own_aux2 = aux2;
     pdata->first->aux_left_indent = aux_indent;
 
     /*
@@ -1364,6 +1538,7 @@ static font_encoding *new_font_encoding(font_data *font)
 	font->list->head = fe;
     font->list->tail = fe;
 
+    fe->name = NULL;
     fe->font = font;
     fe->free_pos = 0x21;
 
@@ -1375,37 +1550,45 @@ static font_encoding *new_font_encoding(font_data *font)
     return fe;
 }
 
+static subfont_map_entry *find_sfmap(font_data *font, glyph g)
+{
+    subfont_map_entry **block = &font->subfont_map[g >> 8];
+
+    if (!*block) {
+	int i;
+
+	*block = snewn(256, subfont_map_entry);
+	for (i = 0; i < 256; i++)
+	    (*block)[i].subfont = NULL;
+    }
+    return &(*block)[g & 0xFF];
+}
+
 static subfont_map_entry *encode_glyph_at(glyph g, wchar_t u,
 					  font_encoding *fe, int pos)
 {
-    subfont_map_entry *sme = snew(subfont_map_entry);
+    subfont_map_entry *sme = find_sfmap(fe->font, g);
 
-    sme->subfont = fe;
-    sme->position = pos;
     fe->vector[pos] = g;
     fe->to_unicode[pos] = u;
-    add234(fe->font->subfont_map, sme);
+    /*
+     * If two characters share a glyph, the first position it was
+     * given is the one we keep using.
+     */
+    if (!sme->subfont) {
+	sme->subfont = fe;
+	sme->position = pos;
+    }
     return sme;
 }
 
-static int new_sfmap_cmp(void *a, void *b)
-{
-    glyph ga = *(glyph *)a;
-    subfont_map_entry *sb = b;
-    glyph gb = sb->subfont->vector[sb->position];
-
-    if (ga < gb) return -1;
-    if (ga > gb) return 1;
-    return 0;
-}
-
 static subfont_map_entry *encode_glyph(glyph g, wchar_t u, font_data *font)
 {
     subfont_map_entry *sme;
     int c;
 
-    sme = find234(font->subfont_map, &g, new_sfmap_cmp);
-    if (sme) return sme;
+    sme = find_sfmap(font, g);
+    if (sme->subfont) return sme;
 
     /*
      * This character is not yet in a subfont. Assign one.
@@ -1420,17 +1603,6 @@ static subfont_map_entry *encode_glyph(glyph g, wchar_t u, font_data *font)
     return encode_glyph_at(g, u, font->latest_subfont, c);
 }
 
-static int sfmap_cmp(void *a, void *b)
-{
-    subfont_map_entry *sa = a, *sb = b;
-    glyph ga = sa->subfont->vector[sa->position];
-    glyph gb = sb->subfont->vector[sb->position];
-
-    if (ga < gb) return -1;
-    if (ga > gb) return 1;
-    return 0;
-}
-
 int width_cmp(void *a, void *b)
 {
     glyph_width const *wa = a, *wb = b;
@@ -1476,11 +1648,12 @@ static int utoglyph(font_info const *fi, wchar_t u) {
     return (u < 0 || u > 0xFFFF ? NOGLYPH : fi->bmp[u]);
 }
 
-void listfonts(void) {
+void listfonts(halibut *h) {
     font_info const *fi;
 
-    init_std_fonts();
-    for (fi = all_fonts; fi; fi = fi->next)
+    for (fi = std_fonts(); fi; fi = fi->next)
+	printf("%s\n", fi->name);
+    for (fi = h->fonts; fi; fi = fi->next)
 	printf("%s\n", fi->name);
 }
 
@@ -1495,15 +1668,15 @@ static font_data *make_std_font(font_list *fontlist, char const *name)
 	if (strcmp(fe->font->info->name, name) == 0)
 	    return fe->font;
 
-    for (fi = all_fonts; fi; fi = fi->next)
-	if (strcmp(fi->name, name) == 0) break;
+    fi = find_font(fontlist->loaded, name);
     if (!fi) return NULL;
 
     f = snew(font_data);
 
     f->list = fontlist;
     f->info = fi;
-    f->subfont_map = newtree234(sfmap_cmp);
+    for (i = 0; i < (int)lenof(f->subfont_map); i++)
+	f->subfont_map[i] = NULL;
 
     /*
      * Our first subfont will contain all of US-ASCII. This isn't
@@ -1537,6 +1710,69 @@ int find_width(font_data *font, glyph index)
     return w->width;
 }
 
+/*
+ * Number formatting for bk_ps.c and bk_pdf.c, which write a great
+ * many coordinates. These functions don't allocate memory or
+ * consult the locale. Each writes a number into buf, which must
+ * have room for NUMBUF_SIZE characters, and returns its length.
+ */
+int fmt_int(char *buf, int n)
+{
+    char digits[NUMBUF_SIZE];
+    unsigned long u;
+    int len = 0, i = 0;
+
+    if (n < 0) {
+	buf[len++] = '-';
+	u = -(unsigned long)n;
+    } else
+	u = n;
+    do {
+	digits[i++] = (char)('0' + u % 10);
+	u /= 10;
+    } while (u);
+    while (i > 0)
+	buf[len++] = digits[--i];
+    buf[len] = '\0';
+    return len;
+}
+
+/*
+ * Write a distance in internal units as points, exactly as "%g"
+ * would write units / FUNITS_PER_PT. Up to a thousand points,
+ * that's just the decimal expansion with trailing zeroes removed;
+ * beyond that "%g" rounds to six significant figures, and we let
+ * it.
+ */
+int fmt_units(char *buf, int units)
+{
+    unsigned long u, frac;
+    int len = 0;
+
+    if (units <= -1000 * UNITS_PER_PT || units >= 1000 * UNITS_PER_PT)
+	return sprintf(buf, "%g", units / FUNITS_PER_PT);
+
+    if (units < 0) {
+	buf[len++] = '-';
+	u = -(unsigned long)units;
+    } else
+	u = units;
+    len += fmt_int(buf + len, (int)(u / UNITS_PER_PT));
+    frac = u % UNITS_PER_PT;
+    if (frac) {
+	int scale = UNITS_PER_PT / 10;
+
+	buf[len++] = '.';
+	while (frac) {
+	    buf[len++] = (char)('0' + frac / scale);
+	    frac %= scale;
+	    scale /= 10;
+	}
+	buf[len] = '\0';
+    }
+    return len;
+}
+
 static int find_kern(font_data *font, int lindex, int rindex)
 {
     kern_pair wantkp;
@@ -1785,14 +2021,117 @@ static void wrap_paragraph(para_data *pdata, word *words,
 	ldata->penalty_before = ldata->penalty_after = 0;
     }
 
+    wrap_free(wrapping);
+}
+
+/*
+ * Per-line data used by page_breaks(), gathered into a flat array
+ * so that the inner loop doesn't have to go chasing line_data
+ * pointers.
+ */
+typedef struct {
+    line_data *line;
+    /* Height contributed if this line follows another on a page */
+    int text_join, space_join;
+    /* Height contributed if this line begins a page */
+    int text_first, space_first;
+    int page_break;		       /* must begin a new page */
+    int can_break;		       /* may end a page */
+    int ends_run;		       /* last line before a forced break */
+    int penalty;		       /* cost of breaking after this line */
+} pb_line;
+
+/*
+ * The decision made for a page starting at a given line.
+ */
+typedef struct {
+    int last;			       /* index of last line on the page */
+    int vshortfall, space;	       /* for vertical justification */
+} pb_choice;
+
+/*
+ * Try ending a page (starting at some line) on line j of the array,
+ * and record it in *cost and *ch if it's better than what's there.
+ * `next' is the cost of page-breaking everything after line j.
+ */
+static void pb_try(pb_line const *lines, int j, int this_height,
+		   int minheight, int space, int next,
+		   int *cost, pb_choice *ch)
+{
+    int c;
+
+    /*
+     * Compute the cost of this arrangement, as the square of the
+     * amount of wasted space on the page. Exception: if this is
+     * the last page before a mandatory break or the document end,
+     * we don't penalise a large blank area.
+     */
+    if (!lines[j].ends_run) {
+	int x = (this_height - minheight) / FUNITS_PER_PT * 4096.0;
+	int xf;
+
+	xf = x & 0xFF;
+	x >>= 8;
+
+	c = x*x;
+	c += (x * xf) >> 8;
+	c += lines[j].penalty;
+	c += next;
+    } else
+	c = 0;
+
+    if (*cost == -1 || *cost > c) {
+	/*
+	 * This is the best option yet for this starting point.
+	 */
+	*cost = c;
+	ch->last = j;
+	ch->vshortfall = (lines[j].ends_run ? 0 : this_height - minheight);
+	ch->space = space;
+    }
+}
+
+/*
+ * page_breaks() keeps the costs it has computed in a ring buffer of
+ * ringsize entries (each of ncols+1 ints), indexed by line number
+ * modulo ringsize. Lines are done in decreasing order, and line i's
+ * costs are only stored once all its options have been tried; so
+ * while working on line i, the ring holds the costs for exactly
+ * lines i+1 to i+ringsize (the last of those in the slot that line
+ * i will take over). Make sure that includes line `want', growing
+ * the ring and moving those entries to their new slots if not.
+ */
+static int *pb_ring_reach(int *ring, int *ringsize, int i, int want,
+			  int nlines, int ncols)
+{
+    int oldsize = *ringsize, newsize = oldsize, k, k1;
+    int *newring;
+
+    assert(want > i);
+    if (want - i < oldsize)
+	return ring;
+    while (want - i >= newsize)
+	newsize *= 2;
+
+    newring = snewn(newsize * (ncols+1), int);
+    for (k = i+1; k < nlines && k <= i+oldsize; k++)
+	for (k1 = 0; k1 <= ncols; k1++)
+	    newring[(k % newsize) * (ncols+1) + k1] =
+		ring[(k % oldsize) * (ncols+1) + k1];
+    sfree(ring);
+    *ringsize = newsize;
+    return newring;
 }
 
 static page_data *page_breaks(line_data *first, line_data *last,
 			      int page_height, int ncols, int headspace)
 {
-    line_data *l, *m;
+    line_data *l;
     page_data *ph, *pt;
-    int n, n1, this_height;
+    pb_line *lines;
+    pb_choice *choices;
+    int *ring, *cur, ringsize;
+    int nlines, i, j, n, n1, this_height;
 
     /*
      * Page breaking is done by a close analogue of the optimal
@@ -1811,21 +2150,66 @@ static page_data *page_breaks(line_data *first, line_data *last,
      * times over, hypothetically trying to put every subsequence
      * on every possible page.
      * 
-     * Since my line_data structures are only used for this
-     * purpose, I might as well just store the algorithm data
-     * directly in them.
+     * The pre-computed costs are only ever looked up at most a
+     * page's worth of lines ahead, so they live in a ring buffer
+     * which grows (see pb_ring_reach) if it turns out a page can
+     * hold more lines than it has room for. The choice made for
+     * each starting line has to be kept for the whole document,
+     * since we don't know which starting lines we'll actually use
+     * until we assemble the pages at the end.
      */
 
-    for (l = last; l; l = l->prev) {
-	l->bestcost = snewn(ncols+1, int);
-	l->vshortfall = snewn(ncols+1, int);
-	l->text = snewn(ncols+1, int);
-	l->space = snewn(ncols+1, int);
-	l->page_last = snewn(ncols+1, line_data *);
+    nlines = 0;
+    for (l = first; l; l = l->next) {
+	nlines++;
+	if (l == last)
+	    break;
+    }
+
+    lines = snewn(nlines, pb_line);
+    for (i = 0, l = first; i < nlines; i++, l = l->next) {
+	pb_line *p = &lines[i];
 
+	p->line = l;
+	p->text_join = p->space_join = 0;
+	p->text_first = p->space_first = 0;
+	if (l->space_before > 0)
+	    p->space_join += l->space_before;
+	else
+	    p->text_join += l->space_before;
+	if (l->page_break) {
+	    p->text_first = p->text_join;
+	    p->space_first = p->space_join;
+	}
+	if (i > 0) {
+	    if (l->prev->space_after > 0)
+		p->space_join += l->prev->space_after;
+	    else
+		p->text_join += l->prev->space_after;
+	}
+	p->text_join += l->line_height;
+	p->text_first += l->line_height;
+	p->page_break = l->page_break;
+	/*
+	 * If the space after this paragraph is _negative_ (which
+	 * means the next line is folded on to this one, which
+	 * happens in the index), we absolutely cannot break here.
+	 */
+	p->can_break = (l->space_after >= 0);
+	p->ends_run = (l == last || !l->next || l->next->page_break);
+	p->penalty = (p->ends_run ? 0 :
+		      l->penalty_after + l->next->penalty_before);
+    }
+
+    choices = snewn(nlines * (ncols+1), pb_choice);
+    ringsize = 64;
+    ring = snewn(ringsize * (ncols+1), int);
+    cur = snewn(ncols+1, int);
+
+    for (i = nlines; i-- > 0 ;) {
 	for (n = 0; n <= ncols; n++) {
-	    int minheight, text = 0, space = 0;
-	    int cost;
+	    pb_choice *ch = &choices[i * (ncols+1) + n];
+	    int minheight, text, space, fit, fitspace;
 
 	    n1 = (n < ncols ? n+1 : ncols);
 	    if (n < ncols)
@@ -1833,97 +2217,73 @@ static page_data *page_breaks(line_data *first, line_data *last,
 	    else
 		this_height = page_height;
 
-	    l->bestcost[n] = -1;
-	    for (m = l; m; m = m->next) {
-		if (m != l && m->page_break)
-		    break;	       /* we've gone as far as we can */
-
-		if (m != l) {
-		    if (m->prev->space_after > 0)
-			space += m->prev->space_after;
-		    else
-			text += m->prev->space_after;
+	    cur[n] = -1;
+	    text = lines[i].text_first;
+	    space = lines[i].space_first;
+	    minheight = fit = fitspace = 0;
+	    for (j = i; j < nlines; j++) {
+		int next = 0;
+
+		if (j != i) {
+		    if (lines[j].page_break)
+			break;	       /* we've gone as far as we can */
+		    text += lines[j].text_join;
+		    space += lines[j].space_join;
 		}
-		if (m != l || m->page_break) {
-		    if (m->space_before > 0)
-			space += m->space_before;
-		    else
-			text += m->space_before;
-		}
-		text += m->line_height;
+		if (j != i && text + space > this_height)
+		    break;
 		minheight = text + space;
+		fit = j;
+		fitspace = space;
 
-		if (m != l && minheight > this_height)
-		    break;
+		if (!lines[j].can_break)
+		    continue;
 
+		if (!lines[j].ends_run) {
+		    ring = pb_ring_reach(ring, &ringsize, i, j+1,
+					 nlines, ncols);
+		    next = ring[((j+1) % ringsize) * (ncols+1) + n1];
+		}
+		pb_try(lines, j, this_height, minheight, space, next,
+		       &cur[n], ch);
+	    }
+
+	    if (cur[n] == -1) {
 		/*
-		 * If the space after this paragraph is _negative_
-		 * (which means the next line is folded on to this
-		 * one, which happens in the index), we absolutely
-		 * cannot break here.
+		 * There was nowhere we were allowed to break before
+		 * the page filled up (an index entry longer than a
+		 * page can do this). Break as late as will fit.
 		 */
-		if (m->space_after >= 0) {
-
-		    /*
-		     * Compute the cost of this arrangement, as the
-		     * square of the amount of wasted space on the
-		     * page. Exception: if this is the last page
-		     * before a mandatory break or the document
-		     * end, we don't penalise a large blank area.
-		     */
-		    if (m != last && m->next && !m->next->page_break)
-		    {
-			int x = (this_height - minheight) / FUNITS_PER_PT *
-			    4096.0;
-			int xf;
-
-			xf = x & 0xFF;
-			x >>= 8;
-
-			cost = x*x;
-			cost += (x * xf) >> 8;
-		    } else
-			cost = 0;
-
-		    if (m != last && m->next && !m->next->page_break) {
-			cost += m->penalty_after;
-			cost += m->next->penalty_before;
-		    }
+		int next = 0;
 
-		    if (m != last && m->next && !m->next->page_break)
-			cost += m->next->bestcost[n1];
-		    if (l->bestcost[n] == -1 || l->bestcost[n] > cost) {
-			/*
-			 * This is the best option yet for this
-			 * starting point.
-			 */
-			l->bestcost[n] = cost;
-			if (m != last && m->next && !m->next->page_break)
-			    l->vshortfall[n] = this_height - minheight;
-			else
-			    l->vshortfall[n] = 0;
-			l->text[n] = text;
-			l->space[n] = space;
-			l->page_last[n] = m;
-		    }
+		if (!lines[fit].ends_run) {
+		    ring = pb_ring_reach(ring, &ringsize, i, fit+1,
+					 nlines, ncols);
+		    next = ring[((fit+1) % ringsize) * (ncols+1) + n1];
 		}
-
-		if (m == last)
-		    break;
+		pb_try(lines, fit, this_height, minheight, fitspace, next,
+		       &cur[n], ch);
 	    }
 	}
+
+	for (n = 0; n <= ncols; n++)
+	    ring[(i % ringsize) * (ncols+1) + n] = cur[n];
     }
 
+    sfree(cur);
+    sfree(ring);
+
     /*
      * Now go through the line list forwards and assemble the
      * actual pages.
      */
     ph = pt = NULL;
 
-    l = first;
+    i = 0;
     n = 0;
-    while (l) {
+    while (i < nlines) {
 	page_data *page;
+	pb_choice *ch = &choices[i * (ncols+1) + n];
 	int text, space, head;
 
 	page = snew(page_data);
@@ -1935,52 +2295,41 @@ static page_data *page_breaks(line_data *first, line_data *last,
 	    ph = page;
 	pt = page;
 
-	page->first_line = l;
-	page->last_line = l->page_last[n];
+	page->first_line = lines[i].line;
+	page->last_line = lines[ch->last].line;
 
 	page->first_text = page->last_text = NULL;
 	page->first_xref = page->last_xref = NULL;
 	page->first_rect = page->last_rect = NULL;
+	page->frag_chunks = NULL;
 
 	/*
 	 * Now assign a y-coordinate to each line on the page.
 	 */
-	text = space = 0;
+	text = lines[i].text_first;
+	space = lines[i].space_first;
 	head = (n < ncols ? headspace : 0);
-	for (l = page->first_line; l; l = l->next) {
-	    if (l != page->first_line) {
-		if (l->prev->space_after > 0)
-		    space += l->prev->space_after;
-		else
-		    text += l->prev->space_after;
+	for (j = i; j <= ch->last; j++) {
+	    l = lines[j].line;
+	    if (j != i) {
+		text += lines[j].text_join;
+		space += lines[j].space_join;
 	    }
-	    if (l != page->first_line || l->page_break) {
-		if (l->space_before > 0)
-		    space += l->space_before;
-		else
-		    text += l->space_before;
-	    }
-	    text += l->line_height;
 
 	    l->page = page;
 	    l->ypos = text + space + head;
-	    if (page->first_line->space[n]) {
-		l->ypos += space * (float)page->first_line->vshortfall[n] /
-		    page->first_line->space[n];
+	    if (ch->space) {
+		l->ypos += space * (float)ch->vshortfall / ch->space;
 	    }
-
-	    if (l == page->last_line)
-		break;
 	}
 
-	l = page->last_line;
-	if (l == last)
-	    break;
-	l = l->next;
-
+	i = ch->last + 1;
 	n = (n < ncols ? n+1 : ncols);
     }
 
+    sfree(choices);
+    sfree(lines);
+
     return ph;
 }
 
@@ -2001,13 +2350,68 @@ static void add_rect_to_page(page_data *page, int x, int y, int w, int h)
     r->h = h;
 }
 
+/*
+ * Text fragments, with their text and kerning, are allocated in
+ * bulk from memory belonging to their page, since a page can have
+ * a great many of them and they all last as long as the page does.
+ */
+#define FRAG_CHUNK_SIZE 16384
+
+struct frag_chunk_Tag {
+    frag_chunk *next;
+    char *data;
+    int used, size;
+};
+
+typedef union { void *p; long l; double d; } frag_align;
+
+static void *page_alloc(page_data *page, int size)
+{
+    frag_chunk *c = page->frag_chunks;
+
+    size = (size + sizeof(frag_align) - 1) / sizeof(frag_align) *
+	sizeof(frag_align);
+    if (!c || c->used + size > c->size) {
+	c = snew(frag_chunk);
+	c->size = (size > FRAG_CHUNK_SIZE ? size : FRAG_CHUNK_SIZE);
+	c->data = snewn(c->size, char);
+	c->used = 0;
+	c->next = page->frag_chunks;
+	page->frag_chunks = c;
+    }
+    c->used += size;
+    return c->data + c->used - size;
+}
+
+/*
+ * Free the memory holding a page's text fragments.
+ */
+static void page_free_chunks(page_data *page)
+{
+    frag_chunk *c, *next;
+
+    for (c = page->frag_chunks; c; c = next) {
+	next = c->next;
+	sfree(c->data);
+	sfree(c);
+    }
+    page->frag_chunks = NULL;
+    page->first_text = page->last_text = NULL;
+}
+
 static void add_string_to_page(page_data *page, int x, int y,
-			       font_encoding *fe, int size, char *text,
-			       int width)
+			       font_encoding *fe, int size, char const *text,
+			       int len, int width, frag_kern const *kerns,
+			       int nkerns)
 {
     text_fragment *frag;
+    int kernoff, textoff;
 
-    frag = snew(text_fragment);
+    /* The fragment, then its kerns, then its text. */
+    kernoff = (sizeof(text_fragment) + sizeof(frag_align) - 1) /
+	sizeof(frag_align) * sizeof(frag_align);
+    textoff = kernoff + nkerns * sizeof(frag_kern);
+    frag = page_alloc(page, textoff + len + 1);
     frag->next = NULL;
 
     if (page->last_text)
@@ -2020,8 +2424,15 @@ static void add_string_to_page(page_data *page, int x, int y,
     frag->y = y;
     frag->fe = fe;
     frag->fontsize = size;
-    frag->text = dupstr(text);
+    frag->text = (char *)frag + textoff;
+    memcpy(frag->text, text, len);
+    frag->text[len] = '\0';
+    frag->len = len;
     frag->width = width;
+    frag->kerns = (nkerns ? (frag_kern *)((char *)frag + kernoff) : NULL);
+    if (nkerns)
+	memcpy(frag->kerns, kerns, nkerns * sizeof(frag_kern));
+    frag->nkerns = nkerns;
 }
 
 /*
@@ -2030,13 +2441,26 @@ static void add_string_to_page(page_data *page, int x, int y,
 static int render_string(page_data *page, font_data *font, int fontsize,
 			 int x, int y, wchar_t *str, unsigned flags)
 {
-    char *text;
-    int textpos, textwid, kern, nglyph, glyph, oglyph, lig;
+    char textbuf[128], *text;
+    frag_kern kernbuf[128], *kerns;
+    int textpos, textwid, nkerns, kern, nglyph, glyph, oglyph, lig;
     font_encoding *subfont = NULL, *sf;
     subfont_map_entry *sme;
+    int len = ustrlen(str);
 
-    text = snewn(1 + ustrlen(str), char);
-    textpos = textwid = 0;
+    /*
+     * A string can't produce more glyphs or kerns than it has
+     * characters, and most strings are short enough not to need
+     * anything but these buffers on the stack.
+     */
+    if (len < (int)lenof(textbuf)) {
+	text = textbuf;
+	kerns = kernbuf;
+    } else {
+	text = snewn(len + 1, char);
+	kerns = snewn(len, frag_kern);
+    }
+    textpos = textwid = nkerns = 0;
 
     glyph = NOGLYPH;
     nglyph = utoglyph(font->info, *str);
@@ -2065,18 +2489,24 @@ static int render_string(page_data *page, font_data *font, int fontsize,
 
 	kern = find_kern(font, oglyph, glyph) * fontsize;
 
-	if (!subfont || sf != subfont || kern) {
+	if (!subfont || sf != subfont) {
 	    if (subfont) {
-		text[textpos] = '\0';
 		add_string_to_page(page, x, y, subfont, fontsize, text,
-				   textwid);
+				   textpos, textwid, kerns, nkerns);
 		x += textwid + kern;
 	    } else {
 		assert(textpos == 0);
 	    }
 	    textpos = 0;
 	    textwid = 0;
+	    nkerns = 0;
 	    subfont = sf;
+	} else if (kern) {
+	    textwid += kern;
+	    kerns[nkerns].pos = textpos;
+	    kerns[nkerns].kern = kern;
+	    kerns[nkerns].x = x + textwid;
+	    nkerns++;
 	}
 
 	text[textpos++] = sme->position;
@@ -2086,11 +2516,16 @@ static int render_string(page_data *page, font_data *font, int fontsize,
     }
 
     if (textpos > 0) {
-	text[textpos] = '\0';
-	add_string_to_page(page, x, y, subfont, fontsize, text, textwid);
+	add_string_to_page(page, x, y, subfont, fontsize, text, textpos,
+			   textwid, kerns, nkerns);
 	x += textwid;
     }
 
+    if (text != textbuf) {
+	sfree(text);
+	sfree(kerns);
+    }
+
     return x;
 }
 
@@ -2445,7 +2880,7 @@ static void render_para(para_data *pdata, paper_conf *conf,
 
 	w = fake_word(num);
 	wid = paper_width_simple(pdata, w, conf);
-	sfree(w);
+	free_word_list(w);
 
 	for (x = 0; x < conf->base_width; x += conf->leader_separation)
 	    if (x - conf->leader_separation > last_x - conf->left_margin &&
@@ -2506,10 +2941,13 @@ static para_data *code_paragraph(int indent, word *words, paper_conf *conf)
 
     pdata->first = pdata->last = NULL;
     pdata->outline_level = -1;
+    pdata->outline_title = NULL;
     pdata->rect_type = RECT_NONE;
     pdata->contents_entry = NULL;
     pdata->justification = LEFT;
     pdata->extraflags = RS_NOLIG;
+    pdata->own_words = pdata->own_aux = pdata->own_aux2 = NULL;
+    pdata->own_line_words = TRUE;
 
     for (; words; words = words->next) {
 	wchar_t *t, *e, *start;
@@ -2632,15 +3070,18 @@ static para_data *rule_paragraph(int indent, paper_conf *conf)
     /*
      * Better to break after a rule than before it
      */
-    ldata->penalty_after += 100000;
-    ldata->penalty_before += -100000;
+    ldata->penalty_after = 100000;
+    ldata->penalty_before = -100000;
 
     pdata->first = pdata->last = ldata;
     pdata->outline_level = -1;
+    pdata->outline_title = NULL;
     pdata->rect_type = RECT_RULE;
     pdata->contents_entry = NULL;
     pdata->justification = LEFT;
     pdata->extraflags = 0;
+    pdata->own_words = pdata->own_aux = pdata->own_aux2 = NULL;
+    pdata->own_line_words = FALSE;
 
     standard_line_spacing(pdata, conf);
 
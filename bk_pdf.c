@@ -3,37 +3,86 @@
  */
 
 #include <assert.h>
+#include <stdlib.h>
 #include "halibut.h"
 #include "paper.h"
 #include "deflate.h"
 
 #define TREE_BRANCH 8		       /* max branching factor in page tree */
+#define OBJSTM_SIZE 100		       /* max objects in an object stream */
 
 paragraph *pdf_config_filename(char *filename)
 {
     return cmdline_cfg_simple("pdf-filename", filename, NULL);
 }
 
+typedef struct {
+    int pos;			       /* where in the object's text */
+    object *dest;
+} objreference;
+
 struct object_Tag {
     objlist *list;
     object *next;
     int number;
     rdstringc main, stream;
+    objreference *refs;		       /* references to other objects */
+    int nrefs, refsize;
     int size, fileoff;
     char *final;
+    object *objstm;		       /* object stream containing this */
+    int objstm_index;
+    object *dup;		       /* identical object this was merged into */
+    unsigned long hash;
+    /* For linearized output: */
+    int pagetree;		       /* a page, or a node of the page tree */
+    object *contents;		       /* a page's content stream */
+    int part, page, mark, shareid;
 };
 
 struct objlist_Tag {
     int number;
     object *head, *tail;
+    object *merged;		       /* objects pdf_dedup() took out */
+};
+
+/*
+ * A linearized (`fast web view') file, as described in Annex F of
+ * the PDF Reference, has everything needed to show the first page
+ * near its start, and each other page's objects together after
+ * that, so that a viewer can show any page without reading the
+ * whole file. Each object goes in one part of such a file:
+ */
+enum {
+    PART_NONE,
+    PART_CATALOG,		       /* the catalogue and outlines */
+    PART_FIRSTPAGE,		       /* everything the first page uses */
+    PART_PAGE,			       /* used by just one other page */
+    PART_SHARED,		       /* used by several other pages */
+    PART_OTHER			       /* page tree nodes, Info, etc */
 };
 
+typedef struct {
+    int npages;
+    object **pages;		       /* page objects, in order */
+    int **shareids, *nshareids;	       /* shared objects each page uses */
+    int nmain;			       /* objects in the main xref section */
+    int hintnum;		       /* object number of the hint stream */
+    int size;			       /* one more than the highest number */
+} linearization;
+
 static void pdf_string(void (*add)(object *, char const *),
 		       object *, char const *);
 static void pdf_string_len(void (*add)(object *, char const *),
 			   object *, char const *, int);
 static void objref(object *o, object *dest);
+static void resolve_refs(object *o);
 static void objdest(object *o, page_data *p);
+static char *pdf_units(char *p, int units);
+static void pdf_kerned_text(object *cstr, text_fragment *frag);
+static void pdf_page_contents(void *vpages, int i);
+static void pdf_finish_object(void *vobjs, int i);
+static void pdf_dedup(objlist *olist);
 
 static int is_std_font(char const *name);
 
@@ -42,35 +91,63 @@ static void make_pages_node(object *node, object *parent, page_data *first,
 			    object *mediabox);
 static int make_outline(object *parent, outline_element *start, int n,
 			int open);
-static int pdf_versionid(FILE *fp, word *words);
+static void pdf_versionid(rdstringc *rs, word *words);
+static void pdf_xref_stream(outsink *out, objlist *olist, int fileoff,
+			    object *cat, object *info);
+static linearization *pdf_linearize(objlist *olist, document *doc,
+				    object *cat);
+static void pdf_write_linearized(outsink *out, objlist *olist,
+				 linearization *lin, object *info,
+				 rdstringc *vids);
+static void pdf_write_plain(outsink *out, objlist *olist, int objstms,
+			    object *cat, object *info, rdstringc *vids);
+static void pdf_free_objects(objlist *olist);
+static void lin_free(linearization *lin);
 
 void pdf_backend(paragraph *sourceform, keywordlist *keywords,
-		 indexdata *idx, void *vdoc) {
+		 indexdata *idx, void *vdoc, outdest *od) {
     document *doc = (document *)vdoc;
     int font_index;
     font_encoding *fe;
     page_data *page;
-    FILE *fp;
+    outsink *out;
     char *filename;
     paragraph *p;
     objlist olist;
     object *o, *info, *cat, *outlines, *pages, *resources, *mediabox;
-    int fileoff;
+    int objstms, linearize;
+    linearization *lin;
+    rdstringc vids = {0, 0, NULL};
 
     IGNORE(keywords);
     IGNORE(idx);
 
     filename = dupstr("output.pdf");
+    objstms = linearize = FALSE;
     for (p = sourceform; p; p = p->next) {
 	if (p->type == para_Config) {
 	    if (!ustricmp(p->keyword, L"pdf-filename")) {
 		sfree(filename);
 		filename = dupstr(adv(p->origkeyword));
+	    } else if (!ustricmp(p->keyword, L"pdf-object-streams")) {
+		objstms = utob(uadv(p->keyword));
+	    } else if (!ustricmp(p->keyword, L"pdf-linearize")) {
+		linearize = utob(uadv(p->keyword));
 	    }
 	}
     }
 
-    olist.head = olist.tail = NULL;
+    /*
+     * A linearized file needs a plain cross-reference table, so
+     * that a viewer can find the first page's objects before the
+     * rest of the file arrives.
+     */
+    if (!doc->pages)
+	linearize = FALSE;
+    if (linearize)
+	objstms = FALSE;
+
+    olist.head = olist.tail = olist.merged = NULL;
     olist.number = 1;
 
     {
@@ -134,10 +211,45 @@ void pdf_backend(paragraph *sourceform, keywordlist *keywords,
 	object *font, *fontdesc;
 	int flags;
 	font_info const *fi = fe->font->info;
+	char const *fontname = fi->name;
+	char *subsetname = NULL;
+	sfnt *sf = NULL;
 
 	sprintf(fname, "f%d", font_index++);
 	fe->name = dupstr(fname);
 
+	/*
+	 * From a TrueType font we embed only the glyphs this subfont
+	 * uses. The PDF spec asks for a subset's name to start with
+	 * a tag of six capital letters, different for each subset
+	 * in the file.
+	 */
+	if (fi->filetype == TRUETYPE) {
+	    sf = fi->fontfile;
+	    if (!is_std_font(fi->name)) {
+		glyph glyphs[256];
+		int n = 0;
+		sfnt *ss;
+
+		for (i = 0; i < 256; i++)
+		    if (fe->vector[i] != NOGLYPH)
+			glyphs[n++] = fe->vector[i];
+		ss = sfnt_subset(fi, glyphs, n);
+		if (ss) {
+		    int tag = font_index - 1;
+
+		    sf = ss;
+		    subsetname = snewn(strlen(fi->name) + 8, char);
+		    for (i = 5; i >= 0; i--) {
+			subsetname[i] = 'A' + tag % 26;
+			tag /= 26;
+		    }
+		    sprintf(subsetname + 6, "+%s", fi->name);
+		    fontname = subsetname;
+		}
+	    }
+	}
+
 	font = new_object(&olist);
 
 	objtext(resources, "/");
@@ -165,7 +277,7 @@ void pdf_backend(paragraph *sourceform, keywordlist *keywords,
 #define FF_FORCEBOLD	0x00040000
 
 	    objtext(fontdesc, "<<\n/Type /FontDescriptor\n/Name /");
-	    objtext(fontdesc, fi->name);
+	    objtext(fontdesc, fontname);
 	    flags = 0;
 	    if (fi->italicangle) flags |= FF_ITALIC;
 	    flags |= FF_NONSYMBOLIC;
@@ -191,7 +303,7 @@ void pdf_backend(paragraph *sourceform, keywordlist *keywords,
 	}
 
 	objtext(font, "<<\n/Type /Font\n/BaseFont /");
-	objtext(font, fe->font->info->name);
+	objtext(font, fontname);
 	if (fe->font->info->filetype == TRUETYPE) {
 	    object *cidfont = new_object(&olist);
 	    object *cmap = new_object(&olist);
@@ -229,8 +341,7 @@ void pdf_backend(paragraph *sourceform, keywordlist *keywords,
 		ranges[i] = 0;
 		if (fe->vector[i] == NOGLYPH)
 		    continue;
-		idx = sfnt_glyphtoindex(fe->font->info->fontfile,
-					fe->vector[i]);
+		idx = sfnt_glyphtoindex(sf, fe->vector[i]);
 		if (start >= 0 && idx - startidx == (unsigned)(i - start)) {
 		    if (ranges[start] == 1) {
 			nranges++; nchars--;
@@ -258,8 +369,7 @@ void pdf_backend(paragraph *sourceform, keywordlist *keywords,
 			objstream(cmap, buf);
 			sprintf(buf, "%hu\n",
 				(unsigned short)
-				sfnt_glyphtoindex(fe->font->info->fontfile,
-						  fe->vector[i]));
+				sfnt_glyphtoindex(sf, fe->vector[i]));
 			objstream(cmap, buf);
 			blk--;
 		    }
@@ -280,8 +390,7 @@ void pdf_backend(paragraph *sourceform, keywordlist *keywords,
 			objstream(cmap, buf);
 			sprintf(buf, "%hu\n",
 				(unsigned short)
-				sfnt_glyphtoindex(fe->font->info->fontfile,
-						  fe->vector[i]));
+				sfnt_glyphtoindex(sf, fe->vector[i]));
 			objstream(cmap, buf);
 			blk--;
 		    }
@@ -298,18 +407,20 @@ void pdf_backend(paragraph *sourceform, keywordlist *keywords,
 	    objtext(font, "]\n");
 	    objtext(cidfont, "<<\n/Type/Font\n/Subtype/CIDFontType2\n"
 		    "/BaseFont/");
-	    objtext(cidfont, fe->font->info->name);
+	    objtext(cidfont, fontname);
 	    objtext(cidfont, "\n/CIDSystemInfo<</Registry(Adobe)"
 		    "/Ordering(Identity)/Supplement 0>>\n");
 	    objtext(cidfont, "/FontDescriptor ");
 	    objref(cidfont, fontdesc);
 	    objtext(cidfont, "\n/W[0[");
-	    for (i = 0; i < (int)sfnt_nglyphs(fe->font->info->fontfile); i++) {
-		char buf[20];
-		double width;
-		width = find_width(fe->font,
-			       sfnt_indextoglyph(fe->font->info->fontfile, i));
-		sprintf(buf, "%g ", 1000.0 * width / FUNITS_PER_PT);
+	    for (i = 0; i < (int)sfnt_nglyphs(sf); i++) {
+		char buf[NUMBUF_SIZE + 1];
+		int len;
+
+		/* Widths are in thousandths of an em, as PDF wants. */
+		len = fmt_int(buf, find_width(fe->font,
+					      sfnt_indextoglyph(sf, i)));
+		strcpy(buf + len, " ");
 		objtext(cidfont, buf);
 	    }
 	    objtext(cidfont, "]]>>\n");
@@ -346,12 +457,13 @@ void pdf_backend(paragraph *sourceform, keywordlist *keywords,
 		objtext(font, "\n");
 		objtext(widths, "[\n");
 		for (i = firstchar; i <= lastchar; i++) {
-		    double width;
+		    int width, len;
 		    if (fe->vector[i] == NOGLYPH)
-			width = 0.0;
+			width = 0;
 		    else
 			width = find_width(fe->font, fe->vector[i]);
-		    sprintf(buf, "%g\n", 1000.0 * width / FUNITS_PER_PT);
+		    len = fmt_int(buf, width);
+		    strcpy(buf + len, "\n");
 		    objtext(widths, buf);
 		}
 		objtext(widths, "]\n");
@@ -385,7 +497,7 @@ void pdf_backend(paragraph *sourceform, keywordlist *keywords,
 		size_t len;
 		char *ffbuf;
 
-		sfnt_data((font_info *)fi, &ffbuf, &len);
+		sfnt_data(sf, &ffbuf, &len);
 		objstream_len(fontfile, ffbuf, len);
 		sprintf(buf, "<<\n/Length1 %lu\n", (unsigned long)len);
 		objtext(fontfile, buf);
@@ -396,6 +508,10 @@ void pdf_backend(paragraph *sourceform, keywordlist *keywords,
 	}
 
 	objtext(font, "\n>>\n");
+
+	if (sf && sf != fi->fontfile)
+	    sfnt_free(sf);
+	sfree(subsetname);
     }
     objtext(resources, ">>\n>>\n");
 
@@ -416,6 +532,7 @@ void pdf_backend(paragraph *sourceform, keywordlist *keywords,
 	object *opage;
 
 	opage = new_object(&olist);
+	opage->pagetree = TRUE;
 	page->spare = opage;
 	objtext(opage, "<<\n/Type /Page\n");
     }
@@ -426,14 +543,11 @@ void pdf_backend(paragraph *sourceform, keywordlist *keywords,
     make_pages_node(pages, NULL, doc->pages, NULL, resources, mediabox);
 
     /*
-     * Create and render the individual pages.
+     * Create the individual pages. Their content streams are
+     * rendered afterwards.
      */
     for (page = doc->pages; page; page = page->next) {
 	object *opage, *cstr;
-	rect *r;
-	text_fragment *frag, *frag_end;
-	char buf[256];
-	int x, y, lx, ly;
 
 	opage = (object *)page->spare;
 	/*
@@ -449,116 +563,28 @@ void pdf_backend(paragraph *sourceform, keywordlist *keywords,
 	 * topmost /Pages node because we carefully put it there.
 	 * So we don't need a /Resources entry here.  The same applies
 	 * to /MediaBox.
+	 *
+	 * Except in a linearized file, where a viewer may want to
+	 * show a page before it has the page tree.
 	 */
+	if (linearize) {
+	    objtext(opage, "/Resources ");
+	    objref(opage, resources);
+	    objtext(opage, "\n/MediaBox ");
+	    objref(opage, mediabox);
+	    objtext(opage, "\n");
+	}
 
 	/*
-	 * Now we're ready to define a content stream containing
-	 * the actual text on the page.
+	 * Now we're ready to define a content stream, which will
+	 * contain the actual text on the page.
 	 */
 	cstr = new_object(&olist);
+	opage->contents = cstr;
 	objtext(opage, "/Contents ");
 	objref(opage, cstr);
 	objtext(opage, "\n");
 
-	/*
-	 * Render any rectangles on the page.
-	 */
-	for (r = page->first_rect; r; r = r->next) {
-	    char buf[512];
-	    sprintf(buf, "%g %g %g %g re f\n",
-		    r->x / FUNITS_PER_PT, r->y / FUNITS_PER_PT,
-		    r->w / FUNITS_PER_PT, r->h / FUNITS_PER_PT);
-	    objstream(cstr, buf);
-	}
-
-	objstream(cstr, "BT\n");
-
-	/*
-	 * PDF tracks two separate current positions: the position
-	 * given in the `line matrix' and the position given in the
-	 * `text matrix'. We must therefore track both as well.
-	 * They start off at -1 (unset).
-	 */
-	lx = ly = -1;
-	x = y = -1;
-
-	frag = page->first_text;
-	while (frag) {
-	    /*
-	     * For compactness, I'm going to group text fragments
-	     * into subsequences that use the same font+size. So
-	     * first find the end of this subsequence.
-	     */
-	    for (frag_end = frag;
-		 (frag_end &&
-		  frag_end->fe == frag->fe &&
-		  frag_end->fontsize == frag->fontsize);
-		 frag_end = frag_end->next);
-
-	    /*
-	     * Now select the text fragment, and prepare to display
-	     * the text.
-	     */
-	    objstream(cstr, "/");
-	    objstream(cstr, frag->fe->name);
-	    sprintf(buf, " %d Tf ", frag->fontsize);
-	    objstream(cstr, buf);
-
-	    while (frag && frag != frag_end) {
-		/*
-		 * Place the text position for the first piece of
-		 * text.
-		 */
-		if (lx < 0) {
-		    sprintf(buf, "1 0 0 1 %g %g Tm ",
-			    frag->x/FUNITS_PER_PT, frag->y/FUNITS_PER_PT);
-		} else {
-		    sprintf(buf, "%g %g Td ",
-			    (frag->x - lx)/FUNITS_PER_PT,
-			    (frag->y - ly)/FUNITS_PER_PT);
-		}
-		objstream(cstr, buf);
-		lx = x = frag->x;
-		ly = y = frag->y;
-
-		/*
-		 * See if we're going to use Tj (show a single
-		 * string) or TJ (show an array of strings with
-		 * x-spacings between them). We determine this by
-		 * seeing if there's more than one text fragment in
-		 * sequence with the same y-coordinate.
-		 */
-		if (frag->next && frag->next != frag_end &&
-		    frag->next->y == y) {
-		    /*
-		     * The TJ strategy.
-		     */
-		    objstream(cstr, "[");
-		    while (frag && frag != frag_end && frag->y == y) {
-			if (frag->x != x) {
-			    sprintf(buf, "%g",
-				    (x - frag->x) * 1000.0 /
-				    (FUNITS_PER_PT * frag->fontsize));
-			    objstream(cstr, buf);
-			}
-			pdf_string(objstream, cstr, frag->text);
-			x = frag->x + frag->width;
-			frag = frag->next;
-		    }
-		    objstream(cstr, "]TJ\n");
-		} else
-		{
-		    /*
-		     * The Tj strategy.
-		     */
-		    pdf_string(objstream, cstr, frag->text);
-		    objstream(cstr, "Tj\n");
-		    frag = frag->next;
-		}
-	    }
-	}
-	objstream(cstr, "ET");
-
 	/*
 	 * Also, we want an annotation dictionary containing the
 	 * cross-references from this page.
@@ -568,12 +594,13 @@ void pdf_backend(paragraph *sourceform, keywordlist *keywords,
 	    objtext(opage, "/Annots [\n");
 
 	    for (xr = page->first_xref; xr; xr = xr->next) {
-		char buf[256];
+		char buf[4 * NUMBUF_SIZE], *p;
 
 		objtext(opage, "<</Subtype/Link\n/Rect[");
-		sprintf(buf, "%g %g %g %g",
-			xr->lx / FUNITS_PER_PT, xr->by / FUNITS_PER_PT,
-			xr->rx / FUNITS_PER_PT, xr->ty / FUNITS_PER_PT);
+		p = pdf_units(buf, xr->lx);
+		p = pdf_units(p, xr->by);
+		p = pdf_units(p, xr->rx);
+		p += fmt_units(p, xr->ty);
 		objtext(opage, buf);
 		objtext(opage, "]/Border[0 0 0]\n");
 
@@ -595,6 +622,24 @@ void pdf_backend(paragraph *sourceform, keywordlist *keywords,
 	objtext(opage, ">>\n");
     }
 
+    /*
+     * Render the pages' content streams, which are independent of
+     * each other, on as many threads as we're allowed.
+     */
+    {
+	page_data **pagearray;
+	int i, npages;
+
+	npages = 0;
+	for (page = doc->pages; page; page = page->next)
+	    npages++;
+	pagearray = snewn(npages, page_data *);
+	for (i = 0, page = doc->pages; page; page = page->next)
+	    pagearray[i++] = page;
+	run_in_parallel(npages, pdf_page_contents, pagearray);
+	sfree(pagearray);
+    }
+
     /*
      * Set up the outlines dictionary.
      */
@@ -609,116 +654,198 @@ void pdf_backend(paragraph *sourceform, keywordlist *keywords,
 	objtext(outlines, buf);
     }
 
-    /*
-     * Assemble the final linear form of every object.
-     */
-    for (o = olist.head; o; o = o->next) {
-	rdstringc rs = {0, 0, NULL};
-	char text[80];
-	deflate_compress_ctx *zcontext;
-	void *zbuf;
-	int zlen;
+    pdf_dedup(&olist);
 
-	sprintf(text, "%d 0 obj\n", o->number);
-	rdaddsc(&rs, text);
+    lin = linearize ? pdf_linearize(&olist, doc, cat) : NULL;
 
-	if (o->stream.text) {
-	    if (!o->main.text)
-		rdaddsc(&o->main, "<<\n");
-#ifdef PDF_NOCOMPRESS
-	    zlen = o->stream.pos;
-	    zbuf = snewn(zlen, char);
-	    memcpy(zbuf, o->stream.text, zlen);
-	    sprintf(text, "/Length %d\n>>\n", zlen);
-#else
-	    zcontext = deflate_compress_new(DEFLATE_TYPE_ZLIB);
-	    deflate_compress_data(zcontext, o->stream.text, o->stream.pos,
-				  DEFLATE_END_OF_DATA, &zbuf, &zlen);
-	    deflate_compress_free(zcontext);
-	    sprintf(text, "/Filter/FlateDecode\n/Length %d\n>>\n", zlen);
-#endif
-	    rdaddsc(&o->main, text);
-	}
-
-	assert(o->main.text);
-	rdaddsc(&rs, o->main.text);
-	sfree(o->main.text);
+    for (o = olist.head; o; o = o->next)
+	resolve_refs(o);
 
-	if (rs.text[rs.pos-1] != '\n')
-	    rdaddc(&rs, '\n');
+    /*
+     * PDF 1.5 lets objects other than streams be kept in object
+     * streams, which can be compressed. There are lots of small
+     * objects in a big document (page dictionaries and outline
+     * entries, mostly), so this saves a good deal of space.
+     */
+    if (objstms) {
+	object *last = olist.tail, *stm = NULL;
+	rdstringc offsets = {0, 0, NULL}, bodies = {0, 0, NULL};
+	int n = 0;
+
+	for (o = olist.head; ; o = o->next) {
+	    if (stm && (n == OBJSTM_SIZE || !o || o == last->next)) {
+		char text[80];
+
+		sprintf(text, "<<\n/Type/ObjStm\n/N %d\n/First %d\n",
+			n, offsets.pos);
+		objtext(stm, text);
+		objstream_len(stm, offsets.text, offsets.pos);
+		objstream_len(stm, bodies.text, bodies.pos);
+		sfree(offsets.text);
+		sfree(bodies.text);
+		offsets = empty_rdstringc;
+		bodies = empty_rdstringc;
+		stm = NULL;
+	    }
+	    if (!o || o == last->next)
+		break;
+	    if (o->stream.text)
+		continue;
 
-	if (o->stream.text) {
-	    rdaddsc(&rs, "stream\n");
-	    rdaddsn(&rs, zbuf, zlen);
-	    rdaddsc(&rs, "\nendstream\n");
-	    sfree(o->stream.text);
-	    sfree(zbuf);
+	    if (!stm) {
+		stm = new_object(&olist);
+		n = 0;
+	    }
+	    {
+		char text[40];
+		sprintf(text, "%d %d ", o->number, bodies.pos);
+		rdaddsc(&offsets, text);
+	    }
+	    assert(o->main.text);
+	    rdaddsc(&bodies, o->main.text);
+	    if (bodies.text[bodies.pos-1] != '\n')
+		rdaddc(&bodies, '\n');
+	    sfree(o->main.text);
+	    o->main.text = NULL;
+	    o->objstm = stm;
+	    o->objstm_index = n++;
 	}
+    }
 
-	rdaddsc(&rs, "endobj\n");
-
-	o->final = rs.text;
-	o->size = rs.pos;
+    /*
+     * Assemble the final linear form of every object. Compressing
+     * the streams is most of the work, so it's spread across
+     * threads.
+     */
+    {
+	object **objarray;
+	int i, nobjs;
+
+	nobjs = 0;
+	for (o = olist.head; o; o = o->next)
+	    nobjs++;
+	objarray = snewn(nobjs, object *);
+	for (i = 0, o = olist.head; o; o = o->next)
+	    objarray[i++] = o;
+	run_in_parallel(nobjs, pdf_finish_object, objarray);
+	sfree(objarray);
     }
 
     /*
      * Write out the PDF file.
      */
 
-    if (!strcmp(filename, "-"))
-	fp = stdout;
-    else
-	fp = fopen(filename, "wb");
-    if (!fp) {
-	err_cantopenw(filename);
-	return;
+    out = out_open(od, filename, OUT_BINARY);
+    if (out) {
+	for (p = sourceform; p; p = p->next)
+	    if (p->type == para_VersionID)
+		pdf_versionid(&vids, p->words);
+
+	if (lin)
+	    pdf_write_linearized(out, &olist, lin, info, &vids);
+	else
+	    pdf_write_plain(out, &olist, objstms, cat, info, &vids);
+	out_close(out);
     }
 
+    if (lin)
+	lin_free(lin);
+    sfree(vids.text);
+    pdf_free_objects(&olist);
+    for (fe = doc->fonts->head; fe; fe = fe->next) {
+	sfree(fe->name);
+	fe->name = NULL;
+    }
+    sfree(filename);
+}
+
+/*
+ * Write out the PDF file in the ordinary way: header, body, and
+ * then a cross-reference table, or a cross-reference stream if the
+ * body uses object streams.
+ */
+static void pdf_write_plain(outsink *out, objlist *olist, int objstms,
+			    object *cat, object *info, rdstringc *vids)
+{
+    object *o;
+    int fileoff;
+
     /*
      * Header. I'm going to put the version IDs in the header as
      * well, simply in PDF comments.  The PDF Reference also suggests
      * that binary PDF files contain four top-bit-set characters in
      * the second line.
      */
-    fileoff = fprintf(fp, "%%PDF-1.3\n%% L\xc3\xba\xc3\xb0""a\n");
-    for (p = sourceform; p; p = p->next)
-	if (p->type == para_VersionID)
-	    fileoff += pdf_versionid(fp, p->words);
+    fileoff = out_printf(out, "%%PDF-%s\n%% L\xc3\xba\xc3\xb0""a\n",
+			 objstms ? "1.5" : "1.3");
+    if (vids->pos)
+	out_write(out, vids->text, vids->pos);
+    fileoff += vids->pos;
 
     /*
      * Body
      */
-    for (o = olist.head; o; o = o->next) {
+    for (o = olist->head; o; o = o->next) {
+	if (o->objstm)
+	    continue;
 	o->fileoff = fileoff;
-	fwrite(o->final, 1, o->size, fp);
+	out_write(out, o->final, o->size);
 	fileoff += o->size;
     }
 
+    if (objstms) {
+	pdf_xref_stream(out, olist, fileoff, cat, info);
+	return;
+    }
+
     /*
      * Cross-reference table
      */
-    fprintf(fp, "xref\n");
-    assert(olist.head->number == 1);
-    fprintf(fp, "0 %d\n", olist.tail->number + 1);
-    fprintf(fp, "0000000000 65535 f \n");
-    for (o = olist.head; o; o = o->next) {
+    out_printf(out, "xref\n");
+    assert(olist->head->number == 1);
+    out_printf(out, "0 %d\n", olist->tail->number + 1);
+    out_printf(out, "0000000000 65535 f \n");
+    for (o = olist->head; o; o = o->next) {
 	char entry[40];
 	sprintf(entry, "%010d 00000 n \n", o->fileoff);
 	assert(strlen(entry) == 20);
-	fputs(entry, fp);
+	out_puts(out, entry);
     }
 
     /*
      * Trailer
      */
-    fprintf(fp, "trailer\n<<\n/Size %d\n/Root %d 0 R\n/Info %d 0 R\n>>\n",
-	    olist.tail->number + 1, cat->number, info->number);
-    fprintf(fp, "startxref\n%d\n%%%%EOF\n", fileoff);
+    out_printf(out, "trailer\n<<\n/Size %d\n/Root %d 0 R\n/Info %d 0 R\n>>\n",
+	       olist->tail->number + 1, cat->number, info->number);
+    out_printf(out, "startxref\n%d\n%%%%EOF\n", fileoff);
+}
 
-    if (fp != stdout)
-	fclose(fp);
+static void free_object(object *o)
+{
+    sfree(o->main.text);
+    sfree(o->stream.text);
+    sfree(o->refs);
+    sfree(o->final);
+    sfree(o);
+}
 
-    sfree(filename);
+/*
+ * Free every object in a list, including any pdf_dedup() merged
+ * away.
+ */
+static void pdf_free_objects(objlist *olist)
+{
+    object *o, *next;
+
+    for (o = olist->head; o; o = next) {
+	next = o->next;
+	free_object(o);
+    }
+    for (o = olist->merged; o; o = next) {
+	next = o->next;
+	free_object(o);
+    }
+    olist->head = olist->tail = olist->merged = NULL;
 }
 
 object *new_object(objlist *list)
@@ -731,6 +858,8 @@ object *new_object(objlist *list)
     obj->main.pos = obj->main.size = 0;
     obj->stream.text = NULL;
     obj->stream.pos = obj->stream.size = 0;
+    obj->refs = NULL;
+    obj->nrefs = obj->refsize = 0;
 
     obj->number = list->number++;
 
@@ -743,6 +872,16 @@ object *new_object(objlist *list)
 
     obj->size = 0;
     obj->final = NULL;
+    obj->objstm = NULL;
+    obj->objstm_index = 0;
+    obj->dup = NULL;
+    obj->hash = 0;
+    obj->pagetree = FALSE;
+    obj->contents = NULL;
+    obj->part = PART_NONE;
+    obj->page = -1;
+    obj->mark = 0;
+    obj->shareid = 0;
 
     return obj;
 }
@@ -762,11 +901,365 @@ void objstream(object *o, char const *text)
     rdaddsc(&o->stream, text);
 }
 
+/*
+ * A reference to another object is only noted down when it's made,
+ * so that objects can be renumbered before the file is written.
+ * resolve_refs() puts the final numbers into the object's text.
+ */
 static void objref(object *o, object *dest)
+{
+    if (o->nrefs >= o->refsize) {
+	o->refsize = o->nrefs * 3 / 2 + 8;
+	o->refs = sresize(o->refs, o->refsize, objreference);
+    }
+    o->refs[o->nrefs].pos = o->main.pos;
+    o->refs[o->nrefs].dest = dest;
+    o->nrefs++;
+}
+
+static void resolve_refs(object *o)
+{
+    rdstringc rs = {0, 0, NULL};
+    char buf[40];
+    int i, pos = 0;
+
+    if (!o->nrefs)
+	return;
+    for (i = 0; i < o->nrefs; i++) {
+	rdaddsn(&rs, o->main.text + pos, o->refs[i].pos - pos);
+	sprintf(buf, "%d 0 R", o->refs[i].dest->number);
+	rdaddsc(&rs, buf);
+	pos = o->refs[i].pos;
+    }
+    if (o->main.text)
+	rdaddsc(&rs, o->main.text + pos);
+    sfree(o->main.text);
+    o->main = rs;
+    sfree(o->refs);
+    o->refs = NULL;
+    o->nrefs = o->refsize = 0;
+}
+
+/*
+ * Write a distance in internal units into a content stream buffer,
+ * followed by a space, and return where it ended.
+ */
+static char *pdf_units(char *p, int units)
+{
+    p += fmt_units(p, units);
+    *p++ = ' ';
+    return p;
+}
+
+/*
+ * Write a fragment's text into a TJ array, as strings separated by
+ * its kerning adjustments.
+ */
+static void pdf_kerned_text(object *cstr, text_fragment *frag)
 {
     char buf[40];
-    sprintf(buf, "%d 0 R", dest->number);
-    rdaddsc(&o->main, buf);
+    int i, pos = 0;
+
+    for (i = 0; i < frag->nkerns; i++) {
+	frag_kern const *k = &frag->kerns[i];
+
+	pdf_string_len(objstream, cstr, frag->text + pos, k->pos - pos);
+	sprintf(buf, "%g",
+		-k->kern * 1000.0 / (FUNITS_PER_PT * frag->fontsize));
+	objstream(cstr, buf);
+	pos = k->pos;
+    }
+    pdf_string_len(objstream, cstr, frag->text + pos, frag->len - pos);
+}
+
+/*
+ * Render one page's content stream. Everything this writes to
+ * belongs to the page's own content stream object, so it can be run
+ * on several pages at once.
+ */
+static void pdf_page_contents(void *vpages, int i)
+{
+    page_data *page = ((page_data **)vpages)[i];
+    object *cstr = ((object *)page->spare)->contents;
+    rect *r;
+    text_fragment *frag, *frag_end;
+    char buf[256], *p;
+    int x, y, lx, ly;
+
+    /*
+     * Render any rectangles on the page.
+     */
+    for (r = page->first_rect; r; r = r->next) {
+	p = pdf_units(buf, r->x);
+	p = pdf_units(p, r->y);
+	p = pdf_units(p, r->w);
+	p = pdf_units(p, r->h);
+	objstream_len(cstr, buf, p - buf);
+	objstream(cstr, "re f\n");
+    }
+
+    objstream(cstr, "BT\n");
+
+    /*
+     * PDF tracks two separate current positions: the position
+     * given in the `line matrix' and the position given in the
+     * `text matrix'. We must therefore track both as well.
+     * They start off at -1 (unset).
+     */
+    lx = ly = -1;
+    x = y = -1;
+
+    frag = page->first_text;
+    while (frag) {
+	/*
+	 * For compactness, I'm going to group text fragments
+	 * into subsequences that use the same font+size. So
+	 * first find the end of this subsequence.
+	 */
+	for (frag_end = frag;
+	     (frag_end &&
+	      frag_end->fe == frag->fe &&
+	      frag_end->fontsize == frag->fontsize);
+	     frag_end = frag_end->next);
+
+	/*
+	 * Now select the text fragment, and prepare to display
+	 * the text.
+	 */
+	objstream(cstr, "/");
+	objstream(cstr, frag->fe->name);
+	buf[0] = ' ';
+	p = buf + 1 + fmt_int(buf + 1, frag->fontsize);
+	objstream_len(cstr, buf, p - buf);
+	objstream(cstr, " Tf ");
+
+	while (frag && frag != frag_end) {
+	    /*
+	     * Place the text position for the first piece of
+	     * text.
+	     */
+	    if (lx < 0) {
+		strcpy(buf, "1 0 0 1 ");
+		p = pdf_units(buf + 8, frag->x);
+		p = pdf_units(p, frag->y);
+		strcpy(p, "Tm ");
+	    } else {
+		p = pdf_units(buf, frag->x - lx);
+		p = pdf_units(p, frag->y - ly);
+		strcpy(p, "Td ");
+	    }
+	    objstream_len(cstr, buf, p + 3 - buf);
+	    lx = x = frag->x;
+	    ly = y = frag->y;
+
+	    /*
+	     * See if we're going to use Tj (show a single
+	     * string) or TJ (show an array of strings with
+	     * x-spacings between them). We determine this by
+	     * seeing if there's more than one text fragment in
+	     * sequence with the same y-coordinate.
+	     */
+	    if (frag->nkerns || (frag->next && frag->next != frag_end &&
+				 frag->next->y == y)) {
+		/*
+		 * The TJ strategy.
+		 */
+		objstream(cstr, "[");
+		while (frag && frag != frag_end && frag->y == y) {
+		    if (frag->x != x) {
+			sprintf(buf, "%g",
+				(x - frag->x) * 1000.0 /
+				(FUNITS_PER_PT * frag->fontsize));
+			objstream(cstr, buf);
+		    }
+		    pdf_kerned_text(cstr, frag);
+		    x = frag->x + frag->width;
+		    frag = frag->next;
+		}
+		objstream(cstr, "]TJ\n");
+	    } else
+	    {
+		/*
+		 * The Tj strategy.
+		 */
+		pdf_string(objstream, cstr, frag->text);
+		objstream(cstr, "Tj\n");
+		frag = frag->next;
+	    }
+	}
+    }
+    objstream(cstr, "ET");
+}
+
+/*
+ * Assemble the final linear form of one object, compressing its
+ * stream if it has one. Each object is dealt with on its own, so
+ * this can run on several at once.
+ */
+static void pdf_finish_object(void *vobjs, int i)
+{
+    object *o = ((object **)vobjs)[i];
+    rdstringc rs = {0, 0, NULL};
+    char text[80];
+    deflate_compress_ctx *zcontext;
+    void *zbuf;
+    int zlen;
+
+    if (o->objstm)
+	return;
+
+    sprintf(text, "%d 0 obj\n", o->number);
+    rdaddsc(&rs, text);
+
+    if (o->stream.text) {
+	if (!o->main.text)
+	    rdaddsc(&o->main, "<<\n");
+#ifdef PDF_NOCOMPRESS
+	zlen = o->stream.pos;
+	zbuf = snewn(zlen, char);
+	memcpy(zbuf, o->stream.text, zlen);
+	sprintf(text, "/Length %d\n>>\n", zlen);
+#else
+	zcontext = deflate_compress_new(DEFLATE_TYPE_ZLIB);
+	deflate_compress_data(zcontext, o->stream.text, o->stream.pos,
+			      DEFLATE_END_OF_DATA, &zbuf, &zlen);
+	deflate_compress_free(zcontext);
+	sprintf(text, "/Filter/FlateDecode\n/Length %d\n>>\n", zlen);
+#endif
+	rdaddsc(&o->main, text);
+    }
+
+    assert(o->main.text);
+    rdaddsc(&rs, o->main.text);
+    sfree(o->main.text);
+    o->main.text = NULL;
+
+    if (rs.text[rs.pos-1] != '\n')
+	rdaddc(&rs, '\n');
+
+    if (o->stream.text) {
+	rdaddsc(&rs, "stream\n");
+	rdaddsn(&rs, zbuf, zlen);
+	rdaddsc(&rs, "\nendstream\n");
+	sfree(o->stream.text);
+	o->stream.text = NULL;
+	sfree(zbuf);
+    }
+
+    rdaddsc(&rs, "endobj\n");
+
+    o->final = rs.text;
+    o->size = rs.pos;
+}
+
+/*
+ * Merging identical objects. Two objects are the same if their
+ * text and streams are, and they refer to the same objects in the
+ * same places; so once some objects have been merged, others which
+ * refer to them may turn out to be the same as well, and we go
+ * round again until nothing changes.
+ */
+static object *obj_canonical(object *o)
+{
+    while (o->dup)
+	o = o->dup;
+    return o;
+}
+
+static unsigned long obj_hash(object const *o)
+{
+    unsigned long h = 2166136261UL;
+    int i;
+
+    for (i = 0; i < o->main.pos; i++)
+	h = ((h ^ (unsigned char)o->main.text[i]) * 16777619UL) & 0xFFFFFFFFUL;
+    for (i = 0; i < o->stream.pos; i++)
+	h = ((h ^ (unsigned char)o->stream.text[i]) * 16777619UL) & 0xFFFFFFFFUL;
+    for (i = 0; i < o->nrefs; i++)
+	h = ((h ^ (unsigned long)o->refs[i].dest->number) * 16777619UL)
+	    & 0xFFFFFFFFUL;
+    return h;
+}
+
+static int obj_cmp(void *av, void *bv)
+{
+    object const *a = (object const *)av;
+    object const *b = (object const *)bv;
+    int i, c;
+
+    if (a->hash != b->hash)
+	return a->hash < b->hash ? -1 : +1;
+    if (a->main.pos != b->main.pos)
+	return a->main.pos < b->main.pos ? -1 : +1;
+    if (a->stream.pos != b->stream.pos)
+	return a->stream.pos < b->stream.pos ? -1 : +1;
+    if (a->nrefs != b->nrefs)
+	return a->nrefs < b->nrefs ? -1 : +1;
+    if (a->main.pos && (c = memcmp(a->main.text, b->main.text,
+				   a->main.pos)) != 0)
+	return c;
+    if (a->stream.pos && (c = memcmp(a->stream.text, b->stream.text,
+				     a->stream.pos)) != 0)
+	return c;
+    for (i = 0; i < a->nrefs; i++) {
+	if (a->refs[i].pos != b->refs[i].pos)
+	    return a->refs[i].pos < b->refs[i].pos ? -1 : +1;
+	if (a->refs[i].dest != b->refs[i].dest)
+	    return (a->refs[i].dest->number < b->refs[i].dest->number ?
+		    -1 : +1);
+    }
+    return 0;
+}
+
+/*
+ * Remove every object which duplicates an earlier one, pointing
+ * references at the earlier one instead, and renumber what's left.
+ * Page objects are left alone, since each must appear in the page
+ * tree exactly once.
+ */
+static void pdf_dedup(objlist *olist)
+{
+    tree234 *objs;
+    object *o, *prev, *next, *canon;
+    int merged, i;
+
+    do {
+	merged = FALSE;
+	for (o = olist->head; o; o = o->next) {
+	    for (i = 0; i < o->nrefs; i++)
+		o->refs[i].dest = obj_canonical(o->refs[i].dest);
+	    if (o->contents)
+		o->contents = obj_canonical(o->contents);
+	    o->hash = obj_hash(o);
+	}
+
+	objs = newtree234(obj_cmp);
+	prev = NULL;
+	for (o = olist->head; o; o = next) {
+	    next = o->next;
+	    if (!o->pagetree && (canon = add234(objs, o)) != o) {
+		o->dup = canon;
+		prev->next = next;
+		if (olist->tail == o)
+		    olist->tail = prev;
+		sfree(o->main.text);
+		sfree(o->stream.text);
+		sfree(o->refs);
+		o->main.text = o->stream.text = NULL;
+		o->refs = NULL;
+		o->nrefs = 0;
+		o->next = olist->merged;
+		olist->merged = o;
+		merged = TRUE;
+	    } else
+		prev = o;
+	}
+	freetree234(objs);
+    } while (merged);
+
+    olist->number = 1;
+    for (o = olist->head; o; o = o->next)
+	o->number = olist->number++;
 }
 
 static void objdest(object *o, page_data *p) {
@@ -798,6 +1291,7 @@ static void make_pages_node(object *node, object *parent, page_data *first,
     page_data *page;
     char buf[80];
 
+    node->pagetree = TRUE;
     objtext(node, "<<\n/Type /Pages\n");
     if (parent) {
 	objtext(node, "/Parent ");
@@ -987,11 +1481,9 @@ static int make_outline(object *parent, outline_element *items, int n,
     return totalcount;
 }
 
-static int pdf_versionid(FILE *fp, word *words)
+static void pdf_versionid(rdstringc *rs, word *words)
 {
-    int ret;
-
-    ret = fprintf(fp, "%% ");
+    rdaddsc(rs, "% ");
 
     for (; words; words = words->next) {
 	char *text;
@@ -1021,14 +1513,11 @@ static int pdf_versionid(FILE *fp, word *words)
 	    break;
 	}
 
-	fputs(text, fp);
-	ret += strlen(text);
+	rdaddsc(rs, text);
 	sfree(text);
     }
 
-    ret += fprintf(fp, "\n");
-
-    return ret;
+    rdaddc(rs, '\n');
 }
 
 static void pdf_string_len(void (*add)(object *, char const *),
@@ -1058,3 +1547,570 @@ static void pdf_string(void (*add)(object *, char const *),
 {
     pdf_string_len(add, o, str, strlen(str));
 }
+
+/*
+ * Write a PDF 1.5 cross-reference stream, and the trailer that
+ * points to it, at fileoff. Each entry has a 1-byte type, then
+ * either a 4-byte file offset (type 1) or the number of the object
+ * stream holding the object (type 2), then a 2-byte generation
+ * number or index within the object stream.
+ */
+static void pdf_xref_stream(outsink *out, objlist *olist, int fileoff,
+			    object *cat, object *info)
+{
+    int number = olist->number;	       /* the stream's own number */
+    int size = number + 1;
+    unsigned char *entries, *e;
+    void *zbuf;
+    int zlen;
+    object *o;
+    char text[200];
+
+    entries = snewn(size * 7, unsigned char);
+    memset(entries, 0, size * 7);
+    entries[5] = entries[6] = 0xFF;    /* object 0: free, generation 65535 */
+    for (o = olist->head; o; o = o->next) {
+	unsigned long field2;
+	int field3;
+
+	e = entries + o->number * 7;
+	if (o->objstm) {
+	    e[0] = 2;
+	    field2 = o->objstm->number;
+	    field3 = o->objstm_index;
+	} else {
+	    e[0] = 1;
+	    field2 = o->fileoff;
+	    field3 = 0;
+	}
+	e[1] = (unsigned char)(field2 >> 24);
+	e[2] = (unsigned char)(field2 >> 16);
+	e[3] = (unsigned char)(field2 >> 8);
+	e[4] = (unsigned char)field2;
+	e[5] = (unsigned char)(field3 >> 8);
+	e[6] = (unsigned char)field3;
+    }
+    e = entries + number * 7;
+    e[0] = 1;
+    e[1] = (unsigned char)(fileoff >> 24);
+    e[2] = (unsigned char)(fileoff >> 16);
+    e[3] = (unsigned char)(fileoff >> 8);
+    e[4] = (unsigned char)fileoff;
+
+#ifdef PDF_NOCOMPRESS
+    zlen = size * 7;
+    zbuf = entries;
+    entries = NULL;
+    sprintf(text, "%d 0 obj\n<<\n/Type/XRef\n/Size %d\n/W[1 4 2]\n"
+	    "/Root %d 0 R\n/Info %d 0 R\n/Length %d\n>>\nstream\n",
+	    number, size, cat->number, info->number, zlen);
+#else
+    {
+	deflate_compress_ctx *zcontext;
+	zcontext = deflate_compress_new(DEFLATE_TYPE_ZLIB);
+	deflate_compress_data(zcontext, entries, size * 7,
+			      DEFLATE_END_OF_DATA, &zbuf, &zlen);
+	deflate_compress_free(zcontext);
+    }
+    sprintf(text, "%d 0 obj\n<<\n/Type/XRef\n/Size %d\n/W[1 4 2]\n"
+	    "/Root %d 0 R\n/Info %d 0 R\n/Filter/FlateDecode\n/Length %d\n"
+	    ">>\nstream\n", number, size, cat->number, info->number, zlen);
+#endif
+    out_puts(out, text);
+    out_write(out, zbuf, zlen);
+    out_printf(out, "\nendstream\nendobj\n");
+    out_printf(out, "startxref\n%d\n%%%%EOF\n", fileoff);
+
+    sfree(entries);
+    sfree(zbuf);
+}
+
+/*
+ * List the objects reachable from start, without going by way of
+ * another page or a node of the page tree, in the order they're
+ * found. Each is given the mark `mark', so that it's listed once.
+ */
+static int lin_reach(object *start, int mark, object ***list, int *size)
+{
+    int n = 0, i, j;
+
+    if (*size < 1) {
+	*size = 64;
+	*list = sresize(*list, *size, object *);
+    }
+    start->mark = mark;
+    (*list)[n++] = start;
+
+    for (i = 0; i < n; i++) {
+	object *o = (*list)[i];
+	for (j = 0; j < o->nrefs; j++) {
+	    object *dest = o->refs[j].dest;
+	    if (dest->mark == mark || dest->pagetree)
+		continue;
+	    if (n >= *size) {
+		*size = n * 3 / 2 + 64;
+		*list = sresize(*list, *size, object *);
+	    }
+	    dest->mark = mark;
+	    (*list)[n++] = dest;
+	}
+    }
+
+    return n;
+}
+
+/*
+ * The order of objects in a linearized file: by part, other pages'
+ * objects grouped by page with the page object first, and otherwise
+ * in the order they were made.
+ */
+static int lin_cmp(void const *av, void const *bv)
+{
+    object const *a = *(object * const *)av;
+    object const *b = *(object * const *)bv;
+
+    if (a->part != b->part)
+	return a->part < b->part ? -1 : +1;
+    if (a->part == PART_PAGE && a->page != b->page)
+	return a->page < b->page ? -1 : +1;
+    if ((a->part == PART_FIRSTPAGE || a->part == PART_PAGE) &&
+	a->pagetree != b->pagetree)
+	return a->pagetree ? -1 : +1;
+    if (a->number != b->number)
+	return a->number < b->number ? -1 : +1;
+    return 0;
+}
+
+/*
+ * Sort out which part of a linearized file each object belongs in,
+ * then put the object list in file order and renumber it. Objects
+ * up to the end of the first page are numbered after all the rest,
+ * so that they can have a cross-reference section of their own at
+ * the start of the file; one number there is kept back for the
+ * linearization dictionary and one for the hint stream.
+ */
+static linearization *pdf_linearize(objlist *olist, document *doc,
+				    object *cat)
+{
+    linearization *lin = snew(linearization);
+    object **list = NULL, **all, *o;
+    int size = 0, mark = 0, nobjs, nfirst, nmain, n, i, j;
+    int first, rest;
+    page_data *page;
+
+    lin->npages = 0;
+    for (page = doc->pages; page; page = page->next)
+	lin->npages++;
+    lin->pages = snewn(lin->npages, object *);
+    i = 0;
+    for (page = doc->pages; page; page = page->next) {
+	o = (object *)page->spare;
+	o->page = i;
+	lin->pages[i++] = o;
+    }
+
+    n = lin_reach(cat, ++mark, &list, &size);
+    for (i = 0; i < n; i++)
+	list[i]->part = PART_CATALOG;
+
+    n = lin_reach(lin->pages[0], ++mark, &list, &size);
+    for (i = 0; i < n; i++)
+	if (list[i]->part == PART_NONE)
+	    list[i]->part = PART_FIRSTPAGE;
+
+    for (j = 1; j < lin->npages; j++) {
+	n = lin_reach(lin->pages[j], ++mark, &list, &size);
+	for (i = 0; i < n; i++) {
+	    o = list[i];
+	    if (o->part != PART_NONE)
+		continue;
+	    if (o->page < 0)
+		o->page = j;
+	    else if (o->page != j)
+		o->part = PART_SHARED;
+	}
+    }
+
+    nobjs = nfirst = nmain = 0;
+    for (o = olist->head; o; o = o->next) {
+	if (o->part == PART_NONE)
+	    o->part = (o->page >= 0 ? PART_PAGE : PART_OTHER);
+	if (o->part == PART_FIRSTPAGE)
+	    nfirst++;
+	if (o->part >= PART_PAGE)
+	    nmain++;
+	nobjs++;
+    }
+
+    all = snewn(nobjs, object *);
+    i = 0;
+    for (o = olist->head; o; o = o->next)
+	all[i++] = o;
+    qsort(all, nobjs, sizeof(*all), lin_cmp);
+
+    lin->nmain = nmain;
+    lin->hintnum = 0;
+    first = nmain + 2;
+    rest = 1;
+    n = 0;
+    for (i = 0; i < nobjs; i++) {
+	o = all[i];
+	if (o->part <= PART_FIRSTPAGE) {
+	    if (o->part == PART_FIRSTPAGE && !lin->hintnum)
+		lin->hintnum = first++;
+	    o->number = first++;
+	} else
+	    o->number = rest++;
+	/*
+	 * The hint tables identify shared objects by their position
+	 * among the first page's objects followed by the shared
+	 * ones.
+	 */
+	if (o->part == PART_FIRSTPAGE || o->part == PART_SHARED)
+	    o->shareid = n++;
+	o->next = (i + 1 < nobjs ? all[i+1] : NULL);
+    }
+    olist->head = all[0];
+    olist->tail = all[nobjs-1];
+    olist->number = lin->size = first;
+    sfree(all);
+
+    lin->shareids = snewn(lin->npages, int *);
+    lin->nshareids = snewn(lin->npages, int);
+    lin->shareids[0] = NULL;
+    lin->nshareids[0] = 0;
+    for (j = 1; j < lin->npages; j++) {
+	int k = 0;
+
+	n = lin_reach(lin->pages[j], ++mark, &list, &size);
+	lin->shareids[j] = snewn(n, int);
+	for (i = 0; i < n; i++)
+	    if (list[i]->part == PART_FIRSTPAGE ||
+		list[i]->part == PART_SHARED)
+		lin->shareids[j][k++] = list[i]->shareid;
+	lin->nshareids[j] = k;
+    }
+
+    sfree(list);
+    return lin;
+}
+
+static void lin_free(linearization *lin)
+{
+    int j;
+
+    for (j = 0; j < lin->npages; j++)
+	sfree(lin->shareids[j]);
+    sfree(lin->shareids);
+    sfree(lin->nshareids);
+    sfree(lin->pages);
+    sfree(lin);
+}
+
+/*
+ * The hint tables are packed bit fields, most significant bit first.
+ */
+typedef struct {
+    rdstringc data;
+    int byte, nbits;
+} bitwriter;
+
+static void bits_put(bitwriter *bw, unsigned long value, int nbits)
+{
+    while (nbits-- > 0) {
+	bw->byte = (bw->byte << 1) | (int)((value >> nbits) & 1);
+	if (++bw->nbits == 8) {
+	    rdaddc(&bw->data, (char)bw->byte);
+	    bw->byte = bw->nbits = 0;
+	}
+    }
+}
+
+static void bits_align(bitwriter *bw)
+{
+    if (bw->nbits)
+	bits_put(bw, 0, 8 - bw->nbits);
+}
+
+static int bits_needed(unsigned long value)
+{
+    int n = 0;
+    while (value) {
+	n++;
+	value >>= 1;
+    }
+    return n;
+}
+
+/*
+ * Build the page offset and shared object hint tables, returning
+ * the offset of the latter in *shared. Object offsets in the tables
+ * are counted as if the hint stream weren't in the file, which is
+ * how the objects' fileoff fields are set when this is called.
+ */
+static void lin_hints(objlist *olist, linearization *lin, rdstringc *rs,
+		      int *shared)
+{
+    bitwriter bw;
+    object *o, *firstshared = NULL;
+    int np = lin->npages;
+    int *nobjs, *len, *coff, *clen;
+    int minobjs, maxobjs, minlen, maxlen, mincoff, maxcoff, minclen, maxclen;
+    int maxshared, maxid, ngroups, mingroup, maxgroup;
+    int i, j;
+
+    nobjs = snewn(np, int);
+    len = snewn(np, int);
+    coff = snewn(np, int);
+    clen = snewn(np, int);
+    for (j = 0; j < np; j++)
+	nobjs[j] = len[j] = coff[j] = clen[j] = 0;
+    ngroups = 0;
+    for (o = olist->head; o; o = o->next) {
+	j = -1;
+	if (o->part == PART_FIRSTPAGE)
+	    j = 0;
+	else if (o->part == PART_PAGE)
+	    j = o->page;
+	if (j >= 0) {
+	    nobjs[j]++;
+	    len[j] += o->size;
+	}
+	if (o->part == PART_FIRSTPAGE || o->part == PART_SHARED)
+	    ngroups++;
+	if (o->part == PART_SHARED && !firstshared)
+	    firstshared = o;
+    }
+    for (j = 0; j < np; j++) {
+	object *c = lin->pages[j]->contents;
+	if (c && (j == 0 ? c->part == PART_FIRSTPAGE :
+		  c->part == PART_PAGE && c->page == j)) {
+	    coff[j] = c->fileoff - lin->pages[j]->fileoff;
+	    clen[j] = c->size;
+	}
+    }
+
+    minobjs = maxobjs = nobjs[0];
+    minlen = maxlen = len[0];
+    mincoff = maxcoff = coff[0];
+    minclen = maxclen = clen[0];
+    maxshared = maxid = 0;
+    for (j = 0; j < np; j++) {
+	if (nobjs[j] < minobjs) minobjs = nobjs[j];
+	if (nobjs[j] > maxobjs) maxobjs = nobjs[j];
+	if (len[j] < minlen) minlen = len[j];
+	if (len[j] > maxlen) maxlen = len[j];
+	if (coff[j] < mincoff) mincoff = coff[j];
+	if (coff[j] > maxcoff) maxcoff = coff[j];
+	if (clen[j] < minclen) minclen = clen[j];
+	if (clen[j] > maxclen) maxclen = clen[j];
+	if (lin->nshareids[j] > maxshared) maxshared = lin->nshareids[j];
+	for (i = 0; i < lin->nshareids[j]; i++)
+	    if (lin->shareids[j][i] > maxid) maxid = lin->shareids[j][i];
+    }
+
+    bw.data = empty_rdstringc;
+    bw.byte = bw.nbits = 0;
+
+    /*
+     * Page offset hint table. Fractional positions of shared
+     * objects aren't given: their numerators have no bits.
+     */
+    bits_put(&bw, minobjs, 32);
+    bits_put(&bw, lin->pages[0]->fileoff, 32);
+    bits_put(&bw, bits_needed(maxobjs - minobjs), 16);
+    bits_put(&bw, minlen, 32);
+    bits_put(&bw, bits_needed(maxlen - minlen), 16);
+    bits_put(&bw, mincoff, 32);
+    bits_put(&bw, bits_needed(maxcoff - mincoff), 16);
+    bits_put(&bw, minclen, 32);
+    bits_put(&bw, bits_needed(maxclen - minclen), 16);
+    bits_put(&bw, bits_needed(maxshared), 16);
+    bits_put(&bw, bits_needed(maxid), 16);
+    bits_put(&bw, 0, 16);
+    bits_put(&bw, 1, 16);
+
+    for (j = 0; j < np; j++)
+	bits_put(&bw, nobjs[j] - minobjs, bits_needed(maxobjs - minobjs));
+    bits_align(&bw);
+    for (j = 0; j < np; j++)
+	bits_put(&bw, len[j] - minlen, bits_needed(maxlen - minlen));
+    bits_align(&bw);
+    for (j = 0; j < np; j++)
+	bits_put(&bw, lin->nshareids[j], bits_needed(maxshared));
+    bits_align(&bw);
+    for (j = 0; j < np; j++)
+	for (i = 0; i < lin->nshareids[j]; i++)
+	    bits_put(&bw, lin->shareids[j][i], bits_needed(maxid));
+    bits_align(&bw);
+    for (j = 0; j < np; j++)
+	bits_put(&bw, coff[j] - mincoff, bits_needed(maxcoff - mincoff));
+    bits_align(&bw);
+    for (j = 0; j < np; j++)
+	bits_put(&bw, clen[j] - minclen, bits_needed(maxclen - minclen));
+    bits_align(&bw);
+
+    /*
+     * Shared object hint table. Every group is a single object, and
+     * none has an MD5 signature.
+     */
+    *shared = bw.data.pos;
+    mingroup = maxgroup = -1;
+    for (o = olist->head; o; o = o->next)
+	if (o->part == PART_FIRSTPAGE || o->part == PART_SHARED) {
+	    if (mingroup < 0 || o->size < mingroup) mingroup = o->size;
+	    if (o->size > maxgroup) maxgroup = o->size;
+	}
+    bits_put(&bw, firstshared ? firstshared->number : 0, 32);
+    bits_put(&bw, firstshared ? firstshared->fileoff : 0, 32);
+    bits_put(&bw, nobjs[0], 32);
+    bits_put(&bw, ngroups, 32);
+    bits_put(&bw, 0, 16);
+    bits_put(&bw, mingroup, 32);
+    bits_put(&bw, bits_needed(maxgroup - mingroup), 16);
+    for (o = olist->head; o; o = o->next)
+	if (o->part == PART_FIRSTPAGE || o->part == PART_SHARED)
+	    bits_put(&bw, o->size - mingroup,
+		     bits_needed(maxgroup - mingroup));
+    bits_align(&bw);
+    for (i = 0; i < ngroups; i++)
+	bits_put(&bw, 0, 1);
+    bits_align(&bw);
+
+    *rs = bw.data;
+    sfree(nobjs);
+    sfree(len);
+    sfree(coff);
+    sfree(clen);
+}
+
+#define LINDICT_FMT "%d 0 obj\n<</Linearized 1/L %10d/H[%10d %10d]/O %d" \
+    "/E %10d/N %d/T %10d>>\nendobj\n"
+#define LINTRAILER_FMT "trailer\n<</Size %d/Root %d 0 R/Info %d 0 R" \
+    "/Prev %10d>>\nstartxref\n0\n%%%%EOF\n"
+
+/*
+ * Write a linearized file, from an object list which pdf_linearize()
+ * has put in order and whose objects are ready to write. The layout
+ * is: header; linearization dictionary; cross-reference section for
+ * the objects up to the end of the first page; catalogue and
+ * outlines; hint stream; first page; other pages; shared objects;
+ * everything else; main cross-reference section. Fixed-width
+ * numbers in the dictionary and the first trailer let us work out
+ * every offset before writing anything.
+ */
+static void pdf_write_linearized(outsink *out, objlist *olist,
+				 linearization *lin, object *info,
+				 rdstringc *vids)
+{
+    char header[40], lindict[200], text[200];
+    rdstringc hints, hintobj = {0, 0, NULL};
+    object *o, *cat = olist->head, *page1 = lin->pages[0];
+    int hdrlen, ldlen, xref1off, xref1len, hintoff, hintlen, shared;
+    int firstend, end, xrefoff, xreflen, T, nfirst;
+    void *zbuf;
+    int zlen;
+
+    nfirst = lin->size - (lin->nmain + 1);
+    hdrlen = sprintf(header, "%%PDF-1.3\n%% L\xc3\xba\xc3\xb0""a\n");
+    ldlen = sprintf(lindict, LINDICT_FMT, lin->nmain + 1,
+		    0, 0, 0, page1->number, 0, lin->npages, 0);
+    xref1off = hdrlen + ldlen;
+    xref1len = sprintf(text, "xref\n%d %d\n", lin->nmain + 1, nfirst);
+    xref1len += 20 * nfirst;
+    xref1len += sprintf(text, LINTRAILER_FMT, lin->size, cat->number,
+			info->number, 0);
+
+    /*
+     * Lay the objects out without the hint stream, and build it.
+     */
+    end = xref1off + xref1len;
+    hintoff = firstend = 0;
+    for (o = olist->head; o; o = o->next) {
+	if (o->part == PART_FIRSTPAGE && !hintoff)
+	    hintoff = end;
+	o->fileoff = end;
+	end += o->size;
+	if (o->part == PART_FIRSTPAGE)
+	    firstend = end;
+    }
+    lin_hints(olist, lin, &hints, &shared);
+
+#ifdef PDF_NOCOMPRESS
+    zlen = hints.pos;
+    zbuf = snewn(zlen, char);
+    memcpy(zbuf, hints.text, zlen);
+    sprintf(text, "%d 0 obj\n<</S %d/Length %d>>\nstream\n",
+	    lin->hintnum, shared, zlen);
+#else
+    {
+	deflate_compress_ctx *zcontext;
+	zcontext = deflate_compress_new(DEFLATE_TYPE_ZLIB);
+	deflate_compress_data(zcontext, hints.text, hints.pos,
+			      DEFLATE_END_OF_DATA, &zbuf, &zlen);
+	deflate_compress_free(zcontext);
+    }
+    sprintf(text, "%d 0 obj\n<</S %d/Filter/FlateDecode/Length %d>>\n"
+	    "stream\n", lin->hintnum, shared, zlen);
+#endif
+    rdaddsc(&hintobj, text);
+    rdaddsn(&hintobj, zbuf, zlen);
+    rdaddsc(&hintobj, "\nendstream\nendobj\n");
+    sfree(zbuf);
+    sfree(hints.text);
+    hintlen = hintobj.pos;
+
+    /*
+     * Now move everything after the hint stream up to make room
+     * for it, and see where that leaves the main cross-reference
+     * section.
+     */
+    for (o = olist->head; o; o = o->next)
+	if (o->part >= PART_FIRSTPAGE)
+	    o->fileoff += hintlen;
+    firstend += hintlen;
+    end += hintlen;
+    xrefoff = end + vids->pos;
+    T = xrefoff + sprintf(text, "xref\n0 %d", lin->nmain + 1);
+    xreflen = sprintf(text, "xref\n0 %d\n", lin->nmain + 1);
+    xreflen += 20 * (lin->nmain + 1);
+    xreflen += sprintf(text, "trailer\n<</Size %d>>\nstartxref\n%d\n"
+		       "%%%%EOF\n", lin->nmain + 1, xref1off);
+
+    ldlen = sprintf(lindict, LINDICT_FMT, lin->nmain + 1,
+		    xrefoff + xreflen, hintoff, hintlen, page1->number,
+		    firstend, lin->npages, T);
+    assert(ldlen == xref1off - hdrlen);
+
+    /*
+     * Write it all out.
+     */
+    out_write(out, header, hdrlen);
+    out_write(out, lindict, ldlen);
+    out_printf(out, "xref\n%d %d\n", lin->nmain + 1, nfirst);
+    out_printf(out, "%010d 00000 n \n", hdrlen);
+    for (o = olist->head; o && o->part <= PART_FIRSTPAGE; o = o->next) {
+	if (o == page1)
+	    out_printf(out, "%010d 00000 n \n", hintoff);
+	out_printf(out, "%010d 00000 n \n", o->fileoff);
+    }
+    out_printf(out, LINTRAILER_FMT, lin->size, cat->number, info->number,
+	       xrefoff);
+
+    for (o = olist->head; o; o = o->next) {
+	if (o == page1)
+	    out_write(out, hintobj.text, hintobj.pos);
+	out_write(out, o->final, o->size);
+    }
+    sfree(hintobj.text);
+    if (vids->pos)
+	out_write(out, vids->text, vids->pos);
+
+    out_printf(out, "xref\n0 %d\n", lin->nmain + 1);
+    out_printf(out, "0000000000 65535 f \n");
+    for (o = olist->head; o; o = o->next)
+	if (o->part >= PART_PAGE)
+	    out_printf(out, "%010d 00000 n \n", o->fileoff);
+    out_printf(out, "trailer\n<</Size %d>>\nstartxref\n%d\n%%%%EOF\n",
+	       lin->nmain + 1, xref1off);
+}
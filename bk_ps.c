@@ -12,9 +12,22 @@
 /* Absolute maxiumum characters per line, for use in DSC comments */
 #define PS_MAXWIDTH 255
 
-static void ps_comment(FILE *fp, char const *leader, word *words);
-static void ps_string_len(FILE *fp, int *cc, char const *str, int len);
-static void ps_string(FILE *fp, int *cc, char const *str);
+/*
+ * The pages to be rendered by ps_page(), and the results.
+ */
+typedef struct {
+    page_data **pages;
+    char **data;
+    int *len;
+} pspages;
+
+static void ps_comment(outsink *out, char const *leader, word *words);
+static void ps_page(void *vpages, int i);
+static int ps_first_subfont(document *doc, font_encoding *fe);
+static void ps_string_len(outsink *out, int *cc, char const *str, int len);
+static void ps_string(outsink *out, int *cc, char const *str);
+static void ps_rawtoken(outsink *out, int *cc, char const *text, int len);
+static char *ps_units(char *p, int units, char after);
 
 paragraph *ps_config_filename(char *filename)
 {
@@ -22,13 +35,13 @@ paragraph *ps_config_filename(char *filename)
 }
 
 void ps_backend(paragraph *sourceform, keywordlist *keywords,
-		indexdata *idx, void *vdoc) {
+		indexdata *idx, void *vdoc, outdest *od) {
     document *doc = (document *)vdoc;
     int font_index;
     font_encoding *fe;
     page_data *page;
     int pageno;
-    FILE *fp;
+    outsink *out;
     char *filename;
     paragraph *p;
     outline_element *oe;
@@ -48,39 +61,33 @@ void ps_backend(paragraph *sourceform, keywordlist *keywords,
 	}
     }
 
-    if (!strcmp(filename, "-"))
-	fp = stdout;
-    else
-	fp = fopen(filename, "w");
-    if (!fp) {
-	err_cantopenw(filename);
+    out = out_open(od, filename, 0);
+    if (!out)
 	return;
-    }
 
-    fprintf(fp, "%%!PS-Adobe-3.0\n");
-    fprintf(fp, "%%%%Creator: Halibut, %s\n", version);
-    fprintf(fp, "%%%%DocumentData: Clean7Bit\n");
-    fprintf(fp, "%%%%LanguageLevel: 1\n");
+    out_printf(out, "%%!PS-Adobe-3.0\n");
+    out_printf(out, "%%%%Creator: Halibut, %s\n", version);
+    out_printf(out, "%%%%DocumentData: Clean7Bit\n");
+    out_printf(out, "%%%%LanguageLevel: 1\n");
     for (pageno = 0, page = doc->pages; page; page = page->next)
 	pageno++;
-    fprintf(fp, "%%%%Pages: %d\n", pageno);
+    out_printf(out, "%%%%Pages: %d\n", pageno);
+    out_printf(out, "%%%%PageOrder: Ascend\n");
     for (p = sourceform; p; p = p->next)
 	if (p->type == para_Title)
-	    ps_comment(fp, "%%Title: ", p->words);
-    fprintf(fp, "%%%%DocumentNeededResources:\n");
+	    ps_comment(out, "%%Title: ", p->words);
+    out_printf(out, "%%%%DocumentNeededResources:\n");
     for (fe = doc->fonts->head; fe; fe = fe->next)
-	/* XXX This may request the same font multiple times. */
-	if (!fe->font->info->fontfile)
-	    fprintf(fp, "%%%%+ font %s\n", fe->font->info->name);
-    fprintf(fp, "%%%%DocumentSuppliedResources: procset Halibut 0 3\n");
+	if (!fe->font->info->fontfile && ps_first_subfont(doc, fe))
+	    out_printf(out, "%%%%+ font %s\n", fe->font->info->name);
+    out_printf(out, "%%%%DocumentSuppliedResources: procset Halibut 0 3\n");
     for (fe = doc->fonts->head; fe; fe = fe->next)
-	/* XXX This may request the same font multiple times. */
-	if (fe->font->info->fontfile)
-	    fprintf(fp, "%%%%+ font %s\n", fe->font->info->name);
-    fprintf(fp, "%%%%EndComments\n");
+	if (fe->font->info->fontfile && ps_first_subfont(doc, fe))
+	    out_printf(out, "%%%%+ font %s\n", fe->font->info->name);
+    out_printf(out, "%%%%EndComments\n");
 
-    fprintf(fp, "%%%%BeginProlog\n");
-    fprintf(fp, "%%%%BeginResource: procset Halibut 0 3\n");
+    out_printf(out, "%%%%BeginProlog\n");
+    out_printf(out, "%%%%BeginResource: procset Halibut 0 3\n");
     /*
      * Supply a prologue function which allows a reasonably
      * compressed representation of the text on the pages.
@@ -94,16 +101,16 @@ void ps_backend(paragraph *sourceform, keywordlist *keywords,
      *
      * "r" takes four arguments, and behaves like "rectfill".
      */
-    fprintf(fp,
-	    "/tdict 4 dict dup begin\n"
-	    "  /arraytype {aload pop scalefont setfont} bind def\n"
-	    "  /realtype {1 index moveto} bind def\n"
-	    "  /integertype /realtype load def\n"
-	    "  /stringtype {show} bind def\n"
-	    "end def\n"
-	    "/t { tdict begin {dup type exec} forall end pop } bind def\n"
-	    "/r { 4 2 roll moveto 1 index 0 rlineto 0 exch rlineto\n"
-	    "     neg 0 rlineto closepath fill } bind def\n");
+    out_printf(out,
+	       "/tdict 4 dict dup begin\n"
+	       "  /arraytype {aload pop scalefont setfont} bind def\n"
+	       "  /realtype {1 index moveto} bind def\n"
+	       "  /integertype /realtype load def\n"
+	       "  /stringtype {show} bind def\n"
+	       "end def\n"
+	       "/t { tdict begin {dup type exec} forall end pop } bind def\n"
+	       "/r { 4 2 roll moveto 1 index 0 rlineto 0 exch rlineto\n"
+	       "     neg 0 rlineto closepath fill } bind def\n");
     /*
      * pdfmark wrappers
      *
@@ -115,31 +122,31 @@ void ps_backend(paragraph *sourceform, keywordlist *keywords,
      *
      * They all do nothing if pdfmark is undefined.
      */
-    fprintf(fp,
-	    "/pdfmark where { pop\n"
-	    "  /p { [ /Dest 3 -1 roll /View [ /XYZ null null null ]\n"
-	    "       /DEST pdfmark } bind def\n"
-	    "  /x { [ /Dest 3 -1 roll /Rect 5 -1 roll /Border [0 0 0]\n"
-	    "       /Subtype /Link /ANN pdfmark } bind def\n"
-	    "  /u { 2 dict dup /Subtype /URI put dup /URI 4 -1 roll put\n"
-	    "       [ /Action 3 -1 roll /Rect 5 -1 roll /Border [0 0 0]\n"
-	    "       /Subtype /Link /ANN pdfmark } bind def\n"
-	    "  /o { [ /Count 3 -1 roll /Dest 5 -1 roll /Title 7 -1 roll\n"
-	    "       /OUT pdfmark } bind def\n"
-	    "  /m /pdfmark load def\n"
-	    "}\n");
-    fprintf(fp, "{\n"
-	    "  /p { pop } bind def\n"
-	    "  /x { pop pop } bind def\n"
-	    "  /u /x load def\n"
-	    "  /o { pop pop pop } bind def\n"
-	    "  /m /cleartomark load def\n"
-	    "} ifelse\n");
-
-    fprintf(fp, "%%%%EndResource\n");
-    fprintf(fp, "%%%%EndProlog\n");
-
-    fprintf(fp, "%%%%BeginSetup\n");
+    out_printf(out,
+	       "/pdfmark where { pop\n"
+	       "  /p { [ /Dest 3 -1 roll /View [ /XYZ null null null ]\n"
+	       "       /DEST pdfmark } bind def\n"
+	       "  /x { [ /Dest 3 -1 roll /Rect 5 -1 roll /Border [0 0 0]\n"
+	       "       /Subtype /Link /ANN pdfmark } bind def\n"
+	       "  /u { 2 dict dup /Subtype /URI put dup /URI 4 -1 roll put\n"
+	       "       [ /Action 3 -1 roll /Rect 5 -1 roll /Border [0 0 0]\n"
+	       "       /Subtype /Link /ANN pdfmark } bind def\n"
+	       "  /o { [ /Count 3 -1 roll /Dest 5 -1 roll /Title 7 -1 roll\n"
+	       "       /OUT pdfmark } bind def\n"
+	       "  /m /pdfmark load def\n"
+	       "}\n");
+    out_printf(out, "{\n"
+	       "  /p { pop } bind def\n"
+	       "  /x { pop pop } bind def\n"
+	       "  /u /x load def\n"
+	       "  /o { pop pop pop } bind def\n"
+	       "  /m /cleartomark load def\n"
+	       "} ifelse\n");
+
+    out_printf(out, "%%%%EndResource\n");
+    out_printf(out, "%%%%EndProlog\n");
+
+    out_printf(out, "%%%%BeginSetup\n");
 
     /*
      * Assign a destination name to each page for pdfmark purposes.
@@ -158,7 +165,7 @@ void ps_backend(paragraph *sourceform, keywordlist *keywords,
      */
     for (p = sourceform; p; p = p->next)
 	if (p->type == para_VersionID)
-	    ps_comment(fp, "% ", p->words);
+	    ps_comment(out, "% ", p->words);
 
     cc = 0;
     /*
@@ -167,13 +174,13 @@ void ps_backend(paragraph *sourceform, keywordlist *keywords,
      * but that would require us to have a way of getting the name of
      * the page size given its dimensions.
      */
-    ps_token(fp, &cc, "/setpagedevice where {\n");
-    ps_token(fp, &cc, "  pop 2 dict dup /PageSize [%g %g] put setpagedevice\n",
+    ps_token(out, &cc, "/setpagedevice where {\n");
+    ps_token(out, &cc, "  pop 2 dict dup /PageSize [%g %g] put setpagedevice\n",
 	     doc->paper_width / FUNITS_PER_PT,
 	     doc->paper_height / FUNITS_PER_PT);
-    ps_token(fp, &cc, "} if\n");
+    ps_token(out, &cc, "} if\n");
 
-    ps_token(fp, &cc, "[/PageMode/UseOutlines/DOCVIEW m\n");
+    ps_token(out, &cc, "[/PageMode/UseOutlines/DOCVIEW m\n");
     noe = doc->n_outline_elements;
     for (oe = doc->outline_elements; noe; oe++, noe--) {
 	char *title;
@@ -181,9 +188,9 @@ void ps_backend(paragraph *sourceform, keywordlist *keywords,
 
 	title = pdf_outline_convert(oe->pdata->outline_title, &titlelen);
 	if (oe->level == 0) {
-	    ps_token(fp, &cc, "[/Title");
-	    ps_string_len(fp, &cc, title, titlelen);
-	    ps_token(fp, &cc, "/DOCINFO m\n");
+	    ps_token(out, &cc, "[/Title");
+	    ps_string_len(out, &cc, title, titlelen);
+	    ps_token(out, &cc, "/DOCINFO m\n");
 	}
 
 	count = 0;
@@ -192,24 +199,51 @@ void ps_backend(paragraph *sourceform, keywordlist *keywords,
 		count++;
 	if (oe->level > 0) count = -count;
 
-	ps_string_len(fp, &cc, title, titlelen);
+	ps_string_len(out, &cc, title, titlelen);
 	sfree(title);
-	ps_token(fp, &cc, "%s %d o\n",
+	ps_token(out, &cc, "%s %d o\n",
 		(char *)oe->pdata->first->page->spare, count);
     }
 
     for (fe = doc->fonts->head; fe; fe = fe->next) {
-	/* XXX This may request the same font multiple times. */
+	/*
+	 * Each font goes in only once, however many subfonts use it,
+	 * so that a TrueType font can be cut down to just the glyphs
+	 * they use between them.
+	 */
+	if (!ps_first_subfont(doc, fe))
+	    continue;
 	if (fe->font->info->fontfile) {
-	    fprintf(fp, "%%%%BeginResource: font %s\n", fe->font->info->name);
-	    if (fe->font->info->filetype == TYPE1)
-		pf_writeps(fe->font->info, fp);
-	    else
-		sfnt_writeps(fe->font->info, fp);
-	    fprintf(fp, "%%%%EndResource\n");
+	    font_info const *fi = fe->font->info;
+	    font_encoding *fe2;
+
+	    out_printf(out, "%%%%BeginResource: font %s\n", fi->name);
+	    if (fi->filetype == TYPE1) {
+		pf_writeps(fi, out);
+	    } else {
+		glyph *glyphs = NULL;
+		int i, nglyphs = 0, glyphsize = 0;
+
+		for (fe2 = fe; fe2; fe2 = fe2->next) {
+		    if (fe2->font->info != fi)
+			continue;
+		    for (i = 0; i < 256; i++) {
+			if (fe2->vector[i] == NOGLYPH)
+			    continue;
+			if (nglyphs >= glyphsize) {
+			    glyphsize = nglyphs + 256;
+			    glyphs = sresize(glyphs, glyphsize, glyph);
+			}
+			glyphs[nglyphs++] = fe2->vector[i];
+		    }
+		}
+		sfnt_writeps(fi, glyphs, nglyphs, out);
+		sfree(glyphs);
+	    }
+	    out_printf(out, "%%%%EndResource\n");
 	} else {
-	    fprintf(fp, "%%%%IncludeResource: font %s\n",
-		    fe->font->info->name);
+	    out_printf(out, "%%%%IncludeResource: font %s\n",
+		       fe->font->info->name);
 	}
     }
 
@@ -224,99 +258,174 @@ void ps_backend(paragraph *sourceform, keywordlist *keywords,
 	sprintf(fname, "f%d", font_index++);
 	fe->name = dupstr(fname);
 
-	ps_token(fp, &cc, "/%s findfont dup length dict begin\n",
+	ps_token(out, &cc, "/%s findfont dup length dict begin\n",
 	    fe->font->info->name);
-	ps_token(fp, &cc, "{1 index /FID ne {def} {pop pop} ifelse} forall\n");
-	ps_token(fp, &cc, "/Encoding [\n");
+	ps_token(out, &cc, "{1 index /FID ne {def} {pop pop} ifelse} forall\n");
+	ps_token(out, &cc, "/Encoding [\n");
 	for (i = 0; i < 256; i++)
-	    ps_token(fp, &cc, "/%s", glyph_extern(fe->vector[i]));
-	ps_token(fp, &cc, "] def\n");
-	ps_token(fp, &cc, "currentdict end\n");
-	ps_token(fp, &cc, "/fontname-%s exch definefont /%s exch def\n",
+	    ps_token(out, &cc, "/%s", glyph_extern(fe->vector[i]));
+	ps_token(out, &cc, "] def\n");
+	ps_token(out, &cc, "currentdict end\n");
+	ps_token(out, &cc, "/fontname-%s exch definefont /%s exch def\n",
 		 fe->name, fe->name);
     }
-    fprintf(fp, "%%%%EndSetup\n");
+    out_printf(out, "%%%%EndSetup\n");
 
     /*
-     * Output the text and graphics.
+     * Output the text and graphics. Each page is rendered into a
+     * buffer of its own, on as many threads as we're allowed, and
+     * the buffers are then written out in order.
      */
-    pageno = 0;
-    for (page = doc->pages; page; page = page->next) {
-	text_fragment *frag, *frag_end;
-	rect *r;
-	xref *xr;
-	font_encoding *fe;
-	int fs;
-
-	pageno++;
-	fprintf(fp, "%%%%Page: %d %d\n", pageno, pageno);
-	cc = 0;
-	ps_token(fp, &cc, "save %s p\n", (char *)page->spare);
-	
-	for (xr = page->first_xref; xr; xr = xr->next) {
-	    ps_token(fp, &cc, "[%g %g %g %g]",
-		    xr->lx/FUNITS_PER_PT, xr->by/FUNITS_PER_PT,
-		    xr->rx/FUNITS_PER_PT, xr->ty/FUNITS_PER_PT);
-	    if (xr->dest.type == PAGE) {
-		ps_token(fp, &cc, "%s x\n", (char *)xr->dest.page->spare);
-	    } else {
-		ps_string(fp, &cc, xr->dest.url);
-		ps_token(fp, &cc, "u\n");
-	    }
+    {
+	pspages pages;
+	int i, npages;
+
+	npages = 0;
+	for (page = doc->pages; page; page = page->next)
+	    npages++;
+	pages.pages = snewn(npages, page_data *);
+	pages.data = snewn(npages, char *);
+	pages.len = snewn(npages, int);
+	for (i = 0, page = doc->pages; page; page = page->next)
+	    pages.pages[i++] = page;
+
+	run_in_parallel(npages, ps_page, &pages);
+
+	for (i = 0; i < npages; i++) {
+	    out_write(out, pages.data[i], pages.len[i]);
+	    sfree(pages.data[i]);
 	}
+	sfree(pages.pages);
+	sfree(pages.data);
+	sfree(pages.len);
+    }
 
-	for (r = page->first_rect; r; r = r->next) {
-	    ps_token(fp, &cc, "%g %g %g %g r\n",
-		    r->x / FUNITS_PER_PT, r->y / FUNITS_PER_PT,
-		    r->w / FUNITS_PER_PT, r->h / FUNITS_PER_PT);
-	}
+    out_printf(out, "%%%%EOF\n");
 
-	frag = page->first_text;
-	fe = NULL;
-	fs = -1;
-	while (frag) {
-	    /*
-	     * Collect all the adjacent text fragments with the
-	     * same y-coordinate.
-	     */
-	    for (frag_end = frag;
-		 frag_end && frag_end->y == frag->y;
-		 frag_end = frag_end->next);
+    out_close(out);
 
-	    ps_token(fp, &cc, "%g[", frag->y / FUNITS_PER_PT);
+    for (page = doc->pages; page; page = page->next) {
+	sfree(page->spare);
+	page->spare = NULL;
+    }
+    for (fe = doc->fonts->head; fe; fe = fe->next) {
+	sfree(fe->name);
+	fe->name = NULL;
+    }
 
-	    while (frag && frag != frag_end) {
+    sfree(filename);
+}
 
-		if (frag->fe != fe || frag->fontsize != fs)
-		    ps_token(fp, &cc, "[%s %d]",
-			     frag->fe->name, frag->fontsize);
-		fe = frag->fe;
-		fs = frag->fontsize;
+/*
+ * Report whether fe is the first subfont of its font. A font which
+ * is split into several subfonts is only listed, supplied or
+ * requested once.
+ */
+static int ps_first_subfont(document *doc, font_encoding *fe) {
+    font_encoding *fe2;
 
-		ps_token(fp, &cc, "%g", frag->x/FUNITS_PER_PT);
-		ps_string(fp, &cc, frag->text);
+    for (fe2 = doc->fonts->head; fe2 != fe; fe2 = fe2->next)
+	if (fe2->font->info == fe->font->info)
+	    return FALSE;
+    return TRUE;
+}
 
-		frag = frag->next;
+/*
+ * Render one page, from its %%Page comment to its showpage, into
+ * its own buffer. Pages are independent of each other, so this can
+ * run on several at once.
+ */
+static void ps_page(void *vpages, int i) {
+    pspages *pages = (pspages *)vpages;
+    page_data *page = pages->pages[i];
+    outsink *out = out_open_buffer();
+    text_fragment *frag, *frag_end;
+    rect *r;
+    xref *xr;
+    font_encoding *fe;
+    int fs;
+    char buf[4 * NUMBUF_SIZE + 4], *p;
+    int cc = 0, pos, k;
+
+    out_printf(out, "%%%%Page: %d %d\n", i + 1, i + 1);
+    ps_token(out, &cc, "save %s p\n", (char *)page->spare);
+
+    for (xr = page->first_xref; xr; xr = xr->next) {
+	buf[0] = '[';
+	p = ps_units(buf + 1, xr->lx, ' ');
+	p = ps_units(p, xr->by, ' ');
+	p = ps_units(p, xr->rx, ' ');
+	p = ps_units(p, xr->ty, ']');
+	ps_rawtoken(out, &cc, buf, p - buf);
+	if (xr->dest.type == PAGE) {
+	    ps_token(out, &cc, "%s x\n", (char *)xr->dest.page->spare);
+	} else {
+	    ps_string(out, &cc, xr->dest.url);
+	    ps_token(out, &cc, "u\n");
+	}
+    }
+
+    for (r = page->first_rect; r; r = r->next) {
+	p = ps_units(buf, r->x, ' ');
+	p = ps_units(p, r->y, ' ');
+	p = ps_units(p, r->w, ' ');
+	p = ps_units(p, r->h, ' ');
+	strcpy(p, "r\n");
+	ps_rawtoken(out, &cc, buf, p + 2 - buf);
+    }
+
+    frag = page->first_text;
+    fe = NULL;
+    fs = -1;
+    while (frag) {
+	/*
+	 * Collect all the adjacent text fragments with the
+	 * same y-coordinate.
+	 */
+	for (frag_end = frag;
+	     frag_end && frag_end->y == frag->y;
+	     frag_end = frag_end->next);
+
+	p = ps_units(buf, frag->y, '[');
+	ps_rawtoken(out, &cc, buf, p - buf);
+
+	while (frag && frag != frag_end) {
+
+	    if (frag->fe != fe || frag->fontsize != fs)
+		ps_token(out, &cc, "[%s %d]",
+			 frag->fe->name, frag->fontsize);
+	    fe = frag->fe;
+	    fs = frag->fontsize;
+
+	    /*
+	     * A kerned fragment is shown in pieces, each at its own
+	     * position.
+	     */
+	    pos = 0;
+	    for (k = 0; k <= frag->nkerns; k++) {
+		int end = (k < frag->nkerns ? frag->kerns[k].pos : frag->len);
+
+		p = ps_units(buf, k ? frag->kerns[k-1].x : frag->x, '\0');
+		ps_rawtoken(out, &cc, buf, p - buf);
+		ps_string_len(out, &cc, frag->text + pos, end - pos);
+		pos = end;
 	    }
 
-	    ps_token(fp, &cc, "]t\n");
+	    frag = frag->next;
 	}
 
-	ps_token(fp, &cc, "restore showpage\n");
+	ps_token(out, &cc, "]t\n");
     }
 
-    fprintf(fp, "%%%%EOF\n");
-
-    if (fp != stdout)
-	fclose(fp);
+    ps_token(out, &cc, "restore showpage\n");
 
-    sfree(filename);
+    pages->data[i] = out_close_buffer(out, &pages->len[i]);
 }
 
-static void ps_comment(FILE *fp, char const *leader, word *words) {
+static void ps_comment(outsink *out, char const *leader, word *words) {
     int cc = 0;
 
-    cc += fprintf(fp, "%s", leader);
+    cc += out_printf(out, "%s", leader);
 
     for (; words; words = words->next) {
 	char *text;
@@ -348,28 +457,54 @@ static void ps_comment(FILE *fp, char const *leader, word *words) {
 
 	if (cc + strlen(text) > PS_MAXWIDTH)
 	    text[PS_MAXWIDTH - cc] = 0;
-	cc += fprintf(fp, "%s", text);
+	cc += out_printf(out, "%s", text);
 	sfree(text);
     }
 
-    fprintf(fp, "\n");
+    out_printf(out, "\n");
 }
 
-void ps_token(FILE *fp, int *cc, char const *fmt, ...) {
+void ps_token(outsink *out, int *cc, char const *fmt, ...) {
     va_list ap;
 
     va_start(ap, fmt);
     if (*cc >= PS_WIDTH - 10) {
-	fprintf(fp, "\n");
+	out_printf(out, "\n");
 	*cc = 0;
     }
-    *cc += vfprintf(fp, fmt, ap);
+    *cc += out_vprintf(out, fmt, ap);
     /* Assume that \n only occurs at the end of a string */
     if (fmt[strlen(fmt) - 1] == '\n')
 	*cc = 0;
 }
 
-static void ps_string_len(FILE *fp, int *cc, char const *str, int len) {
+/*
+ * Like ps_token(), for a token which is already formatted.
+ */
+static void ps_rawtoken(outsink *out, int *cc, char const *text, int len) {
+    if (*cc >= PS_WIDTH - 10) {
+	out_putc(out, '\n');
+	*cc = 0;
+    }
+    out_write(out, text, len);
+    *cc += len;
+    if (len > 0 && text[len - 1] == '\n')
+	*cc = 0;
+}
+
+/*
+ * Write a distance in internal units into buf as points, followed
+ * by the character `after' unless that's zero, and return where it
+ * ended.
+ */
+static char *ps_units(char *p, int units, char after) {
+    p += fmt_units(p, units);
+    if (after)
+	*p++ = after;
+    return p;
+}
+
+static void ps_string_len(outsink *out, int *cc, char const *str, int len) {
     char const *c;
     int score = 0;
 
@@ -382,33 +517,33 @@ static void ps_string_len(FILE *fp, int *cc, char const *str, int len) {
 	    score -= 1;
     }
     if (score > 0) {
-	ps_token(fp, cc, "<");
+	ps_token(out, cc, "<");
 	for (c = str; c < str+len; c++) {
-	    ps_token(fp, cc, "%02X", 0xFF & (int)*c);
+	    ps_token(out, cc, "%02X", 0xFF & (int)*c);
 	}
-	ps_token(fp, cc, ">");
+	ps_token(out, cc, ">");
     } else {
-	*cc += fprintf(fp, "(");
+	*cc += out_printf(out, "(");
 	for (c = str; c < str+len; c++) {
 	    if (*cc >= PS_WIDTH - 4) {
-		fprintf(fp, "\\\n");
+		out_printf(out, "\\\n");
 		*cc = 0;
 	    }
 	    if (*c < ' ' || *c > '~') {
-		*cc += fprintf(fp, "\\%03o", 0xFF & (int)*c);
+		*cc += out_printf(out, "\\%03o", 0xFF & (int)*c);
 	    } else {
 		if (*c == '(' || *c == ')' || *c == '\\') {
-		    fputc('\\', fp);
+		    out_putc(out, '\\');
 		    (*cc)++;
 		}
-		fputc(*c, fp);
+		out_putc(out, *c);
 		(*cc)++;
 	    }
 	}
-	*cc += fprintf(fp, ")");
+	*cc += out_printf(out, ")");
     }
 }
 
-static void ps_string(FILE *fp, int *cc, char const *str) {
-    ps_string_len(fp, cc, str, strlen(str));
+static void ps_string(outsink *out, int *cc, char const *str) {
+    ps_string_len(out, cc, str, strlen(str));
 }
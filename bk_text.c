@@ -28,12 +28,20 @@ typedef struct {
     wchar_t *lquote, *rquote, *rule;
     char *filename;
     wchar_t *listsuffix, *startemph, *endemph, *startstrong, *endstrong;
+    /* display widths of the above, cached for text_width() */
+    int lquote_wid, rquote_wid, startemph_wid, endemph_wid;
+    int startstrong_wid, endstrong_wid;
 } textconfig;
 
+#define TEXT_OUTBUF_SIZE 65536
+
 typedef struct {
-    FILE *fp;
+    outsink *out;
     int charset;
     charset_state state;
+    int ascii_ok;		       /* printable ASCII encodes as itself */
+    char *outbuf;
+    int outlen;			       /* bytes waiting in outbuf */
 } textfile;
 
 static void text_heading(textfile *, word *, word *, word *, alignstruct,
@@ -46,6 +54,7 @@ static void text_versionid(textfile *, word *, textconfig *);
 
 static void text_output(textfile *, const wchar_t *);
 static void text_output_many(textfile *, int, wchar_t);
+static void text_flush(textfile *);
 
 static alignment utoalign(wchar_t *p) {
     if (!ustricmp(p, L"centre") || !ustricmp(p, L"center"))
@@ -309,6 +318,13 @@ static textconfig text_configure(paragraph *source) {
 	   !cvt_ok(ret.charset, ret.rule))
 	ret.rule = uadv(ret.rule);
 
+    ret.lquote_wid = ustrwid(ret.lquote, ret.charset);
+    ret.rquote_wid = ustrwid(ret.rquote, ret.charset);
+    ret.startemph_wid = ustrwid(ret.startemph, ret.charset);
+    ret.endemph_wid = ustrwid(ret.endemph, ret.charset);
+    ret.startstrong_wid = ustrwid(ret.startstrong, ret.charset);
+    ret.endstrong_wid = ustrwid(ret.endstrong, ret.charset);
+
     return ret;
 }
 
@@ -318,7 +334,7 @@ paragraph *text_config_filename(char *filename)
 }
 
 void text_backend(paragraph *sourceform, keywordlist *keywords,
-		  indexdata *idx, void *unused) {
+		  indexdata *idx, void *unused, outdest *od) {
     paragraph *p;
     textconfig conf;
     word *prefix, *body, *wp;
@@ -337,16 +353,14 @@ void text_backend(paragraph *sourceform, keywordlist *keywords,
     /*
      * Open the output file.
      */
-    if (!strcmp(conf.filename, "-"))
-	tf.fp = stdout;
-    else
-	tf.fp = fopen(conf.filename, "w");
-    if (!tf.fp) {
-	err_cantopenw(conf.filename);
+    tf.out = out_open(od, conf.filename, 0);
+    if (!tf.out)
 	return;
-    }
     tf.charset = conf.charset;
     tf.state = charset_init_state;
+    tf.ascii_ok = ascii_ok(conf.charset);
+    tf.outbuf = snewn(TEXT_OUTBUF_SIZE, char);
+    tf.outlen = 0;
 
     /* Do the title */
     for (p = sourceform; p; p = p->next)
@@ -477,42 +491,140 @@ void text_backend(paragraph *sourceform, keywordlist *keywords,
      * Tidy up
      */
     text_output(&tf, NULL);	       /* end charset conversion */
-    if (tf.fp != stdout)
-	fclose(tf.fp);
+    text_flush(&tf);
+    sfree(tf.outbuf);
+    out_close(tf.out);
     sfree(conf.asect);
     sfree(conf.filename);
 }
 
+/*
+ * Output goes through a large buffer in the textfile. Plain ASCII
+ * (in any charset which encodes it as itself, and only while the
+ * charset is in its initial shift state) and all of UTF-8 are
+ * encoded directly into the buffer; anything else goes through
+ * libcharset.
+ */
+static void text_flush(textfile *tf)
+{
+    if (tf->outlen > 0)
+	out_write(tf->out, tf->outbuf, tf->outlen);
+    tf->outlen = 0;
+}
+
+static int text_in_init_state(textfile *tf)
+{
+    return !memcmp(&tf->state, &charset_init_state, sizeof(tf->state));
+}
+
+/*
+ * Encode as much of a string as the fast paths can handle, and
+ * return how many characters that was.
+ */
+static int text_output_fast(textfile *tf, const wchar_t *s, int len)
+{
+    int i = 0;
+
+    if (tf->charset == CS_UTF8) {
+	while (i < len) {
+	    int n;
+	    if (tf->outlen > TEXT_OUTBUF_SIZE - 4)
+		text_flush(tf);
+	    n = utf8_encode(tf->outbuf + tf->outlen, s[i]);
+	    if (!n)
+		break;
+	    tf->outlen += n;
+	    i++;
+	}
+    } else if (tf->ascii_ok && text_in_init_state(tf)) {
+	while (i < len && s[i] >= 0x20 && s[i] < 0x7F) {
+	    if (tf->outlen == TEXT_OUTBUF_SIZE)
+		text_flush(tf);
+	    tf->outbuf[tf->outlen++] = (char)s[i++];
+	}
+    }
+    return i;
+}
+
+static void text_output_slow(textfile *tf, const wchar_t **sp, int *len)
+{
+    int ret;
+
+    if (tf->outlen > TEXT_OUTBUF_SIZE - 256)
+	text_flush(tf);
+    ret = charset_from_unicode(sp, len, tf->outbuf + tf->outlen,
+			       TEXT_OUTBUF_SIZE - tf->outlen,
+			       tf->charset, &tf->state, NULL);
+    tf->outlen += ret;
+}
+
 static void text_output(textfile *tf, const wchar_t *s)
 {
-    char buf[256];
-    int ret, len;
-    const wchar_t **sp;
+    int len, n;
 
     if (!s) {
-	sp = NULL;
 	len = 1;
-    } else {
-	sp = &s;
-	len = ustrlen(s);
+	text_output_slow(tf, NULL, &len);
+	return;
     }
 
+    len = ustrlen(s);
     while (len > 0) {
-	ret = charset_from_unicode(sp, &len, buf, lenof(buf),
-				   tf->charset, &tf->state, NULL);
-	if (!sp)
-	    len = 0;
-	fwrite(buf, 1, ret, tf->fp);
+	n = text_output_fast(tf, s, len);
+	s += n;
+	len -= n;
+	if (len > 0) {
+	    /*
+	     * Hand libcharset just the one character the fast path
+	     * couldn't do, then go back to the fast path.
+	     */
+	    int one = 1;
+	    while (one > 0)
+		text_output_slow(tf, &s, &one);
+	    len--;
+	}
     }
 }
 
+/*
+ * Output n copies of c. We encode it once, and then (as long as
+ * that left the charset in its initial state, so that the bytes
+ * are the same each time) copy the encoded bytes n times.
+ */
 static void text_output_many(textfile *tf, int n, wchar_t c)
 {
     wchar_t s[2];
+    char enc[16];
+    int start, enclen;
+
+    if (n <= 0)
+	return;
+
     s[0] = c;
     s[1] = L'\0';
-    while (n-- > 0)
-	text_output(tf, s);
+
+    if (tf->outlen > TEXT_OUTBUF_SIZE - 256)
+	text_flush(tf);
+    start = tf->outlen;
+    text_output(tf, s);
+    n--;
+    enclen = tf->outlen - start;
+    if (enclen <= 0 || enclen > (int)sizeof(enc) || !text_in_init_state(tf)) {
+	while (n-- > 0)
+	    text_output(tf, s);
+	return;
+    }
+    memcpy(enc, tf->outbuf + start, enclen);
+
+    while (n-- > 0) {
+	if (tf->outlen > TEXT_OUTBUF_SIZE - enclen)
+	    text_flush(tf);
+	if (enclen == 1)
+	    tf->outbuf[tf->outlen] = enc[0];
+	else
+	    memcpy(tf->outbuf + tf->outlen, enc, enclen);
+	tf->outlen += enclen;
+    }
 }
 
 static void text_rdaddw(rdstring *rs, word *text, word *end, textconfig *cfg) {
@@ -614,16 +726,16 @@ static int text_width(void *ctx, word *text) {
     if (attr == word_Emph || attr == word_Strong || attr == word_Code) {
 	if (attraux(text->aux) == attr_Only ||
 	    attraux(text->aux) == attr_First)
-	    wid += ustrwid(attr == word_Emph ? cfg->startemph :
-                           attr == word_Strong ? cfg->startstrong :
-                           cfg->lquote, cfg->charset);
+	    wid += (attr == word_Emph ? cfg->startemph_wid :
+		    attr == word_Strong ? cfg->startstrong_wid :
+		    cfg->lquote_wid);
     }
     if (attr == word_Emph || attr == word_Strong || attr == word_Code) {
 	if (attraux(text->aux) == attr_Only ||
 	    attraux(text->aux) == attr_Last)
-	    wid += ustrwid(attr == word_Emph ? cfg->startemph :
-                           attr == word_Strong ? cfg->startstrong :
-                           cfg->lquote, cfg->charset);
+	    wid += (attr == word_Emph ? cfg->endemph_wid :
+		    attr == word_Strong ? cfg->endstrong_wid :
+		    cfg->rquote_wid);
     }
 
     switch (text->type) {
@@ -652,9 +764,9 @@ static int text_width(void *ctx, word *text) {
 	       text->type != word_WkCodeQuote);
 	if (removeattr(text->type) == word_Quote) {
 	    if (quoteaux(text->aux) == quote_Open)
-		wid += ustrwid(cfg->lquote, cfg->charset);
+		wid += cfg->lquote_wid;
 	    else
-		wid += ustrwid(cfg->rquote, cfg->charset);
+		wid += cfg->rquote_wid;
 	} else
 	    wid++;		       /* space */
     }
@@ -17,7 +17,7 @@ struct bk_whlp_state {
     WHLP_TOPIC curr_topic;
     int charset;
     charset_state cstate;
-    FILE *cntfp;
+    outsink *cntout;
     int cnt_last_level, cnt_workaround;
 };
 
@@ -150,7 +150,7 @@ static whlpconf whlp_configure(paragraph *source) {
 }
 
 void whlp_backend(paragraph *sourceform, keywordlist *keywords,
-		  indexdata *idx, void *unused) {
+		  indexdata *idx, void *unused, outdest *od) {
     WHLP h;
     char *cntname;
     paragraph *p, *lastsect;
@@ -221,11 +221,9 @@ void whlp_backend(paragraph *sourceform, keywordlist *keywords,
 	sprintf(cntname, "%.*s.cnt", len-4, conf.filename);
     }
 
-    state.cntfp = fopen(cntname, "wb");
-    if (!state.cntfp) {
-	err_cantopenw(cntname);
+    state.cntout = out_open(od, cntname, OUT_BINARY);
+    if (!state.cntout)
 	return;
-    }
     state.cnt_last_level = -1; state.cnt_workaround = 0;
 
     /*
@@ -350,7 +348,7 @@ void whlp_backend(paragraph *sourceform, keywordlist *keywords,
 	}
 	if (rs.text) {
 	    whlp_title(h, rs.text);
-	    fprintf(state.cntfp, ":Title %s\r\n", rs.text);
+	    out_printf(state.cntout, ":Title %s\r\n", rs.text);
 	    sfree(rs.text);
 	}
 	{
@@ -641,8 +639,8 @@ void whlp_backend(paragraph *sourceform, keywordlist *keywords,
 	break;
     }
 
-    fclose(state.cntfp);
-    whlp_close(h, conf.filename);
+    out_close(state.cntout);
+    whlp_close(h, out_open(od, conf.filename, OUT_BINARY));
 
     /*
      * Loop over the index entries, cleaning up our final text
@@ -669,16 +667,16 @@ static void whlp_contents_write(struct bk_whlp_state *state,
 	state->cnt_workaround = 0;
     state->cnt_last_level = level;
 
-    fprintf(state->cntfp, "%d ", level + state->cnt_workaround);
+    out_printf(state->cntout, "%d ", level + state->cnt_workaround);
     while (*text) {
 	if (*text == '=')
-	    fputc('\\', state->cntfp);
-	fputc(*text, state->cntfp);
+	    out_putc(state->cntout, '\\');
+	out_putc(state->cntout, *text);
 	text++;
     }
     if (topic)
-	fprintf(state->cntfp, "=%s", whlp_topic_id(topic));
-    fputc('\n', state->cntfp);
+	out_printf(state->cntout, "=%s", whlp_topic_id(topic));
+    out_putc(state->cntout, '\n');
 }
 
 static void whlp_navmenu(struct bk_whlp_state *state, paragraph *p,
@@ -53,6 +53,11 @@ static void dotext(word ***wret, wchar_t *text) {
     mnewword->type = word_Normal;
     mnewword->alt = NULL;
     mnewword->next = NULL;
+    mnewword->breaks = FALSE;
+    mnewword->aux = 0;
+    mnewword->fpos.filename = NULL;
+    mnewword->fpos.line = mnewword->fpos.col = 0;
+    mnewword->private_data = NULL;
     **wret = mnewword;
     *wret = &mnewword->next;
 }
@@ -63,6 +68,11 @@ static void dospace(word ***wret) {
     mnewword->type = word_WhiteSpace;
     mnewword->alt = NULL;
     mnewword->next = NULL;
+    mnewword->breaks = FALSE;
+    mnewword->aux = 0;
+    mnewword->fpos.filename = NULL;
+    mnewword->fpos.line = mnewword->fpos.col = 0;
+    mnewword->private_data = NULL;
     **wret = mnewword;
     *wret = &mnewword->next;
 }
@@ -13,9 +13,21 @@
 #define PREFIX 0x0001		       /* give `halibut:' prefix */
 #define FILEPOS 0x0002		       /* give file position prefix */
 
+/*
+ * Messages from documents being processed at once are kept from
+ * interleaving by LOCK_ERRORS. A thread can also ask to have its
+ * diagnostics counted, so that it can tell whether whatever it was
+ * doing drew any; the counter is its own, so needs no lock.
+ */
 static void do_error(const filepos *fpos, const char *fmt, ...)
 {
     va_list ap;
+    int *counter = (int *)parallel_get_local();
+
+    if (counter)
+	(*counter)++;
+
+    parallel_lock(LOCK_ERRORS);
 
     if (fpos) {
 	fprintf(stderr, "%s:",
@@ -34,6 +46,28 @@ static void do_error(const filepos *fpos, const char *fmt, ...)
     va_end(ap);
 
     fputc('\n', stderr);
+    parallel_unlock(LOCK_ERRORS);
+}
+
+/*
+ * Status messages aren't diagnostics: they get no prefix, and they
+ * aren't counted.
+ */
+static void do_info(const char *fmt, ...)
+{
+    va_list ap;
+
+    parallel_lock(LOCK_ERRORS);
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+    fputc('\n', stderr);
+    parallel_unlock(LOCK_ERRORS);
+}
+
+void err_count_into(int *counter)
+{
+    parallel_set_local(counter);
 }
 
 void fatalerr_nomemory(void)
@@ -52,6 +86,12 @@ void err_nosuchopt(const char *sp)
     do_error(NULL, "unrecognised option `-%s'", sp);
 }
 
+void err_badjobs(const char *sp)
+{
+    do_error(NULL, "option `--jobs' requires a non-negative number, "
+             "not `%s'", sp);
+}
+
 void err_cmdcharset(const char *sp)
 {
     do_error(NULL, "character set `%s' not recognised", sp);
@@ -203,6 +243,11 @@ void err_cantopenw(const char *sp)
     do_error(NULL, "unable to open output file `%s'", sp);
 }
 
+void err_cantwrite(const char *sp)
+{
+    do_error(NULL, "error writing output file `%s'", sp);
+}
+
 void err_macroexists(const filepos *fpos, const wchar_t *wsp)
 {
     char *sp = utoa_locale_dup(wsp);
@@ -363,3 +408,32 @@ void err_sfntbadglyph(const filepos *fpos, unsigned wc)
              "warning: character U+%04X references a non-existent glyph",
              wc);
 }
+
+void err_badtree(const char *sp)
+{
+    do_error(NULL, "`%s' is not a document tree saved by this version "
+             "of Halibut", sp);
+}
+
+void err_treetext(void)
+{
+    do_error(NULL, "input files given with --load-tree may only "
+             "contain fonts");
+}
+
+void err_watchstdin(void)
+{
+    do_error(NULL, "cannot watch standard input for changes");
+}
+
+void info_htmlupdated(int nwritten, int ntotal)
+{
+    do_info("%d of %d HTML output files changed and were written",
+            nwritten, ntotal);
+}
+
+void info_watchrebuilt(int nchanged)
+{
+    do_info("%d input file%s changed; output rebuilt",
+            nchanged, nchanged == 1 ? "" : "s");
+}
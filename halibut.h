@@ -2,6 +2,7 @@
 #define HALIBUT_HALIBUT_H
 
 #include <stdio.h>
+#include <stdarg.h>
 #include <wchar.h>
 #include <time.h>
 #include <string.h>
@@ -25,6 +26,7 @@
 #define IGNORE(x) ( (x) = (x) )
 
 #include "tree234.h"
+#include "libhalibut.h"
 
 /*
  * Structure tags
@@ -40,6 +42,8 @@ typedef struct indexdata_Tag indexdata;
 typedef struct indextag_Tag indextag;
 typedef struct indexentry_Tag indexentry;
 typedef struct macrostack_Tag macrostack;
+typedef struct parsecache_Tag parsecache;
+typedef struct pcstore_Tag pcstore;
 
 /*
  * Data structure to hold a file name and index, a line and a
@@ -58,6 +62,7 @@ typedef struct pushback_Tag {
     filepos pos;
 } pushback;
 struct input_Tag {
+    halibut *h;			       /* where fonts we read are kept */
     char **filenames;		       /* complete list of input files */
     int nfiles;			       /* how many in the list */
     FILE *currfp;		       /* the currently open one */
@@ -73,6 +78,26 @@ struct input_Tag {
     wchar_t wc[16];		       /* wide chars from input conversion */
     int nwc, wcpos;		       /* size of, and position in, wc[] */
     char *pushback_chars;	       /* used to save input-encoding data */
+    char *cachedir;		       /* where to cache parsed files, or NULL */
+    pcstore *cachestore;	       /* or cache them in memory, or NULL */
+    parsecache *cache;		       /* cache entry for the current file */
+    int nerrors;		       /* diagnostics while reading it */
+    int *unchanged;		       /* per file: known unchanged, or NULL */
+};
+
+/*
+ * The state belonging to one document, for the library interface
+ * (or one run of the halibut command).
+ */
+struct halibut_Tag {
+    struct font_info_Tag *fonts;       /* read from input files */
+    char **filenames;		       /* library interface's input files */
+    int nfiles, filessize;
+    paragraph *cfg, *cfg_tail;	       /* and its configuration */
+    int backendbits;		       /* and its output formats */
+    int input_charset;
+    pcstore *cachestore;	       /* parsed input files, for reuse */
+    struct outdest_Tag *out;	       /* where output files go */
 };
 
 /*
@@ -211,6 +236,8 @@ void fatalerr_nomemory(void) NORETURN;
 void err_optnoarg(const char *sp);
 /* unrecognised option `-%s' */
 void err_nosuchopt(const char *sp);
+/* --jobs given something other than a thread count */
+void err_badjobs(const char *sp);
 /* unrecognised charset %s (cmdline) */
 void err_cmdcharset(const char *sp);
 /* futile option `-%s'%s */
@@ -266,6 +293,8 @@ void err_multiBR(const filepos *fpos, const wchar_t *wsp);
 void err_nosuchidxtag(const filepos *fpos, const wchar_t *wsp);
 /* can't open output file for write */
 void err_cantopenw(const char *sp);
+/* error while writing output file */
+void err_cantwrite(const char *sp);
 /* this macro already exists */
 void err_macroexists(const filepos *fpos, const wchar_t *wsp);
 /* jump a heading level, eg \C -> \S */
@@ -322,6 +351,22 @@ void err_sfnttablevers(const filepos *fpos, const char *sp);
 void err_sfntbadhdr(const filepos *fpos);
 /* sfnt cmap references bad glyph */
 void err_sfntbadglyph(const filepos *fpos, unsigned wc);
+/* saved document tree unusable */
+void err_badtree(const char *sp);
+/* document text with --load-tree */
+void err_treetext(void);
+/* --watch given standard input */
+void err_watchstdin(void);
+/* count this thread's diagnostics in *counter (or stop, if NULL) */
+void err_count_into(int *counter);
+
+/*
+ * Status messages, which aren't diagnostics (also error.c)
+ */
+/* count of HTML files rewritten */
+void info_htmlupdated(int nwritten, int ntotal);
+/* --watch has rebuilt the output */
+void info_watchrebuilt(int nchanged);
 
 /*
  * malloc.c
@@ -377,6 +422,9 @@ int utob(wchar_t const *);
 int uisdigit(wchar_t);
 wchar_t *ustrlow(wchar_t *s);
 wchar_t *ustrftime(const wchar_t *wfmt, const struct tm *timespec);
+int ascii_ok(int charset);
+int uasciispan(const wchar_t *s);
+int utf8_encode(char *p, wchar_t wc);
 int cvt_ok(int charset, const wchar_t *s);
 int charset_from_ustr(filepos *fpos, const wchar_t *name);
 
@@ -453,11 +501,102 @@ void cmdline_cfg_add(paragraph *cfg, char *string);
 paragraph *cmdline_cfg_new(void);
 paragraph *cmdline_cfg_simple(char *string, ...);
 
+/*
+ * parallel.c
+ */
+#define MAX_JOBS 256		       /* more threads than this is silly */
+void parallel_set_jobs(int n);
+int parallel_jobs(void);
+void run_in_parallel(int n, void (*fn)(void *ctx, int i), void *ctx);
+enum {
+    LOCK_GLYPHS,		       /* psdata.c's glyph name table */
+    LOCK_FONTS,			       /* building the standard fonts */
+    LOCK_TABLES,		       /* lazily filled lookup caches */
+    LOCK_ERRORS,		       /* error messages */
+    LOCK_OUTPUT,		       /* output.c's memory and callbacks */
+    NLOCKS
+};
+void parallel_lock(int which);
+void parallel_unlock(int which);
+void parallel_publish(void const **slot, void const *p);
+void const *parallel_fetch(void const *const *slot);
+void parallel_set_local(void *p);
+void *parallel_get_local(void);
+
 /*
  * input.c
  */
+void init_input(input *in, halibut *h, char **filenames, int nfiles,
+		int charset, int reportcols);
 paragraph *read_input(input *in, indexdata *idx);
 
+/*
+ * watch.c
+ */
+typedef struct watcher_Tag watcher;
+watcher *watch_new(char **filenames, int nfiles);
+void watch_wait(watcher *w, int *changed);
+void watch_free(watcher *w);
+
+/*
+ * output.c
+ */
+typedef struct outdest_Tag outdest;
+typedef struct outsink_Tag outsink;
+#define OUT_BINARY 1		       /* no newline translation */
+#define OUT_IF_CHANGED 2	       /* leave an identical file alone */
+outdest *outdest_files(void);
+outdest *outdest_memory(void);
+outdest *outdest_callbacks(halibut_outfuncs const *funcs, void *ctx);
+void outdest_reset(outdest *d);
+void outdest_free(outdest *d);
+int outdest_get(outdest *d, int n, char const **filename,
+		char const **data, int *len);
+outsink *out_open(outdest *d, char const *filename, int flags);
+void out_write(outsink *s, void const *data, int len);
+void out_puts(outsink *s, char const *str);
+void out_putc(outsink *s, int c);
+int out_vprintf(outsink *s, char const *fmt, va_list ap);
+int out_printf(outsink *s, char const *fmt, ...);
+int out_close(outsink *s);
+outsink *out_open_buffer(void);
+char *out_close_buffer(outsink *s, int *len);
+
+/*
+ * search.c
+ */
+typedef struct searchindex_Tag searchindex;
+searchindex *search_new(void);
+int search_add_target(searchindex *si, char const *filename,
+		      char const *fragment, word *number, word *title);
+void search_add_words(searchindex *si, int target, word *words);
+void search_add_para(searchindex *si, int target, paragraph *p);
+void search_write(searchindex *si, outdest *od, char const *prefix,
+		  int flags);
+void search_free(searchindex *si);
+
+/*
+ * parsecache.c
+ */
+pcstore *pcstore_new(void);
+void pcstore_prune(pcstore *st);
+void pcstore_free(pcstore *st);
+parsecache *pcache_new(char const *dir, pcstore *store, FILE *fp,
+		       int charset, int reportcols,
+		       wchar_t const *macros, int macroslen);
+void pcache_free(parsecache *pc);
+void pcache_note_merge(parsecache *pc, wchar_t const *tags, word *text,
+		       filepos const *fpos);
+void pcache_note_macro(parsecache *pc, wchar_t const *name,
+		       wchar_t const *text);
+void pcache_uncacheable(parsecache *pc);
+int pcache_load(parsecache *pc, char *filename, paragraph ***hptr,
+		indexdata *idx,
+		void (*defmacro)(void *ctx, wchar_t *name, wchar_t *text,
+				 filepos fpos),
+		void *ctx);
+void pcache_save(parsecache *pc, char const *filename, paragraph *paras);
+
 /*
  * in_afm.c
  */
@@ -493,6 +632,7 @@ struct keyword_Tag {
 };
 keyword *kw_lookup(keywordlist *, wchar_t *);
 keywordlist *get_keywords(paragraph *);
+keywordlist *make_keywords(keyword **kws, int nkws);
 void free_keywords(keywordlist *);
 void subst_keywords(paragraph *, keywordlist *);
 
@@ -506,6 +646,8 @@ void subst_keywords(paragraph *, keywordlist *);
 struct indexdata_Tag {
     tree234 *tags;		       /* holds type `indextag' */
     tree234 *entries;		       /* holds type `indexentry' */
+    indextag **taghash;		       /* interned tags, hashed by name */
+    int ntags, taghashsize;
 };
 
 /*
@@ -538,7 +680,18 @@ void cleanup_index(indexdata *);
 void index_merge(indexdata *, int is_explicit, wchar_t *, word *, filepos *);
 void build_index(indexdata *);
 void index_debug(indexdata *);
-indextag *index_findtag(indexdata *idx, wchar_t *name);
+indextag *index_findtag(indexdata *idx, wchar_t const *name);
+void index_addtag(indexdata *idx, indextag *tag);
+
+/*
+ * treefile.c
+ */
+typedef struct treefile_Tag treefile;
+int save_tree(char const *filename, paragraph *sourceform,
+	      keywordlist *keywords, indexdata *idx);
+treefile *load_tree(char const *filename, paragraph **sourceform,
+		    keywordlist **keywords, indexdata **idx);
+void free_tree(treefile *tf);
 
 /*
  * contents.c
@@ -553,52 +706,72 @@ void number_free(numberstate *);
  */
 void gen_citations(paragraph *, keywordlist *);
 
+/*
+ * libhalibut.c
+ */
+int find_backend(char const *name, char *filename, paragraph **cfg);
+int process_document(halibut *h, input *in, paragraph *cfg,
+		     int backendbits, int debug, int list_fonts,
+		     char *save_tree_file);
+void run_backends(halibut *h, paragraph *sourceform, keywordlist *keywords,
+		  indexdata *idx, int backendbits);
+void debug_document(paragraph *sourceform, keywordlist *keywords,
+		    indexdata *idx);
+
 /*
  * bk_text.c
  */
-void text_backend(paragraph *, keywordlist *, indexdata *, void *);
+void text_backend(paragraph *, keywordlist *, indexdata *, void *,
+		  outdest *);
 paragraph *text_config_filename(char *filename);
 
 /*
  * bk_html.c
  */
-void html_backend(paragraph *, keywordlist *, indexdata *, void *);
+void html_backend(paragraph *, keywordlist *, indexdata *, void *,
+		  outdest *);
 paragraph *html_config_filename(char *filename);
 
 /*
  * bk_whlp.c
  */
-void whlp_backend(paragraph *, keywordlist *, indexdata *, void *);
+void whlp_backend(paragraph *, keywordlist *, indexdata *, void *,
+		  outdest *);
 paragraph *whlp_config_filename(char *filename);
 
 /*
  * bk_man.c
  */
-void man_backend(paragraph *, keywordlist *, indexdata *, void *);
+void man_backend(paragraph *, keywordlist *, indexdata *, void *,
+		 outdest *);
 paragraph *man_config_filename(char *filename);
 
 /*
  * bk_info.c
  */
-void info_backend(paragraph *, keywordlist *, indexdata *, void *);
+void info_backend(paragraph *, keywordlist *, indexdata *, void *,
+		  outdest *);
 paragraph *info_config_filename(char *filename);
 
 /*
  * bk_paper.c
  */
-void *paper_pre_backend(paragraph *, keywordlist *, indexdata *);
-void listfonts(void);
+void *paper_pre_backend(paragraph *, keywordlist *, indexdata *, halibut *);
+void paper_free_document(void *);
+void listfonts(halibut *h);
 
 /*
  * bk_ps.c
  */
-void ps_backend(paragraph *, keywordlist *, indexdata *, void *);
+void ps_backend(paragraph *, keywordlist *, indexdata *, void *,
+		outdest *);
 paragraph *ps_config_filename(char *filename);
 
 /*
  * bk_pdf.c
  */
-void pdf_backend(paragraph *, keywordlist *, indexdata *, void *);
+void pdf_backend(paragraph *, keywordlist *, indexdata *, void *,
+		 outdest *);
 paragraph *pdf_config_filename(char *filename);
 
 #endif
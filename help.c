@@ -19,6 +19,11 @@ static const char *const helptext[] = {
     "         --list-charsets       display supported character set names",
     "         --list-fonts          display supported font names",
     "         --precise             report column numbers in error messages",
+    "         --jobs=n              use up to n threads in back ends",
+    "         --save-tree=file      save the parsed document to a file",
+    "         --load-tree=file      use a parsed document saved earlier",
+    "         --parse-cache=dir     reuse unchanged input files' parses",
+    "         --watch               rebuild whenever an input file changes",
     "         --help                display this text",
     "         --version             display version number",
     "         --licence             display licence text",
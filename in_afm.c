@@ -57,6 +57,9 @@ void read_afm_file(input *in) {
     fi->name = NULL;
     fi->widths = newtree234(width_cmp);
     fi->fontfile = NULL;
+    fi->filetype = TYPE1;
+    fi->srcfile = in->currindex;
+    fi->fontsrcfile = -1;
     fi->kerns = newtree234(kern_cmp);
     fi->ligs = newtree234(lig_cmp);
     fi->fontbbox[0] = fi->fontbbox[1] = fi->fontbbox[2] = fi->fontbbox[3] = 0;
@@ -83,8 +86,9 @@ void read_afm_file(input *in) {
 	    goto giveup;
 	key = strtok(line, " \t");
 	if (strcmp(key, "EndFontMetrics") == 0) {
-	    fi->next = all_fonts;
-	    all_fonts = fi;
+	    sfree(line);
+	    fi->next = in->h->fonts;
+	    in->h->fonts = fi;
 	    fclose(in->currfp);
 	    return;
 	} else if (strcmp(key, "FontName") == 0) {
@@ -224,8 +228,6 @@ void read_afm_file(input *in) {
 	    line = afm_read_line(in);
 	    if (!line || !afm_require_key(line, "EndCharMetrics", in))
 		goto giveup;
-	    sfree(line);
-
 	} else if (strcmp(key, "StartKernPairs") == 0 ||
 		   strcmp(key, "StartKernPairs0") == 0) {
 	    int nkerns, i;
@@ -253,19 +255,21 @@ void read_afm_file(input *in) {
 		    }
 		    l = glyph_intern(nl);
 		    r = glyph_intern(nr);
-		    if (l == -1 || r == -1) continue;
-		    kp = snew(kern_pair);
-		    kp->left = l;
-		    kp->right = r;
-		    kp->kern = atoi(val);
-		    add234(fi->kerns, kp);
+		    if (l != -1 && r != -1) {
+			kp = snew(kern_pair);
+			kp->left = l;
+			kp->right = r;
+			kp->kern = atoi(val);
+			add234(fi->kerns, kp);
+		    }
 		}
+		sfree(line);
 	    }
 	    line = afm_read_line(in);
 	    if (!line || !afm_require_key(line, "EndKernPairs", in))
 		goto giveup;
-	    sfree(line);
 	}
+	sfree(line);
     }
   giveup:
     sfree(fi);
@@ -42,7 +42,7 @@ typedef struct pfstate_Tag {
     size_t offset;
 } pfstate;
 
-static void pf_identify(t1_font *tf);
+static void pf_identify(t1_font *tf, input *in);
 
 static t1_data *load_pfb_file(FILE *fp, filepos *pos) {
     t1_data *head = NULL, *tail = NULL;
@@ -61,6 +61,7 @@ static t1_data *load_pfb_file(FILE *fp, filepos *pos) {
 	    head = snew(t1_data);
 	    tail = head;
 	}
+	tail->next = NULL;
 	tail->type = type;
 	tail->length = 0;
 	for (i = 0; i < 4; i++) {
@@ -102,7 +103,7 @@ void read_pfa_file(input *in) {
     tf->pos = in->pos;
     tf->length1 = tf->length2 = 0;
     fclose(in->currfp);
-    pf_identify(tf);
+    pf_identify(tf, in);
 }
 
 void read_pfb_file(input *in) {
@@ -112,7 +113,7 @@ void read_pfb_file(input *in) {
     tf->pos = in->pos;
     tf->length1 = tf->length2 = 0;
     fclose(in->currfp);
-    pf_identify(tf);
+    pf_identify(tf, in);
 }
 static char *pf_read_token(pfstate *);
 
@@ -162,7 +163,7 @@ static size_t pf_tell(pfstate *pf) {
     return o + pf->offset;
 }
 
-static void pf_identify(t1_font *tf) {
+static void pf_identify(t1_font *tf, input *in) {
     rdstringc rsc = { 0, 0, NULL };
     char *p;
     size_t len;
@@ -178,6 +179,7 @@ static void pf_identify(t1_font *tf) {
 	if (c == EOF) {
 	    sfree(rsc.text);
 	    err_pfeof(&tf->pos);
+	    pf_free(tf);
 	    return;
 	}
 	rdaddc(&rsc, c);
@@ -186,6 +188,7 @@ static void pf_identify(t1_font *tf) {
     if ((p = strchr(p, ':')) == NULL) {
 	sfree(rsc.text);
 	err_pfhead(&tf->pos);
+	pf_free(tf);
 	return;
     }
     p++;
@@ -196,16 +199,37 @@ static void pf_identify(t1_font *tf) {
     fontname[len] = 0;
     sfree(rsc.text);
 
-    for (fi = all_fonts; fi; fi = fi->next) {
+    for (fi = in->h->fonts; fi; fi = fi->next) {
 	if (strcmp(fi->name, fontname) == 0) {
+	    /* Replace any copy read before this file last changed. */
+	    if (fi->fontfile) {
+		if (fi->filetype == TRUETYPE)
+		    sfnt_free(fi->fontfile);
+		else
+		    pf_free(fi->fontfile);
+	    }
 	    fi->fontfile = tf;
 	    fi->filetype = TYPE1;
+	    fi->fontsrcfile = in->currindex;
 	    sfree(fontname);
 	    return;
 	}
     }
     err_pfnoafm(&tf->pos, fontname);
     sfree(fontname);
+    pf_free(tf);
+}
+
+void pf_free(void *fontfile) {
+    t1_font *tf = (t1_font *)fontfile;
+    t1_data *td, *next;
+
+    for (td = tf->data; td; td = next) {
+	next = td->next;
+	sfree(td->data);
+	sfree(td);
+    }
+    sfree(tf);
 }
 
 /*
@@ -305,12 +329,12 @@ static void pf_getascii(t1_font *tf, size_t off, size_t len,
     }   
 }
 
-void pf_writeps(font_info const *fi, FILE *ofp) {
+void pf_writeps(font_info const *fi, outsink *out) {
     char *buf;
     size_t len;
 
     pf_getascii(fi->fontfile, 0, INT_MAX, &buf, &len);
-    fwrite(buf, 1, len, ofp);
+    out_write(out, buf, len);
     sfree(buf);
 }
 
@@ -500,23 +500,38 @@ static char *sfnt_psname(font_info *fi) {
     return NULL;
 }
 
-static unsigned short *cmp_glyphsbyindex;
-static int glyphsbyname_cmp(void const *a, void const *b) {
-    glyph ga = cmp_glyphsbyindex[*(unsigned short *)a];
-    glyph gb = cmp_glyphsbyindex[*(unsigned short *)b];
-    if (ga < gb) return -1;
-    if (ga > gb) return 1;
+/*
+ * glyphsbyname lists glyph indices in order of glyph. We sort
+ * (glyph, index) pairs rather than bare indices, so that the
+ * comparison function doesn't need to find glyphsbyindex through a
+ * global variable (fonts may be read by several threads at once).
+ */
+struct glyphsort {
+    glyph g;
+    unsigned short idx;
+};
+static int glyphsort_cmp(void const *av, void const *bv) {
+    struct glyphsort const *a = (struct glyphsort const *)av;
+    struct glyphsort const *b = (struct glyphsort const *)bv;
+    if (a->g < b->g) return -1;
+    if (a->g > b->g) return 1;
     /* For de-duping, we'd prefer to have the first glyph stay first */
-    if (*(unsigned short *)a < *(unsigned short *)b) return -1;
-    if (*(unsigned short *)a > *(unsigned short *)b) return 1;
+    if (a->idx < b->idx) return -1;
+    if (a->idx > b->idx) return 1;
     return 0;
 }
-static int glyphsbyname_cmp_search(void const *a, void const *b) {
-    glyph ga = *(glyph *)a;
-    glyph gb = cmp_glyphsbyindex[*(unsigned short *)b];
-    if (ga < gb) return -1;
-    if (ga > gb) return 1;
-    return 0;
+static void sort_glyphsbyname(sfnt *sf) {
+    struct glyphsort *gs = snewn(sf->nglyphs, struct glyphsort);
+    unsigned i;
+
+    for (i = 0; i < sf->nglyphs; i++) {
+	gs[i].idx = sf->glyphsbyname[i];
+	gs[i].g = sf->glyphsbyindex[gs[i].idx];
+    }
+    qsort(gs, sf->nglyphs, sizeof(*gs), glyphsort_cmp);
+    for (i = 0; i < sf->nglyphs; i++)
+	sf->glyphsbyname[i] = gs[i].idx;
+    sfree(gs);
 }
 
 /* Generate an name for a glyph that doesn't have one. */
@@ -617,9 +632,7 @@ static void sfnt_mapglyphs(font_info *fi) {
     sf->glyphsbyname = snewn(sf->nglyphs, unsigned short);
     for (i = 0; i < sf->nglyphs; i++)
 	sf->glyphsbyname[i] = i;
-    cmp_glyphsbyindex = sf->glyphsbyindex;
-    qsort(sf->glyphsbyname, sf->nglyphs, sizeof(*sf->glyphsbyname),
-	  glyphsbyname_cmp);
+    sort_glyphsbyname(sf);
     /*
      * It's possible for fonts to specify the same name for multiple
      * glyphs, which would make one of them inaccessible.  Check for
@@ -654,8 +667,7 @@ static void sfnt_mapglyphs(font_info *fi) {
 	prev = this;
     }
     /* We may have renamed some glyphs, so re-sort the array. */
-    qsort(sf->glyphsbyname, sf->nglyphs, sizeof(*sf->glyphsbyname),
-	  glyphsbyname_cmp);
+    sort_glyphsbyname(sf);
 }
 
 glyph sfnt_indextoglyph(sfnt *sf, unsigned idx) {
@@ -667,10 +679,29 @@ unsigned sfnt_nglyphs(sfnt *sf) {
 }
 
 unsigned sfnt_glyphtoindex(sfnt *sf, glyph g) {
-    cmp_glyphsbyindex = sf->glyphsbyindex;
-    return *(unsigned short *)bsearch(&g, sf->glyphsbyname, sf->nglyphs,
-				      sizeof(*sf->glyphsbyname),
-				      glyphsbyname_cmp_search);
+    unsigned lo = 0, hi = sf->nglyphs, mid;
+
+    while (lo < hi) {
+	mid = lo + (hi - lo) / 2;
+	if (sf->glyphsbyindex[sf->glyphsbyname[mid]] < g)
+	    lo = mid + 1;
+	else
+	    hi = mid;
+    }
+    assert(lo < sf->nglyphs &&
+	   sf->glyphsbyindex[sf->glyphsbyname[lo]] == g);
+    return sf->glyphsbyname[lo];
+}
+
+void sfnt_free(void *fontfile) {
+    sfnt *sf = (sfnt *)fontfile;
+
+    sfree(sf->data);
+    sfree(sf->td);
+    if (sf->glyphsbyindex != (glyph *)tt_std_glyphs)
+	sfree(sf->glyphsbyindex);
+    sfree(sf->glyphsbyname);
+    sfree(sf);
 }
 
 /*
@@ -715,6 +746,7 @@ void sfnt_getmetrics(font_info *fi) {
     if (decoden(longhormetric_decode, ptr, end, hmtx, sizeof(*hmtx),
 		hhea.numOfLongHorMetrics) == NULL) {
 	err_sfntbadtable(&sf->pos, "hmtx");
+	sfree(hmtx);
 	return;
     }
     for (i = 0; i < sf->nglyphs; i++) {
@@ -724,6 +756,7 @@ void sfnt_getmetrics(font_info *fi) {
 	w->width = hmtx[j] * UNITS_PER_PT / sf->head.unitsPerEm;
 	add234(fi->widths, w);
     }
+    sfree(hmtx);
     /* Now see if the 'OS/2' table has any useful metrics */
     if (!sfnt_findtable(sf, TAG_OS_2, &ptr, &end))
 	return;
@@ -773,7 +806,6 @@ static void sfnt_getkern(font_info *fi) {
     if (ptr == NULL) goto bad;
     for (i = 0; i < kern.nTables; i++) {
 	kern_f0 f0;
-	kern_pair *kerns;
 	if (version == 0) {
 	    kern_v0_subhdr sub;
 	    ptr = decode(kern_v0_subhdr_decode, ptr, end, &sub);
@@ -798,17 +830,18 @@ static void sfnt_getkern(font_info *fi) {
 	}
 	ptr = decode(kern_f0_decode, ptr, end, &f0);
 	if (ptr == NULL) goto bad;
-	kerns = snewn(f0.nPairs, kern_pair);
 	for (j = 0; j < f0.nPairs; j++) {
 	    kern_f0_pair p;
-	    kern_pair *kp = kerns + j;
+	    kern_pair *kp;
 	    ptr = decode(kern_f0_pair_decode, ptr, end, &p);
 	    if (ptr == NULL) goto bad;
 	    if (p.left >= sf->nglyphs || p.right >= sf->nglyphs) goto bad;
+	    kp = snew(kern_pair);
 	    kp->left = sfnt_indextoglyph(sf, p.left);
 	    kp->right = sfnt_indextoglyph(sf, p.right);
 	    kp->kern = p.value * UNITS_PER_PT / (int)sf->head.unitsPerEm;
-	    add234(fi->kerns, kp);
+	    if (add234(fi->kerns, kp) != kp)
+		sfree(kp);
 	}
     }
     return;
@@ -828,7 +861,7 @@ static void sfnt_getkern(font_info *fi) {
 void sfnt_getmap(font_info *fi) {
     sfnt *sf = fi->fontfile;
     t_cmap cmap;
-    encodingrec *esd;
+    encodingrec *esd = NULL;
     void *base, *ptr, *end;
     unsigned i;
     unsigned format;
@@ -913,13 +946,16 @@ void sfnt_getmap(font_info *fi) {
 		    }
 		}
 		sfree(data);
+		sfree(esd);
 		return;
 	    }
 	}
     }
+    sfree(esd);
     err_sfntnounicmap(&sf->pos);
     return;
   bad:
+    sfree(esd);
     err_sfntbadtable(&sf->pos, "cmap");
 }
 
@@ -940,6 +976,8 @@ void read_sfnt_file(input *in) {
     fi->stemh = fi->stemv = fi->italicangle = 0;
     fi->fontfile = sf;
     fi->filetype = TRUETYPE;
+    fi->srcfile = in->currindex;
+    fi->fontsrcfile = -1;
 
     sf->len = 32768;
     sf->data = snewn(sf->len, unsigned char);
@@ -1000,8 +1038,8 @@ void read_sfnt_file(input *in) {
     sfnt_getmetrics(fi);
     sfnt_getkern(fi);
     sfnt_getmap(fi);
-    fi->next = all_fonts;
-    all_fonts = fi;
+    fi->next = in->h->fonts;
+    in->h->fonts = fi;
 }
 
 static int sizecmp(const void *a, const void *b) {
@@ -1016,59 +1054,75 @@ static int sizecmp(const void *a, const void *b) {
  * <http://partners.adobe.com/public/developer/en/font/5012.Type42_Spec.pdf>
  */
 
-void sfnt_writeps(font_info const *fi, FILE *ofp) {
-    unsigned i, j, lastbreak;
-    sfnt *sf = fi->fontfile;
-    size_t *breaks, glyfoff, glyflen;
+/*
+ * Each string in the sfnts array must be no longer than 65535 bytes
+ * (including a padding byte at the end), and must end on a table or
+ * glyph boundary.
+ */
+#define SFNTS_MAXSTR 65534
+
+/*
+ * Write a Type 42 font containing the given glyphs (plus whatever
+ * else sfnt_subset() decides they need).
+ */
+void sfnt_writeps(font_info const *fi, glyph const *glyphs, int nglyphs,
+		  outsink *out) {
+    unsigned i, j, nbreaks;
+    sfnt *sf;
+    size_t *breaks, glyfoff, glyflen, start, end;
     void *glyfptr, *glyfend, *locaptr, *locaend;
     unsigned *loca;
     int cc = 0;
 
+    sf = sfnt_subset(fi, glyphs, nglyphs);
+    if (!sf)
+	sf = fi->fontfile;
+
     /* XXX Unclear that this is the correct format. */
-    fprintf(ofp, "%%!PS-TrueTypeFont-%u-%u\n", sf->osd.scaler_type,
-	    sf->head.fontRevision);
+    out_printf(out, "%%!PS-TrueTypeFont-%u-%u\n", sf->osd.scaler_type,
+	       sf->head.fontRevision);
     if (sf->minmem)
-	fprintf(ofp, "%%%%VMUsage: %u %u\n", sf->minmem, sf->maxmem);
-    fprintf(ofp, "9 dict dup begin\n");
-    fprintf(ofp, "/FontType 42 def\n");
-    fprintf(ofp, "/FontMatrix [1 0 0 1 0 0] def\n");
-    fprintf(ofp, "/FontName /%s def\n", fi->name);
-    fprintf(ofp, "/Encoding StandardEncoding def\n");
+	out_printf(out, "%%%%VMUsage: %u %u\n", sf->minmem, sf->maxmem);
+    out_printf(out, "9 dict dup begin\n");
+    out_printf(out, "/FontType 42 def\n");
+    out_printf(out, "/FontMatrix [1 0 0 1 0 0] def\n");
+    out_printf(out, "/FontName /%s def\n", fi->name);
+    out_printf(out, "/Encoding StandardEncoding def\n");
     if ((sf->head.flags & 0x0003) == 0x0003) {
 	/*
 	 * Sensible font with the origin in the right place, such that
 	 * the bounding box is meaningful.
 	 */
-	fprintf(ofp, "/FontBBox [%g %g %g %g] readonly def\n",
-		(double)sf->head.xMin / sf->head.unitsPerEm,
-		(double)sf->head.yMin / sf->head.unitsPerEm,
-		(double)sf->head.xMax / sf->head.unitsPerEm, 
-		(double)sf->head.yMax / sf->head.unitsPerEm);
+	out_printf(out, "/FontBBox [%g %g %g %g] readonly def\n",
+		   (double)sf->head.xMin / sf->head.unitsPerEm,
+		   (double)sf->head.yMin / sf->head.unitsPerEm,
+		   (double)sf->head.xMax / sf->head.unitsPerEm, 
+		   (double)sf->head.yMax / sf->head.unitsPerEm);
     } else {
 	/* Non-sensible font. */
-	fprintf(ofp, "/FontBBox [0 0 0 0] readonly def\n");
+	out_printf(out, "/FontBBox [0 0 0 0] readonly def\n");
     }
-    fprintf(ofp, "/PaintType 0 def\n");
-    fprintf(ofp, "/CharStrings %u dict dup begin\n", sf->nglyphs);
-    fprintf(ofp, "0 1 %u{currentfile token pop exch def}bind for\n",
-	sf->nglyphs - 1);
+    out_printf(out, "/PaintType 0 def\n");
+    out_printf(out, "/CharStrings %u dict dup begin\n", sf->nglyphs);
+    out_printf(out, "0 1 %u{currentfile token pop exch def}bind for\n",
+	   sf->nglyphs - 1);
     for (i = 0; i < sf->nglyphs; i++)
-	ps_token(ofp, &cc, "/%s", glyph_extern(sfnt_indextoglyph(sf, i)));
-    fprintf(ofp, "\nend readonly def\n");
-    fprintf(ofp, "/sfnts [<");
+	ps_token(out, &cc, "/%s", glyph_extern(sfnt_indextoglyph(sf, i)));
+    out_printf(out, "\nend readonly def\n");
+    out_printf(out, "/sfnts [<");
     breaks = snewn(sf->osd.numTables + sf->nglyphs, size_t);
     for (i = 0; i < sf->osd.numTables; i++) {
 	breaks[i] = sf->td[i].offset;
     }
     if (!sfnt_findtable(sf, TAG_glyf, &glyfptr, &glyfend)) {
 	err_sfntnotable(&sf->pos, "glyf");
-	return;
+	goto done;
     }
     glyfoff = (char *)glyfptr - (char *)sf->data;
     glyflen = (char *)glyfend - (char *)glyfptr;
     if (!sfnt_findtable(sf, TAG_loca, &locaptr, &locaend)) {
 	err_sfntnotable(&sf->pos, "loca");
-	return;
+	goto done;
     }
     loca = snewn(sf->nglyphs, unsigned);
     if (sf->head.indexToLocFormat == 0) {
@@ -1083,28 +1137,563 @@ void sfnt_writeps(font_info const *fi, FILE *ofp) {
 	if (loca[i] > glyflen) goto badloca;
 	breaks[sf->osd.numTables + i - 1] = loca[i] + glyfoff;
     }
-    breaks[sf->osd.numTables + sf->nglyphs - 1] = sf->len;
-    qsort(breaks, sf->osd.numTables + sf->nglyphs, sizeof(*breaks), sizecmp);
-    j = lastbreak = 0;
-    for (i = 0; i < sf->len; i++) {
-	if ((i - lastbreak) % 38 == 0) fprintf(ofp, "\n");
-	if (i == breaks[j]) {
-	    while (i == breaks[j]) j++;
-	    lastbreak = i;
-	    fprintf(ofp, "00><\n");
+    sfree(loca);
+    nbreaks = sf->osd.numTables + sf->nglyphs;
+    breaks[nbreaks - 1] = sf->len;
+    qsort(breaks, nbreaks, sizeof(*breaks), sizecmp);
+
+    /*
+     * Put as much into each string as will fit, breaking only where
+     * we must.
+     */
+    j = 0;
+    for (start = 0; start < sf->len; start = end) {
+	unsigned char *p = (unsigned char *)sf->data + start;
+	size_t k;
+
+	end = start;
+	while (j < nbreaks && breaks[j] <= start + SFNTS_MAXSTR) {
+	    if (breaks[j] > end)
+		end = breaks[j];
+	    j++;
+	}
+	if (end == start) {
+	    /* A single table or glyph too big for one string. */
+	    end = breaks[j++];
+	}
+
+	if (start > 0)
+	    out_printf(out, "00><");
+	for (k = 0; k < end - start; k++) {
+	    static const char hex[] = "0123456789abcdef";
+	    if (k % 38 == 0) out_putc(out, '\n');
+	    out_putc(out, hex[p[k] >> 4]);
+	    out_putc(out, hex[p[k] & 15]);
 	}
-	fprintf(ofp, "%02x", *((unsigned char *)sf->data + i));
+	out_putc(out, '\n');
     }
-    fprintf(ofp, "00>] readonly def\n");
-    sfree(breaks);
-    fprintf(ofp, "end /%s exch definefont\n", fi->name);
-    return;
+    out_printf(out, "00>] readonly def\n");
+    out_printf(out, "end /%s exch definefont\n", fi->name);
+    goto done;
   badloca:
+    sfree(loca);
     err_sfntbadtable(&sf->pos, "loca");
+  done:
+    sfree(breaks);
+    if (sf != fi->fontfile)
+	sfnt_free(sf);
 }
 
-void sfnt_data(font_info *fi, char **bufp, size_t *lenp) {
-    sfnt *sf = fi->fontfile;
+void sfnt_data(sfnt *sf, char **bufp, size_t *lenp) {
     *bufp = sf->data;
     *lenp = sf->len;
 }
+
+/*
+ * Font subsetting
+ *
+ * sfnt_subset() builds a new TrueType font containing only the
+ * glyphs a document uses, together with .notdef and any glyphs they
+ * refer to as components. Glyphs keep their names and their order
+ * in the original font, so a given set of glyphs always produces the
+ * same font. The result is an sfnt like any other, so the functions
+ * above can be used to find glyphs in it and to get at its data.
+ *
+ * Only the tables needed for rendering are kept: 'glyf', 'loca',
+ * 'hmtx', 'cmap' and 'post' are rebuilt for the new glyph set,
+ * 'head', 'hhea' and 'maxp' are patched to match, and the hinting
+ * tables and 'OS/2', 'name' and 'gasp' are copied unchanged.
+ * Anything else (kerning, layout and bitmap tables, say) would
+ * refer to the old glyph numbers, and isn't needed by PDF or
+ * PostScript interpreters anyway.
+ */
+
+#define TAG_cvt 	0x63767420
+#define TAG_fpgm	0x6670676d
+#define TAG_gasp	0x67617370
+#define TAG_prep	0x70726570
+
+/* Flags in composite glyph descriptions */
+#define ARG_1_AND_2_ARE_WORDS		0x0001
+#define WE_HAVE_A_SCALE			0x0008
+#define MORE_COMPONENTS			0x0020
+#define WE_HAVE_AN_X_AND_Y_SCALE	0x0040
+#define WE_HAVE_A_TWO_BY_TWO		0x0080
+
+static void put_uint16(unsigned char *p, unsigned v) {
+    p[0] = (v >> 8) & 0xff;
+    p[1] = v & 0xff;
+}
+
+static void put_uint32(unsigned char *p, unsigned long v) {
+    p[0] = (v >> 24) & 0xff;
+    p[1] = (v >> 16) & 0xff;
+    p[2] = (v >> 8) & 0xff;
+    p[3] = v & 0xff;
+}
+
+static unsigned long sfnt_checksum(unsigned char const *p, size_t len) {
+    unsigned long sum = 0;
+    size_t i;
+
+    /* Tables are zero-padded to a multiple of four bytes. */
+    for (i = 0; i < len; i++)
+	sum += (unsigned long)p[i] << (24 - 8 * (i & 3));
+    return sum & 0xffffffffUL;
+}
+
+/*
+ * Call fn on each component of a composite glyph, which must be
+ * well-formed. The component's glyph index is at *p.
+ */
+static void sfnt_components(unsigned char *g, size_t len,
+			    void (*fn)(unsigned char *p, void *ctx),
+			    void *ctx) {
+    unsigned char *p = g + 10, *end = g + len;
+    unsigned flags;
+
+    do {
+	flags = (p[0] << 8) | p[1];
+	fn(p + 2, ctx);
+	p += 4 + (flags & ARG_1_AND_2_ARE_WORDS ? 4 : 2);
+	if (flags & WE_HAVE_A_SCALE) p += 2;
+	else if (flags & WE_HAVE_AN_X_AND_Y_SCALE) p += 4;
+	else if (flags & WE_HAVE_A_TWO_BY_TWO) p += 8;
+    } while ((flags & MORE_COMPONENTS) && p < end);
+}
+
+/*
+ * Check that a composite glyph's component records all fit within
+ * it, and refer to glyphs that exist.
+ */
+static int sfnt_checkcomposite(unsigned char *g, size_t len,
+			       unsigned nglyphs) {
+    unsigned char *p = g + 10, *end = g + len;
+    unsigned flags;
+
+    do {
+	if (p + 4 > end) return FALSE;
+	flags = (p[0] << 8) | p[1];
+	if ((unsigned)((p[2] << 8) | p[3]) >= nglyphs) return FALSE;
+	p += 4 + (flags & ARG_1_AND_2_ARE_WORDS ? 4 : 2);
+	if (flags & WE_HAVE_A_SCALE) p += 2;
+	else if (flags & WE_HAVE_AN_X_AND_Y_SCALE) p += 4;
+	else if (flags & WE_HAVE_A_TWO_BY_TWO) p += 8;
+	if (p > end) return FALSE;
+    } while (flags & MORE_COMPONENTS);
+    return TRUE;
+}
+
+struct subsetmark {
+    unsigned char *used;
+    unsigned *stack;
+    unsigned nstack;
+};
+
+static void subset_mark(unsigned char *p, void *ctx) {
+    struct subsetmark *sm = (struct subsetmark *)ctx;
+    unsigned idx = (p[0] << 8) | p[1];
+
+    if (!sm->used[idx]) {
+	sm->used[idx] = TRUE;
+	sm->stack[sm->nstack++] = idx;
+    }
+}
+
+static void subset_renumber(unsigned char *p, void *ctx) {
+    unsigned *newidx = (unsigned *)ctx;
+    put_uint16(p, newidx[(p[0] << 8) | p[1]]);
+}
+
+struct subsettable {
+    unsigned tag;
+    unsigned char *data;
+    size_t len;
+};
+
+static int subsettable_cmp(void const *av, void const *bv) {
+    struct subsettable const *a = (struct subsettable const *)av;
+    struct subsettable const *b = (struct subsettable const *)bv;
+    if (a->tag < b->tag) return -1;
+    if (a->tag > b->tag) return 1;
+    return 0;
+}
+
+/*
+ * Build a format 4 'cmap' subtable for the Unicode characters in
+ * the BMP which map to glyphs in the subset.
+ */
+static unsigned char *subset_cmap(font_info const *fi, sfnt *sf,
+				  unsigned *newidx, size_t *lenp) {
+    unsigned *start, *end, *delta;
+    unsigned nseg, i, c, idx;
+    unsigned char *data, *p;
+    size_t len;
+
+    start = snewn(65536, unsigned);
+    end = snewn(65536, unsigned);
+    delta = snewn(65536, unsigned);
+    nseg = 0;
+    for (c = 0; c < 0xffff; c++) {
+	if (fi->bmp[c] == NOGLYPH)
+	    continue;
+	idx = newidx[sfnt_glyphtoindex(sf, fi->bmp[c])];
+	if (idx == 0)
+	    continue;		       /* not in subset, or .notdef */
+	if (nseg > 0 && end[nseg-1] == c - 1 &&
+	    ((c + delta[nseg-1]) & 0xffff) == idx) {
+	    end[nseg-1] = c;
+	} else {
+	    start[nseg] = end[nseg] = c;
+	    delta[nseg] = (idx - c) & 0xffff;
+	    nseg++;
+	}
+    }
+    start[nseg] = end[nseg] = 0xffff;
+    delta[nseg] = 1;
+    nseg++;
+
+    len = 4 + 8 + 16 + 8 * nseg;
+    data = snewn(len, unsigned char);
+    put_uint16(data, 0);	       /* version */
+    put_uint16(data + 2, 1);	       /* numTables */
+    put_uint16(data + 4, 3);	       /* platformID: Microsoft */
+    put_uint16(data + 6, 1);	       /* encodingID: Unicode BMP */
+    put_uint32(data + 8, 12);	       /* offset */
+    p = data + 12;
+    put_uint16(p, 4);		       /* format */
+    put_uint16(p + 2, len - 12);
+    put_uint16(p + 4, 0);	       /* language */
+    put_uint16(p + 6, nseg * 2);
+    for (i = 1; i * 2 <= nseg; i *= 2);
+    put_uint16(p + 8, i * 2);	       /* searchRange */
+    for (c = 0; (1U << (c + 1)) <= i; c++);
+    put_uint16(p + 10, c);	       /* entrySelector */
+    put_uint16(p + 12, nseg * 2 - i * 2); /* rangeShift */
+    p += 14;
+    for (i = 0; i < nseg; i++, p += 2) put_uint16(p, end[i]);
+    put_uint16(p, 0); p += 2;	       /* reservedPad */
+    for (i = 0; i < nseg; i++, p += 2) put_uint16(p, start[i]);
+    for (i = 0; i < nseg; i++, p += 2) put_uint16(p, delta[i]);
+    for (i = 0; i < nseg; i++, p += 2) put_uint16(p, 0);
+    assert(p == data + len);
+
+    sfree(start);
+    sfree(end);
+    sfree(delta);
+    *lenp = len;
+    return data;
+}
+
+/*
+ * Build a format 2 'post' table naming the glyphs in the subset.
+ */
+static unsigned char *subset_post(sfnt *sf, unsigned *oldidx,
+				  unsigned nnew, size_t *lenp) {
+    void *ptr, *end;
+    unsigned *nameidx, i, j, nextra;
+    unsigned char *data, *p;
+    size_t len;
+
+    nameidx = snewn(nnew, unsigned);
+    len = 34 + 2 * nnew;
+    nextra = 0;
+    for (i = 0; i < nnew; i++) {
+	glyph g = sfnt_indextoglyph(sf, oldidx[i]);
+	for (j = 0; j < 258; j++)
+	    if (tt_std_glyphs[j] == g)
+		break;
+	if (j == 258) {
+	    size_t n = strlen(glyph_extern(g));
+	    j = 258 + nextra++;
+	    len += 1 + (n > 255 ? 255 : n);
+	}
+	nameidx[i] = j;
+    }
+
+    data = snewn(len, unsigned char);
+    memset(data, 0, 32);
+    if (sfnt_findtable(sf, TAG_post, &ptr, &end) &&
+	(char *)end - (char *)ptr >= 32)
+	memcpy(data, ptr, 32);	       /* italicAngle and so on */
+    put_uint32(data, 0x00020000);
+    memset(data + 16, 0, 16);	       /* VM usage is no longer known */
+    put_uint16(data + 32, nnew);
+    p = data + 34;
+    for (i = 0; i < nnew; i++, p += 2)
+	put_uint16(p, nameidx[i]);
+    for (i = 0; i < nnew; i++) {
+	if (nameidx[i] >= 258) {
+	    char const *name = glyph_extern(sfnt_indextoglyph(sf, oldidx[i]));
+	    size_t n = strlen(name);
+	    if (n > 255) n = 255;
+	    *p++ = n;
+	    memcpy(p, name, n);
+	    p += n;
+	}
+    }
+    assert(p == data + len);
+    sfree(nameidx);
+    *lenp = len;
+    return data;
+}
+
+/*
+ * Make a subset of a TrueType font containing the given glyphs, all
+ * of which must be in the font. Returns NULL if the font can't be
+ * subsetted, in which case the caller should use the whole font.
+ */
+sfnt *sfnt_subset(font_info const *fi, glyph const *glyphs, int nglyphs) {
+    sfnt *sf = fi->fontfile, *ss;
+    void *glyfptr, *glyfend, *locaptr, *locaend, *ptr, *end;
+    unsigned char *glyf, *hmtx, *used, *p;
+    unsigned *loca, *newidx, *oldidx;
+    size_t glyflen, hmtxlen, off;
+    unsigned i, nnew, nlong, ntables;
+    struct subsettable tables[16];
+    struct subsetmark sm;
+    t_hhea hhea;
+    unsigned long sum;
+    static const unsigned copytags[] = {
+	TAG_OS_2, TAG_cvt, TAG_fpgm, TAG_gasp, TAG_name, TAG_prep
+    };
+
+    if (!sfnt_findtable(sf, TAG_glyf, &glyfptr, &glyfend) ||
+	!sfnt_findtable(sf, TAG_loca, &locaptr, &locaend) ||
+	!sfnt_findtable(sf, TAG_hhea, &ptr, &end) ||
+	!decode(t_hhea_decode, ptr, end, &hhea) ||
+	hhea.numOfLongHorMetrics == 0 ||
+	!sfnt_findtable(sf, TAG_hmtx, &ptr, &end))
+	return NULL;
+    glyf = glyfptr;
+    glyflen = (char *)glyfend - (char *)glyfptr;
+    hmtx = ptr;
+    hmtxlen = (char *)end - (char *)ptr;
+    nlong = hhea.numOfLongHorMetrics;
+    if (nlong > sf->nglyphs ||
+	hmtxlen < 4 * nlong + 2 * (sf->nglyphs - nlong)) {
+	err_sfntbadtable(&sf->pos, "hmtx");
+	return NULL;
+    }
+
+    loca = snewn(sf->nglyphs + 1, unsigned);
+    if (sf->head.indexToLocFormat == 0) {
+	if (!decoden(uint16_decode, locaptr, locaend, loca, sizeof(*loca),
+		     sf->nglyphs + 1)) goto badloca;
+	for (i = 0; i <= sf->nglyphs; i++) loca[i] *= 2;
+    } else {
+	if (!decoden(uint32_decode, locaptr, locaend, loca, sizeof(*loca),
+		     sf->nglyphs + 1)) goto badloca;
+    }
+    for (i = 0; i < sf->nglyphs; i++)
+	if (loca[i] > loca[i+1] || loca[i+1] > glyflen) goto badloca;
+
+    /*
+     * Work out which glyphs we need, following references from
+     * composite glyphs to their components.
+     */
+    used = snewn(sf->nglyphs, unsigned char);
+    memset(used, 0, sf->nglyphs);
+    sm.used = used;
+    sm.stack = snewn(sf->nglyphs, unsigned);
+    sm.nstack = 0;
+    used[0] = TRUE;
+    sm.stack[sm.nstack++] = 0;
+    for (i = 0; i < (unsigned)nglyphs; i++) {
+	unsigned idx = sfnt_glyphtoindex(sf, glyphs[i]);
+	if (!used[idx]) {
+	    used[idx] = TRUE;
+	    sm.stack[sm.nstack++] = idx;
+	}
+    }
+    while (sm.nstack > 0) {
+	unsigned idx = sm.stack[--sm.nstack];
+	unsigned char *g = glyf + loca[idx];
+	size_t len = loca[idx+1] - loca[idx];
+
+	if (len == 0)
+	    continue;
+	if (len < 10) goto badglyf;
+	if (g[0] & 0x80) {	       /* numberOfContours < 0 */
+	    if (!sfnt_checkcomposite(g, len, sf->nglyphs)) goto badglyf;
+	    sfnt_components(g, len, subset_mark, &sm);
+	}
+    }
+    sfree(sm.stack);
+
+    newidx = snewn(sf->nglyphs, unsigned);
+    oldidx = snewn(sf->nglyphs, unsigned);
+    for (i = nnew = 0; i < sf->nglyphs; i++) {
+	newidx[i] = used[i] ? nnew : 0;
+	if (used[i])
+	    oldidx[nnew++] = i;
+    }
+    sfree(used);
+
+    /*
+     * Build the new tables.
+     */
+    ntables = 0;
+
+    /* 'glyf' and 'loca', with each glyph padded to four bytes. */
+    off = 0;
+    for (i = 0; i < nnew; i++)
+	off += (loca[oldidx[i]+1] - loca[oldidx[i]] + 3) & ~3;
+    tables[ntables].tag = TAG_glyf;
+    tables[ntables].len = off;
+    tables[ntables].data = p = snewn(off ? off : 1, unsigned char);
+    tables[ntables+1].tag = TAG_loca;
+    tables[ntables+1].len = 4 * (nnew + 1);
+    tables[ntables+1].data = snewn(4 * (nnew + 1), unsigned char);
+    off = 0;
+    for (i = 0; i < nnew; i++) {
+	size_t len = loca[oldidx[i]+1] - loca[oldidx[i]];
+	put_uint32(tables[ntables+1].data + 4*i, off);
+	memcpy(p + off, glyf + loca[oldidx[i]], len);
+	if (len > 0 && (p[off] & 0x80))
+	    sfnt_components(p + off, len, subset_renumber, newidx);
+	while (len & 3)
+	    p[off + len++] = 0;
+	off += len;
+    }
+    put_uint32(tables[ntables+1].data + 4*nnew, off);
+    ntables += 2;
+
+    /* 'hmtx', with a full metric for every glyph. */
+    tables[ntables].tag = TAG_hmtx;
+    tables[ntables].len = 4 * nnew;
+    tables[ntables].data = p = snewn(4 * nnew, unsigned char);
+    for (i = 0; i < nnew; i++) {
+	unsigned j = oldidx[i];
+	if (j < nlong) {
+	    memcpy(p + 4*i, hmtx + 4*j, 4);
+	} else {
+	    memcpy(p + 4*i, hmtx + 4*(nlong-1), 2);
+	    memcpy(p + 4*i + 2, hmtx + 4*nlong + 2*(j-nlong), 2);
+	}
+    }
+    ntables++;
+
+    /* 'head', 'hhea' and 'maxp', patched. */
+    if (!sfnt_findtable(sf, TAG_head, &ptr, &end) ||
+	(char *)end - (char *)ptr < 54) goto badhead;
+    tables[ntables].tag = TAG_head;
+    tables[ntables].len = 54;
+    tables[ntables].data = snewn(54, unsigned char);
+    memcpy(tables[ntables].data, ptr, 54);
+    put_uint32(tables[ntables].data + 8, 0); /* checkSumAdjustment */
+    put_uint16(tables[ntables].data + 50, 1); /* indexToLocFormat */
+    ntables++;
+    sfnt_findtable(sf, TAG_hhea, &ptr, &end);
+    tables[ntables].tag = TAG_hhea;
+    tables[ntables].len = 36;
+    tables[ntables].data = snewn(36, unsigned char);
+    memcpy(tables[ntables].data, ptr, 36);
+    put_uint16(tables[ntables].data + 34, nnew);
+    ntables++;
+    sfnt_findtable(sf, TAG_maxp, &ptr, &end);
+    tables[ntables].tag = TAG_maxp;
+    tables[ntables].len = (char *)end - (char *)ptr;
+    tables[ntables].data = snewn(tables[ntables].len, unsigned char);
+    memcpy(tables[ntables].data, ptr, tables[ntables].len);
+    put_uint16(tables[ntables].data + 4, nnew);
+    ntables++;
+
+    tables[ntables].tag = TAG_cmap;
+    tables[ntables].data = subset_cmap(fi, sf, newidx,
+				       &tables[ntables].len);
+    ntables++;
+    tables[ntables].tag = TAG_post;
+    tables[ntables].data = subset_post(sf, oldidx, nnew,
+				       &tables[ntables].len);
+    ntables++;
+
+    for (i = 0; i < lenof(copytags); i++) {
+	if (sfnt_findtable(sf, copytags[i], &ptr, &end)) {
+	    tables[ntables].tag = copytags[i];
+	    tables[ntables].len = (char *)end - (char *)ptr;
+	    tables[ntables].data = snewn(tables[ntables].len + 1,
+					 unsigned char);
+	    memcpy(tables[ntables].data, ptr, tables[ntables].len);
+	    ntables++;
+	}
+    }
+    qsort(tables, ntables, sizeof(*tables), subsettable_cmp);
+
+    /*
+     * Put the new font together.
+     */
+    ss = snew(sfnt);
+    ss->len = 12 + 16 * ntables;
+    for (i = 0; i < ntables; i++)
+	ss->len += (tables[i].len + 3) & ~3;
+    ss->data = p = snewn(ss->len, unsigned char);
+    memset(p, 0, ss->len);
+    ss->end = (char *)ss->data + ss->len;
+    ss->pos = sf->pos;
+    ss->osd.scaler_type = sfnt_00010000;
+    ss->osd.numTables = ntables;
+    ss->td = snewn(ntables, tabledir);
+    put_uint32(p, sfnt_00010000);
+    put_uint16(p + 4, ntables);
+    for (i = 1; i * 2 <= ntables; i *= 2);
+    put_uint16(p + 6, i * 16);	       /* searchRange */
+    for (nlong = 0; (1U << (nlong + 1)) <= i; nlong++);
+    put_uint16(p + 8, nlong);	       /* entrySelector */
+    put_uint16(p + 10, ntables * 16 - i * 16); /* rangeShift */
+    off = 12 + 16 * ntables;
+    for (i = 0; i < ntables; i++) {
+	memcpy(p + off, tables[i].data, tables[i].len);
+	ss->td[i].tag = tables[i].tag;
+	ss->td[i].checkSum = sfnt_checksum(p + off, tables[i].len);
+	ss->td[i].offset = off;
+	ss->td[i].length = tables[i].len;
+	put_uint32(p + 12 + 16*i, ss->td[i].tag);
+	put_uint32(p + 12 + 16*i + 4, ss->td[i].checkSum);
+	put_uint32(p + 12 + 16*i + 8, ss->td[i].offset);
+	put_uint32(p + 12 + 16*i + 12, ss->td[i].length);
+	off += (tables[i].len + 3) & ~3;
+	sfree(tables[i].data);
+    }
+    sum = sfnt_checksum(p, ss->len);
+    for (i = 0; i < ntables; i++)
+	if (ss->td[i].tag == TAG_head)
+	    put_uint32(p + ss->td[i].offset + 8,
+		       (0xB1B0AFBAUL - sum) & 0xffffffffUL);
+
+    ss->head = sf->head;
+    ss->head.indexToLocFormat = 1;
+    ss->nglyphs = nnew;
+    ss->glyphsbyindex = snewn(nnew, glyph);
+    ss->glyphsbyname = snewn(nnew, unsigned short);
+    for (i = 0; i < nnew; i++) {
+	ss->glyphsbyindex[i] = sfnt_indextoglyph(sf, oldidx[i]);
+	ss->glyphsbyname[i] = i;
+    }
+    sort_glyphsbyname(ss);
+    ss->minmem = ss->maxmem = 0;
+
+    sfree(loca);
+    sfree(newidx);
+    sfree(oldidx);
+    return ss;
+
+  badhead:
+    err_sfntbadtable(&sf->pos, "head");
+    while (ntables > 0)
+	sfree(tables[--ntables].data);
+    sfree(loca);
+    sfree(newidx);
+    sfree(oldidx);
+    return NULL;
+  badglyf:
+    err_sfntbadtable(&sf->pos, "glyf");
+    sfree(sm.stack);
+    sfree(used);
+    sfree(loca);
+    return NULL;
+  badloca:
+    err_sfntbadtable(&sf->pos, "loca");
+    sfree(loca);
+    return NULL;
+}
@@ -9,10 +9,18 @@
 static int compare_tags(void *av, void *bv);
 static int compare_entries(void *av, void *bv);
 
+#define INITIAL_TAGHASH_SIZE 256       /* must be a power of two */
+
 indexdata *make_index(void) {
+    int i;
     indexdata *ret = snew(indexdata);
     ret->tags = newtree234(compare_tags);
     ret->entries = newtree234(compare_entries);
+    ret->ntags = 0;
+    ret->taghashsize = INITIAL_TAGHASH_SIZE;
+    ret->taghash = snewn(ret->taghashsize, indextag *);
+    for (i = 0; i < ret->taghashsize; i++)
+	ret->taghash[i] = NULL;
     return ret;
 }
 
@@ -32,22 +40,75 @@ static int compare_tags(void *av, void *bv) {
     return ustricmp(a->name, b->name);
 }
 
-static int compare_to_find_tag(void *av, void *bv) {
-    wchar_t *a = (wchar_t *)av;
-    indextag *b = (indextag *)bv;
-    return ustricmp(a, b->name);
-}
-
 static int compare_entries(void *av, void *bv) {
     indexentry *a = (indexentry *)av, *b = (indexentry *)bv;
     return compare_wordlists(a->text, b->text);    
 }
 
 /*
- * Back-end utility: find the indextag with a given name.
+ * The tag names are interned in an open-addressed hash table,
+ * alongside the sorted tree234 which build_index walks. Tags
+ * compare case-insensitively, so the hash is computed over the
+ * case-folded name.
+ */
+static unsigned long tag_hash(wchar_t const *name) {
+    unsigned long h = 2166136261UL;
+    for (; *name; name++)
+	h = ((h ^ (unsigned long)utolower(*name)) * 16777619UL) & 0xFFFFFFFFUL;
+    return h;
+}
+
+/*
+ * Return the hash table slot holding the tag called `name', or the
+ * empty slot where it would go.
  */
-indextag *index_findtag(indexdata *idx, wchar_t *name) {
-    return find234(idx->tags, name, compare_to_find_tag);
+static indextag **tag_slot(indexdata *idx, wchar_t const *name) {
+    unsigned long mask = idx->taghashsize - 1;
+    unsigned long i = tag_hash(name) & mask;
+    indextag **slot;
+
+    while (*(slot = &idx->taghash[i]) != NULL) {
+	if (!ustricmp((*slot)->name, name))
+	    break;
+	i = (i + 1) & mask;
+    }
+    return slot;
+}
+
+static void tag_insert(indexdata *idx, indextag *t) {
+    if (4 * (idx->ntags + 1) > 3 * idx->taghashsize) {
+	indextag **old = idx->taghash;
+	int oldsize = idx->taghashsize;
+	int i;
+
+	idx->taghashsize *= 2;
+	idx->taghash = snewn(idx->taghashsize, indextag *);
+	for (i = 0; i < idx->taghashsize; i++)
+	    idx->taghash[i] = NULL;
+	for (i = 0; i < oldsize; i++)
+	    if (old[i])
+		*tag_slot(idx, old[i]->name) = old[i];
+	sfree(old);
+    }
+    *tag_slot(idx, t->name) = t;
+    idx->ntags++;
+    add234(idx->tags, t);
+}
+
+/*
+ * Add a complete tag (one from a saved document tree) to the index.
+ */
+void index_addtag(indexdata *idx, indextag *tag) {
+    tag_insert(idx, tag);
+}
+
+/*
+ * Back-end utility: find the indextag with a given name. This is a
+ * single hash probe, so back ends may call it once per
+ * word_IndexRef without caching the result themselves.
+ */
+indextag *index_findtag(indexdata *idx, wchar_t const *name) {
+    return *tag_slot(idx, name);
 }
 
 /*
@@ -60,7 +121,8 @@ indextag *index_findtag(indexdata *idx, wchar_t *name) {
  */
 void index_merge(indexdata *idx, int is_explicit, wchar_t *tags, word *text,
 		 filepos *fpos) {
-    indextag *t, *existing;
+    indextag *t;
+    int kept = FALSE;
 
     /*
      * For an implicit merge, we want to remove all emphasis,
@@ -84,15 +146,8 @@ void index_merge(indexdata *idx, int is_explicit, wchar_t *tags, word *text,
      * FIXME: want to warn on overlapping source sets.
      */
     for (; *tags; tags = uadv(tags)) {
-	t = make_indextag();
-	t->name = tags;
-	existing = add234(idx->tags, t);
-	if (existing == t) {
-	    /*
-	     * Duplicate this so we can free it independently.
-	     */
-	    t->name = ustrdup(tags);
-
+	t = index_findtag(idx, tags);
+	if (!t) {
 	    /*
 	     * Every tag has an implicit \IM. So if this tag
 	     * doesn't exist and we're explicit, then we should
@@ -105,9 +160,15 @@ void index_merge(indexdata *idx, int is_explicit, wchar_t *tags, word *text,
 
 	    /*
 	     * Otherwise, this is a new tag with an implicit \IM.
+	     * Intern its name: every later reference to the same
+	     * tag finds this copy.
 	     */
+	    t = make_indextag();
+	    t->name = ustrdup(tags);
 	    t->implicit_text = text;
 	    t->implicit_fpos = *fpos;
+	    tag_insert(idx, t);
+	    kept = TRUE;
 	} else {
 	    if (!is_explicit) {
  		/*
@@ -122,20 +183,16 @@ void index_merge(indexdata *idx, int is_explicit, wchar_t *tags, word *text,
 		 * Check the tag against its previous occurrence to
 		 * see if the cases match.
 		 */
-		if (ustrcmp(t->name, existing->name)) {
-		    err_indexcase(fpos, t->name,
-			  &existing->implicit_fpos, existing->name);
+		if (ustrcmp(tags, t->name)) {
+		    err_indexcase(fpos, tags,
+			  &t->implicit_fpos, t->name);
 		}
-
-		sfree(t);
 	    } else {
 		/*
 		 * An explicit \IM added to a valid tag. In
 		 * particular, this removes the implicit \IM if
 		 * present.
 		 */
-		sfree(t);
-		t = existing;
 		if (t->implicit_text) {
 		    free_word_list(t->implicit_text);
 		    t->implicit_text = NULL;
@@ -153,6 +210,13 @@ void index_merge(indexdata *idx, int is_explicit, wchar_t *tags, word *text,
 	    }
 	}
     }
+
+    /*
+     * An implicit \IM's text is ours to keep or free; an explicit
+     * one's belongs to its paragraph.
+     */
+    if (!is_explicit && !kept)
+	free_word_list(text);
 }
 
 /*
@@ -202,10 +266,12 @@ void cleanup_index(indexdata *i) {
 	sfree(t->name);
 	free_word_list(t->implicit_text);
 	sfree(t->explicit_texts);
+	sfree(t->explicit_fpos);
 	sfree(t->refs);
 	sfree(t);
     }
     freetree234(i->tags);
+    sfree(i->taghash);
     for (ti = 0; (ent = (indexentry *)index234(i->entries, ti))!=NULL; ti++) {
 	sfree(ent);
     }
@@ -6,6 +6,7 @@
 #include <assert.h>
 #include <time.h>
 #include "halibut.h"
+#include "paper.h"
 
 #define TAB_STOP 8		       /* for column number tracking */
 
@@ -71,6 +72,27 @@ static int macrolookup(tree234 *macros, input *in, wchar_t *name,
     } else
 	return FALSE;
 }
+static void macrodef_cached(void *ctx, wchar_t *name, wchar_t *text,
+			    filepos fpos) {
+    macrodef((tree234 *)ctx, name, text, fpos);
+}
+/*
+ * Every macro currently defined, as name\0text\0name\0text\0...,
+ * for the parse cache (a file's parse may depend on any of them).
+ */
+static wchar_t *macrodump(tree234 *macros, int *len) {
+    rdstring rs = { 0, 0, NULL };
+    int ti;
+    macro *m;
+    for (ti = 0; (m = (macro *)index234(macros, ti)) != NULL; ti++) {
+	rdadds(&rs, m->name);
+	rdadd(&rs, L'\0');
+	rdadds(&rs, m->text);
+	rdadd(&rs, L'\0');
+    }
+    *len = rs.pos;
+    return rs.text;
+}
 static void macrocleanup(tree234 *macros) {
     int ti;
     macro *m;
@@ -668,10 +690,12 @@ static void read_file(paragraph ***ret, input *in, indexdata *idx,
 	    int wtype = word_WeakCode;
 
 	    par.type = para_Code;
+	    par.aux = 0;
 	    par.fpos = t.pos;
 	    while (1) {
 		dtor(t), t = get_codepar_token(in);
 		wd.type = wtype;
+		wd.aux = 0;
 		wd.breaks = FALSE;     /* shouldn't need this... */
 		wd.text = ustrdup(t.text);
 		wd.alt = NULL;
@@ -827,6 +851,8 @@ static void read_file(paragraph ***ret, input *in, indexdata *idx,
 	 * text)
 	 */
 	par.type = para_Normal;
+	par.aux = 0;
+	par.fpos = t.pos;
 	if (t.type == tok_cmd) {
 	    int needkw;
 	    int is_macro = FALSE;
@@ -985,6 +1011,8 @@ static void read_file(paragraph ***ret, input *in, indexdata *idx,
 			if (t.type == tok_eop || t.type == tok_eof)
                             break;
 		    }
+		    if (in->cache)
+			pcache_note_macro(in->cache, rs.text, macrotext.text);
 		    macrodef(macros, rs.text, macrotext.text, fp);
 		    continue;	       /* next paragraph */
 		}
@@ -1158,6 +1186,9 @@ static void read_file(paragraph ***ret, input *in, indexdata *idx,
 			}
 			indexing = FALSE;
 			rdadd(&indexstr, L'\0');
+			if (in->cache)
+			    pcache_note_merge(in->cache, indexstr.text,
+					      idxwordlist, &sitem->fpos);
 			index_merge(idx, FALSE, indexstr.text,
 				    idxwordlist, &sitem->fpos);
 			sfree(indexstr.text);
@@ -1302,9 +1333,15 @@ static void read_file(paragraph ***ret, input *in, indexdata *idx,
 		    if (t.type != tok_lbrace) {
 			if (wd.type == word_Normal) {
 			    time_t thetime = time(NULL);
-			    struct tm *broken = localtime(&thetime);
+			    struct tm *broken;
+			    if (in->cache)   /* the date won't stay the same */
+				pcache_uncacheable(in->cache);
 			    already = TRUE;
+			    /* localtime's result is shared by all threads */
+			    parallel_lock(LOCK_TABLES);
+			    broken = localtime(&thetime);
 			    wdtext = ustrftime(NULL, broken);
+			    parallel_unlock(LOCK_TABLES);
 			    wd.type = style;
 			} else {
 			    err_explbr(&t.pos);
@@ -1321,8 +1358,13 @@ static void read_file(paragraph ***ret, input *in, indexdata *idx,
 			}
 			if (wd.type == word_Normal) {
 			    time_t thetime = time(NULL);
-			    struct tm *broken = localtime(&thetime);
+			    struct tm *broken;
+			    if (in->cache)   /* the date won't stay the same */
+				pcache_uncacheable(in->cache);
+			    parallel_lock(LOCK_TABLES);
+			    broken = localtime(&thetime);
 			    wdtext = ustrftime(rs.text, broken);
+			    parallel_unlock(LOCK_TABLES);
 			    wd.type = style;
 			} else {
 			    wdtext = ustrdup(rs.text);
@@ -1589,7 +1631,7 @@ static void read_file(paragraph ***ret, input *in, indexdata *idx,
     stk_free(crossparastk);
 }
 
-struct {
+static const struct {
     char const *magic;
     size_t nmagic;
     int binary;
@@ -1603,6 +1645,51 @@ struct {
     { "true",		   4, TRUE,  &read_sfnt_file },
 };
 
+/*
+ * Set up an input structure to read the given files, adding any
+ * fonts among them to h's list.
+ */
+void init_input(input *in, halibut *h, char **filenames, int nfiles,
+		int charset, int reportcols) {
+    in->h = h;
+    in->filenames = filenames;
+    in->nfiles = nfiles;
+    in->currfp = NULL;
+    in->currindex = 0;
+    in->npushback = in->pushbacksize = 0;
+    in->pushback = NULL;
+    in->reportcols = reportcols;
+    in->stack = NULL;
+    in->defcharset = charset;
+    in->cachedir = NULL;
+    in->cachestore = NULL;
+    in->cache = NULL;
+    in->nerrors = 0;
+    in->unchanged = NULL;
+}
+
+/*
+ * Before a rebuild, throw away the fonts read from any font file
+ * which has changed, so that reading it again doesn't leave stale
+ * copies on in->h->fonts. A Type 1 font's separate font file has to
+ * be read again too, so that it's attached to the new metrics.
+ */
+static void drop_changed_fonts(input *in) {
+    font_info **fp = &in->h->fonts, *fi;
+
+    while ((fi = *fp) != NULL) {
+	if (in->unchanged[fi->srcfile]) {
+	    fp = &fi->next;
+	    continue;
+	}
+	*fp = fi->next;
+	if (fi->fontsrcfile >= 0)
+	    in->unchanged[fi->fontsrcfile] = FALSE;
+	fi->next = NULL;
+	free_font_list(fi);
+    }
+}
+
 paragraph *read_input(input *in, indexdata *idx) {
     paragraph *head = NULL;
     paragraph **hptr = &head;
@@ -1614,6 +1701,9 @@ paragraph *read_input(input *in, indexdata *idx) {
 
     macros = newtree234(macrocmp);
 
+    if (in->unchanged)
+	drop_changed_fonts(in);
+
     while (in->currindex < in->nfiles) {
 	setpos(in, in->filenames[in->currindex]);
 	in->charset = in->defcharset;
@@ -1658,7 +1748,45 @@ paragraph *read_input(input *in, indexdata *idx) {
 	    }
 	}
 	if (in->currfp) {
-	    if (reader == NULL) {
+	    if (reader != NULL && in->unchanged &&
+		in->unchanged[in->currindex]) {
+		/*
+		 * A font file we've already loaded on a previous
+		 * pass, and which hasn't changed since: its fonts
+		 * are still on in->h->fonts.
+		 */
+		fclose(in->currfp);
+		in->currfp = NULL;
+	    } else if (reader == NULL && (in->cachedir || in->cachestore) &&
+		in->filenames[in->currindex]) {
+		char *fname = in->filenames[in->currindex];
+		int dumplen;
+		wchar_t *dump = macrodump(macros, &dumplen);
+		in->cache = pcache_new(in->cachedir, in->cachestore,
+				       in->currfp, in->charset,
+				       in->reportcols, dump, dumplen);
+		sfree(dump);
+		if (in->cache && pcache_load(in->cache, fname, &hptr, idx,
+					     macrodef_cached, macros)) {
+		    fclose(in->currfp);
+		    in->currfp = NULL;
+		} else {
+		    paragraph **start = hptr;
+		    in->nerrors = 0;
+		    err_count_into(&in->nerrors);
+		    read_file(&hptr, in, idx, macros);
+		    err_count_into(NULL);
+		    /*
+		     * Don't cache a file that drew any diagnostics: a
+		     * cache hit would silently lose them.
+		     */
+		    if (in->cache && in->nerrors == 0)
+			pcache_save(in->cache, fname, *start);
+		}
+		if (in->cache)
+		    pcache_free(in->cache);
+		in->cache = NULL;
+	    } else if (reader == NULL) {
 		read_file(&hptr, in, idx, macros);
 	    } else {
 		(*reader)(in);
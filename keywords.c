@@ -99,6 +99,24 @@ keywordlist *get_keywords(paragraph *source) {
     return kl;
 }
 
+/*
+ * Build a keywordlist around an existing array of keywords (from a
+ * saved document tree). The keywords still belong to the caller, so
+ * the result must not be passed to free_keywords.
+ */
+keywordlist *make_keywords(keyword **kws, int nkws) {
+    keywordlist *kl = snew(keywordlist);
+    int i;
+
+    kl->size = 0;
+    kl->keys = newtree234(kwcmp);
+    kl->nlooseends = kl->looseendssize = 0;
+    kl->looseends = NULL;
+    for (i = 0; i < nkws; i++)
+	add234(kl->keys, kws[i]);
+    return kl;
+}
+
 void free_keywords(keywordlist *kl) {
     keyword *kw;
     while (kl->nlooseends)
@@ -138,6 +156,9 @@ void subst_keywords(paragraph *source, keywordlist *kl) {
 		close->text = NULL;
 		close->alt = NULL;
 		close->type = word_XrefEnd;
+		close->breaks = FALSE;
+		close->aux = 0;
+		close->private_data = NULL;
 		close->fpos = ptr->fpos;
 
 		close->next = ptr->next;
@@ -0,0 +1,423 @@
+/*
+ * libhalibut.c: the top level of Halibut, shared between the
+ * halibut command and programs using the library interface
+ */
+
+#include <assert.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "halibut.h"
+#include "paper.h"
+
+static void dbg_prtsource(paragraph *sourceform);
+static void dbg_prtwordlist(int level, word *w);
+static void dbg_prtkws(keywordlist *kws);
+
+static const struct pre_backend {
+    void *(*func)(paragraph *, keywordlist *, indexdata *, halibut *);
+    void (*free)(void *);
+    int bitfield;
+} pre_backends[] = {
+    {paper_pre_backend, paper_free_document, 0x0001}
+};
+
+static const struct backend {
+    char *name;
+    void (*func)(paragraph *, keywordlist *, indexdata *, void *, outdest *);
+    paragraph *(*filename)(char *filename);
+    int bitfield, prebackend_bitfield;
+} backends[] = {
+    {"text", text_backend, text_config_filename, 0x0001, 0},
+    {"xhtml", html_backend, html_config_filename, 0x0002, 0},
+    {"html", html_backend, html_config_filename, 0x0002, 0},
+    {"hlp", whlp_backend, whlp_config_filename, 0x0004, 0},
+    {"whlp", whlp_backend, whlp_config_filename, 0x0004, 0},
+    {"winhelp", whlp_backend, whlp_config_filename, 0x0004, 0},
+    {"man", man_backend, man_config_filename, 0x0008, 0},
+    {"info", info_backend, info_config_filename, 0x0010, 0},
+    {"ps", ps_backend, ps_config_filename, 0x0020, 0x0001},
+    {"pdf", pdf_backend, pdf_config_filename, 0x0040, 0x0001},
+};
+
+/*
+ * Look up an output format by name. Returns its bit for the
+ * backendbits arguments below, or 0 if there's no such format. If
+ * an output file name is given, *cfg is set to the configuration
+ * paragraphs which select it.
+ */
+int find_backend(char const *name, char *filename, paragraph **cfg) {
+    int k;
+
+    for (k = 0; k < (int)lenof(backends); k++)
+	if (!strcmp(name, backends[k].name)) {
+	    if (filename)
+		*cfg = backends[k].filename(filename);
+	    return backends[k].bitfield;
+	}
+    return 0;
+}
+
+/* ----------------------------------------------------------------------
+ * The library interface (see libhalibut.h).
+ */
+
+halibut *halibut_new(void) {
+    halibut *h = snew(halibut);
+
+    h->fonts = NULL;
+    h->filenames = NULL;
+    h->nfiles = h->filessize = 0;
+    h->cfg = h->cfg_tail = NULL;
+    h->backendbits = 0;
+    h->input_charset = CS_ASCII;
+    h->cachestore = pcstore_new();
+    h->out = outdest_files();
+    return h;
+}
+
+void halibut_reset(halibut *h) {
+    while (h->nfiles > 0)
+	sfree(h->filenames[--h->nfiles]);
+    free_para_list(h->cfg);
+    h->cfg = h->cfg_tail = NULL;
+    h->backendbits = 0;
+    h->input_charset = CS_ASCII;
+    outdest_reset(h->out);
+}
+
+void halibut_free(halibut *h) {
+    halibut_reset(h);
+    sfree(h->filenames);
+    free_font_list(h->fonts);
+    pcstore_free(h->cachestore);
+    outdest_free(h->out);
+    sfree(h);
+}
+
+void halibut_add_input(halibut *h, char const *filename) {
+    if (h->nfiles >= h->filessize) {
+	h->filessize = h->nfiles + 16;
+	h->filenames = sresize(h->filenames, h->filessize, char *);
+    }
+    h->filenames[h->nfiles++] = dupstr(filename);
+}
+
+static void add_cfg(halibut *h, paragraph *p) {
+    if (h->cfg_tail)
+	h->cfg_tail->next = p;
+    else
+	h->cfg = p;
+    while (p->next)
+	p = p->next;
+    h->cfg_tail = p;
+}
+
+int halibut_add_output(halibut *h, char const *format,
+		       char const *filename) {
+    paragraph *p = NULL;
+    int bit;
+
+    bit = find_backend(format, (char *)filename, &p);
+    if (!bit)
+	return FALSE;
+    h->backendbits |= bit;
+    if (p)
+	add_cfg(h, p);
+    return TRUE;
+}
+
+void halibut_add_config(halibut *h, char const *key, ...) {
+    paragraph *p = cmdline_cfg_new();
+    char const *s;
+    va_list ap;
+
+    cmdline_cfg_add(p, (char *)key);
+    va_start(ap, key);
+    while ((s = va_arg(ap, char const *)) != NULL)
+	cmdline_cfg_add(p, (char *)s);
+    va_end(ap);
+    add_cfg(h, p);
+}
+
+int halibut_set_input_charset(halibut *h, char const *charset) {
+    int cs = charset_from_localenc(charset);
+
+    if (cs == CS_NONE)
+	return FALSE;
+    h->input_charset = cs;
+    return TRUE;
+}
+
+void halibut_output_to_files(halibut *h) {
+    outdest_free(h->out);
+    h->out = outdest_files();
+}
+
+void halibut_output_to_memory(halibut *h) {
+    outdest_free(h->out);
+    h->out = outdest_memory();
+}
+
+void halibut_output_to_callbacks(halibut *h, halibut_outfuncs const *funcs,
+				 void *ctx) {
+    outdest_free(h->out);
+    h->out = outdest_callbacks(funcs, ctx);
+}
+
+int halibut_get_output(halibut *h, int n, char const **filename,
+		       char const **data, int *len) {
+    return outdest_get(h->out, n, filename, data, len);
+}
+
+int halibut_render(halibut *h) {
+    input in;
+    int ret;
+
+    /*
+     * Font files are read again along with everything else, so
+     * forget the ones from last time.
+     */
+    free_font_list(h->fonts);
+    h->fonts = NULL;
+    outdest_reset(h->out);
+
+    init_input(&in, h, h->filenames, h->nfiles, h->input_charset, 0);
+    in.cachestore = h->cachestore;
+    ret = process_document(h, &in, h->cfg, h->backendbits,
+			   FALSE, FALSE, NULL);
+    sfree(in.pushback);
+    pcstore_prune(h->cachestore);
+    return ret;
+}
+
+/* ----------------------------------------------------------------------
+ * Producing a document.
+ */
+
+
+/*
+ * Read, cross-reference and index the input files, and run the
+ * back ends on the result. Returns FALSE if the input was too
+ * broken to produce any output, or if a tree we were asked to save
+ * couldn't be written.
+ */
+int process_document(halibut *h, input *in, paragraph *cfg,
+		     int backendbits, int debug, int list_fonts,
+		     char *save_tree_file) {
+    paragraph *sourceform, *end, *p;
+    indexdata *idx;
+    keywordlist *keywords;
+    int ret = TRUE;
+
+    in->currindex = 0;
+    in->npushback = 0;
+
+    idx = make_index();
+
+    sourceform = read_input(in, idx);
+    if (list_fonts) {
+	listfonts(h);
+	exit(EXIT_SUCCESS);
+    }
+    if (!sourceform) {
+	cleanup_index(idx);
+	return FALSE;
+    }
+
+    /*
+     * Append the config directives acquired from the command line.
+     * They still belong to our caller, so we detach them again
+     * before freeing the document.
+     */
+    end = sourceform;
+    while (end && end->next)
+	end = end->next;
+    assert(end);
+
+    end->next = cfg;
+
+    keywords = get_keywords(sourceform);
+    if (!keywords) {
+	end->next = NULL;
+	free_para_list(sourceform);
+	cleanup_index(idx);
+	return FALSE;
+    }
+    gen_citations(sourceform, keywords);
+    subst_keywords(sourceform, keywords);
+
+    for (p = sourceform; p; p = p->next)
+	if (p->type == para_IM)
+	    index_merge(idx, TRUE, p->keyword, p->words, &p->fpos);
+
+    build_index(idx);
+
+    /*
+     * Set up attr_First / attr_Last / attr_Always, in the main
+     * document and in the index entries.
+     */
+    for (p = sourceform; p; p = p->next)
+	mark_attr_ends(p->words);
+    {
+	int i;
+	indexentry *entry;
+
+	for (i = 0; (entry = index234(idx->entries, i)) != NULL; i++)
+	    mark_attr_ends(entry->text);
+    }
+
+    /*
+     * If no output formats were asked for explicitly, saving the
+     * tree is all we were meant to do. The command-line config is
+     * left out of the saved tree, since --load-tree appends its own.
+     */
+    if (save_tree_file) {
+	end->next = NULL;
+	if (!save_tree(save_tree_file, sourceform, keywords, idx))
+	    ret = FALSE;
+	end->next = cfg;
+    }
+    if (!save_tree_file || backendbits != 0) {
+	if (debug)
+	    debug_document(sourceform, keywords, idx);
+
+	run_backends(h, sourceform, keywords, idx, backendbits);
+    }
+
+    end->next = NULL;
+    free_para_list(sourceform);
+    free_keywords(keywords);
+    cleanup_index(idx);
+    return ret;
+}
+
+/*
+ * Select and run the pre-backends, and then the back ends.
+ */
+void run_backends(halibut *h, paragraph *sourceform, keywordlist *keywords,
+		  indexdata *idx, int backendbits) {
+    void *pre_backend_data[16];
+    int prebackbits;
+    int k, b;
+
+    prebackbits = 0;
+    for (k = 0; k < (int)lenof(backends); k++)
+	if (backendbits == 0 || (backendbits & backends[k].bitfield))
+	    prebackbits |= backends[k].prebackend_bitfield;
+    for (k = 0; k < (int)lenof(pre_backends); k++)
+	if (prebackbits & pre_backends[k].bitfield) {
+	    assert(k < (int)lenof(pre_backend_data));
+	    pre_backend_data[k] =
+		pre_backends[k].func(sourceform, keywords, idx, h);
+	}
+
+    for (k = b = 0; k < (int)lenof(backends); k++)
+	if (b != backends[k].bitfield) {
+	    b = backends[k].bitfield;
+	    if (backendbits == 0 || (backendbits & b)) {
+		void *pbd = NULL;
+		int pbb = backends[k].prebackend_bitfield;
+		int m;
+
+		for (m = 0; m < (int)lenof(pre_backends); m++)
+		    if (pbb & pre_backends[m].bitfield) {
+			assert(m < (int)lenof(pre_backend_data));
+			pbd = pre_backend_data[m];
+			break;
+		    }
+
+		backends[k].func(sourceform, keywords, idx, pbd, h->out);
+	    }
+	}
+
+    for (k = 0; k < (int)lenof(pre_backends); k++)
+	if (prebackbits & pre_backends[k].bitfield)
+	    pre_backends[k].free(pre_backend_data[k]);
+}
+
+/*
+ * Output the parsed document in debugging format, for -d.
+ */
+void debug_document(paragraph *sourceform, keywordlist *keywords,
+		    indexdata *idx) {
+    index_debug(idx);
+    dbg_prtkws(keywords);
+    dbg_prtsource(sourceform);
+}
+
+static void dbg_prtsource(paragraph *sourceform) {
+    /*
+     * Output source form in debugging format.
+     */
+
+    paragraph *p;
+    for (p = sourceform; p; p = p->next) {
+	wchar_t *wp;
+	printf("para %d ", p->type);
+	if (p->keyword) {
+	    wp = p->keyword;
+	    while (*wp) {
+		putchar('\"');
+		for (; *wp; wp++)
+		    putchar(*wp);
+		putchar('\"');
+		if (*++wp)
+		    printf(", ");
+	    }
+	} else
+	    printf("(no keyword)");
+	printf(" {\n");
+	dbg_prtwordlist(1, p->words);
+	printf("}\n");
+    }
+}
+
+static void dbg_prtkws(keywordlist *kws) {
+    /*
+     * Output keywords in debugging format.
+     */
+
+    int i;
+    keyword *kw;
+
+    for (i = 0; (kw = index234(kws->keys, i)) != NULL; i++) {
+	wchar_t *wp;
+	printf("keyword ");
+	wp = kw->key;
+	while (*wp) {
+	    putchar('\"');
+	    for (; *wp; wp++)
+		putchar(*wp);
+	    putchar('\"');
+	    if (*++wp)
+		printf(", ");
+	}
+	printf(" {\n");
+	dbg_prtwordlist(1, kw->text);
+	printf("}\n");
+    }
+}
+
+static void dbg_prtwordlist(int level, word *w) {
+    for (; w; w = w->next) {
+	wchar_t *wp;
+	printf("%*sword %d ", level*4, "", w->type);
+	if (w->text) {
+	    printf("\"");
+	    for (wp = w->text; *wp; wp++)
+		    putchar(*wp);
+	    printf("\"");
+	} else
+	    printf("(no text)");
+	if (w->breaks)
+	    printf(" [breaks]");
+	if (w->alt) {
+	    printf(" alt = {\n");
+	    dbg_prtwordlist(level+1, w->alt);
+	    printf("%*s}", level*4, "");
+	}
+	printf("\n");
+    }
+}
+
@@ -0,0 +1,102 @@
+/*
+ * libhalibut.h: interface for programs which want to run Halibut
+ * in-process, rather than starting the halibut command.
+ *
+ * A `halibut' object holds one document: its input files, its
+ * configuration, the output formats wanted, and any fonts read from
+ * its input. Separate threads may each render their own document at
+ * the same time; any one object must only be used by one thread at
+ * a time. What objects do share is safe to use from several
+ * threads at once: caches which only ever fill up with the same
+ * answers whoever asks (character widths, which charsets leave
+ * ASCII alone, glyph names, the standard fonts' metrics), and
+ * standard error, to which each diagnostic is written whole.
+ *
+ * Diagnostics go to standard error, just as for the halibut
+ * command. Output files are named here or by the document's
+ * configuration; by default they're written relative to the current
+ * directory, but they can be kept in memory or passed to the
+ * caller's own functions instead.
+ */
+
+#ifndef HALIBUT_LIBHALIBUT_H
+#define HALIBUT_LIBHALIBUT_H
+
+typedef struct halibut_Tag halibut;
+
+halibut *halibut_new(void);
+void halibut_free(halibut *h);
+
+/*
+ * Add an input file: Halibut source, or a font file.
+ */
+void halibut_add_input(halibut *h, char const *filename);
+
+/*
+ * Ask for output in one of the formats the halibut command has an
+ * option for ("text", "html", "pdf" and so on), optionally naming
+ * the output file, as `--pdf=filename' would. Returns 0 if there's
+ * no such format.
+ */
+int halibut_add_output(halibut *h, char const *format,
+		       char const *filename);
+
+/*
+ * Add a configuration directive, as `\cfg' in the input or `-C' on
+ * the command line would. The arguments are the directive's key
+ * and then its values, terminated by NULL.
+ */
+void halibut_add_config(halibut *h, char const *key, ...);
+
+/*
+ * Set the character set in which input files are read, if they
+ * don't say for themselves. Returns 0 if the name isn't recognised.
+ */
+int halibut_set_input_charset(halibut *h, char const *charset);
+
+/*
+ * Where output files go. halibut_output_to_files() restores the
+ * default of writing real files.
+ *
+ * halibut_output_to_memory() keeps each output file in memory
+ * instead. After halibut_render(), halibut_get_output() retrieves
+ * them one at a time, in order of file name, starting at n = 0; it
+ * returns 0 when there are no more. The data is followed by a zero
+ * byte not counted in len, and stays valid until the next call to
+ * halibut_render(), halibut_reset() or halibut_free().
+ *
+ * halibut_output_to_callbacks() hands the output to the caller as it
+ * is produced. `open' is given the file name and returns a handle
+ * for `write' and `close', or NULL to report that the file can't be
+ * opened. `write' and `close' return 0 on failure. The functions
+ * may be called from threads other than the one that called
+ * halibut_render(), but never more than one at a time.
+ */
+typedef struct halibut_outfuncs {
+    void *(*open)(void *ctx, char const *filename);
+    int (*write)(void *file, void const *data, int len);
+    int (*close)(void *file);
+} halibut_outfuncs;
+void halibut_output_to_files(halibut *h);
+void halibut_output_to_memory(halibut *h);
+void halibut_output_to_callbacks(halibut *h, halibut_outfuncs const *funcs,
+				 void *ctx);
+int halibut_get_output(halibut *h, int n, char const **filename,
+		       char const **data, int *len);
+
+/*
+ * Read the input files and write all the requested output (or
+ * every format, if none was requested). Can be called again after
+ * the input files change; files which haven't changed since the
+ * last call aren't parsed again. Returns 0 if the input was too
+ * broken to produce any output.
+ */
+int halibut_render(halibut *h);
+
+/*
+ * Forget the input files, output formats and configuration, so that
+ * the object can be used for a different document.
+ */
+void halibut_reset(halibut *h);
+
+#endif
@@ -8,35 +8,6 @@
 #include <stdlib.h>
 #include "halibut.h"
 
-static void dbg_prtsource(paragraph *sourceform);
-static void dbg_prtwordlist(int level, word *w);
-static void dbg_prtkws(keywordlist *kws);
-
-static const struct pre_backend {
-    void *(*func)(paragraph *, keywordlist *, indexdata *);
-    int bitfield;
-} pre_backends[] = {
-    {paper_pre_backend, 0x0001}
-};
-
-static const struct backend {
-    char *name;
-    void (*func)(paragraph *, keywordlist *, indexdata *, void *);
-    paragraph *(*filename)(char *filename);
-    int bitfield, prebackend_bitfield;
-} backends[] = {
-    {"text", text_backend, text_config_filename, 0x0001, 0},
-    {"xhtml", html_backend, html_config_filename, 0x0002, 0},
-    {"html", html_backend, html_config_filename, 0x0002, 0},
-    {"hlp", whlp_backend, whlp_config_filename, 0x0004, 0},
-    {"whlp", whlp_backend, whlp_config_filename, 0x0004, 0},
-    {"winhelp", whlp_backend, whlp_config_filename, 0x0004, 0},
-    {"man", man_backend, man_config_filename, 0x0008, 0},
-    {"info", info_backend, info_config_filename, 0x0010, 0},
-    {"ps", ps_backend, ps_config_filename, 0x0020, 0x0001},
-    {"pdf", pdf_backend, pdf_config_filename, 0x0040, 0x0001},
-};
-
 int main(int argc, char **argv) {
     char **infiles;
     int nfiles;
@@ -46,10 +17,13 @@ int main(int argc, char **argv) {
     int list_fonts;
     int input_charset;
     int debug;
-    int backendbits, prebackbits;
+    int backendbits;
     int k, b;
-    paragraph *cfg, *cfg_tail;
-    void *pre_backend_data[16];
+    int watch;
+    char *save_tree_file, *load_tree_file;
+    char *cachedir;
+    paragraph *cfg, *cfg_tail, *para;
+    halibut *h;
 
     /*
      * Use the specified locale everywhere. It'll be used for
@@ -74,6 +48,9 @@ int main(int argc, char **argv) {
     debug = 0;
     backendbits = 0;
     cfg = cfg_tail = NULL;
+    save_tree_file = load_tree_file = NULL;
+    cachedir = NULL;
+    watch = FALSE;
 
     if (argc == 1) {
 	usage();
@@ -108,24 +85,18 @@ int main(int argc, char **argv) {
 			    val = NULL;
 
 			assert(opt[0] == '-');
-			for (k = 0; k < (int)lenof(backends); k++)
-			    if (!strcmp(opt+1, backends[k].name)) {
-				backendbits |= backends[k].bitfield;
-				if (val) {
-				    paragraph *p = backends[k].filename(val);
-				    assert(p);
-				    if (cfg_tail)
-					cfg_tail->next = p;
-				    else
-					cfg = p;
-				    while (p->next)
-					p = p->next;
-				    cfg_tail = p;
-				}
-				break;
+			if ((b = find_backend(opt+1, val, &para)) != 0) {
+			    backendbits |= b;
+			    if (val) {
+				assert(para);
+				if (cfg_tail)
+				    cfg_tail->next = para;
+				else
+				    cfg = para;
+				while (para->next)
+				    para = para->next;
+				cfg_tail = para;
 			    }
-			if (k < (int)lenof(backends)) {
-			    /* do nothing */;
 			} else if (!strcmp(opt, "-input-charset")) {
 			    if (!val) {
 				errs = TRUE, err_optnoarg(opt);
@@ -154,6 +125,38 @@ int main(int argc, char **argv) {
 			    list_fonts = TRUE;
 			} else if (!strcmp(opt, "-precise")) {
 			    reportcols = 1;
+			} else if (!strcmp(opt, "-jobs")) {
+			    if (!val) {
+				errs = TRUE, err_optnoarg(opt);
+			    } else {
+				char *end;
+				long n = strtol(val, &end, 10);
+				if (end == val || *end || n < 0)
+				    errs = TRUE, err_badjobs(val);
+				else
+				    parallel_set_jobs(n > MAX_JOBS ? MAX_JOBS :
+						      (int)n);
+			    }
+			} else if (!strcmp(opt, "-save-tree")) {
+			    if (!val) {
+				errs = TRUE, err_optnoarg(opt);
+			    } else {
+				save_tree_file = val;
+			    }
+			} else if (!strcmp(opt, "-load-tree")) {
+			    if (!val) {
+				errs = TRUE, err_optnoarg(opt);
+			    } else {
+				load_tree_file = val;
+			    }
+			} else if (!strcmp(opt, "-parse-cache")) {
+			    if (!val) {
+				errs = TRUE, err_optnoarg(opt);
+			    } else {
+				cachedir = val;
+			    }
+			} else if (!strcmp(opt, "-watch")) {
+			    watch = TRUE;
 			} else {
 			    errs = TRUE, err_nosuchopt(opt);
 			}
@@ -279,204 +282,120 @@ int main(int argc, char **argv) {
     /*
      * Do the work.
      */
-    if (nfiles == 0 && !list_fonts) {
+    if (nfiles == 0 && !list_fonts && !load_tree_file) {
 	err_noinput();
 	usage();
 	exit(EXIT_FAILURE);
     }
+    if (watch) {
+	if (load_tree_file) {
+	    err_futileopt("-watch", " with --load-tree");
+	    watch = FALSE;
+	}
+	for (k = 0; k < nfiles; k++)
+	    if (!infiles[k]) {
+		err_watchstdin();
+		exit(EXIT_FAILURE);
+	    }
+    }
 
     {
 	input in;
-	paragraph *sourceform, *p;
-	indexdata *idx;
-	keywordlist *keywords;
-
-	in.filenames = infiles;
-	in.nfiles = nfiles;
-	in.currfp = NULL;
-	in.currindex = 0;
-	in.npushback = in.pushbacksize = 0;
-	in.pushback = NULL;
-	in.reportcols = reportcols;
-	in.stack = NULL;
-	in.defcharset = input_charset;
-
-	idx = make_index();
-
-	sourceform = read_input(&in, idx);
-	if (list_fonts) {
-	    listfonts();
-	    exit(EXIT_SUCCESS);
-	}
-	if (!sourceform)
-	    exit(EXIT_FAILURE);
-
-	/*
-	 * Append the config directives acquired from the command
-	 * line.
-	 */
-	{
-	    paragraph *end;
-
-	    end = sourceform;
-	    while (end && end->next)
-		end = end->next;
-	    assert(end);
-
-	    end->next = cfg;
-	}
-
-	sfree(in.pushback);
-
-	sfree(infiles);
-
-	keywords = get_keywords(sourceform);
-	if (!keywords)
-	    exit(EXIT_FAILURE);
-	gen_citations(sourceform, keywords);
-	subst_keywords(sourceform, keywords);
-
-	for (p = sourceform; p; p = p->next)
-	    if (p->type == para_IM)
-		index_merge(idx, TRUE, p->keyword, p->words, &p->fpos);
 
-	build_index(idx);
+	h = halibut_new();
+	init_input(&in, h, infiles, nfiles, input_charset, reportcols);
+	in.cachedir = cachedir;
 
-	/*
-	 * Set up attr_First / attr_Last / attr_Always, in the main
-	 * document and in the index entries.
-	 */
-	for (p = sourceform; p; p = p->next)
-	    mark_attr_ends(p->words);
-	{
-	    int i;
-	    indexentry *entry;
+	if (load_tree_file) {
+	    paragraph *sourceform, *p;
+	    indexdata *idx;
+	    keywordlist *keywords;
+	    treefile *tree;
 
-	    for (i = 0; (entry = index234(idx->entries, i)) != NULL; i++)
-		mark_attr_ends(entry->text);
-	}
-
-	if (debug) {
-	    index_debug(idx);
-	    dbg_prtkws(keywords);
-	    dbg_prtsource(sourceform);
-	}
-
-	/*
-	 * Select and run the pre-backends.
-	 */
-	prebackbits = 0;
-	for (k = 0; k < (int)lenof(backends); k++)
-	    if (backendbits == 0 || (backendbits & backends[k].bitfield))
-		prebackbits |= backends[k].prebackend_bitfield;
-	for (k = 0; k < (int)lenof(pre_backends); k++)
-	    if (prebackbits & pre_backends[k].bitfield) {
-		assert(k < (int)lenof(pre_backend_data));
-		pre_backend_data[k] =
-		    pre_backends[k].func(sourceform, keywords, idx);
-	    }
-
-	/*
-	 * Run the selected set of backends.
-	 */
-	for (k = b = 0; k < (int)lenof(backends); k++)
-	    if (b != backends[k].bitfield) {
-		b = backends[k].bitfield;
-		if (backendbits == 0 || (backendbits & b)) {
-		    void *pbd = NULL;
-		    int pbb = backends[k].prebackend_bitfield;
-		    int m;
-
-		    for (m = 0; m < (int)lenof(pre_backends); m++)
-			if (pbb & pre_backends[m].bitfield) {
-			    assert(m < (int)lenof(pre_backend_data));
-			    pbd = pre_backend_data[m];
-			    break;
-			}
-			    
-		    backends[k].func(sourceform, keywords, idx, pbd);
+	    /*
+	     * The document comes ready-parsed from a tree file. Any
+	     * input files we were given can only be fonts, but we
+	     * still have to read them.
+	     */
+	    tree = load_tree(load_tree_file, &sourceform, &keywords, &idx);
+	    if (!tree)
+		exit(EXIT_FAILURE);
+	    if (nfiles > 0) {
+		indexdata *fontidx = make_index();
+		if (read_input(&in, fontidx)) {
+		    err_treetext();
+		    exit(EXIT_FAILURE);
 		}
+		cleanup_index(fontidx);
+	    }
+	    if (list_fonts) {
+		listfonts(h);
+		exit(EXIT_SUCCESS);
 	    }
+	    if (!sourceform)
+		exit(EXIT_FAILURE);
 
-	free_para_list(sourceform);
-	free_keywords(keywords);
-	cleanup_index(idx);
-    }
+	    /*
+	     * Config from the command line goes on the end as usual.
+	     * (Too late to affect numbering, since that was done
+	     * when the tree was saved.)
+	     */
+	    for (p = sourceform; p->next; p = p->next);
+	    p->next = cfg;
 
-    return 0;
-}
+	    if (debug)
+		debug_document(sourceform, keywords, idx);
 
-static void dbg_prtsource(paragraph *sourceform) {
-    /*
-     * Output source form in debugging format.
-     */
+	    run_backends(h, sourceform, keywords, idx, backendbits);
 
-    paragraph *p;
-    for (p = sourceform; p; p = p->next) {
-	wchar_t *wp;
-	printf("para %d ", p->type);
-	if (p->keyword) {
-	    wp = p->keyword;
-	    while (*wp) {
-		putchar('\"');
-		for (; *wp; wp++)
-		    putchar(*wp);
-		putchar('\"');
-		if (*++wp)
-		    printf(", ");
+	    free_para_list(cfg);
+	    free_tree(tree);
+	} else if (!watch) {
+	    if (!process_document(h, &in, cfg, backendbits, debug, list_fonts,
+				  save_tree_file))
+		exit(EXIT_FAILURE);
+	    free_para_list(cfg);
+	} else {
+	    /*
+	     * Build once, then again every time any input file
+	     * changes, until we're interrupted. Files which haven't
+	     * changed come back out of the parse cache (kept in
+	     * memory if the user didn't give us a directory for it),
+	     * and font files which haven't changed aren't reread at
+	     * all.
+	     */
+	    watcher *w = watch_new(infiles, nfiles);
+	    int *changed = snewn(nfiles, int);
+	    int i, n;
+
+	    if (!cachedir)
+		in.cachestore = h->cachestore;
+	    in.unchanged = snewn(nfiles, int);
+	    for (i = 0; i < nfiles; i++)
+		in.unchanged[i] = FALSE;
+
+	    process_document(h, &in, cfg, backendbits, debug, list_fonts,
+			     save_tree_file);
+	    while (1) {
+		watch_wait(w, changed);
+		for (i = n = 0; i < nfiles; i++) {
+		    in.unchanged[i] = !changed[i];
+		    if (changed[i])
+			n++;
+		}
+		if (process_document(h, &in, cfg, backendbits, debug,
+				     list_fonts, save_tree_file))
+		    info_watchrebuilt(n);
+		if (in.cachestore)
+		    pcstore_prune(in.cachestore);
 	    }
-	} else
-	    printf("(no keyword)");
-	printf(" {\n");
-	dbg_prtwordlist(1, p->words);
-	printf("}\n");
-    }
-}
-
-static void dbg_prtkws(keywordlist *kws) {
-    /*
-     * Output keywords in debugging format.
-     */
-
-    int i;
-    keyword *kw;
-
-    for (i = 0; (kw = index234(kws->keys, i)) != NULL; i++) {
-	wchar_t *wp;
-	printf("keyword ");
-	wp = kw->key;
-	while (*wp) {
-	    putchar('\"');
-	    for (; *wp; wp++)
-		putchar(*wp);
-	    putchar('\"');
-	    if (*++wp)
-		printf(", ");
 	}
-	printf(" {\n");
-	dbg_prtwordlist(1, kw->text);
-	printf("}\n");
-    }
-}
 
-static void dbg_prtwordlist(int level, word *w) {
-    for (; w; w = w->next) {
-	wchar_t *wp;
-	printf("%*sword %d ", level*4, "", w->type);
-	if (w->text) {
-	    printf("\"");
-	    for (wp = w->text; *wp; wp++)
-		    putchar(*wp);
-	    printf("\"");
-	} else
-	    printf("(no text)");
-	if (w->breaks)
-	    printf(" [breaks]");
-	if (w->alt) {
-	    printf(" alt = {\n");
-	    dbg_prtwordlist(level+1, w->alt);
-	    printf("%*s}", level*4, "");
-	}
-	printf("\n");
+	sfree(in.pushback);
+	halibut_free(h);
     }
+
+    sfree(infiles);
+
+    return 0;
 }
@@ -143,6 +143,7 @@ void free_para_list(paragraph *p) {
 	t = p;
 	p = p->next;
 	sfree(t->keyword);
+	sfree(t->origkeyword);
 	free_word_list(t->words);
 	sfree(t);
     }
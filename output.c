@@ -0,0 +1,443 @@
+/*
+ * output.c: where the back ends' output goes
+ *
+ * Every back end writes each of its output files through an
+ * outsink, which it gets by asking an outdest to open the file by
+ * name. The ordinary outdest writes real files (with `-' meaning
+ * standard output); programs using the library interface can
+ * instead have every output file collected in memory, or handed to
+ * functions of their own as it's produced.
+ */
+
+#define _ISOC99_SOURCE			/* for vsnprintf */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <assert.h>
+#include "halibut.h"
+
+#if !defined va_copy && defined __va_copy
+#define va_copy __va_copy
+#endif
+
+#define OUT_BUFSIZE 65536
+
+enum { DEST_FILES, DEST_MEMORY, DEST_CALLBACKS };
+
+struct outdest_Tag {
+    int type;
+    tree234 *outputs;		       /* DEST_MEMORY: memfiles, by name */
+    halibut_outfuncs funcs;	       /* DEST_CALLBACKS */
+    void *ctx;
+};
+
+typedef struct {
+    char *filename;
+    char *data;
+    int len;
+} memfile;
+
+struct outsink_Tag {
+    outdest *dest;
+    char *filename;
+    int flags;
+    FILE *fp;			       /* if writing straight to a file */
+    void *file;			       /* caller's handle, for DEST_CALLBACKS */
+    char *buf;			       /* otherwise, output collects here */
+    int len, size;
+    int error;
+};
+
+static int memfile_cmp(void *av, void *bv)
+{
+    memfile *a = (memfile *)av;
+    memfile *b = (memfile *)bv;
+    return strcmp(a->filename, b->filename);
+}
+
+static outdest *outdest_new(int type)
+{
+    outdest *d = snew(outdest);
+
+    d->type = type;
+    d->outputs = NULL;
+    d->ctx = NULL;
+    return d;
+}
+
+outdest *outdest_files(void)
+{
+    return outdest_new(DEST_FILES);
+}
+
+outdest *outdest_memory(void)
+{
+    outdest *d = outdest_new(DEST_MEMORY);
+    d->outputs = newtree234(memfile_cmp);
+    return d;
+}
+
+outdest *outdest_callbacks(halibut_outfuncs const *funcs, void *ctx)
+{
+    outdest *d = outdest_new(DEST_CALLBACKS);
+    d->funcs = *funcs;
+    d->ctx = ctx;
+    return d;
+}
+
+/*
+ * Forget any output collected in memory.
+ */
+void outdest_reset(outdest *d)
+{
+    memfile *mf;
+
+    if (!d->outputs)
+	return;
+    while ((mf = delpos234(d->outputs, 0)) != NULL) {
+	sfree(mf->filename);
+	sfree(mf->data);
+	sfree(mf);
+    }
+}
+
+void outdest_free(outdest *d)
+{
+    outdest_reset(d);
+    if (d->outputs)
+	freetree234(d->outputs);
+    sfree(d);
+}
+
+/*
+ * Retrieve the nth output file collected in memory, in order of
+ * file name. Returns FALSE if there isn't one.
+ */
+int outdest_get(outdest *d, int n, char const **filename,
+		char const **data, int *len)
+{
+    memfile *mf;
+
+    if (!d->outputs || (mf = index234(d->outputs, n)) == NULL)
+	return FALSE;
+    *filename = mf->filename;
+    *data = mf->data;
+    *len = mf->len;
+    return TRUE;
+}
+
+/*
+ * Open an output file. Returns NULL, having reported the error, if
+ * it can't be opened.
+ *
+ * OUT_IF_CHANGED only means anything to real files: the output is
+ * collected in memory, and out_close() leaves an existing file
+ * alone if it already has exactly that content.
+ */
+outsink *out_open(outdest *d, char const *filename, int flags)
+{
+    outsink *s = snew(outsink);
+
+    s->dest = d;
+    s->filename = dupstr((char *)filename);
+    s->flags = flags;
+    s->fp = NULL;
+    s->file = NULL;
+    s->buf = NULL;
+    s->len = s->size = 0;
+    s->error = FALSE;
+
+    switch (d->type) {
+      case DEST_FILES:
+	if (!strcmp(filename, "-")) {
+	    s->fp = stdout;
+	    s->flags &= ~OUT_IF_CHANGED;
+	} else if (!(flags & OUT_IF_CHANGED)) {
+	    s->fp = fopen(filename, (flags & OUT_BINARY) ? "wb" : "w");
+	    if (!s->fp) {
+		err_cantopenw(filename);
+		sfree(s->filename);
+		sfree(s);
+		return NULL;
+	    }
+	}
+	break;
+      case DEST_CALLBACKS:
+	parallel_lock(LOCK_OUTPUT);
+	s->file = d->funcs.open(d->ctx, filename);
+	parallel_unlock(LOCK_OUTPUT);
+	if (!s->file) {
+	    err_cantopenw(filename);
+	    sfree(s->filename);
+	    sfree(s);
+	    return NULL;
+	}
+	break;
+    }
+
+    if (!s->fp) {
+	s->size = OUT_BUFSIZE;
+	s->buf = snewn(s->size, char);
+    }
+    return s;
+}
+
+/*
+ * Open a sink which just collects what's written to it in memory,
+ * for a back end which builds pieces of a file separately (perhaps
+ * on several threads) and then writes them out in order.
+ * out_close_buffer() hands back the data, which the caller must
+ * free, and frees the sink.
+ */
+outsink *out_open_buffer(void)
+{
+    static outdest buffer_dest = {
+	DEST_MEMORY, NULL, { NULL, NULL, NULL }, NULL
+    };
+    outsink *s = snew(outsink);
+
+    s->dest = &buffer_dest;
+    s->filename = NULL;
+    s->flags = OUT_BINARY;
+    s->fp = NULL;
+    s->file = NULL;
+    s->size = 4096;
+    s->buf = snewn(s->size, char);
+    s->len = 0;
+    s->error = FALSE;
+    return s;
+}
+
+char *out_close_buffer(outsink *s, int *len)
+{
+    char *data = s->buf;
+
+    *len = s->len;
+    sfree(s);
+    return data;
+}
+
+/*
+ * Pass buffered data on to the caller's write function.
+ */
+static void out_flush(outsink *s)
+{
+    if (s->len > 0 && !s->error) {
+	parallel_lock(LOCK_OUTPUT);
+	if (!s->dest->funcs.write(s->file, s->buf, s->len))
+	    s->error = TRUE;
+	parallel_unlock(LOCK_OUTPUT);
+    }
+    s->len = 0;
+}
+
+/*
+ * Make room for at least n more bytes in the buffer. Callback sinks
+ * empty the buffer where they can; everything else keeps the whole
+ * file, so the buffer just grows.
+ */
+static void out_reserve(outsink *s, int n)
+{
+    if (s->len + n <= s->size)
+	return;
+    if (s->dest->type == DEST_CALLBACKS) {
+	out_flush(s);
+	if (n <= s->size)
+	    return;
+    }
+    s->size = (s->len + n) * 3 / 2;
+    s->buf = sresize(s->buf, s->size, char);
+}
+
+void out_write(outsink *s, void const *data, int len)
+{
+    if (s->fp) {
+	if (fwrite(data, 1, len, s->fp) != (size_t)len)
+	    s->error = TRUE;
+	return;
+    }
+    out_reserve(s, len);
+    memcpy(s->buf + s->len, data, len);
+    s->len += len;
+}
+
+void out_puts(outsink *s, char const *str)
+{
+    out_write(s, str, strlen(str));
+}
+
+void out_putc(outsink *s, int c)
+{
+    if (s->fp) {
+	if (putc(c, s->fp) == EOF)
+	    s->error = TRUE;
+	return;
+    }
+    out_reserve(s, 1);
+    s->buf[s->len++] = (char)c;
+}
+
+/*
+ * Formatted output, returning the number of characters written as
+ * fprintf would.
+ */
+int out_vprintf(outsink *s, char const *fmt, va_list ap)
+{
+    va_list ap2;
+    int n;
+
+    if (s->fp) {
+	n = vfprintf(s->fp, fmt, ap);
+	if (n < 0)
+	    s->error = TRUE;
+	return n;
+    }
+
+    out_reserve(s, 256);
+    va_copy(ap2, ap);
+    n = vsnprintf(s->buf + s->len, s->size - s->len, fmt, ap2);
+    va_end(ap2);
+    assert(n >= 0);
+    if (n >= s->size - s->len) {
+	out_reserve(s, n + 1);
+	vsnprintf(s->buf + s->len, s->size - s->len, fmt, ap);
+    }
+    s->len += n;
+    return n;
+}
+
+int out_printf(outsink *s, char const *fmt, ...)
+{
+    va_list ap;
+    int n;
+
+    va_start(ap, fmt);
+    n = out_vprintf(s, fmt, ap);
+    va_end(ap);
+    return n;
+}
+
+/*
+ * Replace a file with new contents, unless it already has exactly
+ * those contents. The new file is written under a temporary name
+ * and renamed into place, so that nothing reading the directory
+ * ever sees a half-written file. Returns TRUE if the file was
+ * written.
+ */
+static int update_file(char const *filename, char const *data, int len,
+		       int flags)
+{
+    FILE *fp;
+    char *tmpname;
+    int ok;
+
+    fp = fopen(filename, (flags & OUT_BINARY) ? "rb" : "r");
+    if (fp) {
+	char buf[4096];
+	int pos = 0, n;
+
+	ok = TRUE;
+	while (ok && (n = fread(buf, 1, sizeof(buf), fp)) > 0) {
+	    if (n > len - pos || memcmp(buf, data + pos, n))
+		ok = FALSE;
+	    pos += n;
+	}
+	fclose(fp);
+	if (ok && pos == len)
+	    return FALSE;	       /* unchanged */
+    }
+
+    tmpname = snewn(strlen(filename) + 5, char);
+    sprintf(tmpname, "%s.tmp", filename);
+    fp = fopen(tmpname, (flags & OUT_BINARY) ? "wb" : "w");
+    if (!fp) {
+	err_cantopenw(tmpname);
+	sfree(tmpname);
+	return FALSE;
+    }
+    ok = (fwrite(data, 1, len, fp) == (size_t)len);
+    if (fclose(fp))
+	ok = FALSE;
+    if (ok && rename(tmpname, filename)) {
+	/*
+	 * Some systems won't rename over an existing file.
+	 */
+	remove(filename);
+	if (rename(tmpname, filename))
+	    ok = FALSE;
+    }
+    if (!ok) {
+	remove(tmpname);
+	err_cantwrite(filename);
+    }
+    sfree(tmpname);
+    return ok;
+}
+
+/*
+ * Finish an output file and free the sink. Returns TRUE if the file
+ * was written: FALSE if something went wrong (which has been
+ * reported), or if OUT_IF_CHANGED found nothing to change.
+ */
+int out_close(outsink *s)
+{
+    int written = TRUE;
+
+    switch (s->dest->type) {
+      case DEST_FILES:
+	if (s->flags & OUT_IF_CHANGED) {
+	    written = update_file(s->filename, s->buf, s->len, s->flags);
+	} else if (s->fp == stdout) {
+	    if (fflush(stdout))
+		s->error = TRUE;
+	} else if (fclose(s->fp))
+	    s->error = TRUE;
+	break;
+      case DEST_MEMORY:
+	{
+	    memfile *mf = snew(memfile), *old;
+
+	    mf->filename = s->filename;
+	    mf->data = sresize(s->buf, s->len + 1, char);
+	    mf->data[s->len] = '\0';
+	    mf->len = s->len;
+	    s->filename = NULL;
+	    s->buf = NULL;
+
+	    /*
+	     * Writing the same file twice replaces it, just as it
+	     * would on disk.
+	     */
+	    parallel_lock(LOCK_OUTPUT);
+	    old = add234(s->dest->outputs, mf);
+	    if (old != mf) {
+		del234(s->dest->outputs, old);
+		add234(s->dest->outputs, mf);
+	    }
+	    parallel_unlock(LOCK_OUTPUT);
+	    if (old != mf) {
+		sfree(old->filename);
+		sfree(old->data);
+		sfree(old);
+	    }
+	}
+	break;
+      case DEST_CALLBACKS:
+	out_flush(s);
+	parallel_lock(LOCK_OUTPUT);
+	if (!s->dest->funcs.close(s->file))
+	    s->error = TRUE;
+	parallel_unlock(LOCK_OUTPUT);
+	break;
+    }
+
+    if (s->error) {
+	err_cantwrite(s->filename);
+	written = FALSE;
+    }
+    sfree(s->filename);
+    sfree(s->buf);
+    sfree(s);
+    return written;
+}
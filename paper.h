@@ -29,6 +29,8 @@ typedef struct line_data_Tag line_data;
 typedef struct page_data_Tag page_data;
 typedef struct subfont_map_entry_Tag subfont_map_entry;
 typedef struct text_fragment_Tag text_fragment;
+typedef struct frag_kern_Tag frag_kern;
+typedef struct frag_chunk_Tag frag_chunk;
 typedef struct xref_Tag xref;
 typedef struct xref_dest_Tag xref_dest;
 typedef struct rect_Tag rect;
@@ -44,6 +46,7 @@ struct document_Tag {
     page_data *pages;
     outline_element *outline_elements;
     int n_outline_elements;
+    para_data *paras;		       /* every paragraph, for freeing */
 };
 
 /*
@@ -78,8 +81,6 @@ struct ligature_Tag {
  * metrics are read in.
  */
 
-font_info *all_fonts;
-
 struct font_info_Tag {
     font_info *next;
     /*
@@ -91,6 +92,12 @@ struct font_info_Tag {
      */
     void *fontfile;
     enum { TYPE1, TRUETYPE } filetype;
+    /*
+     * Indices into the input file list of the file the metrics came
+     * from, and of the font file if that was a separate one (or -1).
+     * A watched rebuild uses these to drop fonts from changed files.
+     */
+    int srcfile, fontsrcfile;
     /* A tree of glyph_widths */
     tree234 *widths;
     /* A tree of kern_pairs */
@@ -127,12 +134,15 @@ struct font_data_Tag {
     font_info const *info;
     /*
      * At some point I'm going to divide the font into sub-fonts
-     * with largely non-overlapping encoding vectors. This tree
-     * will track which glyphs go into which subfonts. Also here I
-     * keep track of the latest subfont of any given font, so I can
-     * go back and extend its encoding.
+     * with largely non-overlapping encoding vectors. This table
+     * will track which glyphs go into which subfonts. It's indexed
+     * by the top byte of the glyph number to find a block of 256
+     * entries (allocated on demand), then by the bottom byte;
+     * entries with a NULL subfont are glyphs not yet encoded. Also
+     * here I keep track of the latest subfont of any given font,
+     * so I can go back and extend its encoding.
      */
-    tree234 *subfont_map;
+    subfont_map_entry *subfont_map[256];
     font_encoding *latest_subfont;
     /*
      * The font list to which this font belongs.
@@ -167,6 +177,7 @@ struct font_encoding_Tag {
 struct font_list_Tag {
     font_encoding *head;
     font_encoding *tail;
+    font_info *loaded;		       /* fonts read from input files */
 };
 
 /*
@@ -235,6 +246,14 @@ struct para_data_Tag {
      * For adding the page number of a contents entry afterwards.
      */
     paragraph *contents_entry;
+    /*
+     * Word lists made up for this paragraph, rather than borrowed
+     * from the source document, which are freed along with it:
+     * the text itself, and the two pieces of auxiliary text. A
+     * code paragraph also owns the words on each of its lines.
+     */
+    word *own_words, *own_aux, *own_aux2;
+    int own_line_words;
 };
 
 struct line_data_Tag {
@@ -285,12 +304,6 @@ struct line_data_Tag {
      * Penalties for page breaking before or after this line.
      */
     int penalty_before, penalty_after;
-    /*
-     * These fields are used in the page breaking algorithm.
-     */
-    int *bestcost;
-    int *vshortfall, *text, *space;
-    line_data **page_last;	       /* last line on a page starting here */
     /*
      * After page breaking, we can assign an actual y-coordinate on
      * the page to each line. Also we store a pointer back to the
@@ -336,19 +349,37 @@ struct page_data_Tag {
      * The page number, as a string.
      */
     wchar_t *number;
+    /*
+     * Memory from which this page's text fragments are allocated.
+     */
+    frag_chunk *frag_chunks;
     /*
      * This spare pointer field is for use by the client backends.
      */
     void *spare;
 };
 
+/*
+ * A run of text in one subfont. If the font kerns any pairs of
+ * glyphs within the run, it's still one fragment, with a list of
+ * the places where the spacing changes.
+ */
 struct text_fragment_Tag {
     text_fragment *next;
     int x, y;
     font_encoding *fe;
     int fontsize;
     char *text;
-    int width;
+    int len;			       /* length of text */
+    int width;			       /* including any kerning */
+    frag_kern *kerns;
+    int nkerns;
+};
+
+struct frag_kern_Tag {
+    int pos;			       /* index in text of the glyph after */
+    int kern;			       /* the adjustment, in internal units */
+    int x;			       /* where that glyph starts */
 };
 
 struct xref_dest_Tag {
@@ -380,6 +411,9 @@ int width_cmp(void *, void *); /* use when setting up widths */
 int kern_cmp(void *, void *); /* use when setting up kern_pairs */
 int lig_cmp(void *, void *); /* use when setting up ligatures */
 int find_width(font_data *, glyph);
+#define NUMBUF_SIZE 24		       /* room for fmt_int or fmt_units */
+int fmt_int(char *buf, int n);
+int fmt_units(char *buf, int units);
 
 /*
  * Functions and data exported from psdata.c.
@@ -389,7 +423,9 @@ char const *glyph_extern(glyph);
 wchar_t ps_glyph_to_unicode(glyph);
 extern const char *const ps_std_glyphs[];
 extern glyph const tt_std_glyphs[];
-void init_std_fonts(void);
+font_info *std_fonts(void);
+font_info *find_font(font_info *fonts, char const *name);
+void free_font_list(font_info *fi);
 const int *ps_std_font_widths(char const *fontname);
 const kern_pair *ps_std_font_kerns(char const *fontname);
 
@@ -407,14 +443,15 @@ char *pdf_outline_convert(wchar_t *s, int *len);
 /*
  * Function exported from bk_ps.c
  */
-void ps_token(FILE *fp, int *cc, char const *fmt, ...);
+void ps_token(outsink *out, int *cc, char const *fmt, ...);
 
 /*
  * Backend functions exported by in_pf.c
  */
 void pf_part1(font_info *fi, char **bufp, size_t *lenp);
 void pf_part2(font_info *fi, char **bufp, size_t *lenp);
-void pf_writeps(font_info const *fi, FILE *ofp);
+void pf_writeps(font_info const *fi, outsink *out);
+void pf_free(void *fontfile);
 
 /*
  * Backend functions exported by in_sfnt.c
@@ -423,7 +460,10 @@ typedef struct sfnt_Tag sfnt;
 glyph sfnt_indextoglyph(sfnt *sf, unsigned idx);
 unsigned sfnt_glyphtoindex(sfnt *sf, glyph g);
 unsigned sfnt_nglyphs(sfnt *sf);
-void sfnt_writeps(font_info const *fi, FILE *ofp);
-void sfnt_data(font_info *fi, char **bufp, size_t *lenp);
+void sfnt_writeps(font_info const *fi, glyph const *glyphs, int nglyphs,
+		  outsink *out);
+void sfnt_data(sfnt *sf, char **bufp, size_t *lenp);
+sfnt *sfnt_subset(font_info const *fi, glyph const *glyphs, int nglyphs);
+void sfnt_free(void *fontfile);
 
 #endif
@@ -0,0 +1,241 @@
+/*
+ * parallel.c: run independent pieces of back end work on several
+ * threads at once
+ */
+
+/*
+ * We need POSIX declarations (sysconf, pthreads) even though the
+ * rest of Halibut is built as strict ANSI C.
+ */
+#define _POSIX_C_SOURCE 200112L
+
+#include <stdlib.h>
+#include "halibut.h"
+
+/*
+ * The debugging allocator in malloc.c keeps unlocked global state,
+ * so a LOGALLOC build always runs everything on one thread.
+ */
+#if defined LOGALLOC && !defined NO_THREADS
+#define NO_THREADS
+#endif
+
+#ifndef NO_THREADS
+#include <pthread.h>
+#include <unistd.h>
+#endif
+
+static int njobs = 0;		       /* 0 means use one per CPU */
+
+#ifndef NO_THREADS
+static pthread_mutex_t locks[NLOCKS] = {
+    PTHREAD_MUTEX_INITIALIZER, PTHREAD_MUTEX_INITIALIZER,
+    PTHREAD_MUTEX_INITIALIZER, PTHREAD_MUTEX_INITIALIZER,
+    PTHREAD_MUTEX_INITIALIZER,
+};
+#endif
+
+/*
+ * Take and release one of the locks guarding the little state
+ * which is shared by every document in the process (see the LOCK_*
+ * constants in halibut.h), and which may therefore be touched by
+ * several documents, or several threads working on one, at once.
+ * Each lock must be released before taking it again.
+ */
+void parallel_lock(int which)
+{
+#ifndef NO_THREADS
+    pthread_mutex_lock(&locks[which]);
+#else
+    IGNORE(which);
+#endif
+}
+
+void parallel_unlock(int which)
+{
+#ifndef NO_THREADS
+    pthread_mutex_unlock(&locks[which]);
+#else
+    IGNORE(which);
+#endif
+}
+
+/*
+ * Publish a pointer in *slot for other threads to pick up without
+ * taking a lock, and pick one up. A thread which sees the new
+ * pointer through parallel_fetch() also sees everything written
+ * before it was passed to parallel_publish(). Where the compiler
+ * offers no atomic operations, both take a lock instead.
+ */
+#if !defined NO_THREADS && !defined __ATOMIC_ACQUIRE
+static pthread_mutex_t publish_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+void parallel_publish(void const **slot, void const *p)
+{
+#if defined NO_THREADS
+    *slot = p;
+#elif defined __ATOMIC_ACQUIRE
+    __atomic_store_n(slot, p, __ATOMIC_RELEASE);
+#else
+    pthread_mutex_lock(&publish_lock);
+    *slot = p;
+    pthread_mutex_unlock(&publish_lock);
+#endif
+}
+
+void const *parallel_fetch(void const *const *slot)
+{
+#if defined NO_THREADS
+    return *slot;
+#elif defined __ATOMIC_ACQUIRE
+    return __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+#else
+    void const *p;
+
+    pthread_mutex_lock(&publish_lock);
+    p = *slot;
+    pthread_mutex_unlock(&publish_lock);
+    return p;
+#endif
+}
+
+/*
+ * One pointer's worth of state private to the calling thread, which
+ * starts out NULL. error.c uses it to count diagnostics for whatever
+ * the thread is in the middle of reading.
+ */
+#ifndef NO_THREADS
+static pthread_key_t local_key;
+static pthread_once_t local_once = PTHREAD_ONCE_INIT;
+
+static void local_init(void)
+{
+    pthread_key_create(&local_key, NULL);
+}
+#else
+static void *local_ptr = NULL;
+#endif
+
+void parallel_set_local(void *p)
+{
+#ifndef NO_THREADS
+    pthread_once(&local_once, local_init);
+    pthread_setspecific(local_key, p);
+#else
+    local_ptr = p;
+#endif
+}
+
+void *parallel_get_local(void)
+{
+#ifndef NO_THREADS
+    pthread_once(&local_once, local_init);
+    return pthread_getspecific(local_key);
+#else
+    return local_ptr;
+#endif
+}
+
+void parallel_set_jobs(int n)
+{
+    njobs = n;
+}
+
+int parallel_jobs(void)
+{
+#ifdef NO_THREADS
+    return 1;
+#else
+    /*
+     * Several documents may ask at once, so don't write the
+     * answer back to njobs; sysconf is cheap enough.
+     */
+    if (njobs <= 0) {
+	long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+	return (ncpus > 0 ? (int)ncpus : 1);
+    }
+    return njobs;
+#endif
+}
+
+#ifndef NO_THREADS
+
+struct parallel_ctx {
+    pthread_mutex_t lock;
+    int next, n;
+    void (*fn)(void *ctx, int i);
+    void *ctx;
+};
+
+static void *parallel_thread(void *vctx)
+{
+    struct parallel_ctx *pc = (struct parallel_ctx *)vctx;
+    int i;
+
+    while (1) {
+	pthread_mutex_lock(&pc->lock);
+	i = pc->next++;
+	pthread_mutex_unlock(&pc->lock);
+	if (i >= pc->n)
+	    break;
+	pc->fn(pc->ctx, i);
+    }
+    return NULL;
+}
+
+#endif
+
+/*
+ * Call fn(ctx, i) for each i from 0 to n-1, spread across up to
+ * parallel_jobs() threads. Items are started in increasing order
+ * of i, but may finish in any order; the function returns when all
+ * of them have. Callers are responsible for making sure the items
+ * don't write to any shared state, and for putting their results
+ * together deterministically afterwards.
+ *
+ * If threads aren't available or only one job is wanted, the items
+ * are simply run in order on the calling thread.
+ */
+void run_in_parallel(int n, void (*fn)(void *ctx, int i), void *ctx)
+{
+    int nthreads = parallel_jobs();
+    int i;
+
+    if (nthreads > n)
+	nthreads = n;
+
+#ifndef NO_THREADS
+    if (nthreads > 1) {
+	struct parallel_ctx pc;
+	pthread_t *threads = snewn(nthreads, pthread_t);
+	int started;
+
+	pthread_mutex_init(&pc.lock, NULL);
+	pc.next = 0;
+	pc.n = n;
+	pc.fn = fn;
+	pc.ctx = ctx;
+
+	/*
+	 * The calling thread does its share of the work too. If we
+	 * can't start as many threads as we wanted, that's fine:
+	 * the ones we have just take more items each.
+	 */
+	for (started = 0; started < nthreads - 1; started++)
+	    if (pthread_create(&threads[started], NULL,
+			       parallel_thread, &pc) != 0)
+		break;
+	parallel_thread(&pc);
+	for (i = 0; i < started; i++)
+	    pthread_join(threads[i], NULL);
+
+	pthread_mutex_destroy(&pc.lock);
+	sfree(threads);
+	return;
+    }
+#endif
+
+    for (i = 0; i < n; i++)
+	fn(ctx, i);
+}
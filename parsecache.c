@@ -0,0 +1,781 @@
+/*
+ * parsecache.c: cache the result of parsing each input file, so
+ * that unchanged files in a large document needn't be read again.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include "halibut.h"
+
+/*
+ * A cache entry lives in a file named after a hash of everything
+ * which could affect the parse: the text of the input file, the
+ * character set it starts off being read in, whether column numbers
+ * are being tracked, and the macros already defined when it starts.
+ * The entry repeats all of that except the text itself, which is
+ * checked when it's loaded.
+ *
+ * As well as the paragraphs, the entry records the two things
+ * parsing a file does to the world outside it: implicit index
+ * entries (from \i and friends), and macros defined with \define.
+ *
+ * Entries normally live in files in a directory given by the user,
+ * but can instead be kept in memory for the life of the process in
+ * a pcstore (which is what --watch does when it has no directory).
+ *
+ * Entries are a byte stream of variable-length numbers (seven bits
+ * per byte, least significant first, top bit set on all but the
+ * last byte), so they don't depend on the machine's structure layout
+ * and plain ASCII text costs one byte a character. Anything
+ * malformed is treated as a cache miss.
+ */
+
+#define CACHE_MAGIC "HALPCACHE\n"
+#define CACHE_VERSION 1
+
+struct pcmerge {
+    wchar_t *tags;
+    word *text;
+    filepos fpos;
+};
+
+struct pcmacro {
+    wchar_t *name, *text;
+};
+
+struct pcentry {
+    char *name;
+    unsigned char *data;
+    size_t len;
+    int used;			       /* since the last pcstore_prune */
+};
+
+struct pcstore_Tag {
+    tree234 *entries;		       /* struct pcentry, sorted by name */
+};
+
+struct parsecache_Tag {
+    char *entryname;		       /* cache entry (file) name */
+    pcstore *store;		       /* NULL if it's a file */
+    int charset, reportcols;
+    wchar_t *macros;		       /* name\0text\0name\0text\0... */
+    int macroslen;
+    unsigned long textlen;
+    /*
+     * Things done by the parse which a cache hit must repeat.
+     */
+    struct pcmerge *merges;
+    int nmerges, mergesize;
+    struct pcmacro *defs;
+    int ndefs, defsize;
+    int ok;			       /* nothing has made this uncacheable */
+};
+
+/*
+ * The hash is two 32-bit lanes, computed in one pass. It only has
+ * to tell different inputs apart; it isn't defending against anyone
+ * constructing collisions.
+ */
+typedef struct {
+    unsigned long a, b;
+} pchash;
+
+static void pchash_init(pchash *h)
+{
+    h->a = 2166136261UL;
+    h->b = 0x9E3779B9UL;
+}
+
+static void pchash_byte(pchash *h, unsigned c)
+{
+    h->a = ((h->a ^ c) * 16777619UL) & 0xFFFFFFFFUL;
+    h->b = ((h->b ^ c) * 0x5BD1E995UL) & 0xFFFFFFFFUL;
+    h->b ^= h->b >> 15;
+}
+
+static void pchash_u32(pchash *h, unsigned long v)
+{
+    pchash_byte(h, (v >> 24) & 0xFF);
+    pchash_byte(h, (v >> 16) & 0xFF);
+    pchash_byte(h, (v >> 8) & 0xFF);
+    pchash_byte(h, v & 0xFF);
+}
+
+/* ----------------------------------------------------------------------
+ * Writing cache entries.
+ */
+
+typedef struct {
+    unsigned char *data;
+    size_t len, size;
+} pcbuf;
+
+static void pcbuf_bytes(pcbuf *b, void const *data, size_t len)
+{
+    if (b->len + len > b->size) {
+	b->size = (b->len + len) * 3 / 2 + 4096;
+	b->data = sresize(b->data, b->size, unsigned char);
+    }
+    memcpy(b->data + b->len, data, len);
+    b->len += len;
+}
+
+static void pcbuf_byte(pcbuf *b, unsigned long c)
+{
+    if (b->len >= b->size) {
+	b->size = b->len * 3 / 2 + 4096;
+	b->data = sresize(b->data, b->size, unsigned char);
+    }
+    b->data[b->len++] = (unsigned char)c;
+}
+
+static void put_num(pcbuf *b, unsigned long v)
+{
+    v &= 0xFFFFFFFFUL;
+    while (v >= 0x80) {
+	pcbuf_byte(b, (v & 0x7F) | 0x80);
+	v >>= 7;
+    }
+    pcbuf_byte(b, v);
+}
+
+/* Signed numbers are folded so that small negative ones stay short. */
+static void put_int(pcbuf *b, int v)
+{
+    put_num(b, v < 0 ? ((unsigned long)(-(v + 1)) << 1) | 1 :
+	    (unsigned long)v << 1);
+}
+
+/*
+ * Strings are written as their length (including the terminator,
+ * or terminators for a `multi' string such as a paragraph keyword
+ * list) followed by their characters; a null pointer is written as
+ * length zero.
+ *
+ * A multi string always has a first element, even an empty one,
+ * which code elsewhere will step past with uadv(); the list then
+ * runs up to the next empty element.
+ */
+static int wmultilen(wchar_t const *s)
+{
+    int len = ustrlen(s) + 1;
+    while (s[len])
+	len += ustrlen(s + len) + 1;
+    return len + 1;
+}
+
+static void put_wstr(pcbuf *b, wchar_t const *s, int multi)
+{
+    unsigned long len, i;
+
+    if (!s) {
+	put_num(b, 0);
+	return;
+    }
+    len = (multi ? wmultilen(s) : ustrlen(s) + 1);
+    put_num(b, len);
+    for (i = 0; i < len; i++)
+	put_num(b, s[i]);
+}
+
+static void put_str(pcbuf *b, char const *s, int multi)
+{
+    unsigned long len;
+
+    if (!s) {
+	put_num(b, 0);
+	return;
+    }
+    len = strlen(s) + 1;
+    if (multi) {
+	while (s[len])
+	    len += strlen(s + len) + 1;
+	len++;
+    }
+    put_num(b, len);
+    pcbuf_bytes(b, s, len);
+}
+
+static void put_fpos(pcbuf *b, filepos const *fpos)
+{
+    put_int(b, fpos->line);
+    put_int(b, fpos->col);
+}
+
+static void put_words(pcbuf *b, word const *w)
+{
+    word const *ww;
+    unsigned long n = 0;
+
+    for (ww = w; ww; ww = ww->next)
+	n++;
+    put_num(b, n);
+    for (; w; w = w->next) {
+	put_int(b, w->type);
+	put_int(b, w->aux);
+	put_int(b, w->breaks);
+	put_fpos(b, &w->fpos);
+	put_wstr(b, w->text, FALSE);
+	put_words(b, w->alt);
+    }
+}
+
+/*
+ * Everything in a file's parse should carry that file's name (or
+ * none). Check that before caching it, since a cache hit will
+ * simply assume it.
+ */
+static int words_from(word const *w, char const *filename)
+{
+    for (; w; w = w->next)
+	if ((w->fpos.filename && w->fpos.filename != filename) ||
+	    !words_from(w->alt, filename))
+	    return FALSE;
+    return TRUE;
+}
+
+/* ----------------------------------------------------------------------
+ * Reading cache entries.
+ */
+
+typedef struct {
+    unsigned char const *p, *end;
+    char *filename;
+    int bad;
+} pcreader;
+
+static unsigned long get_num(pcreader *r)
+{
+    unsigned long v = 0;
+    int shift;
+
+    for (shift = 0; shift < 35; shift += 7) {
+	if (r->p >= r->end)
+	    break;
+	v |= (unsigned long)(*r->p & 0x7F) << shift;
+	if (!(*r->p++ & 0x80))
+	    return v & 0xFFFFFFFFUL;
+    }
+    r->bad = TRUE;
+    r->p = r->end;
+    return 0;
+}
+
+static int get_int(pcreader *r)
+{
+    unsigned long v = get_num(r);
+    return (v & 1) ? -(int)(v >> 1) - 1 : (int)(v >> 1);
+}
+
+static wchar_t *get_wstr(pcreader *r, int multi)
+{
+    unsigned long len = get_num(r), i;
+    wchar_t *s;
+
+    if (len == 0 || r->bad)
+	return NULL;
+    if (len < (multi ? 2UL : 1UL) ||
+	len > (unsigned long)(r->end - r->p)) {
+	r->bad = TRUE;
+	return NULL;
+    }
+    s = snewn(len, wchar_t);
+    for (i = 0; i < len; i++)
+	s[i] = (wchar_t)get_num(r);
+    s[len-1] = L'\0';		       /* whatever the file said */
+    if (multi)
+	s[len-2] = L'\0';
+    return s;
+}
+
+static char *get_str(pcreader *r, int multi)
+{
+    unsigned long len = get_num(r);
+    char *s;
+
+    if (len == 0 || r->bad)
+	return NULL;
+    if (len < (multi ? 2UL : 1UL) || len > (unsigned long)(r->end - r->p)) {
+	r->bad = TRUE;
+	return NULL;
+    }
+    s = snewn(len, char);
+    memcpy(s, r->p, len);
+    s[len-1] = '\0';
+    if (multi)
+	s[len-2] = '\0';
+    r->p += len;
+    return s;
+}
+
+static void get_fpos(pcreader *r, filepos *fpos)
+{
+    fpos->filename = r->filename;
+    fpos->line = get_int(r);
+    fpos->col = get_int(r);
+}
+
+static word *get_words(pcreader *r)
+{
+    word *head = NULL, **tail = &head;
+    unsigned long n = get_num(r);
+
+    while (n-- > 0 && !r->bad) {
+	word *w = snew(word);
+	w->next = NULL;
+	w->type = get_int(r);
+	w->aux = get_int(r);
+	w->breaks = get_int(r);
+	get_fpos(r, &w->fpos);
+	w->text = get_wstr(r, FALSE);
+	w->alt = get_words(r);
+	w->private_data = NULL;
+	*tail = w;
+	tail = &w->next;
+    }
+    return head;
+}
+
+/* ----------------------------------------------------------------------
+ * Keeping entries in memory.
+ */
+
+static int pcentry_cmp(void *av, void *bv)
+{
+    struct pcentry *a = (struct pcentry *)av, *b = (struct pcentry *)bv;
+    return strcmp(a->name, b->name);
+}
+
+static struct pcentry *pcstore_find(pcstore *st, char *name)
+{
+    struct pcentry key;
+    key.name = name;
+    return (struct pcentry *)find234(st->entries, &key, NULL);
+}
+
+pcstore *pcstore_new(void)
+{
+    pcstore *st = snew(pcstore);
+    st->entries = newtree234(pcentry_cmp);
+    return st;
+}
+
+static void pcentry_free(struct pcentry *e)
+{
+    sfree(e->name);
+    sfree(e->data);
+    sfree(e);
+}
+
+/*
+ * Forget every entry that hasn't been used since the last call, so
+ * that old versions of files being edited don't pile up.
+ */
+void pcstore_prune(pcstore *st)
+{
+    struct pcentry *e;
+    int i = 0;
+
+    while ((e = (struct pcentry *)index234(st->entries, i)) != NULL) {
+	if (e->used) {
+	    e->used = FALSE;
+	    i++;
+	} else {
+	    del234(st->entries, e);
+	    pcentry_free(e);
+	}
+    }
+}
+
+void pcstore_free(pcstore *st)
+{
+    struct pcentry *e;
+
+    while ((e = (struct pcentry *)delpos234(st->entries, 0)) != NULL)
+	pcentry_free(e);
+    freetree234(st->entries);
+    sfree(st);
+}
+
+/* ----------------------------------------------------------------------
+ * The interface to input.c.
+ */
+
+/*
+ * Start considering the input file `fp' for caching, with entries
+ * kept in `store' if it's non-NULL and in files in `dir' otherwise.
+ * Reads the whole file to compute the cache key, and leaves fp
+ * rewound. Returns NULL if the file can't be cached at all.
+ */
+parsecache *pcache_new(char const *dir, pcstore *store, FILE *fp,
+		       int charset, int reportcols,
+		       wchar_t const *macros, int macroslen)
+{
+    parsecache *pc;
+    pchash h;
+    char buf[4096];
+    size_t n;
+    int i;
+
+    pc = snew(parsecache);
+    pc->store = store;
+    pc->charset = charset;
+    pc->reportcols = reportcols;
+    pc->macroslen = macroslen;
+    pc->macros = snewn(macroslen + 1, wchar_t);
+    if (macroslen)
+	memcpy(pc->macros, macros, macroslen * sizeof(wchar_t));
+    pc->merges = NULL;
+    pc->nmerges = pc->mergesize = 0;
+    pc->defs = NULL;
+    pc->ndefs = pc->defsize = 0;
+    pc->ok = TRUE;
+
+    pchash_init(&h);
+    pchash_u32(&h, CACHE_VERSION);
+    pchash_u32(&h, charset);
+    pchash_u32(&h, reportcols);
+    for (i = 0; i < pc->macroslen; i++)
+	pchash_u32(&h, pc->macros[i]);
+    pc->textlen = 0;
+    while ((n = fread(buf, 1, sizeof(buf), fp)) > 0) {
+	size_t j;
+	for (j = 0; j < n; j++)
+	    pchash_byte(&h, (unsigned char)buf[j]);
+	pc->textlen += n;
+    }
+    if (ferror(fp) || fseek(fp, 0, SEEK_SET)) {
+	pcache_free(pc);
+	return NULL;
+    }
+
+    if (store) {
+	pc->entryname = snewn(30, char);
+	sprintf(pc->entryname, "%08lx%08lx", h.a, h.b);
+    } else {
+	pc->entryname = snewn(strlen(dir) + 30, char);
+	sprintf(pc->entryname, "%s/%08lx%08lx.hpc", dir, h.a, h.b);
+    }
+    return pc;
+}
+
+void pcache_free(parsecache *pc)
+{
+    int i;
+
+    for (i = 0; i < pc->nmerges; i++) {
+	sfree(pc->merges[i].tags);
+	free_word_list(pc->merges[i].text);
+    }
+    sfree(pc->merges);
+    for (i = 0; i < pc->ndefs; i++) {
+	sfree(pc->defs[i].name);
+	sfree(pc->defs[i].text);
+    }
+    sfree(pc->defs);
+    sfree(pc->macros);
+    sfree(pc->entryname);
+    sfree(pc);
+}
+
+/*
+ * Called by the parser as it does things the cache will have to
+ * repeat, or finds things that mean the file can't be cached.
+ */
+static void add_merge(parsecache *pc, wchar_t *tags, word *text,
+		      filepos const *fpos)
+{
+    struct pcmerge *m;
+
+    if (pc->nmerges >= pc->mergesize) {
+	pc->mergesize = pc->nmerges * 3 / 2 + 32;
+	pc->merges = sresize(pc->merges, pc->mergesize, struct pcmerge);
+    }
+    m = &pc->merges[pc->nmerges++];
+    m->tags = tags;
+    m->text = text;
+    m->fpos = *fpos;
+}
+
+/*
+ * Like dup_word_list, but leaving null text pointers null (as they
+ * are in whitespace words), so a cache hit gives back exactly what
+ * the parser produced.
+ */
+static word *dup_words(word const *w)
+{
+    word *head = NULL, **tail = &head;
+
+    for (; w; w = w->next) {
+	word *nw = snew(word);
+	*nw = *w;		       /* structure copy */
+	nw->text = w->text ? ustrdup(w->text) : NULL;
+	nw->alt = dup_words(w->alt);
+	nw->next = NULL;
+	*tail = nw;
+	tail = &nw->next;
+    }
+    return head;
+}
+
+void pcache_note_merge(parsecache *pc, wchar_t const *tags, word *text,
+		       filepos const *fpos)
+{
+    int len = wmultilen(tags);
+    wchar_t *tcopy = snewn(len, wchar_t);
+
+    memcpy(tcopy, tags, len * sizeof(wchar_t));
+    add_merge(pc, tcopy, dup_words(text), fpos);
+}
+
+void pcache_note_macro(parsecache *pc, wchar_t const *name,
+		       wchar_t const *text)
+{
+    if (pc->ndefs >= pc->defsize) {
+	pc->defsize = pc->ndefs * 3 / 2 + 16;
+	pc->defs = sresize(pc->defs, pc->defsize, struct pcmacro);
+    }
+    pc->defs[pc->ndefs].name = ustrdup(name);
+    pc->defs[pc->ndefs].text = ustrdup(text);
+    pc->ndefs++;
+}
+
+void pcache_uncacheable(parsecache *pc)
+{
+    pc->ok = FALSE;
+}
+
+/*
+ * Try to load the file's parse from the cache. On success, append
+ * its paragraphs at *hptr, redo its index entries and macro
+ * definitions, and return TRUE.
+ */
+int pcache_load(parsecache *pc, char *filename, paragraph ***hptr,
+		indexdata *idx,
+		void (*defmacro)(void *ctx, wchar_t *name, wchar_t *text,
+				 filepos fpos),
+		void *ctx)
+{
+    unsigned char *data = NULL;
+    size_t len = 0;
+    struct pcentry *e = NULL;
+    pcreader r;
+    paragraph *head = NULL, **tail = &head;
+    unsigned long i, count;
+    int ok;
+
+    if (pc->store) {
+	e = pcstore_find(pc->store, pc->entryname);
+	if (!e)
+	    return FALSE;
+	data = e->data;
+	len = e->len;
+    } else {
+	FILE *fp = fopen(pc->entryname, "rb");
+	size_t size = 0, n;
+
+	if (!fp)
+	    return FALSE;
+	do {
+	    size = size * 3 / 2 + 65536;
+	    data = sresize(data, size, unsigned char);
+	    n = fread(data + len, 1, size - len, fp);
+	    len += n;
+	} while (len == size);
+	fclose(fp);
+    }
+
+    r.p = data;
+    r.end = data + len;
+    r.filename = filename;
+    r.bad = FALSE;
+
+    /*
+     * Check this really is the entry we want.
+     */
+    ok = (len >= sizeof(CACHE_MAGIC) - 1 &&
+	  !memcmp(data, CACHE_MAGIC, sizeof(CACHE_MAGIC) - 1));
+    if (ok) {
+	r.p += sizeof(CACHE_MAGIC) - 1;
+	ok = (get_num(&r) == CACHE_VERSION &&
+	      get_int(&r) == pc->charset &&
+	      get_int(&r) == pc->reportcols &&
+	      get_num(&r) == pc->textlen &&
+	      get_num(&r) == (unsigned long)pc->macroslen);
+	for (i = 0; ok && i < (unsigned long)pc->macroslen; i++)
+	    ok = (get_num(&r) == (unsigned long)pc->macros[i]);
+    }
+    if (!ok || r.bad) {
+	if (!e)
+	    sfree(data);
+	return FALSE;
+    }
+
+    count = get_num(&r);
+    while (count-- > 0 && !r.bad) {
+	paragraph *p = snew(paragraph);
+	p->next = NULL;
+	p->type = get_int(&r);
+	p->aux = get_int(&r);
+	get_fpos(&r, &p->fpos);
+	p->keyword = get_wstr(&r, TRUE);
+	p->origkeyword = get_str(&r, TRUE);
+	p->words = get_words(&r);
+	p->kwtext = p->kwtext2 = NULL;
+	p->parent = p->child = p->sibling = NULL;
+	p->private_data = NULL;
+	*tail = p;
+	tail = &p->next;
+    }
+
+    /*
+     * Read the index merges and macro definitions before doing any
+     * of them, so that a damaged entry has no effect.
+     */
+    count = get_num(&r);
+    while (count-- > 0 && !r.bad) {
+	wchar_t *tags = get_wstr(&r, TRUE);
+	word *text = get_words(&r);
+	filepos fpos;
+	get_fpos(&r, &fpos);
+	if (tags) {
+	    add_merge(pc, tags, text, &fpos);
+	} else
+	    free_word_list(text);
+    }
+    count = get_num(&r);
+    while (count-- > 0 && !r.bad) {
+	wchar_t *name = get_wstr(&r, FALSE), *text = get_wstr(&r, FALSE);
+	if (name && text)
+	    pcache_note_macro(pc, name, text);
+	sfree(name);
+	sfree(text);
+    }
+    if (r.p != r.end)
+	r.bad = TRUE;
+    if (e)
+	e->used = TRUE;
+    else
+	sfree(data);
+
+    if (r.bad) {
+	free_para_list(head);
+	return FALSE;
+    }
+
+    if (head) {
+	**hptr = head;
+	*hptr = tail;
+    }
+    for (i = 0; i < (unsigned long)pc->nmerges; i++) {
+	index_merge(idx, FALSE, pc->merges[i].tags, pc->merges[i].text,
+		    &pc->merges[i].fpos);
+	pc->merges[i].text = NULL;     /* index_merge has taken it */
+    }
+    for (i = 0; i < (unsigned long)pc->ndefs; i++) {
+	filepos fpos;
+	fpos.filename = filename;
+	fpos.line = fpos.col = 0;
+	defmacro(ctx, pc->defs[i].name, pc->defs[i].text, fpos);
+	pc->defs[i].name = pc->defs[i].text = NULL;
+    }
+
+    return TRUE;
+}
+
+/*
+ * Write a cache entry for a file which has just been parsed into
+ * the paragraph list `paras'.
+ */
+void pcache_save(parsecache *pc, char const *filename, paragraph *paras)
+{
+    FILE *fp;
+    pcbuf b;
+    paragraph *p;
+    unsigned long n;
+    char *tmpname;
+    int i, ok;
+
+    if (!pc->ok)
+	return;
+    for (p = paras; p; p = p->next)
+	if ((p->fpos.filename && p->fpos.filename != filename) ||
+	    !words_from(p->words, filename))
+	    return;
+    for (i = 0; i < pc->nmerges; i++)
+	if (!words_from(pc->merges[i].text, filename))
+	    return;
+
+    b.data = NULL;
+    b.len = b.size = 0;
+    pcbuf_bytes(&b, CACHE_MAGIC, sizeof(CACHE_MAGIC) - 1);
+    put_num(&b, CACHE_VERSION);
+    put_int(&b, pc->charset);
+    put_int(&b, pc->reportcols);
+    put_num(&b, pc->textlen);
+    put_num(&b, pc->macroslen);
+    for (i = 0; i < pc->macroslen; i++)
+	put_num(&b, pc->macros[i]);
+
+    for (n = 0, p = paras; p; p = p->next)
+	n++;
+    put_num(&b, n);
+    for (p = paras; p; p = p->next) {
+	put_int(&b, p->type);
+	put_int(&b, p->aux);
+	put_fpos(&b, &p->fpos);
+	put_wstr(&b, p->keyword, TRUE);
+	put_str(&b, p->origkeyword, TRUE);
+	put_words(&b, p->words);
+    }
+
+    put_num(&b, pc->nmerges);
+    for (i = 0; i < pc->nmerges; i++) {
+	put_wstr(&b, pc->merges[i].tags, TRUE);
+	put_words(&b, pc->merges[i].text);
+	put_fpos(&b, &pc->merges[i].fpos);
+    }
+
+    put_num(&b, pc->ndefs);
+    for (i = 0; i < pc->ndefs; i++) {
+	put_wstr(&b, pc->defs[i].name, FALSE);
+	put_wstr(&b, pc->defs[i].text, FALSE);
+    }
+
+    if (pc->store) {
+	struct pcentry *e = pcstore_find(pc->store, pc->entryname);
+	if (!e) {
+	    e = snew(struct pcentry);
+	    e->name = dupstr(pc->entryname);
+	    add234(pc->store->entries, e);
+	} else
+	    sfree(e->data);
+	e->data = sresize(b.data, b.len ? b.len : 1, unsigned char);
+	e->len = b.len;
+	e->used = TRUE;
+	return;
+    }
+
+    tmpname = snewn(strlen(pc->entryname) + 5, char);
+    sprintf(tmpname, "%s.tmp", pc->entryname);
+    fp = fopen(tmpname, "wb");
+    if (!fp) {
+	/* No cache directory, or can't write to it: just don't cache. */
+	sfree(tmpname);
+	sfree(b.data);
+	return;
+    }
+    fwrite(b.data, 1, b.len, fp);
+    sfree(b.data);
+    ok = !ferror(fp);
+    if (fclose(fp))
+	ok = FALSE;
+    if (ok && rename(tmpname, pc->entryname)) {
+	remove(pc->entryname);
+	ok = !rename(tmpname, pc->entryname);
+    }
+    if (!ok)
+	remove(tmpname);
+    sfree(tmpname);
+}
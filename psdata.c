@@ -1121,16 +1121,23 @@ static const char *const ps_glyphs_alphabetic[] = {
     "zretroflexhook", "zstroke", "zuhiragana", "zukatakana", 
 };
 
-char const **extraglyphs = NULL;
-glyph nextglyph = lenof(ps_glyphs_alphabetic);
-tree234 *extrabyname = NULL;
+/*
+ * Names of glyphs not in the list above are interned as they turn
+ * up, for every document in the process. The names live in blocks
+ * which never move once allocated, so that glyph_extern() can look
+ * one up without locking while another thread interns more.
+ */
+#define EXTRA_BLOCK 256
+static char const **extraglyphs[65536 / EXTRA_BLOCK];
+static glyph nextglyph = lenof(ps_glyphs_alphabetic);
+static tree234 *extrabyname = NULL;
 
 char const *glyph_extern(glyph glyph) {
     if (glyph == NOGLYPH) return ".notdef";
     if (glyph < lenof(ps_glyphs_alphabetic))
 	return ps_glyphs_alphabetic[glyph];
-    else
-	return extraglyphs[glyph - lenof(ps_glyphs_alphabetic)];
+    glyph -= lenof(ps_glyphs_alphabetic);
+    return extraglyphs[glyph / EXTRA_BLOCK][glyph % EXTRA_BLOCK];
 }
 
 static int glyphcmp(void *a, void *b) {
@@ -1161,19 +1168,23 @@ glyph glyph_intern(char const *glyphname) {
 	    i = k;
     }
     /* Non-standard glyph.  We may need to add it to our tree. */
+    parallel_lock(LOCK_GLYPHS);
     if (extrabyname == NULL)
 	extrabyname = newtree234(glyphcmp);
     gp = find234(extrabyname, (void *)glyphname, glyphcmp_search);
     if (gp) {
 	k = *gp;
     } else {
-	extraglyphs = sresize(extraglyphs, nextglyph, char const *);
 	k = nextglyph++;
-	extraglyphs[k - lenof(ps_glyphs_alphabetic)] = dupstr(glyphname);
+	i = k - lenof(ps_glyphs_alphabetic);
+	if (!extraglyphs[i / EXTRA_BLOCK])
+	    extraglyphs[i / EXTRA_BLOCK] = snewn(EXTRA_BLOCK, char const *);
+	extraglyphs[i / EXTRA_BLOCK][i % EXTRA_BLOCK] = dupstr(glyphname);
 	gp = snew(glyph);
 	*gp = k;
 	add234(extrabyname, gp);
     }
+    parallel_unlock(LOCK_GLYPHS);
     return k;
 }
 
@@ -4542,16 +4553,30 @@ static const struct ps_std_font_data {
     }},
 };
 
-void init_std_fonts(void) {
+/*
+ * Return the list of the standard PostScript fonts. It's built the
+ * first time anyone asks, and then shared (read-only) by every
+ * document in the process; fonts a document reads in for itself are
+ * kept in a separate list (see font_list in paper.h).
+ */
+font_info *std_fonts(void) {
+    static font_info *all_std_fonts = NULL;
+    static int done = FALSE;
+    font_info *ret;
     int i, j;
     ligature const *lig;
     kern_pair const *kern;
-    static int done = FALSE;
 
-    if (done) return;
+    parallel_lock(LOCK_FONTS);
+    if (done) {
+	ret = all_std_fonts;
+	parallel_unlock(LOCK_FONTS);
+	return ret;
+    }
     for (i = 0; i < (int)lenof(ps_std_fonts); i++) {
 	font_info *fi = snew(font_info);
 	fi->fontfile = NULL;
+	fi->srcfile = fi->fontsrcfile = -1;
 	fi->name = ps_std_fonts[i].name;
 	fi->widths = newtree234(width_cmp);
 	for (j = 0; j < (int)lenof(fi->bmp); j++)
@@ -4572,10 +4597,58 @@ void init_std_fonts(void) {
 	fi->ligs = newtree234(lig_cmp);
 	for (lig = ps_std_fonts[i].ligs; lig->left != NOGLYPH; lig++)
 	    add234(fi->ligs, (void *)lig);
-	fi->next = all_fonts;
-	all_fonts = fi;
+	fi->next = all_std_fonts;
+	all_std_fonts = fi;
     }
     done = TRUE;
+    ret = all_std_fonts;
+    parallel_unlock(LOCK_FONTS);
+    return ret;
+}
+
+/*
+ * Find the font called `name', among the standard fonts or else in
+ * a document's own list of fonts.
+ */
+font_info *find_font(font_info *fonts, char const *name) {
+    font_info *fi;
+
+    for (fi = std_fonts(); fi; fi = fi->next)
+	if (strcmp(fi->name, name) == 0)
+	    return fi;
+    for (fi = fonts; fi; fi = fi->next)
+	if (strcmp(fi->name, name) == 0)
+	    return fi;
+    return NULL;
+}
+
+/*
+ * Free a list of fonts read in by one document.
+ */
+void free_font_list(font_info *fi) {
+    font_info *next;
+    void *p;
+
+    for (; fi; fi = next) {
+	next = fi->next;
+	while ((p = delpos234(fi->widths, 0)) != NULL)
+	    sfree(p);
+	freetree234(fi->widths);
+	while ((p = delpos234(fi->kerns, 0)) != NULL)
+	    sfree(p);
+	freetree234(fi->kerns);
+	while ((p = delpos234(fi->ligs, 0)) != NULL)
+	    sfree(p);
+	freetree234(fi->ligs);
+	if (fi->fontfile) {
+	    if (fi->filetype == TRUETYPE)
+		sfnt_free(fi->fontfile);
+	    else
+		pf_free(fi->fontfile);
+	}
+	sfree((char *)fi->name);
+	sfree(fi);
+    }
 }
 
 const int *ps_std_font_widths(char const *fontname)
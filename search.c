@@ -0,0 +1,556 @@
+/*
+ * search.c: build a sharded inverted index of a document, so that
+ * a small client-side script can search HTML output without
+ * downloading all of it
+ *
+ * The back end registers a `target' (a file name and fragment) for
+ * each section, and then feeds in the text belonging to it. Every
+ * word is folded to lower case, and the index records, for each
+ * distinct word (`term'), the sorted list of targets it occurs in.
+ *
+ * The index is written as JSON. The master file, PREFIX.json, holds
+ *
+ *  - "files": the output file names;
+ *  - "targets": for each target, [file number, fragment, title];
+ *  - "shards": an object mapping shard keys to shard numbers.
+ *
+ * Shard number n is in PREFIX-n.json, which is an object mapping
+ * each of its terms to the list of targets containing that term.
+ * The list is delta-encoded: the first element is a target number,
+ * and each later one is the difference from its predecessor.
+ *
+ * Every term lives in the shard whose key is the longest prefix of
+ * the term. So a client looking for a word loads just the one shard
+ * it needs; to complete a partial word it also loads every shard
+ * whose key begins with what has been typed so far.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include "halibut.h"
+
+#define INITIAL_TERMHASH_SIZE 1024     /* must be a power of two */
+#define SHARD_SIZE 32768	       /* split shards bigger than this */
+#define MAXTOKEN 256		       /* longer `words' are truncated */
+
+typedef struct {
+    char *text;			       /* UTF-8, lower case */
+    int *targets;
+    int ntargets, targetsize;
+    char *json;			       /* "text":[...], filled in late */
+    int jsonlen;
+} term;
+
+struct searchindex_Tag {
+    term **hash;
+    int nterms, hashsize;
+    tree234 *files;
+    char **filenames;		       /* indexed by file number */
+    int nfiles, filesize;
+    rdstringc targets;		       /* JSON for the target list */
+    int ntargets;
+};
+
+typedef struct {
+    char *name;
+    int number;
+} searchfile;
+
+static int searchfile_cmp(void *av, void *bv)
+{
+    searchfile *a = (searchfile *)av;
+    searchfile *b = (searchfile *)bv;
+    return strcmp(a->name, b->name);
+}
+
+searchindex *search_new(void)
+{
+    searchindex *si = snew(searchindex);
+    int i;
+
+    si->hashsize = INITIAL_TERMHASH_SIZE;
+    si->hash = snewn(si->hashsize, term *);
+    for (i = 0; i < si->hashsize; i++)
+	si->hash[i] = NULL;
+    si->nterms = 0;
+    si->files = newtree234(searchfile_cmp);
+    si->filenames = NULL;
+    si->nfiles = si->filesize = 0;
+    si->targets = empty_rdstringc;
+    si->ntargets = 0;
+    return si;
+}
+
+void search_free(searchindex *si)
+{
+    searchfile *sf;
+    int i;
+
+    for (i = 0; i < si->hashsize; i++)
+	if (si->hash[i]) {
+	    sfree(si->hash[i]->text);
+	    sfree(si->hash[i]->targets);
+	    sfree(si->hash[i]->json);
+	    sfree(si->hash[i]);
+	}
+    sfree(si->hash);
+    while ((sf = delpos234(si->files, 0)) != NULL)
+	sfree(sf);
+    freetree234(si->files);
+    for (i = 0; i < si->nfiles; i++)
+	sfree(si->filenames[i]);
+    sfree(si->filenames);
+    sfree(si->targets.text);
+    sfree(si);
+}
+
+/*
+ * Append a string to some JSON, quoted.
+ */
+static void json_string(rdstringc *rs, char const *s)
+{
+    rdaddc(rs, '"');
+    for (; *s; s++) {
+	if (*s == '"' || *s == '\\') {
+	    rdaddc(rs, '\\');
+	    rdaddc(rs, *s);
+	} else if ((unsigned char)*s < 0x20) {
+	    char buf[8];
+	    sprintf(buf, "\\u%04x", (unsigned char)*s);
+	    rdaddsc(rs, buf);
+	} else
+	    rdaddc(rs, *s);
+    }
+    rdaddc(rs, '"');
+}
+
+/*
+ * Append the visible text of a word list to a UTF-8 string.
+ */
+static void words_text(rdstringc *rs, word *w)
+{
+    char buf[4];
+    wchar_t const *p;
+    int n;
+
+    for (; w; w = w->next) {
+	if (w->type >= word_internal_endattrs)
+	    continue;
+	switch (removeattr(w->type)) {
+	  case word_Normal:
+	    for (p = w->text; *p; p++)
+		if ((n = utf8_encode(buf, *p)) > 0)
+		    rdaddsn(rs, buf, n);
+	    break;
+	  case word_WhiteSpace:
+	    rdaddc(rs, ' ');
+	    break;
+	  case word_Quote:
+	    rdaddc(rs, '"');
+	    break;
+	}
+    }
+}
+
+/*
+ * Add a target for the index to point at, returning its number.
+ * Targets must be added before any text is added to them.
+ */
+int search_add_target(searchindex *si, char const *filename,
+		      char const *fragment, word *number, word *title)
+{
+    searchfile *sf, *ret;
+    rdstringc text = { 0, 0, NULL };
+    char buf[40];
+
+    sf = snew(searchfile);
+    sf->name = (char *)filename;
+    sf->number = si->nfiles;
+    ret = add234(si->files, sf);
+    if (ret != sf) {
+	sfree(sf);
+    } else {
+	if (si->nfiles >= si->filesize) {
+	    si->filesize = si->nfiles + 64;
+	    si->filenames = sresize(si->filenames, si->filesize, char *);
+	}
+	sf->name = si->filenames[si->nfiles++] = dupstr((char *)filename);
+    }
+
+    if (number) {
+	words_text(&text, number);
+	if (title)
+	    rdaddc(&text, ' ');
+    }
+    words_text(&text, title);
+
+    rdaddc(&si->targets, si->ntargets ? ',' : '[');
+    sprintf(buf, "\n[%d,", ret->number);
+    rdaddsc(&si->targets, buf);
+    json_string(&si->targets, fragment ? fragment : "");
+    rdaddc(&si->targets, ',');
+    json_string(&si->targets, text.text ? text.text : "");
+    rdaddc(&si->targets, ']');
+    sfree(text.text);
+
+    return si->ntargets++;
+}
+
+static unsigned long term_hash(char const *s)
+{
+    unsigned long h = 2166136261UL;
+    for (; *s; s++)
+	h = ((h ^ (unsigned char)*s) * 16777619UL) & 0xFFFFFFFFUL;
+    return h;
+}
+
+static term **term_slot(searchindex *si, char const *text)
+{
+    unsigned long mask = si->hashsize - 1;
+    unsigned long i = term_hash(text) & mask;
+    term **slot;
+
+    while (*(slot = &si->hash[i]) != NULL) {
+	if (!strcmp((*slot)->text, text))
+	    break;
+	i = (i + 1) & mask;
+    }
+    return slot;
+}
+
+static void add_posting(searchindex *si, char const *text, int target)
+{
+    term **slot, *t;
+
+    slot = term_slot(si, text);
+    if (!*slot) {
+	if (4 * (si->nterms + 1) > 3 * si->hashsize) {
+	    term **old = si->hash;
+	    int i, oldsize = si->hashsize;
+
+	    si->hashsize *= 2;
+	    si->hash = snewn(si->hashsize, term *);
+	    for (i = 0; i < si->hashsize; i++)
+		si->hash[i] = NULL;
+	    for (i = 0; i < oldsize; i++)
+		if (old[i])
+		    *term_slot(si, old[i]->text) = old[i];
+	    sfree(old);
+	    slot = term_slot(si, text);
+	}
+	t = *slot = snew(term);
+	t->text = dupstr((char *)text);
+	t->targets = NULL;
+	t->ntargets = t->targetsize = 0;
+	t->json = NULL;
+	si->nterms++;
+    }
+    t = *slot;
+
+    /*
+     * Text mostly arrives one target at a time, so this catches
+     * most repetitions; search_write() sorts out the rest.
+     */
+    if (t->ntargets > 0 && t->targets[t->ntargets - 1] == target)
+	return;
+    if (t->ntargets >= t->targetsize) {
+	t->targetsize = t->ntargets * 3 / 2 + 4;
+	t->targets = sresize(t->targets, t->targetsize, int);
+    }
+    t->targets[t->ntargets++] = target;
+}
+
+/*
+ * Words are split at anything other than letters and digits.
+ * Single ASCII characters aren't worth indexing.
+ */
+typedef struct {
+    char buf[MAXTOKEN * 4 + 1];
+    int len, nchars;
+} token;
+
+static void token_end(searchindex *si, token *tok, int target)
+{
+    if (tok->nchars > 1 ||
+	(tok->nchars == 1 && (unsigned char)tok->buf[0] >= 0x80)) {
+	tok->buf[tok->len] = '\0';
+	add_posting(si, tok->buf, target);
+    }
+    tok->len = tok->nchars = 0;
+}
+
+static void token_text(searchindex *si, token *tok, int target,
+		       wchar_t const *p)
+{
+    for (; *p; p++) {
+	if (uisalpha(*p) || uisdigit(*p)) {
+	    if (tok->nchars < MAXTOKEN) {
+		int n = utf8_encode(tok->buf + tok->len, utolower(*p));
+		if (n > 0) {
+		    tok->len += n;
+		    tok->nchars++;
+		}
+	    }
+	} else
+	    token_end(si, tok, target);
+    }
+}
+
+void search_add_words(searchindex *si, int target, word *w)
+{
+    token tok;
+
+    tok.len = tok.nchars = 0;
+    for (; w; w = w->next) {
+	/* Invisible words don't interrupt the text around them. */
+	if (w->type >= word_internal_endattrs)
+	    continue;
+	if (removeattr(w->type) == word_Normal)
+	    token_text(si, &tok, target, w->text);
+	else
+	    token_end(si, &tok, target);
+    }
+    token_end(si, &tok, target);
+}
+
+/*
+ * Add the text of a paragraph, if it's one that produces visible
+ * output.
+ */
+void search_add_para(searchindex *si, int target, paragraph *p)
+{
+    word *w;
+
+    switch (p->type) {
+      case para_Code:
+	/*
+	 * Each line of a code paragraph is one word, possibly
+	 * followed by a word giving its emphasis, which isn't text.
+	 */
+	for (w = p->words; w; w = w->next)
+	    if (w->type == word_WeakCode) {
+		token tok;
+		tok.len = tok.nchars = 0;
+		token_text(si, &tok, target, w->text);
+		token_end(si, &tok, target);
+	    }
+	break;
+      case para_Chapter:
+      case para_Appendix:
+      case para_UnnumberedChapter:
+      case para_Heading:
+      case para_Subsect:
+      case para_Normal:
+      case para_BiblioCited:
+      case para_Bullet:
+      case para_NumberedList:
+      case para_DescribedThing:
+      case para_Description:
+      case para_Copyright:
+      case para_Title:
+	search_add_words(si, target, p->words);
+	break;
+    }
+}
+
+static int intcmp(const void *av, const void *bv)
+{
+    int a = *(const int *)av, b = *(const int *)bv;
+    return a < b ? -1 : a > b ? 1 : 0;
+}
+
+static int termcmp(const void *av, const void *bv)
+{
+    term const *a = *(term const *const *)av;
+    term const *b = *(term const *const *)bv;
+    return strcmp(a->text, b->text);
+}
+
+/*
+ * Number of characters (not bytes) in a UTF-8 string.
+ */
+static int utf8_chars(char const *s)
+{
+    int n = 0;
+    for (; *s; s++)
+	if ((*s & 0xC0) != 0x80)
+	    n++;
+    return n;
+}
+
+/*
+ * Length in bytes of the first n characters of a UTF-8 string.
+ */
+static int utf8_prefix(char const *s, int n)
+{
+    char const *p = s;
+    while (*p && n > 0) {
+	p++;
+	while ((*p & 0xC0) == 0x80)
+	    p++;
+	n--;
+    }
+    return p - s;
+}
+
+typedef struct {
+    searchindex *si;
+    outdest *od;
+    char const *prefix;
+    int flags;
+    term **terms;
+    rdstringc keys;		       /* JSON for the shard list */
+    int nshards;
+} shardwriter;
+
+static void write_shard(shardwriter *sw, char const *key, int keylen,
+			int lo, int hi)
+{
+    char *filename, buf[40];
+    rdstringc k = { 0, 0, NULL };
+    outsink *out;
+    int i;
+
+    sw->nshards++;
+    rdaddc(&sw->keys, sw->nshards > 1 ? ',' : '{');
+    rdaddsn(&k, key, keylen);
+    if (!k.text)
+	rdaddsc(&k, "");
+    rdaddc(&sw->keys, '\n');
+    json_string(&sw->keys, k.text);
+    sprintf(buf, ":%d", sw->nshards);
+    rdaddsc(&sw->keys, buf);
+    sfree(k.text);
+
+    filename = snewn(strlen(sw->prefix) + 40, char);
+    sprintf(filename, "%s-%d.json", sw->prefix, sw->nshards);
+    out = out_open(sw->od, filename, sw->flags);
+    sfree(filename);
+    if (!out)
+	return;
+    for (i = lo; i < hi; i++) {
+	out_puts(out, i > lo ? ",\n" : "{");
+	out_write(out, sw->terms[i]->json, sw->terms[i]->jsonlen);
+    }
+    out_puts(out, "}\n");
+    out_close(out);
+}
+
+/*
+ * Write the terms from lo to hi, which all begin with the given key
+ * of depth characters, to one or more shards.
+ */
+static void write_shards(shardwriter *sw, char const *key, int keylen,
+			 int depth, int lo, int hi)
+{
+    int i, j, size = 0;
+
+    for (i = lo; i < hi; i++)
+	size += sw->terms[i]->jsonlen + 2;
+
+    if (size <= SHARD_SIZE) {
+	write_shard(sw, key, keylen, lo, hi);
+	return;
+    }
+
+    /*
+     * Too big, so split it by the next character. Any term which
+     * is exactly the key sorts first, and stays in a shard of its
+     * own.
+     */
+    i = lo;
+    if (utf8_chars(sw->terms[i]->text) == depth) {
+	write_shard(sw, key, keylen, i, i + 1);
+	i++;
+    }
+    while (i < hi) {
+	char const *t = sw->terms[i]->text;
+	int len = utf8_prefix(t, depth + 1);
+
+	for (j = i + 1; j < hi; j++)
+	    if (strncmp(sw->terms[j]->text, t, len))
+		break;
+	write_shards(sw, t, len, depth + 1, i, j);
+	i = j;
+    }
+}
+
+/*
+ * Write out the index, in files whose names start with prefix.
+ */
+void search_write(searchindex *si, outdest *od, char const *prefix,
+		  int flags)
+{
+    shardwriter sw;
+    outsink *out;
+    char *filename;
+    int i, n;
+
+    sw.si = si;
+    sw.od = od;
+    sw.prefix = prefix;
+    sw.flags = flags;
+    sw.keys = empty_rdstringc;
+    sw.nshards = 0;
+
+    /*
+     * Get the terms in order, with their postings sorted,
+     * de-duplicated and delta-encoded.
+     */
+    sw.terms = snewn(si->nterms, term *);
+    for (i = n = 0; i < si->hashsize; i++)
+	if (si->hash[i])
+	    sw.terms[n++] = si->hash[i];
+    assert(n == si->nterms);
+    qsort(sw.terms, n, sizeof(*sw.terms), termcmp);
+
+    for (i = 0; i < n; i++) {
+	term *t = sw.terms[i];
+	rdstringc rs = { 0, 0, NULL };
+	char buf[40];
+	int j, prev = 0;
+
+	qsort(t->targets, t->ntargets, sizeof(int), intcmp);
+	json_string(&rs, t->text);
+	rdaddsc(&rs, ":[");
+	for (j = 0; j < t->ntargets; j++) {
+	    if (j > 0 && t->targets[j] == prev)
+		continue;
+	    sprintf(buf, j > 0 ? ",%d" : "%d", t->targets[j] - prev);
+	    rdaddsc(&rs, buf);
+	    prev = t->targets[j];
+	}
+	rdaddc(&rs, ']');
+	t->jsonlen = rs.pos;
+	t->json = rdtrimc(&rs);
+    }
+
+    if (n > 0)
+	write_shards(&sw, "", 0, 0, 0, n);
+    sfree(sw.terms);
+
+    filename = snewn(strlen(prefix) + 6, char);
+    sprintf(filename, "%s.json", prefix);
+    out = out_open(od, filename, flags);
+    sfree(filename);
+    if (out) {
+	out_puts(out, "{\"files\":[");
+	for (i = 0; i < si->nfiles; i++) {
+	    rdstringc rs = { 0, 0, NULL };
+	    if (i > 0)
+		rdaddc(&rs, ',');
+	    rdaddc(&rs, '\n');
+	    json_string(&rs, si->filenames[i]);
+	    out_write(out, rs.text, rs.pos);
+	    sfree(rs.text);
+	}
+	out_puts(out, "],\n\"targets\":");
+	out_puts(out, si->targets.text ? si->targets.text : "[");
+	out_puts(out, "],\n\"shards\":");
+	out_puts(out, sw.keys.text ? sw.keys.text : "{");
+	out_puts(out, "}}\n");
+	out_close(out);
+    }
+    sfree(sw.keys.text);
+}
@@ -0,0 +1,683 @@
+/*
+ * treefile.c: save the fully resolved document tree (paragraphs,
+ * keywords and index) to a file, and load it back, so that several
+ * runs of Halibut producing different output formats can share the
+ * work of a single parse.
+ */
+
+/*
+ * The file is an image of the in-memory structures themselves, so
+ * loading it is little more than mapping it into memory and
+ * adjusting the pointers in it. That makes it specific to the
+ * machine and the version of Halibut that wrote it; the header
+ * records enough to detect a mismatch.
+ */
+
+#ifndef NO_MMAP
+#define _POSIX_C_SOURCE 200112L
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <assert.h>
+#include "halibut.h"
+
+#ifndef NO_MMAP
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#define TREE_MAGIC "HALTREE\n"
+#define TREE_VERSION 1
+
+/*
+ * Every object in the image is aligned to this.
+ */
+union tree_align { long l; double d; void *p; };
+#define TREE_ALIGN (sizeof(union tree_align))
+
+/*
+ * Sizes which must match between the writer and the reader.
+ */
+enum {
+    ABI_ENDIAN, ABI_POINTER, ABI_INT, ABI_WCHAR,
+    ABI_PARAGRAPH, ABI_WORD, ABI_KEYWORD, ABI_INDEXTAG, ABI_INDEXENTRY,
+    ABI_FILEPOS, NABI
+};
+
+/*
+ * The header lives at offset 0. Since nothing else can, an offset
+ * of 0 stands for a null pointer throughout the image.
+ */
+typedef struct {
+    char magic[8];
+    unsigned long version;
+    unsigned long abi[NABI];
+    unsigned long size;		       /* of the whole image */
+    unsigned long paras;	       /* offset of first paragraph */
+    unsigned long kws, nkws;	       /* array of keyword pointers */
+    unsigned long tags, ntags;	       /* array of indextag pointers */
+    unsigned long entries, nentries;   /* array of indexentry pointers */
+    unsigned long relocs, nrelocs;     /* array of size_t pointer slots */
+} treehdr;
+
+static void tree_abi(unsigned long *abi)
+{
+    abi[ABI_ENDIAN] = 0x01020304UL;
+    abi[ABI_POINTER] = sizeof(void *);
+    abi[ABI_INT] = sizeof(int);
+    abi[ABI_WCHAR] = sizeof(wchar_t);
+    abi[ABI_PARAGRAPH] = sizeof(paragraph);
+    abi[ABI_WORD] = sizeof(word);
+    abi[ABI_KEYWORD] = sizeof(keyword);
+    abi[ABI_INDEXTAG] = sizeof(indextag);
+    abi[ABI_INDEXENTRY] = sizeof(indexentry);
+    abi[ABI_FILEPOS] = sizeof(filepos);
+}
+
+/* ----------------------------------------------------------------------
+ * Writing.
+ */
+
+enum { OBJ_PARA, OBJ_WORD, OBJ_KEYWORD, OBJ_TAG, OBJ_ENTRY };
+
+struct treeobj {
+    int type;
+    void const *ptr;		       /* the original */
+    size_t off;			       /* where its copy goes */
+};
+
+struct treeptr {
+    void const *ptr;
+    size_t off;
+};
+
+typedef struct {
+    char *data;
+    size_t len, size;
+    /*
+     * Everything already copied into the image, so that shared
+     * structure stays shared. Open-addressed, keyed on address.
+     */
+    struct treeptr *ptrs;
+    int nptrs, ptrsize;
+    /*
+     * Objects allocated in the image but whose fields are still to
+     * be filled in.
+     */
+    struct treeobj *queue;
+    int nqueue, queuesize;
+    size_t *relocs;
+    int nrelocs, relocsize;
+} treewriter;
+
+static size_t tw_alloc(treewriter *tw, size_t len)
+{
+    size_t off = (tw->len + TREE_ALIGN - 1) / TREE_ALIGN * TREE_ALIGN;
+
+    if (off + len > tw->size) {
+	tw->size = (off + len) * 3 / 2 + 4096;
+	tw->data = sresize(tw->data, tw->size, char);
+    }
+    memset(tw->data + tw->len, 0, off + len - tw->len);
+    tw->len = off + len;
+    return off;
+}
+
+static struct treeptr *tw_slot(treewriter *tw, void const *ptr)
+{
+    unsigned long mask = tw->ptrsize - 1;
+    unsigned long i = ((unsigned long)(size_t)ptr / TREE_ALIGN *
+		       2654435761UL) & mask;
+
+    while (tw->ptrs[i].ptr && tw->ptrs[i].ptr != ptr)
+	i = (i + 1) & mask;
+    return &tw->ptrs[i];
+}
+
+static void tw_remember(treewriter *tw, void const *ptr, size_t off)
+{
+    struct treeptr *slot;
+
+    if (4 * (tw->nptrs + 1) > 3 * tw->ptrsize) {
+	struct treeptr *old = tw->ptrs;
+	int oldsize = tw->ptrsize, i;
+
+	tw->ptrsize = (oldsize ? oldsize * 2 : 1024);
+	tw->ptrs = snewn(tw->ptrsize, struct treeptr);
+	for (i = 0; i < tw->ptrsize; i++)
+	    tw->ptrs[i].ptr = NULL;
+	for (i = 0; i < oldsize; i++)
+	    if (old[i].ptr)
+		*tw_slot(tw, old[i].ptr) = old[i];
+	sfree(old);
+    }
+    slot = tw_slot(tw, ptr);
+    slot->ptr = ptr;
+    slot->off = off;
+    tw->nptrs++;
+}
+
+static size_t tw_lookup(treewriter *tw, void const *ptr)
+{
+    struct treeptr *slot;
+
+    if (!tw->ptrsize)
+	return 0;
+    slot = tw_slot(tw, ptr);
+    return slot->ptr ? slot->off : 0;
+}
+
+/*
+ * Store a pointer to image offset `off' (or a null pointer, if off
+ * is 0) in the pointer-sized slot at image offset `where'. Non-null
+ * pointers are stored as offsets and listed for the loader to
+ * relocate.
+ */
+static void tw_setptr(treewriter *tw, size_t where, size_t off)
+{
+    if (off) {
+	memcpy(tw->data + where, &off, sizeof(off));
+	if (tw->nrelocs >= tw->relocsize) {
+	    tw->relocsize = tw->nrelocs * 3 / 2 + 1024;
+	    tw->relocs = sresize(tw->relocs, tw->relocsize, size_t);
+	}
+	tw->relocs[tw->nrelocs++] = where;
+    } else {
+	void *null = NULL;
+	memcpy(tw->data + where, &null, sizeof(null));
+    }
+}
+
+static size_t tw_object(treewriter *tw, void const *ptr, int type)
+{
+    size_t off, len;
+
+    if (!ptr)
+	return 0;
+    if ((off = tw_lookup(tw, ptr)) != 0)
+	return off;
+
+    switch (type) {
+      case OBJ_PARA: len = sizeof(paragraph); break;
+      case OBJ_WORD: len = sizeof(word); break;
+      case OBJ_KEYWORD: len = sizeof(keyword); break;
+      case OBJ_TAG: len = sizeof(indextag); break;
+      default /* OBJ_ENTRY */: len = sizeof(indexentry); break;
+    }
+    off = tw_alloc(tw, len);
+    tw_remember(tw, ptr, off);
+
+    if (tw->nqueue >= tw->queuesize) {
+	tw->queuesize = tw->nqueue * 3 / 2 + 256;
+	tw->queue = sresize(tw->queue, tw->queuesize, struct treeobj);
+    }
+    tw->queue[tw->nqueue].type = type;
+    tw->queue[tw->nqueue].ptr = ptr;
+    tw->queue[tw->nqueue].off = off;
+    tw->nqueue++;
+
+    return off;
+}
+
+/*
+ * Strings are copied straight away, since they contain no pointers.
+ * `multi' strings are the zero-terminated lists of zero-terminated
+ * strings used for paragraph keywords.
+ */
+static size_t tw_wstring(treewriter *tw, wchar_t const *s, int multi)
+{
+    size_t off, len;
+
+    if (!s)
+	return 0;
+    if ((off = tw_lookup(tw, s)) != 0)
+	return off;
+
+    if (multi) {
+	for (len = 0; s[len]; len += ustrlen(s + len) + 1);
+	len++;
+    } else
+	len = ustrlen(s) + 1;
+    off = tw_alloc(tw, len * sizeof(wchar_t));
+    memcpy(tw->data + off, s, len * sizeof(wchar_t));
+    tw_remember(tw, s, off);
+    return off;
+}
+
+static size_t tw_string(treewriter *tw, char const *s, int multi)
+{
+    size_t off, len;
+
+    if (!s)
+	return 0;
+    if ((off = tw_lookup(tw, s)) != 0)
+	return off;
+
+    if (multi) {
+	for (len = 0; s[len]; len += strlen(s + len) + 1);
+	len++;
+    } else
+	len = strlen(s) + 1;
+    off = tw_alloc(tw, len);
+    memcpy(tw->data + off, s, len);
+    tw_remember(tw, s, off);
+    return off;
+}
+
+#define SETPTR(type, field, val) \
+    tw_setptr(tw, o->off + offsetof(type, field), (val))
+
+/*
+ * Structures with padding in them are copied a field at a time, so
+ * that the padding stays zero (as tw_alloc left it) and the same
+ * document always gives the same file.
+ */
+
+static void tw_fill(treewriter *tw, struct treeobj *o)
+{
+    switch (o->type) {
+      case OBJ_PARA: {
+	paragraph const *p = (paragraph const *)o->ptr;
+	paragraph *q = (paragraph *)(tw->data + o->off);
+	q->type = p->type;
+	q->aux = p->aux;
+	q->fpos.line = p->fpos.line;
+	q->fpos.col = p->fpos.col;
+	SETPTR(paragraph, next, tw_object(tw, p->next, OBJ_PARA));
+	SETPTR(paragraph, keyword, tw_wstring(tw, p->keyword, TRUE));
+	SETPTR(paragraph, origkeyword, tw_string(tw, p->origkeyword, TRUE));
+	SETPTR(paragraph, words, tw_object(tw, p->words, OBJ_WORD));
+	SETPTR(paragraph, kwtext, tw_object(tw, p->kwtext, OBJ_WORD));
+	SETPTR(paragraph, kwtext2, tw_object(tw, p->kwtext2, OBJ_WORD));
+	SETPTR(paragraph, fpos.filename,
+	       tw_string(tw, p->fpos.filename, FALSE));
+	SETPTR(paragraph, parent, tw_object(tw, p->parent, OBJ_PARA));
+	SETPTR(paragraph, child, tw_object(tw, p->child, OBJ_PARA));
+	SETPTR(paragraph, sibling, tw_object(tw, p->sibling, OBJ_PARA));
+	SETPTR(paragraph, private_data, 0);
+	break;
+      }
+      case OBJ_WORD: {
+	word const *w = (word const *)o->ptr;
+	word *q = (word *)(tw->data + o->off);
+	q->type = w->type;
+	q->aux = w->aux;
+	q->breaks = w->breaks;
+	q->fpos.line = w->fpos.line;
+	q->fpos.col = w->fpos.col;
+	SETPTR(word, next, tw_object(tw, w->next, OBJ_WORD));
+	SETPTR(word, alt, tw_object(tw, w->alt, OBJ_WORD));
+	SETPTR(word, text, tw_wstring(tw, w->text, FALSE));
+	SETPTR(word, fpos.filename, tw_string(tw, w->fpos.filename, FALSE));
+	SETPTR(word, private_data, 0);
+	break;
+      }
+      case OBJ_KEYWORD: {
+	keyword const *kw = (keyword const *)o->ptr;
+	memcpy(tw->data + o->off, kw, sizeof(*kw));
+	SETPTR(keyword, key, tw_wstring(tw, kw->key, TRUE));
+	SETPTR(keyword, text, tw_object(tw, kw->text, OBJ_WORD));
+	SETPTR(keyword, para, tw_object(tw, kw->para, OBJ_PARA));
+	break;
+      }
+      case OBJ_TAG: {
+	indextag const *t = (indextag const *)o->ptr;
+	indextag *q = (indextag *)(tw->data + o->off);
+	size_t arr;
+	int i;
+
+	q->implicit_fpos.line = t->implicit_fpos.line;
+	q->implicit_fpos.col = t->implicit_fpos.col;
+	q->nexplicit = q->explicit_size = t->nexplicit;
+	q->nrefs = t->nrefs;
+	SETPTR(indextag, name, tw_wstring(tw, t->name, FALSE));
+	SETPTR(indextag, implicit_text,
+	       tw_object(tw, t->implicit_text, OBJ_WORD));
+	SETPTR(indextag, implicit_fpos.filename,
+	       tw_string(tw, t->implicit_fpos.filename, FALSE));
+
+	arr = 0;
+	if (t->nexplicit) {
+	    arr = tw_alloc(tw, t->nexplicit * sizeof(word *));
+	    for (i = 0; i < t->nexplicit; i++)
+		tw_setptr(tw, arr + i * sizeof(word *),
+			  tw_object(tw, t->explicit_texts[i], OBJ_WORD));
+	}
+	SETPTR(indextag, explicit_texts, arr);
+
+	arr = 0;
+	if (t->nexplicit) {
+	    arr = tw_alloc(tw, t->nexplicit * sizeof(filepos));
+	    memcpy(tw->data + arr, t->explicit_fpos,
+		   t->nexplicit * sizeof(filepos));
+	    for (i = 0; i < t->nexplicit; i++)
+		tw_setptr(tw, (arr + i * sizeof(filepos) +
+			       offsetof(filepos, filename)),
+			  tw_string(tw, t->explicit_fpos[i].filename, FALSE));
+	}
+	SETPTR(indextag, explicit_fpos, arr);
+
+	arr = 0;
+	if (t->nrefs) {
+	    arr = tw_alloc(tw, t->nrefs * sizeof(indexentry *));
+	    for (i = 0; i < t->nrefs; i++)
+		tw_setptr(tw, arr + i * sizeof(indexentry *),
+			  tw_object(tw, t->refs[i], OBJ_ENTRY));
+	}
+	SETPTR(indextag, refs, arr);
+	break;
+      }
+      case OBJ_ENTRY: {
+	indexentry const *e = (indexentry const *)o->ptr;
+	memcpy(tw->data + o->off, e, sizeof(*e));
+	SETPTR(indexentry, text, tw_object(tw, e->text, OBJ_WORD));
+	SETPTR(indexentry, backend_data, 0);
+	SETPTR(indexentry, fpos.filename,
+	       tw_string(tw, e->fpos.filename, FALSE));
+	break;
+      }
+    }
+}
+
+#undef SETPTR
+
+/*
+ * Allocate an array of pointers to the objects in a tree234, and
+ * return its offset.
+ */
+static size_t tw_array(treewriter *tw, tree234 *t, int type,
+		       unsigned long *n)
+{
+    size_t arr;
+    void *obj;
+    int i;
+
+    *n = count234(t);
+    arr = tw_alloc(tw, *n * sizeof(void *));
+    for (i = 0; (obj = index234(t, i)) != NULL; i++)
+	tw_setptr(tw, arr + i * sizeof(void *), tw_object(tw, obj, type));
+    return arr;
+}
+
+/*
+ * Save a document tree to a file. Returns FALSE, having reported
+ * the problem, if the file couldn't be written; the tree is
+ * written under a temporary name and renamed into place, so a
+ * failure leaves any previous tree file as it was.
+ */
+int save_tree(char const *filename, paragraph *sourceform,
+	      keywordlist *keywords, indexdata *idx)
+{
+    treewriter tw;
+    treehdr *hdr;
+    size_t hdroff, paras, kws, tags, entries, relocs;
+    unsigned long nkws, ntags, nentries;
+    paragraph *p;
+    keyword *kw;
+    FILE *fp;
+    char *tmpname;
+    int i, ok;
+
+    tw.data = NULL;
+    tw.len = tw.size = 0;
+    tw.ptrs = NULL;
+    tw.nptrs = tw.ptrsize = 0;
+    tw.queue = NULL;
+    tw.nqueue = tw.queuesize = 0;
+    tw.relocs = NULL;
+    tw.nrelocs = tw.relocsize = 0;
+
+    /* pointer slots hold offsets until they're relocated */
+    assert(sizeof(size_t) == sizeof(void *));
+
+    hdroff = tw_alloc(&tw, sizeof(treehdr));
+    assert(hdroff == 0);
+
+    /*
+     * Copy the keyword lists first. A keyword's storage may also be
+     * reachable as an ordinary string (a word's text, say), and we
+     * want the copy we share to be the one with all of it.
+     */
+    for (p = sourceform; p; p = p->next) {
+	tw_wstring(&tw, p->keyword, TRUE);
+	tw_string(&tw, p->origkeyword, TRUE);
+    }
+    for (i = 0; (kw = index234(keywords->keys, i)) != NULL; i++)
+	tw_wstring(&tw, kw->key, TRUE);
+
+    paras = tw_object(&tw, sourceform, OBJ_PARA);
+    kws = tw_array(&tw, keywords->keys, OBJ_KEYWORD, &nkws);
+    tags = tw_array(&tw, idx->tags, OBJ_TAG, &ntags);
+    entries = tw_array(&tw, idx->entries, OBJ_ENTRY, &nentries);
+
+    for (i = 0; i < tw.nqueue; i++) {
+	struct treeobj o = tw.queue[i]; /* the queue may move under us */
+	tw_fill(&tw, &o);
+    }
+
+    relocs = tw_alloc(&tw, tw.nrelocs * sizeof(size_t));
+    memcpy(tw.data + relocs, tw.relocs, tw.nrelocs * sizeof(size_t));
+
+    hdr = (treehdr *)tw.data;
+    memcpy(hdr->magic, TREE_MAGIC, sizeof(hdr->magic));
+    hdr->version = TREE_VERSION;
+    tree_abi(hdr->abi);
+    hdr->size = tw.len;
+    hdr->paras = paras;
+    hdr->kws = kws;
+    hdr->nkws = nkws;
+    hdr->tags = tags;
+    hdr->ntags = ntags;
+    hdr->entries = entries;
+    hdr->nentries = nentries;
+    hdr->relocs = relocs;
+    hdr->nrelocs = tw.nrelocs;
+
+    tmpname = snewn(strlen(filename) + 5, char);
+    sprintf(tmpname, "%s.tmp", filename);
+    fp = fopen(tmpname, "wb");
+    if (!fp) {
+	err_cantopenw(tmpname);
+	ok = FALSE;
+    } else {
+	ok = (fwrite(tw.data, 1, tw.len, fp) == tw.len);
+	if (fclose(fp))
+	    ok = FALSE;
+	if (ok && rename(tmpname, filename)) {
+	    /*
+	     * Some systems won't rename over an existing file.
+	     */
+	    remove(filename);
+	    if (rename(tmpname, filename))
+		ok = FALSE;
+	}
+	if (!ok) {
+	    remove(tmpname);
+	    err_cantwrite(filename);
+	}
+    }
+    sfree(tmpname);
+
+    sfree(tw.data);
+    sfree(tw.ptrs);
+    sfree(tw.queue);
+    sfree(tw.relocs);
+    return ok;
+}
+
+/* ----------------------------------------------------------------------
+ * Loading.
+ */
+
+struct treefile_Tag {
+    char *base;
+    size_t size;
+    int mapped;
+    keywordlist *keywords;
+    indexdata *idx;
+};
+
+static int tree_check(treefile *tf)
+{
+    treehdr *hdr = (treehdr *)tf->base;
+    unsigned long abi[NABI];
+    size_t *relocs;
+    size_t i, off;
+
+    if (tf->size < sizeof(treehdr) ||
+	memcmp(hdr->magic, TREE_MAGIC, sizeof(hdr->magic)))
+	return FALSE;
+    tree_abi(abi);
+    if (hdr->version != TREE_VERSION ||
+	memcmp(hdr->abi, abi, sizeof(abi)) ||
+	hdr->size != tf->size)
+	return FALSE;
+
+    if (hdr->relocs > tf->size || hdr->relocs % TREE_ALIGN ||
+	hdr->nrelocs > (tf->size - hdr->relocs) / sizeof(size_t) ||
+	hdr->paras >= tf->size ||
+	hdr->kws + hdr->nkws * sizeof(void *) > tf->size ||
+	hdr->tags + hdr->ntags * sizeof(void *) > tf->size ||
+	hdr->entries + hdr->nentries * sizeof(void *) > tf->size)
+	return FALSE;
+
+    relocs = (size_t *)(tf->base + hdr->relocs);
+    for (i = 0; i < hdr->nrelocs; i++) {
+	if (relocs[i] % sizeof(void *) ||
+	    relocs[i] > tf->size - sizeof(void *))
+	    return FALSE;
+	memcpy(&off, tf->base + relocs[i], sizeof(off));
+	if (off >= tf->size)
+	    return FALSE;
+    }
+
+    return TRUE;
+}
+
+treefile *load_tree(char const *filename, paragraph **sourceform,
+		    keywordlist **keywords, indexdata **idx)
+{
+    treefile *tf = snew(treefile);
+    treehdr *hdr;
+    size_t *relocs;
+    unsigned long i;
+
+    tf->base = NULL;
+    tf->mapped = FALSE;
+    tf->keywords = NULL;
+    tf->idx = NULL;
+
+#ifndef NO_MMAP
+    {
+	int fd = open(filename, O_RDONLY);
+	struct stat st;
+
+	if (fd < 0) {
+	    err_cantopen(filename);
+	    sfree(tf);
+	    return NULL;
+	}
+	if (fstat(fd, &st) == 0 && st.st_size > 0) {
+	    void *map;
+
+	    tf->size = st.st_size;
+	    /*
+	     * A private mapping, so that we can fix up pointers (and
+	     * back ends can scribble on the paragraphs as usual)
+	     * without touching the file.
+	     */
+	    map = mmap(NULL, tf->size, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+		       fd, 0);
+	    if (map != MAP_FAILED) {
+		tf->base = (char *)map;
+		tf->mapped = TRUE;
+	    }
+	}
+	close(fd);
+    }
+#endif
+
+    if (!tf->base) {
+	/*
+	 * No mmap (or it didn't work): just read the file in.
+	 */
+	FILE *fp = fopen(filename, "rb");
+	size_t got;
+
+	if (!fp) {
+	    err_cantopen(filename);
+	    sfree(tf);
+	    return NULL;
+	}
+	tf->size = 0;
+	got = 0;
+	do {
+	    tf->size += 65536;
+	    tf->base = sresize(tf->base, tf->size, char);
+	    got += fread(tf->base + got, 1, tf->size - got, fp);
+	} while (got == tf->size);
+	tf->size = got;
+	fclose(fp);
+    }
+
+    if (!tree_check(tf)) {
+	err_badtree(filename);
+	free_tree(tf);
+	return NULL;
+    }
+
+    hdr = (treehdr *)tf->base;
+    relocs = (size_t *)(tf->base + hdr->relocs);
+    for (i = 0; i < hdr->nrelocs; i++) {
+	size_t off;
+	char *ptr;
+
+	memcpy(&off, tf->base + relocs[i], sizeof(off));
+	ptr = tf->base + off;
+	memcpy(tf->base + relocs[i], &ptr, sizeof(ptr));
+    }
+
+    /*
+     * The trees aren't saved; rebuild them around the loaded
+     * objects.
+     */
+    tf->keywords = make_keywords((keyword **)(tf->base + hdr->kws),
+				 hdr->nkws);
+    tf->idx = make_index();
+    for (i = 0; i < hdr->ntags; i++)
+	index_addtag(tf->idx, ((indextag **)(tf->base + hdr->tags))[i]);
+    for (i = 0; i < hdr->nentries; i++)
+	add234(tf->idx->entries,
+	       ((indexentry **)(tf->base + hdr->entries))[i]);
+
+    *sourceform = hdr->paras ? (paragraph *)(tf->base + hdr->paras) : NULL;
+    *keywords = tf->keywords;
+    *idx = tf->idx;
+    return tf;
+}
+
+void free_tree(treefile *tf)
+{
+    if (tf->keywords) {
+	freetree234(tf->keywords->keys);
+	sfree(tf->keywords);
+    }
+    if (tf->idx) {
+	freetree234(tf->idx->tags);
+	freetree234(tf->idx->entries);
+	sfree(tf->idx->taghash);
+	sfree(tf->idx);
+    }
+#ifndef NO_MMAP
+    if (tf->mapped)
+	munmap(tf->base, tf->size);
+    else
+#endif
+	sfree(tf->base);
+    sfree(tf);
+}
@@ -442,6 +442,100 @@ wchar_t *ustrftime(const wchar_t *wfmt, const struct tm *timespec)
     return rdtrim(&rs);
 }
 
+/*
+ * Determine whether a charset encodes every printable ASCII
+ * character as the same single byte, from its initial state. Most
+ * do, and for those the callers below can skip libcharset entirely
+ * on runs of plain ASCII text. The answer is cached, since the
+ * same handful of charsets are asked about over and over, by every
+ * thread. Each slot in the cache, indexed by charset, points at a
+ * constant answer once someone has worked it out, so a lookup
+ * needs no lock. If two threads work out the same answer at once,
+ * they just publish it twice.
+ */
+static const char ascii_yes = TRUE, ascii_no = FALSE;
+static void const *ascii_ok_cache[256]; /* libcharset's ids are small */
+
+int ascii_ok(int charset)
+{
+    wchar_t wbuf[0x7F - 0x20 + 1];
+    char buf[256];
+    const wchar_t *s;
+    charset_state state = CHARSET_INIT_STATE;
+    int i, len, ret, err, ok, cached;
+    const char *p;
+
+    cached = (charset >= 0 && charset < (int)lenof(ascii_ok_cache));
+    if (cached &&
+	(p = (const char *)parallel_fetch(&ascii_ok_cache[charset])) != NULL)
+	return *p;
+
+    for (i = 0x20; i < 0x7F; i++)
+	wbuf[i - 0x20] = i;
+    wbuf[i - 0x20] = L'\0';
+    s = wbuf;
+    len = 0x7F - 0x20;
+    err = 0;
+    ret = charset_from_unicode(&s, &len, buf, lenof(buf),
+			       charset, &state, &err);
+    ok = (!err && len == 0 && ret == 0x7F - 0x20);
+    for (i = 0; ok && i < ret; i++)
+	if ((unsigned char)buf[i] != 0x20 + i)
+	    ok = FALSE;
+
+    if (cached)
+	parallel_publish(&ascii_ok_cache[charset],
+			 ok ? &ascii_yes : &ascii_no);
+    return ok;
+}
+
+/*
+ * Return the length of the leading run of printable ASCII in a
+ * string.
+ */
+int uasciispan(const wchar_t *s)
+{
+    const wchar_t *p = s;
+    while (*p >= 0x20 && *p < 0x7F)
+	p++;
+    return p - s;
+}
+
+/*
+ * Encode a single character as UTF-8, for back ends that want to
+ * bypass libcharset on their hot output paths. Returns the length
+ * of the encoding (at most 4), or 0 if c isn't a valid Unicode
+ * scalar value, in which case the caller should fall back to
+ * libcharset to find out what to do about it.
+ */
+int utf8_encode(char *p, wchar_t wc)
+{
+    unsigned long c = (unsigned long)wc;
+
+    if (c < 0x80) {
+	p[0] = (char)c;
+	return 1;
+    } else if (c < 0x800) {
+	p[0] = (char)(0xC0 | (c >> 6));
+	p[1] = (char)(0x80 | (c & 0x3F));
+	return 2;
+    } else if (c < 0x10000) {
+	if (c >= 0xD800 && c < 0xE000)
+	    return 0;
+	p[0] = (char)(0xE0 | (c >> 12));
+	p[1] = (char)(0x80 | ((c >> 6) & 0x3F));
+	p[2] = (char)(0x80 | (c & 0x3F));
+	return 3;
+    } else if (c < 0x110000) {
+	p[0] = (char)(0xF0 | (c >> 18));
+	p[1] = (char)(0x80 | ((c >> 12) & 0x3F));
+	p[2] = (char)(0x80 | ((c >> 6) & 0x3F));
+	p[3] = (char)(0x80 | (c & 0x3F));
+	return 4;
+    }
+    return 0;
+}
+
 /*
  * Determine whether a Unicode string can be translated into a
  * given charset without any missing characters.
@@ -450,8 +544,15 @@ int cvt_ok(int charset, const wchar_t *s)
 {
     char buf[256];
     charset_state state = CHARSET_INIT_STATE;
-    int err, len = ustrlen(s);
+    int err, len;
 
+    if (ascii_ok(charset)) {
+	s += uasciispan(s);
+	if (!*s)
+	    return TRUE;
+    }
+
+    len = ustrlen(s);
     err = 0;
     while (len > 0) {
 	(void)charset_from_unicode(&s, &len, buf, lenof(buf),
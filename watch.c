@@ -0,0 +1,224 @@
+/*
+ * watch.c: wait for Halibut's input files to change, for --watch
+ *
+ * On Linux we ask inotify to tell us about activity in each input
+ * file's directory (watching the directory rather than the file
+ * itself means we still notice when an editor saves by writing a
+ * new file and renaming it over the old one). Elsewhere, or if
+ * inotify isn't available, we fall back to looking at every file's
+ * stat information a few times a second.
+ *
+ * Either way the final word on which files have changed comes from
+ * comparing stat information against what we saw last time, plus
+ * (with inotify) any file we were explicitly told was written.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include "halibut.h"
+
+#if defined __linux__ && !defined NO_INOTIFY
+#define USE_INOTIFY
+#include <poll.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+#endif
+
+#define POLL_MS 200		       /* stat interval without inotify */
+#define SETTLE_MS 50		       /* quiet time before rebuilding */
+
+struct watchfile {
+    char *dir;			       /* directory containing the file */
+    char *base;			       /* file name within that directory */
+    int wd;			       /* inotify watch descriptor */
+    int exists;
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    time_t mtime, ctime;
+};
+
+struct watcher_Tag {
+    char **filenames;
+    struct watchfile *files;
+    int nfiles;
+    int fd;			       /* inotify descriptor, or -1 to poll */
+};
+
+/*
+ * Take a fresh look at a file, and report whether it differs from
+ * the last look.
+ */
+static int restat(char const *filename, struct watchfile *f)
+{
+    struct stat st;
+    int exists = (stat(filename, &st) == 0);
+    int changed;
+
+    if (!exists) {
+	changed = f->exists;
+	f->exists = FALSE;
+	return changed;
+    }
+    changed = (!f->exists || f->dev != st.st_dev || f->ino != st.st_ino ||
+	       f->size != st.st_size || f->mtime != st.st_mtime ||
+	       f->ctime != st.st_ctime);
+    f->exists = TRUE;
+    f->dev = st.st_dev;
+    f->ino = st.st_ino;
+    f->size = st.st_size;
+    f->mtime = st.st_mtime;
+    f->ctime = st.st_ctime;
+    return changed;
+}
+
+static void sleep_ms(int ms)
+{
+    struct timespec ts;
+    ts.tv_sec = ms / 1000;
+    ts.tv_nsec = (long)(ms % 1000) * 1000000L;
+    nanosleep(&ts, NULL);
+}
+
+watcher *watch_new(char **filenames, int nfiles)
+{
+    watcher *w = snew(watcher);
+    int i;
+
+    w->filenames = filenames;
+    w->nfiles = nfiles;
+    w->files = snewn(nfiles, struct watchfile);
+    w->fd = -1;
+
+    for (i = 0; i < nfiles; i++) {
+	struct watchfile *f = &w->files[i];
+	char *slash = strrchr(filenames[i], '/');
+
+	if (slash) {
+	    size_t dirlen = (slash == filenames[i] ? 1 :
+			     (size_t)(slash - filenames[i]));
+	    f->dir = snewn(dirlen + 1, char);
+	    memcpy(f->dir, filenames[i], dirlen);
+	    f->dir[dirlen] = '\0';
+	    f->base = dupstr(slash + 1);
+	} else {
+	    f->dir = dupstr(".");
+	    f->base = dupstr(filenames[i]);
+	}
+	f->wd = -1;
+	f->exists = FALSE;
+	restat(filenames[i], f);
+    }
+
+#ifdef USE_INOTIFY
+    w->fd = inotify_init();
+    for (i = 0; i < nfiles && w->fd >= 0; i++) {
+	/*
+	 * Several files in one directory share a watch descriptor,
+	 * because inotify hands back the same one each time.
+	 */
+	w->files[i].wd = inotify_add_watch(w->fd, w->files[i].dir,
+					   IN_CLOSE_WRITE | IN_MOVED_TO |
+					   IN_MOVED_FROM | IN_CREATE |
+					   IN_DELETE | IN_ATTRIB);
+	if (w->files[i].wd < 0) {
+	    /* Can't watch this one; fall back to polling for all. */
+	    close(w->fd);
+	    w->fd = -1;
+	}
+    }
+#endif
+
+    return w;
+}
+
+#ifdef USE_INOTIFY
+/*
+ * Read one batch of inotify events, marking in changed[] every file
+ * they mention.
+ */
+static void read_events(watcher *w, int *changed)
+{
+    char buf[4096];
+    ssize_t len, off;
+    int i;
+
+    len = read(w->fd, buf, sizeof(buf));
+    for (off = 0; off < len; ) {
+	struct inotify_event ev;
+	char const *name = buf + off + sizeof(ev);
+
+	memcpy(&ev, buf + off, sizeof(ev));
+	for (i = 0; i < w->nfiles; i++)
+	    if ((ev.mask & IN_Q_OVERFLOW) ||
+		(ev.len && ev.wd == w->files[i].wd &&
+		 !strcmp(name, w->files[i].base)))
+		changed[i] = TRUE;
+	off += sizeof(ev) + ev.len;
+    }
+}
+#endif
+
+/*
+ * Block until at least one input file has changed, and fill in
+ * changed[] (which has an entry per file) to say which ones.
+ */
+void watch_wait(watcher *w, int *changed)
+{
+    int i, n;
+
+    while (1) {
+	for (i = 0; i < w->nfiles; i++)
+	    changed[i] = FALSE;
+
+#ifdef USE_INOTIFY
+	if (w->fd >= 0) {
+	    struct pollfd pfd;
+
+	    pfd.fd = w->fd;
+	    pfd.events = POLLIN;
+	    read_events(w, changed);
+	    /*
+	     * An editor saving a file, or make regenerating several,
+	     * can produce a burst of events. Wait for things to go
+	     * quiet so we rebuild once, from complete files.
+	     */
+	    while (poll(&pfd, 1, SETTLE_MS) > 0)
+		read_events(w, changed);
+	} else
+#endif
+	    sleep_ms(POLL_MS);
+
+	n = 0;
+	for (i = 0; i < w->nfiles; i++) {
+	    if (restat(w->filenames[i], &w->files[i]))
+		changed[i] = TRUE;
+	    if (changed[i])
+		n++;
+	}
+	if (n)
+	    return;
+    }
+}
+
+void watch_free(watcher *w)
+{
+    int i;
+
+#ifdef USE_INOTIFY
+    if (w->fd >= 0)
+	close(w->fd);
+#endif
+    for (i = 0; i < w->nfiles; i++) {
+	sfree(w->files[i].dir);
+	sfree(w->files[i].base);
+    }
+    sfree(w->files);
+    sfree(w);
+}
@@ -120,12 +120,80 @@ int mk_wcwidth(wchar_t ucs)
 }
 
 
+/*
+ * mk_wcwidth() is too slow to call on every character we measure,
+ * so we cache its results in a two-stage table: the top bits of a
+ * code point select a page, and the page holds one width per code
+ * point. Pages are filled in from mk_wcwidth() the first time
+ * anything in them is looked up; a page whose widths are all the
+ * same (which is most of them) is replaced by a shared constant
+ * page rather than kept separately. The table is shared by every
+ * thread, so pages are only ever made under LOCK_TABLES, and are
+ * filled in before parallel_publish() puts them in the table. Once
+ * a page is in place it never changes, so lookups don't need the
+ * lock.
+ */
+#define WCW_PAGEBITS 8
+#define WCW_PAGESIZE (1 << WCW_PAGEBITS)
+#define WCW_NPAGES (0x110000 >> WCW_PAGEBITS)
+
+static void const *wcw_pages[WCW_NPAGES];
+static signed char wcw_uniform[4][WCW_PAGESIZE]; /* for widths -1 to 2 */
+static int wcw_uniform_done = 0;
+
+static const signed char *wcw_makepage(int page)
+{
+    signed char *leaf = snewn(WCW_PAGESIZE, signed char);
+    int i;
+
+    if (!wcw_uniform_done) {
+	for (i = 0; i < 4; i++)
+	    memset(wcw_uniform[i], i - 1, WCW_PAGESIZE);
+	wcw_uniform_done = 1;
+    }
+    for (i = 0; i < WCW_PAGESIZE; i++)
+	leaf[i] = mk_wcwidth((wchar_t)((page << WCW_PAGEBITS) + i));
+    for (i = 1; i < WCW_PAGESIZE; i++)
+	if (leaf[i] != leaf[0])
+	    break;
+    if (i == WCW_PAGESIZE && leaf[0] >= -1 && leaf[0] <= 2) {
+	int width = leaf[0];
+	sfree(leaf);
+	return wcw_uniform[width + 1];
+    }
+    return leaf;
+}
+
+static int wcw_lookup(wchar_t ucs)
+{
+    unsigned long u = (unsigned long)ucs;
+    const signed char *leaf;
+    int page;
+
+    if (u >= 0x20 && u < 0x7F)
+	return 1;		       /* printable ASCII: skip the table */
+    if (u >= 0x110000)
+	return 1;		       /* what mk_wcwidth() would say */
+    page = u >> WCW_PAGEBITS;
+    leaf = (const signed char *)parallel_fetch(&wcw_pages[page]);
+    if (!leaf) {
+	parallel_lock(LOCK_TABLES);
+	leaf = (const signed char *)wcw_pages[page];
+	if (!leaf) {
+	    leaf = wcw_makepage(page);
+	    parallel_publish(&wcw_pages[page], leaf);
+	}
+	parallel_unlock(LOCK_TABLES);
+    }
+    return leaf[u & (WCW_PAGESIZE - 1)];
+}
+
 int mk_wcswidth(const wchar_t *pwcs, size_t n)
 {
   int w, width = 0;
 
   for (;*pwcs && n-- > 0; pwcs++)
-    if ((w = mk_wcwidth(*pwcs)) < 0)
+    if ((w = wcw_lookup(*pwcs)) < 0)
       return -1;
     else
       width += w;
@@ -135,13 +203,25 @@ int mk_wcswidth(const wchar_t *pwcs, size_t n)
 
 #endif
 
+/*
+ * Both functions below take a fast path over any leading printable
+ * ASCII, which is one column per character in every charset that
+ * represents it at all.
+ */
 int ustrwid(wchar_t const *s, int charset)
 {
     char buf[256];
-    int wid, len = ustrlen(s);
+    int wid, len;
     charset_state state = CHARSET_INIT_STATE;
 
     wid = 0;
+    if (ascii_ok(charset)) {
+	wid = uasciispan(s);
+	s += wid;
+	if (!*s)
+	    return wid;
+    }
+    len = ustrlen(s);
 
     while (len > 0) {
 	int err;
@@ -164,10 +244,17 @@ int ustrwid(wchar_t const *s, int charset)
 int strwid(char const *s, int charset)
 {
     wchar_t buf[256];
-    int wid, len = strlen(s);
+    int wid, len;
     charset_state state = CHARSET_INIT_STATE;
 
     wid = 0;
+    if (ascii_ok(charset)) {
+	while (*s >= 0x20 && *s < 0x7F)
+	    s++, wid++;
+	if (!*s)
+	    return wid;
+    }
+    len = strlen(s);
 
     while (len > 0) {
 	int ret;
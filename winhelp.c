@@ -1741,9 +1741,8 @@ WHLP whlp_new(void)
     return ret;
 }
 
-void whlp_close(WHLP h, char *filename)
+void whlp_close(WHLP h, outsink *out)
 {
-    FILE *fp;
     int filecount, offset, index, filelen;
     struct file *file, *map, *md;
     context *ctx;
@@ -1797,10 +1796,9 @@ void whlp_close(WHLP h, char *filename)
     }
 
     /*
-     * Open the output file.
+     * Check the output file opened.
      */
-    fp = fopen(filename, "wb");
-    if (!fp) {
+    if (!out) {
 	whlp_abandon(h);
 	return;
     }
@@ -1832,7 +1830,7 @@ void whlp_close(WHLP h, char *filename)
 	PUT_32BIT_LSB_FIRST(header+4, offset);       /* offset to directory */
 	PUT_32BIT_LSB_FIRST(header+8, 0xFFFFFFFFL);  /* first free block */
 	PUT_32BIT_LSB_FIRST(header+12, filelen);     /* total file length */
-	fwrite(header, 1, 16, fp);
+	out_write(out, header, 16);
     }
 
     /*
@@ -1854,13 +1852,13 @@ void whlp_close(WHLP h, char *filename)
 	PUT_32BIT_LSB_FIRST(header+0, reserved);
 	PUT_32BIT_LSB_FIRST(header+4, used);
 	header[8] = 0;		       /* flags */
-	fwrite(header, 1, 9, fp);
+	out_write(out, header, 9);
 
 	/* File data. */
-	fwrite(file->data, 1, file->len, fp);
+	out_write(out, file->data, file->len);
     }
 
-    fclose(fp);
+    out_close(out);
 
     whlp_free_file(md);
 
@@ -2359,7 +2357,7 @@ int main(int argc, char **argv)
     whlp_index_term(h, "bar", t2);
     whlp_index_term(h, "baz", t3);
 
-    whlp_close(h, "test.hlp");
+    whlp_close(h, out_open(outdest_files(), "test.hlp", OUT_BINARY));
     return 0;
 }
 
@@ -12,9 +12,11 @@ typedef struct WHLP_TOPIC_tag *WHLP_TOPIC;
 WHLP whlp_new(void);
 
 /*
- * Close a WHlp context and write out the help file it has created.
+ * Close a WHlp context and write the help file it has created to
+ * an output sink, closing that too. If the sink is NULL (because
+ * the file couldn't be opened), the context is just abandoned.
  */
-void whlp_close(WHLP h, char *filename);
+void whlp_close(WHLP h, outsink *out);
 
 /*
  * Abandon and free a WHlp context without writing out anything.